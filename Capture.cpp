@@ -0,0 +1,191 @@
+/*
+ * Capture.cpp
+ */
+
+#include "Capture.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Recorded gaps longer than this, e.g. between appended sessions, are
+// not waited out by a replay
+#define CAPTURE_REPLAY_MAX_GAP_NS 1000000000LL
+
+// Bytes of an existing capture up to the end of its last complete
+// record: 0 if it has no magic yet, -1 if it is not a capture
+static off_t CompleteLength(FILE *file) {
+  if (fseeko(file, 0, SEEK_END) != 0)
+    return -1;
+  off_t size = ftello(file);
+  char magic[CAPTURE_MAGIC_SIZE];
+  size_t nMagic = (size_t) std::min<off_t>(size, CAPTURE_MAGIC_SIZE);
+  rewind(file);
+  if (fread(magic, 1, nMagic, file) != nMagic ||
+      memcmp(magic, CAPTURE_MAGIC, nMagic) != 0)
+    return -1;
+  if (nMagic < CAPTURE_MAGIC_SIZE)
+    return 0;
+
+  off_t offset = CAPTURE_MAGIC_SIZE;
+  sCaptureRecord record;
+  while (size - offset >= (off_t) sizeof(record)) {
+    if (fseeko(file, offset, SEEK_SET) != 0 ||
+        fread(&record, sizeof(record), 1, file) != 1)
+      break;
+    if (size - offset - (off_t) sizeof(record) < (off_t) record.nBytes)
+      break;
+    offset += (off_t) sizeof(record) + record.nBytes;
+  }
+  return offset;
+}
+
+CaptureWriter::~CaptureWriter() {
+  Close();
+}
+
+bool CaptureWriter::Open(const std::string &path) {
+  Close();
+  file_ = fopen(path.c_str(), "r+b");
+  if (file_ == nullptr)
+    file_ = fopen(path.c_str(), "w+b");
+  if (file_ == nullptr)
+    return false;
+  // Appended records start after the last complete one, so a record
+  // torn by a crash does not misalign them
+  off_t end = CompleteLength(file_);
+  if (end < 0 || ftruncate(fileno(file_), end) != 0 ||
+      fseeko(file_, end, SEEK_SET) != 0 ||
+      (end == 0 &&
+       fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_SIZE, file_) !=
+           CAPTURE_MAGIC_SIZE)) {
+    Close();
+    return false;
+  }
+  records_ = 0;
+  return true;
+}
+
+void CaptureWriter::Close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (file_ != nullptr) {
+    fclose(file_);
+    file_ = nullptr;
+  }
+}
+
+bool CaptureWriter::Write(int channel, const timespec &arrival,
+                          const char *pData, size_t nBytes) {
+  sCaptureRecord record;
+  record.arrivalNs = (int64_t) arrival.tv_sec * 1000000000LL + arrival.tv_nsec;
+  record.channel = (uint16_t) channel;
+  record.reserved = 0;
+  record.nBytes = (uint32_t) nBytes;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (file_ == nullptr)
+    return false;
+  // Buffered by stdio; the receive path never waits for the disk
+  if (fwrite(&record, sizeof(record), 1, file_) != 1 ||
+      fwrite(pData, 1, nBytes, file_) != nBytes)
+    return false;
+  records_++;
+  return true;
+}
+
+CaptureReader::~CaptureReader() {
+  Close();
+}
+
+bool CaptureReader::Open(const std::string &path) {
+  Close();
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    return false;
+  struct stat st{};
+  if (fstat(fd, &st) == -1 || (size_t) st.st_size < CAPTURE_MAGIC_SIZE) {
+    close(fd);
+    return false;
+  }
+  void *mapping = mmap(nullptr, (size_t) st.st_size, PROT_READ,
+                       MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return false;
+  data_ = (const char *) mapping;
+  size_ = (size_t) st.st_size;
+  if (memcmp(data_, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0) {
+    Close();
+    return false;
+  }
+  // Records are read front to back
+  madvise((void *) data_, size_, MADV_SEQUENTIAL);
+  Rewind();
+  return true;
+}
+
+void CaptureReader::Close() {
+  if (data_ != nullptr) {
+    munmap((void *) data_, size_);
+    data_ = nullptr;
+  }
+  size_ = 0;
+  offset_ = 0;
+}
+
+bool CaptureReader::Next(sCaptureRecord *record, const char **pData) {
+  if (size_ - offset_ < sizeof(sCaptureRecord))
+    return false;
+  memcpy(record, data_ + offset_, sizeof(sCaptureRecord));
+  if (size_ - offset_ - sizeof(sCaptureRecord) < record->nBytes)
+    return false;
+  *pData = data_ + offset_ + sizeof(sCaptureRecord);
+  offset_ += sizeof(sCaptureRecord) + record->nBytes;
+  return true;
+}
+
+bool ReplayCapture(const std::string &path,
+                   double speed,
+                   const ReplayHandler &handler,
+                   sReplayStats *stats) {
+  CaptureReader reader;
+  if (!reader.Open(path))
+    return false;
+
+  *stats = sReplayStats();
+  std::chrono::steady_clock::time_point begin =
+      std::chrono::steady_clock::now(), start = begin;
+  int64_t firstArrivalNs = 0, lastArrivalNs = 0;
+
+  sCaptureRecord record;
+  const char *pData;
+  while (reader.Next(&record, &pData)) {
+    // Timing restarts at the first record and after a jump of the
+    // arrival time, such as the start of an appended session
+    int64_t gap = record.arrivalNs - lastArrivalNs;
+    if (stats->records == 0 || gap < 0 || gap > CAPTURE_REPLAY_MAX_GAP_NS) {
+      firstArrivalNs = record.arrivalNs;
+      start = std::chrono::steady_clock::now();
+    }
+    lastArrivalNs = record.arrivalNs;
+    if (speed > 0.0) {
+      // Recorded offset from the first datagram, scaled
+      std::chrono::nanoseconds due((int64_t) (
+          (double) (record.arrivalNs - firstArrivalNs) / speed));
+      std::this_thread::sleep_until(start + due);
+    }
+    handler(record, pData);
+    stats->records++;
+    stats->bytes += record.nBytes;
+  }
+
+  stats->seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - begin).count();
+  return true;
+}
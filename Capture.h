@@ -0,0 +1,107 @@
+/*
+ * Capture.h
+ *
+ * Recording of raw NatNet datagrams and their replay.
+ *
+ * A capture file is an 8-byte magic followed by records, each a
+ * sCaptureRecord header and the datagram exactly as received. Files are
+ * appended to; a record cut short by a crash ends the replay, and is cut
+ * off when the file is next opened for writing. Replay memory-maps the
+ * file and hands every datagram to a callback, with the original spacing
+ * scaled by a speed factor; gaps over a second, such as between appended
+ * sessions, are skipped.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+
+#include <time.h>
+
+#define CAPTURE_MAGIC               "NNCAP001"
+#define CAPTURE_MAGIC_SIZE          8
+
+// Socket a datagram was received on
+#define CAPTURE_CHANNEL_DATA        0
+#define CAPTURE_CHANNEL_COMMAND     1
+
+#pragma pack(push, 1)
+struct sCaptureRecord {
+  int64_t arrivalNs;                      // CLOCK_REALTIME
+  uint16_t channel;                       // CAPTURE_CHANNEL_*
+  uint16_t reserved;
+  uint32_t nBytes;                        // datagram bytes that follow
+};
+#pragma pack(pop)
+
+class CaptureWriter {
+ public:
+  CaptureWriter() = default;
+  CaptureWriter(const CaptureWriter &) = delete;
+  CaptureWriter &operator=(const CaptureWriter &) = delete;
+  ~CaptureWriter();
+
+  // Append to path, creating it if needed
+  bool Open(const std::string &path);
+  void Close();
+  // Open() and Close() must not race with Write()
+  bool IsOpen() const { return file_ != nullptr; }
+
+  // Append one datagram; may be called from any thread
+  bool Write(int channel, const timespec &arrival,
+             const char *pData, size_t nBytes);
+
+  uint64_t Records() const { return records_; }
+
+ private:
+  std::mutex mutex_;
+  FILE *file_ = nullptr;
+  uint64_t records_ = 0;
+};
+
+class CaptureReader {
+ public:
+  CaptureReader() = default;
+  CaptureReader(const CaptureReader &) = delete;
+  CaptureReader &operator=(const CaptureReader &) = delete;
+  ~CaptureReader();
+
+  // Map a capture file; false if it cannot be read or is not a capture
+  bool Open(const std::string &path);
+  void Close();
+
+  // Next datagram, or false at the end of the capture. pData points
+  // into the mapping and stays valid until Close().
+  bool Next(sCaptureRecord *record, const char **pData);
+  void Rewind() { offset_ = CAPTURE_MAGIC_SIZE; }
+
+ private:
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  size_t offset_ = 0;
+};
+
+typedef std::function<void(const sCaptureRecord &record,
+                           const char *pData)> ReplayHandler;
+
+struct sReplayStats {
+  uint64_t records = 0;
+  uint64_t bytes = 0;
+  double seconds = 0.0;                   // wall clock time of the replay
+};
+
+// Replay every record of a capture. speed scales the recorded spacing
+// of the datagrams (2.0 replays twice as fast); 0 replays as fast as
+// possible. Returns false if the file cannot be opened.
+bool ReplayCapture(const std::string &path,
+                   double speed,
+                   const ReplayHandler &handler,
+                   sReplayStats *stats);
+
+#endif  // CAPTURE_H
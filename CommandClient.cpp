@@ -0,0 +1,142 @@
+/*
+ * CommandClient.cpp
+ */
+
+#include "CommandClient.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include "NatNetTypes.h"
+
+void CommandClient::SetSendFunction(SendFunction send) {
+  send_ = std::move(send);
+}
+
+void CommandClient::SetTimeout(int timeoutMs) {
+  timeout_ = std::chrono::milliseconds(timeoutMs);
+}
+
+void CommandClient::SetRetries(int retries) {
+  retries_ = retries;
+}
+
+void CommandClient::Send(const std::string &command,
+                         CommandCallback callback) {
+  // NAT_REQUEST with the zero-terminated command
+  size_t nDataBytes = std::min(command.size() + 1, (size_t) MAX_PACKETSIZE);
+  sRequest request;
+  request.packet.resize(4 + nDataBytes);
+  uint16_t header[2] = {NAT_REQUEST, (uint16_t) nDataBytes};
+  memcpy(request.packet.data(), header, 4);
+  memcpy(request.packet.data() + 4, command.c_str(), nDataBytes - 1);
+  request.packet.back() = '\0';
+  request.callback = std::move(callback);
+  request.attempts = 0;
+  Transmit(std::move(request));
+}
+
+std::future<sCommandResult> CommandClient::Send(const std::string &command) {
+  // std::function needs a copyable callable
+  std::shared_ptr<std::promise<sCommandResult>> promise =
+      std::make_shared<std::promise<sCommandResult>>();
+  std::future<sCommandResult> result = promise->get_future();
+  Send(command, [promise](const sCommandResult &completed) {
+    promise->set_value(completed);
+  });
+  return result;
+}
+
+void CommandClient::Transmit(sRequest &&request) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  request.attempts++;
+  request.sent = Clock::now();
+  request.deadline = request.sent + timeout_;
+  // Queued and sent under the lock, so the queue order is the order the
+  // server sees, and a fast response always finds its request
+  pending_.push_back(std::move(request));
+  sRequest &queued = pending_.back();
+  if (send_ && send_(queued.packet.data(), queued.packet.size()))
+    return;
+
+  sRequest failed = std::move(queued);
+  pending_.pop_back();
+  lock.unlock();
+  sCommandResult result;
+  result.status = COMMAND_SEND_FAILED;
+  Complete(failed, std::move(result));
+}
+
+void CommandClient::Complete(const sRequest &request,
+                             sCommandResult &&result) {
+  result.attempts = request.attempts;
+  if (request.callback)
+    request.callback(result);
+}
+
+bool CommandClient::HandleResponse(const char *pData, size_t nBytes) {
+  if (nBytes < 4)
+    return false;
+  uint16_t header[2];
+  memcpy(header, pData, 4);
+  size_t nDataBytes = std::min((size_t) header[1], nBytes - 4);
+
+  sRequest request;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pending_.empty())
+      return false;
+    request = std::move(pending_.front());
+    pending_.pop_front();
+  }
+
+  sCommandResult result;
+  if (header[0] == NAT_UNRECOGNIZED_REQUEST) {
+    result.status = COMMAND_ERROR;
+    result.code = 1;
+  } else if (nDataBytes == 4) {
+    int32_t code;
+    memcpy(&code, pData + 4, 4);
+    result.code = code;
+    result.status = code == 0 ? COMMAND_OK : COMMAND_ERROR;
+  } else {
+    // String responses, e.g. to TestRequest, mean success
+    result.response.assign(pData + 4, strnlen(pData + 4, nDataBytes));
+    result.code = 0;
+    result.status = COMMAND_OK;
+  }
+  result.roundTrip =
+      std::chrono::duration<double>(Clock::now() - request.sent).count();
+  Complete(request, std::move(result));
+  return true;
+}
+
+void CommandClient::Poll() {
+  std::vector<sRequest> expired;
+  std::vector<sRequest> retried;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Clock::time_point now = Clock::now();
+    while (!pending_.empty() && pending_.front().deadline <= now) {
+      sRequest &front = pending_.front();
+      if (front.attempts > retries_)
+        expired.push_back(std::move(front));
+      else
+        retried.push_back(std::move(front));
+      pending_.pop_front();
+    }
+  }
+
+  // Retries go to the back of the queue, behind requests still in flight
+  for (sRequest &request : retried)
+    Transmit(std::move(request));
+  for (sRequest &request : expired)
+    Complete(request, sCommandResult());
+}
+
+size_t CommandClient::Outstanding() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return pending_.size();
+}
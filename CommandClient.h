@@ -0,0 +1,100 @@
+/*
+ * CommandClient.h
+ *
+ * Asynchronous NAT_REQUEST commands to Motive.
+ *
+ * NatNet responses carry no request ID, but the server answers requests
+ * in the order it receives them, so outstanding requests are kept in a
+ * FIFO and each NAT_RESPONSE or NAT_UNRECOGNIZED_REQUEST completes the
+ * oldest one. Several requests can be in flight at once; a script of
+ * playback commands then costs one round trip instead of one per command.
+ *
+ * A request that gets no response within the timeout is sent again, up to
+ * the configured number of retries, and then completes with
+ * COMMAND_TIMEOUT. Timeouts are only noticed by Poll(), which the owner
+ * calls periodically. A response that arrives after its request timed out
+ * is matched to the next request, so the timeout should be well above
+ * the server's response time.
+ */
+
+#ifndef COMMAND_CLIENT_H
+#define COMMAND_CLIENT_H
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum eCommandStatus {
+  COMMAND_OK = 0,
+  COMMAND_ERROR,                  // non-zero result or unrecognized request
+  COMMAND_TIMEOUT,
+  COMMAND_SEND_FAILED
+};
+
+struct sCommandResult {
+  eCommandStatus status = COMMAND_TIMEOUT;
+  int code = -1;                  // 4 byte response, 0 on success
+  std::string response;           // string response, if any
+  int attempts = 0;               // sends, including retries
+  double roundTrip = 0.0;         // seconds from the last send to response
+};
+
+typedef std::function<void(const sCommandResult &)> CommandCallback;
+
+class CommandClient {
+ public:
+  // Sends one NAT_REQUEST packet to the server; false on failure
+  typedef std::function<bool(const char *pData, size_t nBytes)> SendFunction;
+
+  CommandClient() = default;
+  CommandClient(const CommandClient &) = delete;
+  CommandClient &operator=(const CommandClient &) = delete;
+
+  // Must be set before the first request
+  void SetSendFunction(SendFunction send);
+  void SetTimeout(int timeoutMs);
+  void SetRetries(int retries);
+
+  // Send a command; the callback runs on the thread that handles the
+  // response or the timeout, without locks held
+  void Send(const std::string &command, CommandCallback callback);
+  std::future<sCommandResult> Send(const std::string &command);
+
+  // A NAT_RESPONSE or NAT_UNRECOGNIZED_REQUEST packet, header included;
+  // false if no request was outstanding
+  bool HandleResponse(const char *pData, size_t nBytes);
+
+  // Resend or expire overdue requests
+  void Poll();
+
+  size_t Outstanding() const;
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct sRequest {
+    std::vector<char> packet;
+    CommandCallback callback;
+    Clock::time_point sent;
+    Clock::time_point deadline;
+    int attempts;
+  };
+
+  // Send, or complete with COMMAND_SEND_FAILED; mutex_ not held
+  void Transmit(sRequest &&request);
+  static void Complete(const sRequest &request, sCommandResult &&result);
+
+  SendFunction send_;
+  Clock::duration timeout_ = std::chrono::milliseconds(100);
+  int retries_ = 2;
+
+  mutable std::mutex mutex_;
+  std::deque<sRequest> pending_;    // in send order
+};
+
+#endif  // COMMAND_CLIENT_H
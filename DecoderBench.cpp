@@ -0,0 +1,349 @@
+/*
+ * DecoderBench.cpp
+ *
+ * Throughput of the frame and data description decoders on synthetic
+ * packets, for several NatNet versions and a configurable scene.
+ *
+ * Usage:
+ *
+ *   DecoderBench [-v 2.5,2.7,2.10,3.0] [-n frames] [-a] [-x]
+ *                [-m markerSets] [-k markersPerSet] [-o otherMarkers]
+ *                [-r rigidBodies] [-R markersPerRigidBody]
+ *                [-s skeletons] [-b bonesPerSkeleton]
+ *                [-l labeledMarkers] [-f forcePlates] [-c channels]
+ *                [-i rigidBodyIDs]
+ *
+ *   -a also reads every rigid body, bone and labeled marker of each
+ *      decoded frame, as a consumer would.
+ *   -x compares the per-marker accessors with the structure-of-arrays
+ *      extraction of labeled and marker set markers, for every SIMD
+ *      level the CPU supports.
+ *   -i also decodes each frame subscribed to only the given comma
+ *      separated rigid body IDs (1 to rigidBodies), skipping every
+ *      other section, as a node that consumes a few bodies would.
+ */
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "MarkerSoA.h"
+#include "NatNetFrame.h"
+#include "NatNetModelDef.h"
+#include "SyntheticFrames.h"
+
+// Distinct frames cycled through by the benchmark
+#define BENCH_FRAME_COUNT 64
+
+struct sBenchResult {
+  uint64_t frames = 0;
+  uint64_t bytes = 0;
+  double seconds = 0.0;
+  double checksum = 0.0;                  // keeps the work observable
+};
+
+static double Now() {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Values a consumer of the frame would read
+static double ReadFrame(const FrameOfMocapData &frame) {
+  double sum = 0.0;
+  for (int i = 0; i < frame.RigidBodyCount(); i++) {
+    sRigidBodyData rb = frame.RigidBody(i);
+    sum += rb.x + rb.qw;
+  }
+  for (int s = 0; s < frame.SkeletonCount(); s++) {
+    for (int b = 0; b < frame.SkeletonBoneCount(s); b++)
+      sum += frame.SkeletonBone(s, b).y;
+  }
+  for (int i = 0; i < frame.LabeledMarkerCount(); i++)
+    sum += frame.LabeledMarker(i).z;
+  return sum;
+}
+
+static bool BenchFrames(FrameDecoder decoder,
+                        const std::vector<std::vector<char>> &packets,
+                        uint64_t nFrames, bool bRead,
+                        const FrameSubscription *subscription,
+                        sBenchResult *result) {
+  FrameOfMocapData frame;
+  frame.SetSubscription(subscription);
+  double start = Now();
+  for (uint64_t i = 0; i < nFrames; i++) {
+    const std::vector<char> &packet = packets[i % packets.size()];
+    if (!decoder(packet.data(), packet.size(), &frame))
+      return false;
+    result->checksum += bRead ? ReadFrame(frame) : frame.iFrame;
+    result->bytes += packet.size();
+  }
+  result->seconds = Now() - start;
+  result->frames = nFrames;
+  return true;
+}
+
+static bool BenchModelDef(ModelDefDecoder decoder,
+                          const std::vector<char> &packet,
+                          uint64_t nPackets, sBenchResult *result) {
+  sDataDescriptions descriptions;
+  double start = Now();
+  for (uint64_t i = 0; i < nPackets; i++) {
+    if (!decoder(packet.data(), packet.size(), &descriptions))
+      return false;
+    result->checksum += descriptions.rigidBodies.size();
+    result->bytes += packet.size();
+  }
+  result->seconds = Now() - start;
+  result->frames = nPackets;
+  return true;
+}
+
+// Structure-of-arrays buffers for every marker of a frame
+struct sMarkerBuffers {
+  std::vector<int> id;
+  std::vector<float> x, y, z, size, residual;
+
+  explicit sMarkerBuffers(size_t n)
+      : id(n), x(n), y(n), z(n), size(n), residual(n) {}
+  sLabeledMarkerSoA Labeled() {
+    return sLabeledMarkerSoA{id.data(), x.data(), y.data(), z.data(),
+                             size.data(), residual.data()};
+  }
+  sMarkerSoA Positions() {
+    return sMarkerSoA{x.data(), y.data(), z.data()};
+  }
+};
+
+// Copy the markers of a frame one accessor call at a time
+static void CopyMarkersLoop(const FrameOfMocapData &frame,
+                            sMarkerBuffers *buffers) {
+  for (int i = 0; i < frame.LabeledMarkerCount(); i++) {
+    sLabeledMarker marker = frame.LabeledMarker(i);
+    buffers->id[i] = marker.ID;
+    buffers->x[i] = marker.x;
+    buffers->y[i] = marker.y;
+    buffers->z[i] = marker.z;
+    buffers->size[i] = marker.size;
+    buffers->residual[i] = marker.residual;
+  }
+  for (int s = 0; s < frame.MarkerSetCount(); s++) {
+    for (int j = 0; j < frame.MarkerSetMarkerCount(s); j++) {
+      sMarker marker = frame.MarkerSetMarker(s, j);
+      buffers->x[j] = marker.x;
+      buffers->y[j] = marker.y;
+      buffers->z[j] = marker.z;
+    }
+  }
+}
+
+static void CopyMarkersSoA(const FrameOfMocapData &frame,
+                           sMarkerBuffers *buffers) {
+  int capacity = (int) buffers->x.size();
+  frame.LabeledMarkersSoA(buffers->Labeled(), capacity);
+  for (int s = 0; s < frame.MarkerSetCount(); s++)
+    frame.MarkerSetMarkersSoA(s, buffers->Positions(), capacity);
+}
+
+// ns per frame to copy out every labeled and marker set marker
+static double BenchMarkerCopy(const FrameOfMocapData &frame,
+                              uint64_t nFrames, bool bSoA,
+                              double *checksum) {
+  size_t nMarkers = (size_t) frame.LabeledMarkerCount();
+  for (int s = 0; s < frame.MarkerSetCount(); s++)
+    nMarkers = std::max(nMarkers, (size_t) frame.MarkerSetMarkerCount(s));
+  sMarkerBuffers buffers(std::max(nMarkers, (size_t) 1));
+
+  double start = Now();
+  for (uint64_t i = 0; i < nFrames; i++) {
+    if (bSoA)
+      CopyMarkersSoA(frame, &buffers);
+    else
+      CopyMarkersLoop(frame, &buffers);
+    *checksum += buffers.x[i % buffers.x.size()];
+  }
+  return (Now() - start) * 1e9 / nFrames;
+}
+
+static void PrintMarkerCopy(const char *szName, int major, int minor,
+                            const FrameOfMocapData &frame, double ns) {
+  int nMarkers = frame.LabeledMarkerCount();
+  for (int s = 0; s < frame.MarkerSetCount(); s++)
+    nMarkers += frame.MarkerSetMarkerCount(s);
+  printf("%-8s %2d.%-2d %8d %14.0f %10.1f %10.1f\n",
+         szName, major, minor, nMarkers, 1e9 / ns, ns,
+         nMarkers > 0 ? ns / nMarkers : 0.0);
+}
+
+static void PrintResult(const char *szName, int major, int minor,
+                        size_t packetSize, const sBenchResult &result) {
+  double seconds = result.seconds > 0.0 ? result.seconds : 1e-9;
+  printf("%-8s %2d.%-2d %8zu %14.0f %10.1f %10.1f\n",
+         szName, major, minor, packetSize,
+         result.frames / seconds,
+         seconds * 1e9 / result.frames,
+         result.bytes / seconds / 1e6);
+}
+
+static void Usage() {
+  printf("Usage: DecoderBench [-v 2.5,2.7,2.10,3.0] [-n frames] [-a] [-x]\n"
+         "                    [-m markerSets] [-k markersPerSet]"
+         " [-o otherMarkers]\n"
+         "                    [-r rigidBodies] [-R markersPerRigidBody]\n"
+         "                    [-s skeletons] [-b bonesPerSkeleton]\n"
+         "                    [-l labeledMarkers] [-f forcePlates]"
+         " [-c channels]\n"
+         "                    [-i rigidBodyIDs]\n");
+}
+
+int main(int argc, char *argv[]) {
+  sSyntheticScene scene;
+  std::string versions = "2.5,2.7,2.10,3.0";
+  uint64_t nFrames = 1000000;
+  bool bRead = false;
+  bool bMarkers = false;
+  FrameSubscription subscription;
+  bool bSubscribed = false;
+  char *saveptr = nullptr;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "v:n:axm:k:o:r:R:s:b:l:f:c:i:h")) != -1) {
+    switch (opt) {
+      case 'v':versions = optarg;
+        break;
+      case 'n':nFrames = strtoull(optarg, nullptr, 10);
+        break;
+      case 'a':bRead = true;
+        break;
+      case 'x':bMarkers = true;
+        break;
+      case 'm':scene.markerSets = atoi(optarg);
+        break;
+      case 'k':scene.markersPerSet = atoi(optarg);
+        break;
+      case 'o':scene.otherMarkers = atoi(optarg);
+        break;
+      case 'r':scene.rigidBodies = atoi(optarg);
+        break;
+      case 'R':scene.markersPerRigidBody = atoi(optarg);
+        break;
+      case 's':scene.skeletons = atoi(optarg);
+        break;
+      case 'b':scene.bonesPerSkeleton = atoi(optarg);
+        break;
+      case 'l':scene.labeledMarkers = atoi(optarg);
+        break;
+      case 'f':scene.forcePlates = atoi(optarg);
+        break;
+      case 'c':scene.forcePlateChannels = atoi(optarg);
+        break;
+      case 'i':
+        for (char *szID = strtok_r(optarg, ",", &saveptr); szID != nullptr;
+             szID = strtok_r(nullptr, ",", &saveptr))
+          subscription.AddRigidBody(atoi(szID));
+        bSubscribed = true;
+        break;
+      default:Usage();
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (nFrames == 0) {
+    Usage();
+    return 1;
+  }
+
+  printf("Scene: %d marker sets x %d, %d other markers,"
+         " %d rigid bodies x %d markers, %d skeletons x %d bones,"
+         " %d labeled markers, %d force plates x %d channels\n",
+         scene.markerSets, scene.markersPerSet, scene.otherMarkers,
+         scene.rigidBodies, scene.markersPerRigidBody,
+         scene.skeletons, scene.bonesPerSkeleton,
+         scene.labeledMarkers, scene.forcePlates, scene.forcePlateChannels);
+  printf("%-8s %-5s %8s %14s %10s %10s\n",
+         "packet", "ver", "bytes", "packets/s", "ns/packet", "MB/s");
+
+  double checksum = 0.0;
+  for (char *szVersion = strtok_r(&versions[0], ",", &saveptr);
+       szVersion != nullptr;
+       szVersion = strtok_r(nullptr, ",", &saveptr)) {
+    int major = 0, minor = 0;
+    if (sscanf(szVersion, "%d.%d", &major, &minor) != 2) {
+      printf("Invalid version %s\n", szVersion);
+      return 1;
+    }
+
+    std::vector<std::vector<char>> frames(BENCH_FRAME_COUNT);
+    std::vector<char> modelDef;
+    bool bBuilt = true;
+    for (int i = 0; i < BENCH_FRAME_COUNT; i++)
+      bBuilt = bBuilt &&
+          BuildFrameOfMocapData(major, minor, scene, i + 1, &frames[i]);
+    bBuilt = bBuilt && BuildDataDescriptions(major, minor, scene, &modelDef);
+    if (!bBuilt) {
+      printf("NatNet %d.%d: unsupported version or scene too large"
+             " for one packet\n", major, minor);
+      continue;
+    }
+
+    sBenchResult frameResult;
+    if (!BenchFrames(SelectFrameDecoder(major, minor), frames, nFrames,
+                     bRead, nullptr, &frameResult)) {
+      printf("NatNet %d.%d: frame decoding failed\n", major, minor);
+      return 1;
+    }
+    PrintResult("frame", major, minor, frames[0].size(), frameResult);
+
+    sBenchResult subsetResult;
+    if (bSubscribed) {
+      if (!BenchFrames(SelectFrameDecoder(major, minor), frames, nFrames,
+                       bRead, &subscription, &subsetResult)) {
+        printf("NatNet %d.%d: frame decoding failed\n", major, minor);
+        return 1;
+      }
+      PrintResult("subset", major, minor, frames[0].size(), subsetResult);
+    }
+
+    // Descriptions copy strings out of the packet; far fewer iterations
+    sBenchResult modelDefResult;
+    if (!BenchModelDef(SelectModelDefDecoder(major, minor), modelDef,
+                       std::max(nFrames / 100, (uint64_t) 1),
+                       &modelDefResult)) {
+      printf("NatNet %d.%d: data description decoding failed\n",
+             major, minor);
+      return 1;
+    }
+    PrintResult("modeldef", major, minor, modelDef.size(), modelDefResult);
+
+    checksum += frameResult.checksum + subsetResult.checksum +
+        modelDefResult.checksum;
+
+    if (bMarkers) {
+      FrameOfMocapData frame;
+      SelectFrameDecoder(major, minor)(frames[0].data(), frames[0].size(),
+                                       &frame);
+      printf("%-8s %-5s %8s %14s %10s %10s\n",
+             "markers", "ver", "markers", "frames/s", "ns/frame",
+             "ns/marker");
+      PrintMarkerCopy("loop", major, minor, frame,
+                      BenchMarkerCopy(frame, nFrames, false, &checksum));
+      eSimdLevel best = GetMarkerSimdLevel();
+      for (int level = SIMD_SCALAR; level <= SIMD_AVX2; level++) {
+        if (!SetMarkerSimdLevel((eSimdLevel) level))
+          continue;
+        PrintMarkerCopy(SimdLevelName((eSimdLevel) level), major, minor,
+                        frame,
+                        BenchMarkerCopy(frame, nFrames, true, &checksum));
+      }
+      SetMarkerSimdLevel(best);
+    }
+  }
+
+  printf("(checksum %g)\n", checksum);
+  return 0;
+}
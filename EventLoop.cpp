@@ -0,0 +1,129 @@
+/*
+ * EventLoop.cpp
+ */
+
+#include "EventLoop.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+// Readiness events taken per epoll_wait
+#define EVENT_LOOP_MAX_EVENTS 16
+
+EventLoop::~EventLoop() {
+  for (const std::unique_ptr<sWatch> &watch : watches_) {
+    if (watch->isTimer)
+      close(watch->fd);
+  }
+  if (stopFd_ != -1)
+    close(stopFd_);
+  if (epollFd_ != -1)
+    close(epollFd_);
+}
+
+bool EventLoop::Open() {
+  epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epollFd_ == -1)
+    return false;
+  stopFd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (stopFd_ == -1)
+    return false;
+  epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.ptr = nullptr;       // the stop eventfd
+  return epoll_ctl(epollFd_, EPOLL_CTL_ADD, stopFd_, &event) == 0;
+}
+
+bool EventLoop::Watch(int fd, bool isTimer, Handler handler) {
+  std::unique_ptr<sWatch> watch(
+      new sWatch{fd, isTimer, false, std::move(handler)});
+  epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.ptr = watch.get();
+  if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &event) == -1)
+    return false;
+  watches_.push_back(std::move(watch));
+  return true;
+}
+
+bool EventLoop::Add(int fd, Handler onReadable) {
+  return Watch(fd, false, std::move(onReadable));
+}
+
+void EventLoop::Remove(int fd) {
+  for (const std::unique_ptr<sWatch> &watch : watches_) {
+    if (watch->fd == fd && !watch->removed) {
+      epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+      watch->removed = true;
+    }
+  }
+}
+
+bool EventLoop::AddTimer(int periodMs, Handler onTick) {
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (fd == -1)
+    return false;
+  itimerspec period{};
+  period.it_interval.tv_sec = periodMs / 1000;
+  period.it_interval.tv_nsec = (long) (periodMs % 1000) * 1000000L;
+  period.it_value = period.it_interval;
+  if (timerfd_settime(fd, 0, &period, nullptr) == -1 ||
+      !Watch(fd, true, std::move(onTick))) {
+    close(fd);
+    return false;
+  }
+  return true;
+}
+
+bool EventLoop::Run() {
+  epoll_event events[EVENT_LOOP_MAX_EVENTS];
+  bool bRunning = true;
+  while (bRunning) {
+    int nEvents = epoll_wait(epollFd_, events, EVENT_LOOP_MAX_EVENTS, -1);
+    if (nEvents == -1) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+
+    for (int i = 0; i < nEvents; i++) {
+      sWatch *watch = (sWatch *) events[i].data.ptr;
+      uint64_t count;
+      if (watch == nullptr) {
+        // Consume the stop request so the loop can be run again
+        if (read(stopFd_, &count, sizeof(count)) == sizeof(count))
+          bRunning = false;
+        continue;
+      }
+      if (watch->removed)
+        continue;
+      // Timer expirations must be read or the timerfd stays readable
+      if (watch->isTimer &&
+          read(watch->fd, &count, sizeof(count)) != sizeof(count))
+        continue;
+      watch->handler();
+    }
+
+    watches_.erase(
+        std::remove_if(watches_.begin(), watches_.end(),
+                       [](const std::unique_ptr<sWatch> &watch) {
+                         if (watch->removed && watch->isTimer)
+                           close(watch->fd);
+                         return watch->removed;
+                       }),
+        watches_.end());
+  }
+  return true;
+}
+
+void EventLoop::Stop() {
+  uint64_t one = 1;
+  ssize_t nWritten = write(stopFd_, &one, sizeof(one));
+  (void) nWritten;
+}
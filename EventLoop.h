@@ -0,0 +1,64 @@
+/*
+ * EventLoop.h
+ *
+ * Single-threaded readiness loop on epoll.
+ *
+ * File descriptors are registered with a handler that runs on the loop
+ * thread whenever they are readable (level-triggered); periodic work runs
+ * from timerfd timers on the same thread. Stop() writes to an eventfd the
+ * loop watches, so it may be called from any thread or from a signal
+ * handler; Run() returns once the handlers of the current wakeup are done.
+ */
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+class EventLoop {
+ public:
+  typedef std::function<void()> Handler;
+
+  EventLoop() = default;
+  // Closes the epoll instance, the eventfd and the timers, not the
+  // descriptors passed to Add()
+  ~EventLoop();
+
+  EventLoop(const EventLoop &) = delete;
+  EventLoop &operator=(const EventLoop &) = delete;
+
+  // Create the epoll instance and the stop eventfd; false on failure
+  bool Open();
+
+  // Run onReadable whenever fd has input
+  bool Add(int fd, Handler onReadable);
+  // Stop watching fd, e.g. from its own handler at end of file
+  void Remove(int fd);
+  // Run onTick every periodMs milliseconds
+  bool AddTimer(int periodMs, Handler onTick);
+
+  // Dispatch until Stop(); false if epoll_wait fails
+  bool Run();
+  // Async-signal-safe. A Stop() before Run() makes Run() return at once.
+  void Stop();
+
+ private:
+  struct sWatch {
+    int fd;
+    bool isTimer;             // fd is a timerfd owned by the loop
+    bool removed;
+    Handler handler;
+  };
+
+  bool Watch(int fd, bool isTimer, Handler handler);
+
+  int epollFd_ = -1;
+  int stopFd_ = -1;
+  // Referenced from epoll_event.data.ptr; removed entries are freed
+  // between wakeups
+  std::vector<std::unique_ptr<sWatch>> watches_;
+};
+
+#endif  // EVENT_LOOP_H
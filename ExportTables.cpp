@@ -0,0 +1,624 @@
+/*
+ * ExportTables.cpp
+ *
+ * Converts a recording to CSV tables for analysis: one row per rigid
+ * body, skeleton bone and labeled marker of every frame, with the names
+ * of the models from the data descriptions in effect at that frame.
+ *
+ * Usage:
+ *
+ *   ExportTables [-j threads] [-c framesPerChunk] [-V 2.10] [-o prefix]
+ *                recording
+ *
+ *   recording is a capture (~capture_file) or a take (~take_file),
+ *   told apart by their magic. Tables are written to
+ *   prefix_rigid_bodies.csv, prefix_bones.csv and
+ *   prefix_labeled_markers.csv; prefix defaults to the recording's path
+ *   without its extension.
+ *   -j decodes on this many threads, by default one per core.
+ *   -c frames a thread decodes and formats at a time; chunks are
+ *      written in recording order as they complete. Takes are split at
+ *      their own chunks.
+ *   -V NatNet version of a capture that does not start with the
+ *      server's NAT_SERVERINFO.
+ *
+ * A capture is walked once to index its data packets and decode its
+ * NAT_SERVERINFO and NAT_MODELDEF packets; a data packet that repeats
+ * the previous frame number is dropped. Frames are then decoded with
+ * the version-specialized decoder, subscribed to the three tables'
+ * sections only, on a pool of threads.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+#include "Capture.h"
+#include "ModelDefCache.h"
+#include "NatNetFrame.h"
+#include "NatNetModelDef.h"
+#include "NatNetTypes.h"
+#include "Take.h"
+
+#define EXPORT_CHUNK_FRAMES   2048
+// Chunks formatted ahead of the one being written, per thread
+#define EXPORT_WINDOW         4
+
+enum eTable {
+  TABLE_RIGID_BODIES,
+  TABLE_BONES,
+  TABLE_LABELED_MARKERS,
+  TABLE_COUNT
+};
+
+static const char *const kTableSuffixes[TABLE_COUNT] = {
+    "_rigid_bodies.csv", "_bones.csv", "_labeled_markers.csv"};
+
+static const char *const kTableHeaders[TABLE_COUNT] = {
+    "frame,timestamp,id,name,x,y,z,qx,qy,qz,qw,mean_error,tracked\n",
+    "frame,timestamp,skeleton_id,skeleton,bone_id,bone,"
+    "x,y,z,qx,qy,qz,qw,mean_error,tracked\n",
+    "frame,timestamp,model_id,model,marker_id,x,y,z,size,residual,"
+    "occluded,point_cloud_solved,model_solved\n"};
+
+// Formatted rows of a chunk of frames
+struct sChunkOutput {
+  std::string tables[TABLE_COUNT];
+  uint64_t frames = 0;
+  uint64_t rows = 0;
+  bool bDone = false;
+};
+
+// Names of the models described by one NAT_MODELDEF packet
+class ModelNames {
+ public:
+  explicit ModelNames(std::shared_ptr<const ModelDefIndex> index)
+      : index_(std::move(index)) {}
+
+  const char *RigidBody(int ID) const {
+    const char *szName = index_ ? index_->RigidBodyName(ID) : nullptr;
+    return szName != nullptr ? szName : "";
+  }
+
+  const char *Skeleton(int skeletonID) const {
+    const sSkeletonDescription *skeleton =
+        index_ ? index_->Skeleton(skeletonID) : nullptr;
+    return skeleton != nullptr ? skeleton->szName.c_str() : "";
+  }
+
+  const char *Bone(int skeletonID, int boneID) const {
+    const sSkeletonDescription *skeleton =
+        index_ ? index_->Skeleton(skeletonID) : nullptr;
+    if (skeleton == nullptr)
+      return "";
+    // Bones are usually described in ID order from 1
+    const std::vector<sRigidBodyDescription> &bones = skeleton->bones;
+    if (boneID >= 1 && (size_t) boneID <= bones.size() &&
+        bones[boneID - 1].ID == boneID)
+      return bones[boneID - 1].szName.c_str();
+    for (const sRigidBodyDescription &bone : bones) {
+      if (bone.ID == boneID)
+        return bone.szName.c_str();
+    }
+    return "";
+  }
+
+  // Rigid body or skeleton a labeled marker belongs to
+  const char *Model(int modelID) const {
+    const char *szName = RigidBody(modelID);
+    return szName[0] != '\0' ? szName : Skeleton(modelID);
+  }
+
+ private:
+  std::shared_ptr<const ModelDefIndex> index_;
+};
+
+// Longest "%.6f," of a double: 309 integer digits, sign, point,
+// six decimals, comma and the terminating NUL
+#define ROW_MAX_NUMBER 320
+
+// One CSV row, formatted without printf: rows are most of the work
+class Row {
+ public:
+  void Int(int64_t value) {
+    uint64_t magnitude = (uint64_t) value;
+    if (value < 0) {
+      *p_++ = '-';
+      magnitude = 0 - magnitude;
+    }
+    p_ = Unsigned(p_, magnitude);
+    *p_++ = ',';
+  }
+
+  // As %.6f, but for rounding of the last digit
+  void Fixed(double value) {
+    if (!(std::fabs(value) < 1e12)) {
+      int n = snprintf(p_, ROW_MAX_NUMBER, "%.6f,", value);
+      if (n > 0)
+        p_ += std::min(n, ROW_MAX_NUMBER - 1);
+      return;
+    }
+    if (std::signbit(value)) {
+      *p_++ = '-';
+      value = -value;
+    }
+    uint64_t scaled = (uint64_t) std::nearbyint(value * 1e6);
+    p_ = Unsigned(p_, scaled / 1000000);
+    *p_++ = '.';
+    uint64_t fraction = scaled % 1000000;
+    for (int i = 5; i >= 0; i--) {
+      p_[i] = (char) ('0' + fraction % 10);
+      fraction /= 10;
+    }
+    p_ += 6;
+    *p_++ = ',';
+  }
+
+  // Quoted if it needs to be
+  void Name(const char *szName) {
+    size_t n = strnlen(szName, MAX_NAMELENGTH);
+    if (strpbrk(szName, ",\"\r\n") == nullptr) {
+      memcpy(p_, szName, n);
+      p_ += n;
+    } else {
+      *p_++ = '"';
+      for (size_t i = 0; i < n; i++) {
+        if (szName[i] == '"')
+          *p_++ = '"';
+        *p_++ = szName[i];
+      }
+      *p_++ = '"';
+    }
+    *p_++ = ',';
+  }
+
+  void End(std::string *out) {
+    p_[-1] = '\n';
+    out->append(row_, p_ - row_);
+    p_ = row_;
+  }
+
+ private:
+  static char *Unsigned(char *p, uint64_t value) {
+    char digits[20];
+    int n = 0;
+    do {
+      digits[n++] = (char) ('0' + value % 10);
+      value /= 10;
+    } while (value != 0);
+    while (n > 0)
+      *p++ = digits[--n];
+    return p;
+  }
+
+  // Two quoted names and fifteen numbers at most
+  char row_[4 * MAX_NAMELENGTH + ROW_MAX_NUMBER * 16];
+  char *p_ = row_;
+};
+
+static void PutPose(Row *row, const sRigidBodyData &rb) {
+  row->Fixed(rb.x);
+  row->Fixed(rb.y);
+  row->Fixed(rb.z);
+  row->Fixed(rb.qx);
+  row->Fixed(rb.qy);
+  row->Fixed(rb.qz);
+  row->Fixed(rb.qw);
+  row->Fixed(rb.MeanError);
+  row->Int(rb.TrackingValid() ? 1 : 0);
+}
+
+static void AppendRigidBody(sChunkOutput *out, const ModelNames &names,
+                            int frameNumber, double timestamp,
+                            const sRigidBodyData &rb) {
+  Row row;
+  row.Int(frameNumber);
+  row.Fixed(timestamp);
+  row.Int(rb.ID);
+  row.Name(names.RigidBody(rb.ID));
+  PutPose(&row, rb);
+  row.End(&out->tables[TABLE_RIGID_BODIES]);
+  out->rows++;
+}
+
+static void AppendBone(sChunkOutput *out, const ModelNames &names,
+                       int frameNumber, double timestamp, int skeletonID,
+                       const sRigidBodyData &bone) {
+  // Bone IDs are the skeleton ID in the high 16 bits
+  int boneID = bone.ID & 0xffff;
+  Row row;
+  row.Int(frameNumber);
+  row.Fixed(timestamp);
+  row.Int(skeletonID);
+  row.Name(names.Skeleton(skeletonID));
+  row.Int(boneID);
+  row.Name(names.Bone(skeletonID, boneID));
+  PutPose(&row, bone);
+  row.End(&out->tables[TABLE_BONES]);
+  out->rows++;
+}
+
+static void AppendLabeledMarker(sChunkOutput *out, const ModelNames &names,
+                                int frameNumber, double timestamp,
+                                const sLabeledMarker &marker) {
+  int modelID = marker.ID >> 16;
+  Row row;
+  row.Int(frameNumber);
+  row.Fixed(timestamp);
+  row.Int(modelID);
+  row.Name(names.Model(modelID));
+  row.Int(marker.ID & 0xffff);
+  row.Fixed(marker.x);
+  row.Fixed(marker.y);
+  row.Fixed(marker.z);
+  row.Fixed(marker.size);
+  row.Fixed(marker.residual);
+  row.Int((marker.params & 0x01) != 0);
+  row.Int((marker.params & 0x02) != 0);
+  row.Int((marker.params & 0x04) != 0);
+  row.End(&out->tables[TABLE_LABELED_MARKERS]);
+  out->rows++;
+}
+
+// Data packet of a capture, and what it is decoded with
+struct sCapturePacket {
+  const char *pData;
+  uint32_t nBytes;
+  uint32_t epoch;                         // into sCaptureIndex::epochs
+};
+
+// Decoder and names from a NAT_SERVERINFO or NAT_MODELDEF packet on
+struct sCaptureEpoch {
+  FrameDecoder decoder;
+  std::shared_ptr<const ModelNames> names;
+};
+
+struct sCaptureIndex {
+  std::vector<sCapturePacket> packets;
+  std::vector<sCaptureEpoch> epochs;
+  uint64_t duplicates = 0;
+  uint64_t malformed = 0;
+};
+
+static void IndexCapture(CaptureReader *reader, int major, int minor,
+                         sCaptureIndex *index) {
+  index->epochs.push_back(
+      {SelectFrameDecoder(major, minor), std::make_shared<ModelNames>(nullptr)});
+  bool bFirst = true;
+  int lastFrame = 0;
+  sCaptureRecord record;
+  const char *pData;
+  while (reader->Next(&record, &pData)) {
+    if (record.nBytes < 4)
+      continue;
+    uint16_t iMessage;
+    memcpy(&iMessage, pData, sizeof(iMessage));
+    if (record.channel == CAPTURE_CHANNEL_DATA) {
+      if (iMessage != NAT_FRAMEOFDATA)
+        continue;
+      // The frame number leads the payload
+      int iFrame = 0;
+      if (record.nBytes >= 8)
+        memcpy(&iFrame, pData + 4, sizeof(iFrame));
+      if (!bFirst && iFrame == lastFrame) {
+        index->duplicates++;
+        continue;
+      }
+      bFirst = false;
+      lastFrame = iFrame;
+      index->packets.push_back({pData, record.nBytes,
+                                (uint32_t) index->epochs.size() - 1});
+    } else if (iMessage == NAT_SERVERINFO &&
+               record.nBytes >= 4 + sizeof(sSender)) {
+      sSender sender;
+      memcpy(&sender, pData + 4, sizeof(sender));
+      major = sender.NatNetVersion[0];
+      minor = sender.NatNetVersion[1];
+      sCaptureEpoch epoch = index->epochs.back();
+      epoch.decoder = SelectFrameDecoder(major, minor);
+      index->epochs.push_back(epoch);
+    } else if (iMessage == NAT_MODELDEF) {
+      ModelDefDecoder decoder = SelectModelDefDecoder(major, minor);
+      sDataDescriptions descriptions;
+      if (decoder == nullptr ||
+          !decoder(pData, record.nBytes, &descriptions)) {
+        index->malformed++;
+        continue;
+      }
+      sCaptureEpoch epoch = index->epochs.back();
+      epoch.names = std::make_shared<ModelNames>(
+          std::make_shared<ModelDefIndex>(std::move(descriptions)));
+      index->epochs.push_back(epoch);
+    }
+  }
+}
+
+// Format packets [first, last) of a capture
+static void ExportCaptureChunk(const sCaptureIndex &index, size_t first,
+                               size_t last, std::atomic<uint64_t> *malformed,
+                               sChunkOutput *out) {
+  static const FrameSubscription subscription = [] {
+    FrameSubscription s;
+    s.AddSections(FRAME_SECTION_RIGID_BODIES | FRAME_SECTION_SKELETONS |
+                  FRAME_SECTION_LABELED_MARKERS);
+    return s;
+  }();
+  // Each thread decodes into its own frame, reusing its index storage
+  static thread_local FrameOfMocapData frame;
+  frame.SetSubscription(&subscription);
+  for (size_t i = first; i < last; i++) {
+    const sCapturePacket &packet = index.packets[i];
+    const sCaptureEpoch &epoch = index.epochs[packet.epoch];
+    if (epoch.decoder == nullptr ||
+        !epoch.decoder(packet.pData, packet.nBytes, &frame)) {
+      (*malformed)++;
+      continue;
+    }
+    const ModelNames &names = *epoch.names;
+    for (int j = 0; j < frame.RigidBodyCount(); j++)
+      AppendRigidBody(out, names, frame.iFrame, frame.fTimestamp,
+                      frame.RigidBody(j));
+    for (int s = 0; s < frame.SkeletonCount(); s++) {
+      for (int b = 0; b < frame.SkeletonBoneCount(s); b++)
+        AppendBone(out, names, frame.iFrame, frame.fTimestamp,
+                   frame.SkeletonID(s), frame.SkeletonBone(s, b));
+    }
+    for (int j = 0; j < frame.LabeledMarkerCount(); j++)
+      AppendLabeledMarker(out, names, frame.iFrame, frame.fTimestamp,
+                          frame.LabeledMarker(j));
+    out->frames++;
+  }
+}
+
+// Format chunk c of a take, whose frames share one model definition
+static void ExportTakeChunk(const TakeReader &reader, size_t c,
+                            const ModelNames &names,
+                            std::atomic<uint64_t> *malformed,
+                            sChunkOutput *out) {
+  sTakeChunk chunk;
+  if (!reader.ReadChunk(c, &chunk)) {
+    *malformed += reader.ChunkEntry(c).nFrames;
+    return;
+  }
+  sTakeFrame frame;
+  for (uint32_t i = 0; i < chunk.nFrames; i++) {
+    TakeReader::ChunkFrame(chunk, i, &frame);
+    for (const sRigidBodyData &rb : frame.rigidBodies)
+      AppendRigidBody(out, names, frame.frameNumber, frame.timestamp, rb);
+    for (const sTakeSkeleton &skeleton : frame.skeletons) {
+      for (const sRigidBodyData &bone : skeleton.bones)
+        AppendBone(out, names, frame.frameNumber, frame.timestamp,
+                   skeleton.ID, bone);
+    }
+    for (const sLabeledMarker &marker : frame.labeledMarkers)
+      AppendLabeledMarker(out, names, frame.frameNumber, frame.timestamp,
+                          marker);
+    out->frames++;
+  }
+}
+
+// Run export(k) for chunks 0 to nChunks - 1 on nThreads threads and
+// write their tables in chunk order as they complete
+static bool ExportChunks(size_t nChunks, int nThreads,
+                         const std::function<void(size_t, sChunkOutput *)> &
+                             exportChunk,
+                         FILE *files[TABLE_COUNT], sChunkOutput *totals) {
+  std::vector<sChunkOutput> outputs(nChunks);
+  std::mutex mutex;
+  std::condition_variable doneCv, windowCv;
+  std::atomic<size_t> next(0);
+  size_t written = 0;
+  size_t window = (size_t) nThreads * EXPORT_WINDOW;
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < nThreads; t++) {
+    threads.emplace_back([&] {
+      size_t k;
+      while ((k = next++) < nChunks) {
+        {
+          // Bounds the memory held by formatted chunks
+          std::unique_lock<std::mutex> lock(mutex);
+          windowCv.wait(lock, [&] { return k < written + window; });
+        }
+        sChunkOutput output;
+        exportChunk(k, &output);
+        std::lock_guard<std::mutex> lock(mutex);
+        outputs[k] = std::move(output);
+        outputs[k].bDone = true;
+        doneCv.notify_all();
+      }
+    });
+  }
+
+  bool bWritten = true;
+  for (size_t k = 0; k < nChunks; k++) {
+    sChunkOutput output;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      doneCv.wait(lock, [&] { return outputs[k].bDone; });
+      output = std::move(outputs[k]);
+    }
+    for (int t = 0; t < TABLE_COUNT; t++) {
+      const std::string &table = output.tables[t];
+      if (fwrite(table.data(), 1, table.size(), files[t]) != table.size())
+        bWritten = false;
+    }
+    totals->frames += output.frames;
+    totals->rows += output.rows;
+    std::lock_guard<std::mutex> lock(mutex);
+    written++;
+    windowCv.notify_all();
+  }
+  for (std::thread &thread : threads)
+    thread.join();
+  return bWritten;
+}
+
+static bool IsTake(const std::string &path) {
+  char magic[TAKE_MAGIC_SIZE] = {0};
+  FILE *file = fopen(path.c_str(), "rb");
+  if (file == nullptr)
+    return false;
+  size_t n = fread(magic, 1, sizeof(magic), file);
+  fclose(file);
+  return n == sizeof(magic) && memcmp(magic, TAKE_MAGIC, n) == 0;
+}
+
+static double Now() {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void Usage() {
+  printf("Usage: ExportTables [-j threads] [-c framesPerChunk] [-V 2.10]"
+         " [-o prefix]\n"
+         "                    recording\n");
+}
+
+int main(int argc, char *argv[]) {
+  int nThreads = (int) std::max(std::thread::hardware_concurrency(), 1u);
+  size_t chunkFrames = EXPORT_CHUNK_FRAMES;
+  int major = 2, minor = 10;
+  std::string prefix;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "j:c:V:o:h")) != -1) {
+    switch (opt) {
+      case 'j':nThreads = std::max(atoi(optarg), 1);
+        break;
+      case 'c':chunkFrames = (size_t) std::max(atoi(optarg), 1);
+        break;
+      case 'V':
+        if (sscanf(optarg, "%d.%d", &major, &minor) != 2) {
+          printf("Invalid version %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'o':prefix = optarg;
+        break;
+      default:Usage();
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc - 1) {
+    Usage();
+    return 1;
+  }
+  std::string path = argv[optind];
+  if (prefix.empty()) {
+    size_t slash = path.find_last_of('/');
+    size_t dot = path.find_last_of('.');
+    prefix = dot != std::string::npos &&
+             (slash == std::string::npos || dot > slash)
+             ? path.substr(0, dot) : path;
+  }
+
+  double start = Now();
+  std::atomic<uint64_t> malformed(0);
+  sChunkOutput totals;
+  bool bTake = IsTake(path);
+  CaptureReader capture;
+  TakeReader take;
+  sCaptureIndex captureIndex;
+  std::vector<std::shared_ptr<const ModelNames>> takeNames;
+  size_t nChunks;
+  std::function<void(size_t, sChunkOutput *)> exportChunk;
+
+  if (bTake) {
+    if (!take.Open(path)) {
+      printf("Cannot read take %s\n", path.c_str());
+      return 1;
+    }
+    if (!take.HasIndex())
+      printf("%s has no index; read up to its last complete chunk\n",
+             path.c_str());
+    // A take starts a chunk wherever its model definition changes
+    std::unordered_map<const char *, std::shared_ptr<const ModelNames>> decoded;
+    for (size_t c = 0; c < take.ChunkCount(); c++) {
+      // Frames recorded before the first NAT_MODELDEF reply have none
+      sTakeModelDef modelDef{};
+      bool bModelDef = take.ModelDef(take.ChunkEntry(c).firstIndex, &modelDef);
+      std::shared_ptr<const ModelNames> &names =
+          decoded[bModelDef ? modelDef.pData : nullptr];
+      if (!names) {
+        std::shared_ptr<const ModelDefIndex> index;
+        ModelDefDecoder decoder = !bModelDef ? nullptr :
+            SelectModelDefDecoder(modelDef.major, modelDef.minor);
+        sDataDescriptions descriptions;
+        if (decoder != nullptr &&
+            decoder(modelDef.pData, modelDef.nBytes, &descriptions))
+          index = std::make_shared<ModelDefIndex>(std::move(descriptions));
+        names = std::make_shared<ModelNames>(index);
+      }
+      takeNames.push_back(names);
+    }
+    nChunks = take.ChunkCount();
+    exportChunk = [&](size_t c, sChunkOutput *out) {
+      ExportTakeChunk(take, c, *takeNames[c], &malformed, out);
+    };
+  } else {
+    if (!capture.Open(path)) {
+      printf("Cannot read %s as a capture or a take\n", path.c_str());
+      return 1;
+    }
+    IndexCapture(&capture, major, minor, &captureIndex);
+    malformed += captureIndex.malformed;
+    size_t nPackets = captureIndex.packets.size();
+    nChunks = (nPackets + chunkFrames - 1) / chunkFrames;
+    exportChunk = [&, nPackets](size_t k, sChunkOutput *out) {
+      ExportCaptureChunk(captureIndex, k * chunkFrames,
+                         std::min((k + 1) * chunkFrames, nPackets),
+                         &malformed, out);
+    };
+  }
+
+  FILE *files[TABLE_COUNT] = {nullptr};
+  bool bOpened = true;
+  for (int t = 0; t < TABLE_COUNT; t++) {
+    std::string tablePath = prefix + kTableSuffixes[t];
+    files[t] = fopen(tablePath.c_str(), "w");
+    if (files[t] == nullptr) {
+      printf("Cannot create %s\n", tablePath.c_str());
+      bOpened = false;
+      break;
+    }
+    fputs(kTableHeaders[t], files[t]);
+  }
+  bool bWritten = bOpened &&
+      ExportChunks(nChunks, nThreads, exportChunk, files, &totals);
+  for (int t = 0; t < TABLE_COUNT; t++) {
+    if (files[t] != nullptr && fclose(files[t]) != 0)
+      bWritten = false;
+  }
+  if (!bWritten) {
+    if (bOpened)
+      printf("Cannot write the tables of %s\n", prefix.c_str());
+    return 1;
+  }
+
+  double seconds = Now() - start;
+  printf("%" PRIu64 " frames, %" PRIu64 " rows in %.3f s on %d threads:"
+         " %.0f frames/s\n",
+         totals.frames, totals.rows, seconds, nThreads,
+         seconds > 0.0 ? totals.frames / seconds : 0.0);
+  if (!bTake && captureIndex.duplicates > 0)
+    printf("%" PRIu64 " duplicate packets dropped\n", captureIndex.duplicates);
+  if (malformed > 0)
+    printf("%" PRIu64 " malformed packets skipped\n", malformed.load());
+  return 0;
+}
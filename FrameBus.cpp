@@ -0,0 +1,215 @@
+/*
+ * FrameBus.cpp
+ */
+
+#include "FrameBus.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Bytes of a frame up to its last used marker
+static size_t UsedSize(const sFrameBusFrame &frame) {
+  return offsetof(sFrameBusFrame, labeledMarkers) +
+      frame.nLabeledMarkers * sizeof(sFrameBusMarker);
+}
+
+FrameBusWriter::~FrameBusWriter() {
+  Close();
+}
+
+bool FrameBusWriter::Open(const std::string &name, uint32_t slotCount) {
+  Close();
+  slotCount = std::max(slotCount, 1u);
+  // A stale segment of a crashed writer may have another size
+  shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd == -1)
+    return false;
+  size_t size = FrameBusSegmentSize(slotCount);
+  void *mapping = MAP_FAILED;
+  if (ftruncate(fd, (off_t) size) == 0)
+    mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    shm_unlink(name.c_str());
+    return false;
+  }
+
+  // ftruncate zero-fills, so every sequence starts even
+  name_ = name;
+  size_ = size;
+  header_ = (sFrameBusHeader *) mapping;
+  header_->version = FRAME_BUS_VERSION;
+  header_->headerSize = sizeof(sFrameBusHeader);
+  header_->slotSize = sizeof(sFrameBusSlot);
+  header_->slotCount = slotCount;
+  header_->maxRigidBodies = FRAME_BUS_MAX_RIGID_BODIES;
+  header_->maxLabeledMarkers = FRAME_BUS_MAX_LABELED_MARKERS;
+  header_->writerPid = (int32_t) getpid();
+  // Readers check the magic last
+  std::atomic_thread_fence(std::memory_order_release);
+  header_->magic = FRAME_BUS_MAGIC;
+  return true;
+}
+
+void FrameBusWriter::Close() {
+  if (header_ == nullptr)
+    return;
+  header_->writerPid = 0;
+  munmap(header_, size_);
+  shm_unlink(name_.c_str());
+  header_ = nullptr;
+}
+
+sFrameBusSlot *FrameBusWriter::Slot(uint32_t i) const {
+  return (sFrameBusSlot *) ((char *) header_ + header_->headerSize +
+      (size_t) i * header_->slotSize);
+}
+
+void FrameBusWriter::Publish(const FrameOfMocapData &frame) {
+  if (header_ == nullptr)
+    return;
+  uint64_t index = header_->published.load(std::memory_order_relaxed);
+  sFrameBusSlot *slot = Slot((uint32_t) (index % header_->slotCount));
+  uint64_t sequence = slot->sequence.load(std::memory_order_relaxed);
+  slot->sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  slot->frameIndex = index;
+  sFrameBusFrame &out = slot->frame;
+  out.frameNumber = frame.iFrame;
+  out.params = frame.params;
+  out.timestamp = frame.fTimestamp;
+  out.cameraMidExposure = frame.CameraMidExposureTimestamp;
+  out.cameraDataReceived = frame.CameraDataReceivedTimestamp;
+  out.transmit = frame.TransmitTimestamp;
+  timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  out.publishedNs = (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+
+  out.nRigidBodies = std::min(frame.RigidBodyCount(),
+                              FRAME_BUS_MAX_RIGID_BODIES);
+  for (int i = 0; i < out.nRigidBodies; i++) {
+    sRigidBodyData rb = frame.RigidBody(i);
+    sFrameBusRigidBody &body = out.rigidBodies[i];
+    body.id = rb.ID;
+    body.params = rb.params;
+    body.reserved = 0;
+    body.x = rb.x;
+    body.y = rb.y;
+    body.z = rb.z;
+    body.qx = rb.qx;
+    body.qy = rb.qy;
+    body.qz = rb.qz;
+    body.qw = rb.qw;
+    body.meanError = rb.MeanError;
+  }
+  out.nLabeledMarkers = std::min(frame.LabeledMarkerCount(),
+                                 FRAME_BUS_MAX_LABELED_MARKERS);
+  for (int i = 0; i < out.nLabeledMarkers; i++) {
+    sLabeledMarker lm = frame.LabeledMarker(i);
+    sFrameBusMarker &marker = out.labeledMarkers[i];
+    marker.id = lm.ID;
+    marker.params = lm.params;
+    marker.reserved = 0;
+    marker.x = lm.x;
+    marker.y = lm.y;
+    marker.z = lm.z;
+    marker.size = lm.size;
+    marker.residual = lm.residual;
+  }
+  slot->sequence.store(sequence + 2, std::memory_order_release);
+
+  // The latest slot gets the used part of the same frame
+  sFrameBusSlot *latest = Slot(header_->slotCount);
+  uint64_t latestSequence = latest->sequence.load(std::memory_order_relaxed);
+  latest->sequence.store(latestSequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  latest->frameIndex = index;
+  memcpy(&latest->frame, &out, UsedSize(out));
+  latest->sequence.store(latestSequence + 2, std::memory_order_release);
+
+  header_->published.store(index + 1, std::memory_order_release);
+}
+
+FrameBusReader::~FrameBusReader() {
+  Close();
+}
+
+bool FrameBusReader::Open(const std::string &name) {
+  Close();
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd == -1)
+    return false;
+  struct stat st;
+  void *mapping = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(sFrameBusHeader))
+    mapping = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return false;
+
+  const sFrameBusHeader *header = (const sFrameBusHeader *) mapping;
+  bool bValid = header->magic == FRAME_BUS_MAGIC &&
+      header->version == FRAME_BUS_VERSION &&
+      (size_t) header->headerSize + ((size_t) header->slotCount + 1) *
+          header->slotSize <= (size_t) st.st_size;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (!bValid) {
+    munmap(mapping, (size_t) st.st_size);
+    return false;
+  }
+  header_ = header;
+  size_ = (size_t) st.st_size;
+  return true;
+}
+
+void FrameBusReader::Close() {
+  if (header_ == nullptr)
+    return;
+  munmap((void *) header_, size_);
+  header_ = nullptr;
+}
+
+// Copy the used part of a slot; may be torn until the read validates
+static void CopyFrame(const sFrameBusSlot *slot, sFrameBusFrame *frame) {
+  memcpy(frame, &slot->frame, offsetof(sFrameBusFrame, labeledMarkers));
+  size_t nMarkers = (size_t) std::min(std::max(frame->nLabeledMarkers, 0),
+                                      FRAME_BUS_MAX_LABELED_MARKERS);
+  memcpy(frame->labeledMarkers, slot->frame.labeledMarkers,
+         nMarkers * sizeof(sFrameBusMarker));
+}
+
+bool FrameBusReader::ReadLatest(sFrameBusFrame *frame) const {
+  if (header_->published.load(std::memory_order_acquire) == 0)
+    return false;
+  const sFrameBusSlot *slot = FrameBusLatest(header_);
+  uint64_t sequence;
+  do {
+    if (!FrameBusReadBegin(slot, &sequence))
+      return false;
+    CopyFrame(slot, frame);
+  } while (!FrameBusReadEnd(slot, sequence));
+  return true;
+}
+
+bool FrameBusReader::Read(uint64_t index, sFrameBusFrame *frame) const {
+  if (index >= header_->published.load(std::memory_order_acquire))
+    return false;
+  const sFrameBusSlot *slot =
+      FrameBusSlot(header_, (uint32_t) (index % header_->slotCount));
+  uint64_t sequence, slotIndex;
+  do {
+    if (!FrameBusReadBegin(slot, &sequence))
+      return false;
+    slotIndex = slot->frameIndex;
+    CopyFrame(slot, frame);
+  } while (!FrameBusReadEnd(slot, sequence));
+  return slotIndex == index;
+}
@@ -0,0 +1,75 @@
+/*
+ * FrameBus.h
+ *
+ * Writer and reader of the shared-memory frame bus described in
+ * FrameBusLayout.h.
+ *
+ * The writer copies the rigid bodies and labeled markers of each decoded
+ * frame into the next ring slot and the latest-frame slot. It must be
+ * called from one thread only. Readers map the segment read-only and
+ * never touch it from the writer's side, so any number of them can
+ * follow the bus without slowing the client down.
+ */
+
+#ifndef FRAME_BUS_H
+#define FRAME_BUS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "FrameBusLayout.h"
+#include "NatNetFrame.h"
+
+class FrameBusWriter {
+ public:
+  FrameBusWriter() = default;
+  FrameBusWriter(const FrameBusWriter &) = delete;
+  FrameBusWriter &operator=(const FrameBusWriter &) = delete;
+  ~FrameBusWriter();
+
+  // Create or replace the shm_open segment name (e.g. "/natnet") with
+  // slotCount ring slots
+  bool Open(const std::string &name, uint32_t slotCount);
+  // Unmap and unlink the segment; readers that still map it see
+  // writerPid 0
+  void Close();
+  bool IsOpen() const { return header_ != nullptr; }
+
+  void Publish(const FrameOfMocapData &frame);
+
+ private:
+  sFrameBusSlot *Slot(uint32_t i) const;
+
+  std::string name_;
+  sFrameBusHeader *header_ = nullptr;
+  size_t size_ = 0;
+};
+
+class FrameBusReader {
+ public:
+  FrameBusReader() = default;
+  FrameBusReader(const FrameBusReader &) = delete;
+  FrameBusReader &operator=(const FrameBusReader &) = delete;
+  ~FrameBusReader();
+
+  // Map an existing segment; false if it is missing or of another version
+  bool Open(const std::string &name);
+  void Close();
+
+  const sFrameBusHeader *Header() const { return header_; }
+
+  // Both return false if the writer left the slot mid-write, having
+  // died (writerPid) or stalled; the read can be retried.
+  // Copy the newest frame; false if nothing was published yet
+  bool ReadLatest(sFrameBusFrame *frame) const;
+  // Copy frame index; false if it was not published yet or has been
+  // overwritten by a newer one
+  bool Read(uint64_t index, sFrameBusFrame *frame) const;
+
+ private:
+  const sFrameBusHeader *header_ = nullptr;
+  size_t size_ = 0;
+};
+
+#endif  // FRAME_BUS_H
@@ -0,0 +1,135 @@
+/*
+ * FrameBusLayout.h
+ *
+ * Layout of the shared-memory frame bus, for processes that read frames
+ * published by PacketClient. This header has no other dependencies.
+ *
+ * The segment (shm_open name set with ~frame_bus) starts with an
+ * sFrameBusHeader, followed by slotCount ring slots and one latest-frame
+ * slot, each slotSize bytes. Frame n is written to ring slot
+ * n % slotCount; every frame is also copied to the latest slot, so a
+ * reader that only wants the newest poses watches one address.
+ *
+ * Each slot is guarded by a seqlock: the writer makes the sequence odd,
+ * writes the frame and makes it even again. A reader never blocks the
+ * writer and takes no locks or syscalls; it reads in place between
+ * FrameBusReadBegin() and FrameBusReadEnd() and retries if the slot
+ * changed meanwhile. A writer that dies mid-write leaves the slot odd;
+ * FrameBusReadBegin() then gives up after a bounded spin.
+ *
+ *   const sFrameBusSlot *slot = FrameBusLatest(header);
+ *   uint64_t sequence;
+ *   do {
+ *     if (!FrameBusReadBegin(slot, &sequence))
+ *       ... writer died (see writerPid) or stalled; try again later ...
+ *     ... read slot->frame ...
+ *   } while (!FrameBusReadEnd(slot, sequence));
+ *
+ * Readers must check magic and version, and use headerSize and slotSize
+ * from the header rather than sizeof, so that fields can be appended.
+ */
+
+#ifndef FRAME_BUS_LAYOUT_H
+#define FRAME_BUS_LAYOUT_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#define FRAME_BUS_MAGIC                 0x4E4E4246u   // "FBNN"
+#define FRAME_BUS_VERSION               1
+#define FRAME_BUS_MAX_RIGID_BODIES      64
+#define FRAME_BUS_MAX_LABELED_MARKERS   256
+// Loads of an odd sequence before a read gives up; a slot is written
+// in microseconds, this takes milliseconds
+#define FRAME_BUS_READ_SPINS            (1u << 24)
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+              "the frame bus needs lock-free 64 bit atomics");
+
+struct sFrameBusRigidBody {
+  int32_t id;
+  int16_t params;                   // 0x01 : tracked in this frame
+  int16_t reserved;
+  float x, y, z;
+  float qx, qy, qz, qw;
+  float meanError;
+};
+
+struct sFrameBusMarker {
+  int32_t id;                       // model ID << 16 | marker ID
+  int16_t params;
+  int16_t reserved;
+  float x, y, z;
+  float size;
+  float residual;
+};
+
+struct sFrameBusFrame {
+  int32_t frameNumber;
+  int16_t params;                   // frame params from Motive
+  int16_t reserved;
+  double timestamp;                 // seconds, Motive clock
+  uint64_t cameraMidExposure;       // server ticks, NatNet 3.0 and later
+  uint64_t cameraDataReceived;
+  uint64_t transmit;
+  int64_t publishedNs;              // written, CLOCK_REALTIME
+  // Bodies and markers beyond the maxima of the header are dropped
+  int32_t nRigidBodies;
+  int32_t nLabeledMarkers;
+  sFrameBusRigidBody rigidBodies[FRAME_BUS_MAX_RIGID_BODIES];
+  sFrameBusMarker labeledMarkers[FRAME_BUS_MAX_LABELED_MARKERS];
+};
+
+struct alignas(64) sFrameBusSlot {
+  std::atomic<uint64_t> sequence;   // odd while being written
+  uint64_t frameIndex;              // frames published before this one
+  sFrameBusFrame frame;
+};
+
+struct alignas(64) sFrameBusHeader {
+  uint32_t magic;                   // FRAME_BUS_MAGIC once initialized
+  uint32_t version;                 // FRAME_BUS_VERSION
+  uint32_t headerSize;
+  uint32_t slotSize;
+  uint32_t slotCount;               // ring slots, not counting latest
+  uint32_t maxRigidBodies;
+  uint32_t maxLabeledMarkers;
+  int32_t writerPid;                // 0 once the writer has closed
+  std::atomic<uint64_t> published;  // frames written since start
+};
+
+// Ring slot i, or the latest-frame slot for i == slotCount
+inline const sFrameBusSlot *FrameBusSlot(const sFrameBusHeader *header,
+                                         uint32_t i) {
+  return (const sFrameBusSlot *) ((const char *) header +
+      header->headerSize + (size_t) i * header->slotSize);
+}
+
+inline const sFrameBusSlot *FrameBusLatest(const sFrameBusHeader *header) {
+  return FrameBusSlot(header, header->slotCount);
+}
+
+inline size_t FrameBusSegmentSize(uint32_t slotCount) {
+  return sizeof(sFrameBusHeader) + (slotCount + 1) * sizeof(sFrameBusSlot);
+}
+
+// Wait until the slot is not being written and store its sequence;
+// false if it stays written for FRAME_BUS_READ_SPINS loads
+inline bool FrameBusReadBegin(const sFrameBusSlot *slot,
+                              uint64_t *sequence) {
+  for (uint32_t spins = 0; spins < FRAME_BUS_READ_SPINS; spins++) {
+    *sequence = slot->sequence.load(std::memory_order_acquire);
+    if ((*sequence & 1) == 0)
+      return true;
+  }
+  return false;
+}
+
+// True if the slot was not written since FrameBusReadBegin()
+inline bool FrameBusReadEnd(const sFrameBusSlot *slot, uint64_t sequence) {
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return slot->sequence.load(std::memory_order_relaxed) == sequence;
+}
+
+#endif  // FRAME_BUS_LAYOUT_H
@@ -0,0 +1,89 @@
+/*
+ * FrameColumns.cpp
+ */
+
+#include "FrameColumns.h"
+
+void sPoseColumns::Add(const sRigidBodyData &rb) {
+  ID.push_back(rb.ID);
+  x.push_back(rb.x);
+  y.push_back(rb.y);
+  z.push_back(rb.z);
+  qx.push_back(rb.qx);
+  qy.push_back(rb.qy);
+  qz.push_back(rb.qz);
+  qw.push_back(rb.qw);
+  meanError.push_back(rb.MeanError);
+  params.push_back(rb.params);
+}
+
+void sPoseColumns::Clear() {
+  ID.clear();
+  x.clear();
+  y.clear();
+  z.clear();
+  qx.clear();
+  qy.clear();
+  qz.clear();
+  qw.clear();
+  meanError.clear();
+  params.clear();
+}
+
+void sLabeledMarkerColumns::Add(const sLabeledMarker &marker) {
+  ID.push_back(marker.ID);
+  x.push_back(marker.x);
+  y.push_back(marker.y);
+  z.push_back(marker.z);
+  size.push_back(marker.size);
+  residual.push_back(marker.residual);
+  params.push_back(marker.params);
+}
+
+void sLabeledMarkerColumns::Clear() {
+  ID.clear();
+  x.clear();
+  y.clear();
+  z.clear();
+  size.clear();
+  residual.clear();
+  params.clear();
+}
+
+void FrameColumns::Add(const FrameOfMocapData &frame) {
+  frameNumber.push_back(frame.iFrame);
+  timestamp.push_back(frame.fTimestamp);
+  midExposure.push_back(frame.CameraMidExposureTimestamp);
+  params.push_back(frame.params);
+
+  for (int i = 0; i < frame.RigidBodyCount(); i++)
+    rigidBodies.Add(frame.RigidBody(i));
+  rigidBodyStart.push_back((uint32_t) rigidBodies.Size());
+
+  for (int s = 0; s < frame.SkeletonCount(); s++) {
+    skeletonID.push_back(frame.SkeletonID(s));
+    for (int b = 0; b < frame.SkeletonBoneCount(s); b++)
+      bones.Add(frame.SkeletonBone(s, b));
+    boneStart.push_back((uint32_t) bones.Size());
+  }
+  skeletonStart.push_back((uint32_t) skeletonID.size());
+
+  for (int i = 0; i < frame.LabeledMarkerCount(); i++)
+    labeledMarkers.Add(frame.LabeledMarker(i));
+  labeledMarkerStart.push_back((uint32_t) labeledMarkers.Size());
+}
+
+void FrameColumns::Clear() {
+  frameNumber.clear();
+  timestamp.clear();
+  midExposure.clear();
+  params.clear();
+  rigidBodyStart.assign(1, 0);
+  skeletonStart.assign(1, 0);
+  labeledMarkerStart.assign(1, 0);
+  rigidBodies.Clear();
+  skeletonID.clear();
+  boneStart.assign(1, 0);
+  bones.Clear();
+  labeledMarkers.Clear();
+}
@@ -0,0 +1,72 @@
+/*
+ * FrameColumns.h
+ *
+ * Decoded frames accumulated column by column, for consumers that take
+ * many frames at once: take chunks and Python batches.
+ *
+ * Per-frame fields have one entry per frame. Rigid bodies, skeletons,
+ * bones and labeled markers of all frames are concatenated; the
+ * elements of frame i are [start[i], start[i + 1]) of their *Start
+ * column, and the bones of skeleton s are [boneStart[s],
+ * boneStart[s + 1]).
+ */
+
+#ifndef FRAME_COLUMNS_H
+#define FRAME_COLUMNS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "NatNetFrame.h"
+
+// Rigid bodies or skeleton bones
+struct sPoseColumns {
+  std::vector<int32_t> ID;
+  std::vector<float> x, y, z;
+  std::vector<float> qx, qy, qz, qw;
+  std::vector<float> meanError;
+  std::vector<int16_t> params;
+
+  void Add(const sRigidBodyData &rb);
+  void Clear();
+  size_t Size() const { return ID.size(); }
+};
+
+struct sLabeledMarkerColumns {
+  std::vector<int32_t> ID;
+  std::vector<float> x, y, z;
+  std::vector<float> size;
+  std::vector<float> residual;
+  std::vector<int16_t> params;
+
+  void Add(const sLabeledMarker &marker);
+  void Clear();
+  size_t Size() const { return ID.size(); }
+};
+
+class FrameColumns {
+ public:
+  FrameColumns() { Clear(); }
+
+  // Append the rigid bodies, skeletons and labeled markers of a frame
+  void Add(const FrameOfMocapData &frame);
+  void Clear();
+  size_t Frames() const { return frameNumber.size(); }
+
+  std::vector<int32_t> frameNumber;
+  std::vector<double> timestamp;
+  std::vector<uint64_t> midExposure;      // server ticks, NatNet 3.0
+  std::vector<int16_t> params;
+  std::vector<uint32_t> rigidBodyStart;   // Frames() + 1
+  std::vector<uint32_t> skeletonStart;    // Frames() + 1
+  std::vector<uint32_t> labeledMarkerStart;  // Frames() + 1
+
+  sPoseColumns rigidBodies;
+  std::vector<int32_t> skeletonID;
+  std::vector<uint32_t> boneStart;        // skeletons + 1
+  sPoseColumns bones;
+  sLabeledMarkerColumns labeledMarkers;
+};
+
+#endif  // FRAME_COLUMNS_H
@@ -0,0 +1,80 @@
+/*
+ * FrameContinuity.cpp
+ */
+
+#include "FrameContinuity.h"
+
+#include <algorithm>
+
+// Counters have a single writer; relaxed increments are enough
+static void Increment(std::atomic<uint64_t> &counter, uint64_t count = 1) {
+  counter.store(counter.load(std::memory_order_relaxed) + count,
+                std::memory_order_relaxed);
+}
+
+void FrameContinuity::Update(int frameNumber, uint32_t kernelDrops,
+                             uint64_t pipelineDrops) {
+  Increment(frames_);
+  // Drop counters only grow; a smaller value means a new socket
+  kernelDelta_ += kernelDrops >= lastKernelDrops_
+                  ? kernelDrops - lastKernelDrops_ : kernelDrops;
+  pipelineDelta_ += pipelineDrops >= lastPipelineDrops_
+                    ? pipelineDrops - lastPipelineDrops_ : pipelineDrops;
+  lastKernelDrops_ = kernelDrops;
+  lastPipelineDrops_ = pipelineDrops;
+  kernelDrops_.store(kernelDrops, std::memory_order_relaxed);
+
+  int64_t delta = (int64_t) frameNumber - newest_;
+  if (!started_ || delta > FRAME_CONTINUITY_MAX_GAP ||
+      delta <= -FRAME_CONTINUITY_WINDOW) {
+    if (started_)
+      Increment(resets_);
+    started_ = true;
+    newest_ = frameNumber;
+    seen_ = 1;
+    kernelDelta_ = 0;
+    pipelineDelta_ = 0;
+    return;
+  }
+
+  if (delta > 0) {
+    if (delta > 1)
+      Attribute((uint64_t) (delta - 1));
+    // Drops after this frame belong to the next gap
+    kernelDelta_ = 0;
+    pipelineDelta_ = 0;
+    seen_ = delta < FRAME_CONTINUITY_WINDOW ? (seen_ << delta) | 1 : 1;
+    newest_ = frameNumber;
+  } else {
+    uint64_t bit = 1ULL << -delta;
+    if ((seen_ & bit) != 0) {
+      Increment(duplicates_);
+    } else {
+      seen_ |= bit;
+      Increment(late_);
+    }
+  }
+}
+
+void FrameContinuity::Attribute(uint64_t count) {
+  Increment(missing_, count);
+  uint64_t kernel = std::min(count, kernelDelta_);
+  uint64_t pipeline = std::min(count - kernel, pipelineDelta_);
+  if (kernel > 0)
+    Increment(missingKernel_, kernel);
+  if (pipeline > 0)
+    Increment(missingPipeline_, pipeline);
+}
+
+sContinuityStats FrameContinuity::GetStats() const {
+  sContinuityStats stats;
+  stats.frames = frames_.load(std::memory_order_relaxed);
+  stats.missing = missing_.load(std::memory_order_relaxed);
+  stats.missingKernel = missingKernel_.load(std::memory_order_relaxed);
+  stats.missingPipeline = missingPipeline_.load(std::memory_order_relaxed);
+  stats.late = late_.load(std::memory_order_relaxed);
+  stats.duplicates = duplicates_.load(std::memory_order_relaxed);
+  stats.resets = resets_.load(std::memory_order_relaxed);
+  stats.kernelDrops = kernelDrops_.load(std::memory_order_relaxed);
+  return stats;
+}
@@ -0,0 +1,75 @@
+/*
+ * FrameContinuity.h
+ *
+ * Sequence tracking of the frame numbers of one data stream.
+ *
+ * Frames are expected to arrive with consecutive numbers. A jump forward
+ * counts the skipped numbers as missing; a frame older than the newest
+ * one is either a duplicate or a late frame that fills an earlier gap,
+ * told apart by a bitmap of the last FRAME_CONTINUITY_WINDOW numbers.
+ * Jumps further than FRAME_CONTINUITY_MAX_GAP in either direction, e.g.
+ * a Motive restart or a seek in playback, restart the tracking instead.
+ *
+ * Missing frames are attributed to the kernel when the socket's
+ * SO_RXQ_OVFL drop counter grew since the previous frame, then to the
+ * pipeline when its drop counter grew; the remainder was lost on the
+ * network or never sent by Motive.
+ */
+
+#ifndef FRAME_CONTINUITY_H
+#define FRAME_CONTINUITY_H
+
+#include <atomic>
+#include <cstdint>
+
+#define FRAME_CONTINUITY_WINDOW     64
+#define FRAME_CONTINUITY_MAX_GAP    1000
+
+struct sContinuityStats {
+  uint64_t frames;            // frames seen, duplicates included
+  uint64_t missing;           // numbers skipped when a newer frame arrived
+  uint64_t missingKernel;     // ... while the kernel dropped datagrams
+  uint64_t missingPipeline;   // ... while the pipeline dropped datagrams
+  uint64_t late;              // arrived after a newer frame, filling a gap
+  uint64_t duplicates;
+  uint64_t resets;            // tracking restarted after a large jump
+  uint64_t kernelDrops;       // SO_RXQ_OVFL count of the socket
+};
+
+class FrameContinuity {
+ public:
+  FrameContinuity() = default;
+  FrameContinuity(const FrameContinuity &) = delete;
+  FrameContinuity &operator=(const FrameContinuity &) = delete;
+
+  // One frame, with the cumulative kernel and pipeline drop counts at
+  // its arrival. Called from one thread only.
+  void Update(int frameNumber, uint32_t kernelDrops, uint64_t pipelineDrops);
+
+  // May be called from any thread
+  sContinuityStats GetStats() const;
+
+ private:
+  // Charge count missing frames to the drops since the previous frame
+  void Attribute(uint64_t count);
+
+  // Tracking state, owned by the updating thread
+  bool started_ = false;
+  int newest_ = 0;
+  uint64_t seen_ = 0;         // bit i: frame newest_ - i arrived
+  uint32_t lastKernelDrops_ = 0;
+  uint64_t lastPipelineDrops_ = 0;
+  uint64_t kernelDelta_ = 0;
+  uint64_t pipelineDelta_ = 0;
+
+  std::atomic<uint64_t> frames_{0};
+  std::atomic<uint64_t> missing_{0};
+  std::atomic<uint64_t> missingKernel_{0};
+  std::atomic<uint64_t> missingPipeline_{0};
+  std::atomic<uint64_t> late_{0};
+  std::atomic<uint64_t> duplicates_{0};
+  std::atomic<uint64_t> resets_{0};
+  std::atomic<uint64_t> kernelDrops_{0};
+};
+
+#endif  // FRAME_CONTINUITY_H
@@ -0,0 +1,141 @@
+/*
+ * LatencyStats.cpp
+ */
+
+#include "LatencyStats.h"
+
+#include <algorithm>
+
+static int64_t ToNs(const timespec &ts) {
+  return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void LatencyWindow::Add(double seconds) {
+  samples_[count_ % samples_.size()] = seconds;
+  count_++;
+}
+
+sLatencySummary LatencyWindow::Summary() const {
+  sLatencySummary summary;
+  summary.count = count_;
+  summary.window = (size_t) std::min<uint64_t>(count_, samples_.size());
+  if (summary.window == 0)
+    return summary;
+
+  std::vector<double> sorted(samples_.begin(),
+                             samples_.begin() + summary.window);
+  std::sort(sorted.begin(), sorted.end());
+  summary.p50 = sorted[(sorted.size() - 1) / 2];
+  summary.p99 = sorted[(sorted.size() - 1) * 99 / 100];
+  summary.max = sorted.back();
+  return summary;
+}
+
+const char *LatencyStats::StageName(int stage) {
+  switch (stage) {
+    case LATENCY_EXPOSURE_TO_CAMERA:return "exposure -> camera";
+    case LATENCY_CAMERA_TO_TRANSMIT:return "camera -> transmit";
+    case LATENCY_TRANSMIT_TO_ARRIVAL:return "transmit -> arrival";
+    case LATENCY_ARRIVAL_TO_DECODED:return "arrival -> decoded";
+    case LATENCY_DECODED_TO_PUBLISHED:return "decoded -> published";
+    case LATENCY_ARRIVAL_TO_WAKEUP:return "arrival -> wakeup";
+    default:return "unknown";
+  }
+}
+
+void LatencyStats::SetClockFrequency(uint64_t ticksPerSecond) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (ticksPerSecond == ticksPerSecond_)
+    return;
+  // Offsets measured against another clock are meaningless now
+  ticksPerSecond_ = ticksPerSecond;
+  nEchoes_ = 0;
+  hasOffset_ = false;
+}
+
+int64_t LatencyStats::TicksToNs(uint64_t ticks) const {
+  // Split to avoid overflowing 64 bits
+  return (int64_t) ((ticks / ticksPerSecond_) * 1000000000ULL +
+      (ticks % ticksPerSecond_) * 1000000000ULL / ticksPerSecond_);
+}
+
+void LatencyStats::AddEcho(int64_t sentNs, uint64_t serverTicks,
+                           int64_t receivedNs) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (ticksPerSecond_ == 0 || receivedNs < sentNs)
+    return;
+
+  sEcho echo;
+  echo.roundTripNs = receivedNs - sentNs;
+  echo.offsetNs = sentNs + echo.roundTripNs / 2 - TicksToNs(serverTicks);
+  echoes_[nEchoes_ % LATENCY_ECHO_WINDOW] = echo;
+  nEchoes_++;
+
+  // The shortest round trip bounds the offset error best
+  size_t n = std::min(nEchoes_, (size_t) LATENCY_ECHO_WINDOW);
+  const sEcho *best = std::min_element(
+      echoes_, echoes_ + n, [](const sEcho &a, const sEcho &b) {
+        return a.roundTripNs < b.roundTripNs;
+      });
+  offsetNs_ = best->offsetNs;
+  hasOffset_ = true;
+}
+
+void LatencyStats::AddFrame(const FrameOfMocapData &frame,
+                            const timespec &arrival,
+                            const timespec &received,
+                            const timespec &decoded,
+                            const timespec &published) {
+  int64_t arrivalNs = ToNs(arrival);
+  int64_t decodedNs = ToNs(decoded);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  stages_[LATENCY_ARRIVAL_TO_DECODED].Add((decodedNs - arrivalNs) * 1e-9);
+  stages_[LATENCY_DECODED_TO_PUBLISHED].Add(
+      (ToNs(published) - decodedNs) * 1e-9);
+  stages_[LATENCY_ARRIVAL_TO_WAKEUP].Add((ToNs(received) - arrivalNs) * 1e-9);
+
+  // High resolution timestamps are zero before NatNet 3.0
+  if (ticksPerSecond_ == 0 || frame.TransmitTimestamp == 0)
+    return;
+  double secondsPerTick = 1.0 / ticksPerSecond_;
+  stages_[LATENCY_EXPOSURE_TO_CAMERA].Add(
+      (double) (int64_t) (frame.CameraDataReceivedTimestamp -
+          frame.CameraMidExposureTimestamp) * secondsPerTick);
+  stages_[LATENCY_CAMERA_TO_TRANSMIT].Add(
+      (double) (int64_t) (frame.TransmitTimestamp -
+          frame.CameraDataReceivedTimestamp) * secondsPerTick);
+  if (hasOffset_) {
+    int64_t transmitNs = TicksToNs(frame.TransmitTimestamp) + offsetNs_;
+    stages_[LATENCY_TRANSMIT_TO_ARRIVAL].Add((arrivalNs - transmitNs) * 1e-9);
+  }
+}
+
+bool LatencyStats::TicksToSeconds(uint64_t ticks, double *seconds) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (ticksPerSecond_ == 0)
+    return false;
+  *seconds = (double) (ticks / ticksPerSecond_) +
+      (double) (ticks % ticksPerSecond_) / ticksPerSecond_;
+  return true;
+}
+
+bool LatencyStats::TicksToClientNs(uint64_t ticks, int64_t *clientNs) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!hasOffset_)
+    return false;
+  *clientNs = TicksToNs(ticks) + offsetNs_;
+  return true;
+}
+
+void LatencyStats::Summaries(
+    sLatencySummary summaries[LATENCY_STAGE_COUNT]) const {
+  // Copy the samples under the lock, sort outside of it
+  LatencyWindow stages[LATENCY_STAGE_COUNT];
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::copy(stages_, stages_ + LATENCY_STAGE_COUNT, stages);
+  }
+  for (int i = 0; i < LATENCY_STAGE_COUNT; i++)
+    summaries[i] = stages[i].Summary();
+}
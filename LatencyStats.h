@@ -0,0 +1,115 @@
+/*
+ * LatencyStats.h
+ *
+ * Per-stage latency of frames, from camera exposure in Motive to the
+ * end of publishing in the client.
+ *
+ * The first two stages are measured on the server's high resolution
+ * clock (NatNet 3.0 timestamps, HighResClockFrequency ticks per second).
+ * Transmit -> arrival crosses from the server clock to the client's
+ * CLOCK_REALTIME; the offset between the two is estimated from
+ * NAT_ECHOREQUEST round trips, taking the sample with the shortest round
+ * trip of the recent ones and assuming a symmetric path. Until an echo
+ * reply has arrived that stage is not recorded.
+ *
+ * Arrival -> wakeup is the part of arrival -> decoded spent before the
+ * receive call returned: how long the receive thread took to notice a
+ * datagram the kernel already had. Its spread is the wakeup jitter that
+ * the spinning receive mode trades CPU time against.
+ *
+ * Each stage keeps its most recent LATENCY_WINDOW samples; summaries
+ * are computed over that window.
+ */
+
+#ifndef LATENCY_STATS_H
+#define LATENCY_STATS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include <time.h>
+
+#include "NatNetFrame.h"
+
+#define LATENCY_WINDOW              4096
+#define LATENCY_ECHO_WINDOW         16
+
+enum eLatencyStage {
+  LATENCY_EXPOSURE_TO_CAMERA = 0,         // mid-exposure -> camera data received
+  LATENCY_CAMERA_TO_TRANSMIT,             // camera data received -> transmit
+  LATENCY_TRANSMIT_TO_ARRIVAL,            // transmit -> kernel receive
+  LATENCY_ARRIVAL_TO_DECODED,             // kernel receive -> decoded
+  LATENCY_DECODED_TO_PUBLISHED,           // decoded -> published
+  LATENCY_ARRIVAL_TO_WAKEUP,              // kernel receive -> receive call
+  LATENCY_STAGE_COUNT
+};
+
+// Seconds over the current window
+struct sLatencySummary {
+  uint64_t count = 0;                     // samples since start
+  size_t window = 0;                      // samples summarized
+  double p50 = 0.0;
+  double p99 = 0.0;
+  double max = 0.0;
+};
+
+// Most recent samples of one stage
+class LatencyWindow {
+ public:
+  LatencyWindow() : samples_(LATENCY_WINDOW) {}
+  void Add(double seconds);
+  sLatencySummary Summary() const;
+
+ private:
+  std::vector<double> samples_;
+  uint64_t count_ = 0;
+};
+
+class LatencyStats {
+ public:
+  static const char *StageName(int stage);
+
+  // From NAT_SERVERINFO; 0 disables the server clock stages
+  void SetClockFrequency(uint64_t ticksPerSecond);
+
+  // An echo reply: client time the request was sent, server clock when
+  // the server handled it, and client time the reply arrived
+  void AddEcho(int64_t sentNs, uint64_t serverTicks, int64_t receivedNs);
+
+  // A published frame; times are CLOCK_REALTIME
+  void AddFrame(const FrameOfMocapData &frame,
+                const timespec &arrival,
+                const timespec &received,
+                const timespec &decoded,
+                const timespec &published);
+
+  void Summaries(sLatencySummary summaries[LATENCY_STAGE_COUNT]) const;
+
+  // Server clock ticks as seconds; false before the clock frequency is
+  // known
+  bool TicksToSeconds(uint64_t ticks, double *seconds) const;
+
+  // Server clock ticks as client CLOCK_REALTIME; false until an echo
+  // reply has arrived
+  bool TicksToClientNs(uint64_t ticks, int64_t *clientNs) const;
+
+ private:
+  struct sEcho {
+    int64_t roundTripNs;
+    int64_t offsetNs;                     // client ns - server ns
+  };
+
+  int64_t TicksToNs(uint64_t ticks) const;
+
+  mutable std::mutex mutex_;
+  uint64_t ticksPerSecond_ = 0;
+  sEcho echoes_[LATENCY_ECHO_WINDOW];
+  size_t nEchoes_ = 0;
+  bool hasOffset_ = false;
+  int64_t offsetNs_ = 0;
+  LatencyWindow stages_[LATENCY_STAGE_COUNT];
+};
+
+#endif  // LATENCY_STATS_H
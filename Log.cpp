@@ -0,0 +1,243 @@
+/*
+ * Log.cpp
+ */
+
+#include "Log.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "SpscRing.h"
+
+// Writer sleep when the ring is empty
+#define LOG_WRITER_IDLE_US          1000
+
+static_assert((LOG_RING_SIZE & (LOG_RING_SIZE - 1)) == 0,
+              "LOG_RING_SIZE must be a power of two");
+
+// Bounded multi-producer ring with one consumer (D. Vyukov's MPMC
+// queue). A slot's sequence tells whose turn it is: equal to the
+// position when free for a producer, position + 1 once written.
+struct sLogSlot {
+  std::atomic<uint64_t> sequence;
+  uint16_t length;
+  char text[LOG_MESSAGE_SIZE];
+};
+
+class LogRing {
+ public:
+  LogRing() : slots_(LOG_RING_SIZE) {
+    for (size_t i = 0; i < slots_.size(); i++)
+      slots_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  // Claim a slot to format into, or nullptr if the ring is full
+  sLogSlot *Claim(uint64_t *position) {
+    uint64_t pos = enqueuePos_.load(std::memory_order_relaxed);
+    while (true) {
+      sLogSlot *slot = &slots_[pos & (LOG_RING_SIZE - 1)];
+      uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+      int64_t diff = (int64_t) sequence - (int64_t) pos;
+      if (diff == 0) {
+        if (enqueuePos_.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          *position = pos;
+          return slot;
+        }
+      } else if (diff < 0) {
+        return nullptr;
+      } else {
+        pos = enqueuePos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void Publish(sLogSlot *slot, uint64_t position) {
+    slot->sequence.store(position + 1, std::memory_order_release);
+  }
+
+  // Oldest written slot, or nullptr; consumer only
+  sLogSlot *Front() {
+    sLogSlot *slot = &slots_[dequeuePos_ & (LOG_RING_SIZE - 1)];
+    if (slot->sequence.load(std::memory_order_acquire) != dequeuePos_ + 1)
+      return nullptr;
+    return slot;
+  }
+
+  void PopFront(sLogSlot *slot) {
+    slot->sequence.store(dequeuePos_ + LOG_RING_SIZE,
+                         std::memory_order_release);
+    dequeuePos_++;
+  }
+
+ private:
+  std::vector<sLogSlot> slots_;
+  alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> enqueuePos_{0};
+  alignas(CACHE_LINE_SIZE) uint64_t dequeuePos_ = 0;
+};
+
+// Generic cell rate algorithm: tat is the theoretical arrival time
+// of the next message
+struct sRateLimit {
+  std::atomic<int64_t> intervalNs{0};
+  std::atomic<int64_t> toleranceNs{0};
+  std::atomic<int64_t> tat{0};
+  std::atomic<uint64_t> suppressed{0};
+};
+
+static LogRing gLogRing;
+static sRateLimit gRateLimits[LOG_CLASS_COUNT];
+static std::atomic<int> gLogLevel(NATNET_LOG_LEVEL);
+static std::atomic<bool> gLogRunning(false);
+static std::atomic<uint64_t> gLogWritten(0);
+static std::atomic<uint64_t> gLogDropped(0);
+static std::thread gLogWriter;
+
+static int64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Write queued messages; returns false if there were none
+static bool DrainLog(std::vector<char> *buffer) {
+  buffer->clear();
+  sLogSlot *slot;
+  while ((slot = gLogRing.Front()) != nullptr) {
+    buffer->insert(buffer->end(), slot->text, slot->text + slot->length);
+    gLogRing.PopFront(slot);
+  }
+  if (buffer->empty())
+    return false;
+  fwrite(buffer->data(), 1, buffer->size(), stdout);
+  return true;
+}
+
+static void LogWriterLoop() {
+  std::vector<char> buffer;
+  buffer.reserve(LOG_RING_SIZE * 64);
+  while (gLogRunning.load(std::memory_order_relaxed)) {
+    if (!DrainLog(&buffer)) {
+      fflush(stdout);
+      std::this_thread::sleep_for(
+          std::chrono::microseconds(LOG_WRITER_IDLE_US));
+    }
+  }
+  DrainLog(&buffer);
+  fflush(stdout);
+}
+
+void LogStart() {
+  if (gLogRunning.exchange(true))
+    return;
+  fflush(stdout);
+  gLogWriter = std::thread(LogWriterLoop);
+}
+
+void LogStop() {
+  if (!gLogRunning.exchange(false))
+    return;
+  gLogWriter.join();
+}
+
+void LogSetLevel(int level) {
+  gLogLevel.store(level, std::memory_order_relaxed);
+}
+
+int LogGetLevel() {
+  return gLogLevel.load(std::memory_order_relaxed);
+}
+
+bool LogParseLevel(const char *szLevel, int *level) {
+  static const char *szLevels[] = {"error", "warn", "info", "debug"};
+  for (int i = 0; i <= LOG_LEVEL_DEBUG; i++) {
+    if (strcmp(szLevel, szLevels[i]) == 0) {
+      *level = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+void LogSetRateLimit(eLogClass cls, double perSecond) {
+  sRateLimit &limit = gRateLimits[cls];
+  int64_t intervalNs = perSecond > 0.0 ? (int64_t) (1e9 / perSecond) : 0;
+  limit.toleranceNs.store(intervalNs > 0 && intervalNs < 1000000000LL
+                              ? 1000000000LL - intervalNs : 0,
+                          std::memory_order_relaxed);
+  limit.intervalNs.store(intervalNs, std::memory_order_relaxed);
+}
+
+bool LogAdmit(eLogClass cls) {
+  sRateLimit &limit = gRateLimits[cls];
+  int64_t intervalNs = limit.intervalNs.load(std::memory_order_relaxed);
+  if (intervalNs == 0)
+    return true;
+
+  int64_t now = NowNs();
+  int64_t tat = limit.tat.load(std::memory_order_relaxed);
+  while (true) {
+    if (now < tat - limit.toleranceNs.load(std::memory_order_relaxed)) {
+      limit.suppressed.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    int64_t next = (tat > now ? tat : now) + intervalNs;
+    if (limit.tat.compare_exchange_weak(tat, next, std::memory_order_relaxed))
+      return true;
+  }
+}
+
+static void LogFormat(const char *szFormat, va_list args) {
+  if (!gLogRunning.load(std::memory_order_acquire)) {
+    vprintf(szFormat, args);
+    return;
+  }
+
+  uint64_t position;
+  sLogSlot *slot = gLogRing.Claim(&position);
+  if (slot == nullptr) {
+    gLogDropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  int length = vsnprintf(slot->text, LOG_MESSAGE_SIZE, szFormat, args);
+  if (length < 0) {
+    length = 0;
+  } else if (length >= LOG_MESSAGE_SIZE) {
+    // Truncated; keep the line break
+    length = LOG_MESSAGE_SIZE - 1;
+    slot->text[length - 1] = '\n';
+  }
+  slot->length = (uint16_t) length;
+  gLogRing.Publish(slot, position);
+  gLogWritten.fetch_add(1, std::memory_order_relaxed);
+}
+
+void LogAppend(int level, eLogClass cls, const char *szFormat, ...) {
+  va_list args;
+  va_start(args, szFormat);
+  LogFormat(szFormat, args);
+  va_end(args);
+}
+
+void LogMessage(int level, eLogClass cls, const char *szFormat, ...) {
+  if (!LogAdmit(cls))
+    return;
+  va_list args;
+  va_start(args, szFormat);
+  LogFormat(szFormat, args);
+  va_end(args);
+}
+
+sLogStats LogGetStats() {
+  sLogStats stats;
+  stats.written = gLogWritten.load(std::memory_order_relaxed);
+  stats.dropped = gLogDropped.load(std::memory_order_relaxed);
+  for (int i = 0; i < LOG_CLASS_COUNT; i++)
+    stats.suppressed[i] = gRateLimits[i].suppressed.load(
+        std::memory_order_relaxed);
+  return stats;
+}
@@ -0,0 +1,93 @@
+/*
+ * Log.h
+ *
+ * Asynchronous logging for the packet path.
+ *
+ * Messages are formatted by the calling thread into a slot of a bounded
+ * lock-free multi-producer ring and written to stdout by a background
+ * thread, so a slow terminal or journald never blocks decoding. When the
+ * ring is full the message is dropped and counted; logging never waits.
+ * Until LogStart() and after LogStop(), messages are written directly.
+ *
+ * Levels above NATNET_LOG_LEVEL are removed at compile time; the others
+ * can be switched off at run time with LogSetLevel(). Each message class
+ * has its own rate limit, so per-frame diagnostics can stay enabled in
+ * production at a bounded cost.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <cstdint>
+
+#define LOG_LEVEL_ERROR             0
+#define LOG_LEVEL_WARN              1
+#define LOG_LEVEL_INFO              2
+#define LOG_LEVEL_DEBUG             3
+
+// Most verbose level compiled in
+#ifndef NATNET_LOG_LEVEL
+#define NATNET_LOG_LEVEL            LOG_LEVEL_DEBUG
+#endif
+
+// Bytes of one message, longer ones are truncated
+#define LOG_MESSAGE_SIZE            240
+#define LOG_RING_SIZE               4096
+
+enum eLogClass {
+  LOG_CLASS_CLIENT = 0,                   // status and errors
+  LOG_CLASS_FRAME,                        // per-frame dumps
+  LOG_CLASS_MODELDEF,                     // data descriptions
+  LOG_CLASS_COMMAND,                      // command socket traffic
+  LOG_CLASS_COUNT
+};
+
+struct sLogStats {
+  uint64_t written;                       // messages handed to the writer
+  uint64_t dropped;                       // ring was full
+  uint64_t suppressed[LOG_CLASS_COUNT];   // over the class rate limit
+};
+
+void LogStart();
+// Write out every queued message, then stop the writer thread
+void LogStop();
+
+void LogSetLevel(int level);
+int LogGetLevel();
+// Parse "error", "warn", "info" or "debug"; false if unknown
+bool LogParseLevel(const char *szLevel, int *level);
+
+// At most perSecond messages of a class, with bursts of up to one
+// second's worth; 0 removes the limit
+void LogSetRateLimit(eLogClass cls, double perSecond);
+
+// True if a message of this class is within its rate limit; counts a
+// suppressed message otherwise. Admit a group of lines (e.g. one frame
+// dump) once and write its lines with LogAppend().
+bool LogAdmit(eLogClass cls);
+
+// Queue a message without a rate limit check
+void LogAppend(int level, eLogClass cls, const char *szFormat, ...)
+    __attribute__((format(printf, 3, 4)));
+
+// Rate limited message
+void LogMessage(int level, eLogClass cls, const char *szFormat, ...)
+    __attribute__((format(printf, 3, 4)));
+
+sLogStats LogGetStats();
+
+#define LOG_ENABLED(level) \
+  ((level) <= NATNET_LOG_LEVEL && (level) <= LogGetLevel())
+
+#define LOG_AT(level, cls, ...) \
+  do { \
+    if (LOG_ENABLED(level)) \
+      LogMessage(level, cls, __VA_ARGS__); \
+  } while (0)
+
+#define LOG_ERROR(cls, ...) LOG_AT(LOG_LEVEL_ERROR, cls, __VA_ARGS__)
+#define LOG_WARN(cls, ...) LOG_AT(LOG_LEVEL_WARN, cls, __VA_ARGS__)
+#define LOG_INFO(cls, ...) LOG_AT(LOG_LEVEL_INFO, cls, __VA_ARGS__)
+#define LOG_DEBUG(cls, ...) LOG_AT(LOG_LEVEL_DEBUG, cls, __VA_ARGS__)
+
+#endif  // LOG_H
@@ -0,0 +1,61 @@
+/*
+ * MarkerSoA.h
+ *
+ * Bulk extraction of markers from a packet into structure-of-arrays
+ * buffers, for point cloud and clustering code that works on x[], y[],
+ * z[] rather than on one marker at a time.
+ *
+ * Kernels exist for AVX2 (gathers over the labeled marker stride), SSE2
+ * (4x4 transposes and shuffles) and plain C++. SSE2 is selected at
+ * startup where the CPU has it, since the gathers are no faster;
+ * SetMarkerSimdLevel() picks another. Non-x86 builds, or builds with
+ * NATNET_NO_SIMD defined, only have the scalar kernels.
+ */
+
+#ifndef MARKER_SOA_H
+#define MARKER_SOA_H
+
+#include <cstddef>
+
+// Marker positions; each array holds at least as many entries as
+// markers are extracted
+struct sMarkerSoA {
+  float *x;
+  float *y;
+  float *z;
+};
+
+// Labeled markers; residual is zero before NatNet 3.0
+struct sLabeledMarkerSoA {
+  int *id;
+  float *x;
+  float *y;
+  float *z;
+  float *size;
+  float *residual;
+};
+
+enum eSimdLevel {
+  SIMD_SCALAR = 0,
+  SIMD_SSE2,
+  SIMD_AVX2
+};
+
+eSimdLevel GetMarkerSimdLevel();
+// Force a kernel set, e.g. to compare them; false if the CPU lacks it.
+// Must not be called while markers are being extracted.
+bool SetMarkerSimdLevel(eSimdLevel level);
+const char *SimdLevelName(eSimdLevel level);
+
+// count packed x, y, z float triples at pData
+void DeinterleaveMarkers(const char *pData, int count, const sMarkerSoA &out);
+
+// count labeled markers, stride bytes apart, at pData: ID, x, y, z and
+// size, with the residual at residualOffset if that is positive
+void ExtractLabeledMarkers(const char *pData,
+                           int count,
+                           size_t stride,
+                           int residualOffset,
+                           const sLabeledMarkerSoA &out);
+
+#endif  // MARKER_SOA_H
@@ -0,0 +1,384 @@
+/*
+ * Metrics.cpp
+ */
+
+#include "Metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "SpscRing.h"
+
+#define METRICS_BUCKET_COUNT        12
+// Bytes of an HTTP request that are read; the rest is ignored
+#define METRICS_REQUEST_SIZE        2048
+
+// Upper bounds in seconds; the last bucket is +Inf
+static const double kBucketBounds[METRIC_HISTOGRAM_COUNT][METRICS_BUCKET_COUNT] = {
+    {1e-6, 2e-6, 5e-6, 1e-5, 2e-5, 5e-5, 1e-4, 2e-4, 5e-4, 1e-3, 2e-3, 5e-3},
+    {1e-6, 2e-6, 5e-6, 1e-5, 2e-5, 5e-5, 1e-4, 2e-4, 5e-4, 1e-3, 2e-3, 5e-3},
+    {1e-4, 2e-4, 5e-4, 1e-3, 2e-3, 5e-3, 1e-2, 2e-2, 5e-2, 1e-1, 2e-1, 5e-1},
+};
+
+static const char *kHistogramNames[METRIC_HISTOGRAM_COUNT][2] = {
+    {"natnet_decode_seconds", "Time to decode one data datagram"},
+    {"natnet_publish_seconds", "Time to publish one frame"},
+    {"natnet_command_round_trip_seconds",
+     "Time from sending a command to its response"},
+};
+
+struct sRigidBodyCounters {
+  std::atomic<int> source;
+  std::atomic<int> ID;
+  std::atomic<uint64_t> frames;
+  std::atomic<uint64_t> tracked;
+};
+
+struct alignas(CACHE_LINE_SIZE) sThreadMetrics {
+  std::atomic<uint64_t> counters[METRIC_COUNTER_COUNT];
+  std::atomic<uint64_t> buckets[METRIC_HISTOGRAM_COUNT]
+                               [METRICS_BUCKET_COUNT + 1];
+  std::atomic<uint64_t> sumNs[METRIC_HISTOGRAM_COUNT];
+  std::atomic<int> nRigidBodies;
+  sRigidBodyCounters rigidBodies[METRICS_MAX_RIGID_BODIES];
+  std::atomic<bool> inUse;                // by a running thread
+};
+
+// Zero-initialized as a static
+static sThreadMetrics gThreadMetrics[METRICS_MAX_THREADS];
+// Slots ever claimed, which a scrape sums
+static std::atomic<int> gThreadCount(0);
+// Threads that found every slot in use and share the last one
+static std::atomic<uint64_t> gThreadOverflows(0);
+static thread_local sThreadMetrics *tMetrics = nullptr;
+
+// Frees a thread's slot when it exits. Its counts stay in the slot and
+// keep adding up under the next thread that claims it.
+struct sSlotRelease {
+  sThreadMetrics *slot = nullptr;
+  ~sSlotRelease() {
+    if (slot != nullptr)
+      slot->inUse.store(false, std::memory_order_release);
+  }
+};
+static thread_local sSlotRelease tSlotRelease;
+
+static MetricsCollector gCollector;
+static std::vector<std::string> gSources;
+static int gListenFd = -1;
+static std::thread gServerThread;
+
+static sThreadMetrics *ThreadMetrics() {
+  if (tMetrics != nullptr)
+    return tMetrics;
+  for (int i = 0; i < METRICS_MAX_THREADS; i++) {
+    bool bFree = false;
+    if (gThreadMetrics[i].inUse.compare_exchange_strong(
+            bFree, true, std::memory_order_acquire)) {
+      int count = gThreadCount.load(std::memory_order_relaxed);
+      while (count < i + 1 &&
+             !gThreadCount.compare_exchange_weak(count, i + 1)) {}
+      tSlotRelease.slot = tMetrics = &gThreadMetrics[i];
+      return tMetrics;
+    }
+  }
+  gThreadOverflows.fetch_add(1, std::memory_order_relaxed);
+  gThreadCount.store(METRICS_MAX_THREADS, std::memory_order_relaxed);
+  tMetrics = &gThreadMetrics[METRICS_MAX_THREADS - 1];
+  return tMetrics;
+}
+
+void MetricsAdd(eMetricsCounter counter, uint64_t n) {
+  ThreadMetrics()->counters[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+void MetricsObserve(eMetricsHistogram histogram, int64_t ns) {
+  sThreadMetrics *metrics = ThreadMetrics();
+  double seconds = ns * 1e-9;
+  int bucket = 0;
+  while (bucket < METRICS_BUCKET_COUNT &&
+         seconds > kBucketBounds[histogram][bucket])
+    bucket++;
+  metrics->buckets[histogram][bucket].fetch_add(1, std::memory_order_relaxed);
+  metrics->sumNs[histogram].fetch_add((uint64_t) std::max<int64_t>(ns, 0),
+                                      std::memory_order_relaxed);
+}
+
+static bool IsBody(const sRigidBodyCounters &body, int source, int ID) {
+  // ID is published last
+  return body.ID.load(std::memory_order_acquire) == ID &&
+      body.source.load(std::memory_order_relaxed) == source;
+}
+
+void MetricsRigidBody(int source, int index, int ID, bool bTracked) {
+  sThreadMetrics *metrics = ThreadMetrics();
+  int n = metrics->nRigidBodies.load(std::memory_order_acquire);
+  sRigidBodyCounters *body = nullptr;
+  if (index >= 0 && index < n &&
+      IsBody(metrics->rigidBodies[index], source, ID)) {
+    body = &metrics->rigidBodies[index];
+  } else {
+    for (int i = 0; i < n && body == nullptr; i++) {
+      if (IsBody(metrics->rigidBodies[i], source, ID))
+        body = &metrics->rigidBodies[i];
+    }
+  }
+  if (body == nullptr) {
+    // Only the shared overflow slot has concurrent writers; a body it
+    // registers twice is merged again when formatting
+    n = metrics->nRigidBodies.fetch_add(1, std::memory_order_relaxed);
+    if (n >= METRICS_MAX_RIGID_BODIES) {
+      metrics->nRigidBodies.store(METRICS_MAX_RIGID_BODIES,
+                                  std::memory_order_relaxed);
+      return;
+    }
+    body = &metrics->rigidBodies[n];
+    body->source.store(source, std::memory_order_relaxed);
+    body->ID.store(ID, std::memory_order_release);
+  }
+  body->frames.fetch_add(1, std::memory_order_relaxed);
+  if (bTracked)
+    body->tracked.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MetricsSetSources(const std::vector<std::string> &names) {
+  gSources = names;
+}
+
+static void AppendSample(std::string *out, const char *name,
+                         const char *labels, double value) {
+  char line[256];
+  snprintf(line, sizeof(line), labels[0] != '\0' ? "%s{%s} %.17g\n"
+                                                 : "%s%s %.17g\n",
+           name, labels, value);
+  out->append(line);
+}
+
+void MetricsAppend(std::string *out, const char *name, const char *type,
+                   const char *help, const char *labels, double value) {
+  if (help != nullptr) {
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n",
+             name, help, name, type);
+    out->append(line);
+  }
+  AppendSample(out, name, labels, value);
+}
+
+// Labels of a (source, ID) pair
+static void BodyLabels(const std::pair<int, int> &body, char *labels,
+                       size_t size) {
+  if (body.first >= 0 && body.first < (int) gSources.size())
+    snprintf(labels, size, "source=\"%s\",id=\"%d\"",
+             gSources[body.first].c_str(), body.second);
+  else
+    snprintf(labels, size, "source=\"%d\",id=\"%d\"",
+             body.first, body.second);
+}
+
+std::string MetricsFormat() {
+  static const char *kCounterNames[METRIC_COUNTER_COUNT][3] = {
+      {"natnet_data_bytes_total", "", "Bytes of data datagrams decoded"},
+      {"natnet_frames_decoded_total", "", "Frames of mocap data decoded"},
+      {"natnet_frames_published_total", "", "Frames of mocap data published"},
+      {"natnet_commands_total", "status=\"ok\"", "Commands by outcome"},
+      {"natnet_commands_total", "status=\"error\"", ""},
+      {"natnet_commands_total", "status=\"timeout\"", ""},
+      {"natnet_commands_total", "status=\"send_failed\"", ""},
+  };
+
+  int nThreads = std::min(gThreadCount.load(std::memory_order_relaxed),
+                          METRICS_MAX_THREADS);
+  uint64_t counters[METRIC_COUNTER_COUNT] = {};
+  uint64_t buckets[METRIC_HISTOGRAM_COUNT][METRICS_BUCKET_COUNT + 1] = {};
+  uint64_t sumNs[METRIC_HISTOGRAM_COUNT] = {};
+  // (source, ID) -> frames, tracked
+  std::map<std::pair<int, int>, std::pair<uint64_t, uint64_t>> rigidBodies;
+  for (int t = 0; t < nThreads; t++) {
+    const sThreadMetrics &metrics = gThreadMetrics[t];
+    for (int c = 0; c < METRIC_COUNTER_COUNT; c++)
+      counters[c] += metrics.counters[c].load(std::memory_order_relaxed);
+    for (int h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+      for (int b = 0; b <= METRICS_BUCKET_COUNT; b++)
+        buckets[h][b] += metrics.buckets[h][b].load(std::memory_order_relaxed);
+      sumNs[h] += metrics.sumNs[h].load(std::memory_order_relaxed);
+    }
+    int n = std::min(metrics.nRigidBodies.load(std::memory_order_acquire),
+                     METRICS_MAX_RIGID_BODIES);
+    for (int i = 0; i < n; i++) {
+      const sRigidBodyCounters &body = metrics.rigidBodies[i];
+      int ID = body.ID.load(std::memory_order_acquire);
+      std::pair<uint64_t, uint64_t> &total = rigidBodies[std::make_pair(
+          body.source.load(std::memory_order_relaxed), ID)];
+      total.first += body.frames.load(std::memory_order_relaxed);
+      total.second += body.tracked.load(std::memory_order_relaxed);
+    }
+  }
+
+  std::string out;
+  char labels[128];
+  for (int c = 0; c < METRIC_COUNTER_COUNT; c++) {
+    if (kCounterNames[c][2][0] != '\0')
+      MetricsAppend(&out, kCounterNames[c][0], "counter", kCounterNames[c][2],
+                    kCounterNames[c][1], (double) counters[c]);
+    else
+      AppendSample(&out, kCounterNames[c][0], kCounterNames[c][1],
+                   (double) counters[c]);
+  }
+
+  MetricsAppend(&out, "natnet_metrics_thread_overflows_total", "counter",
+                "Threads sharing the last metrics slot because all "
+                "METRICS_MAX_THREADS were in use",
+                "", (double) gThreadOverflows.load(std::memory_order_relaxed));
+
+  for (int h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+    const char *name = kHistogramNames[h][0];
+    out.append("# HELP ").append(name).append(" ")
+        .append(kHistogramNames[h][1]).append("\n");
+    out.append("# TYPE ").append(name).append(" histogram\n");
+    std::string bucketName = std::string(name) + "_bucket";
+    uint64_t cumulative = 0;
+    for (int b = 0; b <= METRICS_BUCKET_COUNT; b++) {
+      cumulative += buckets[h][b];
+      if (b < METRICS_BUCKET_COUNT)
+        snprintf(labels, sizeof(labels), "le=\"%g\"", kBucketBounds[h][b]);
+      else
+        snprintf(labels, sizeof(labels), "le=\"+Inf\"");
+      AppendSample(&out, bucketName.c_str(), labels, (double) cumulative);
+    }
+    AppendSample(&out, (std::string(name) + "_sum").c_str(), "",
+                 sumNs[h] * 1e-9);
+    AppendSample(&out, (std::string(name) + "_count").c_str(), "",
+                 (double) cumulative);
+  }
+
+  out.append("# HELP natnet_rigid_body_frames_total"
+             " Frames in which a rigid body was published\n"
+             "# TYPE natnet_rigid_body_frames_total counter\n");
+  for (const auto &body : rigidBodies) {
+    BodyLabels(body.first, labels, sizeof(labels));
+    AppendSample(&out, "natnet_rigid_body_frames_total", labels,
+                 (double) body.second.first);
+  }
+  out.append("# HELP natnet_rigid_body_tracked_total"
+             " Frames in which a rigid body was tracked\n"
+             "# TYPE natnet_rigid_body_tracked_total counter\n");
+  for (const auto &body : rigidBodies) {
+    BodyLabels(body.first, labels, sizeof(labels));
+    AppendSample(&out, "natnet_rigid_body_tracked_total", labels,
+                 (double) body.second.second);
+  }
+
+  if (gCollector)
+    gCollector(&out);
+  return out;
+}
+
+void MetricsSetCollector(MetricsCollector collector) {
+  gCollector = std::move(collector);
+}
+
+// Answer one HTTP request; the connection is closed afterwards
+static void ServeConnection(int fd) {
+  // A client that sends nothing does not hold up the next scrape
+  timeval timeout{1, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  char request[METRICS_REQUEST_SIZE];
+  size_t nBytes = 0;
+  while (nBytes < sizeof(request) - 1) {
+    ssize_t n = recv(fd, request + nBytes, sizeof(request) - 1 - nBytes, 0);
+    if (n <= 0)
+      break;
+    nBytes += (size_t) n;
+    request[nBytes] = '\0';
+    if (strstr(request, "\r\n\r\n") != nullptr)
+      break;
+  }
+  request[nBytes] = '\0';
+
+  std::string body, status;
+  const char *contentType = "text/plain; charset=utf-8";
+  if (strncmp(request, "GET /metrics ", 13) == 0 ||
+      strncmp(request, "GET /metrics?", 13) == 0) {
+    status = "200 OK";
+    body = MetricsFormat();
+    contentType = "text/plain; version=0.0.4; charset=utf-8";
+  } else if (strncmp(request, "GET ", 4) == 0) {
+    status = "404 Not Found";
+    body = "try /metrics\n";
+  } else {
+    status = "405 Method Not Allowed";
+  }
+
+  char header[256];
+  int nHeader = snprintf(header, sizeof(header),
+                         "HTTP/1.0 %s\r\nContent-Type: %s\r\n"
+                         "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                         status.c_str(), contentType, body.size());
+  std::string response(header, (size_t) nHeader);
+  response += body;
+  size_t nSent = 0;
+  while (nSent < response.size()) {
+    ssize_t n = send(fd, response.data() + nSent, response.size() - nSent,
+                     MSG_NOSIGNAL);
+    if (n <= 0)
+      break;
+    nSent += (size_t) n;
+  }
+  close(fd);
+}
+
+bool MetricsStart(const char *szAddress, int port) {
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons((uint16_t) port);
+  if (inet_pton(AF_INET, szAddress, &address.sin_addr) != 1)
+    return false;
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1)
+    return false;
+  int value = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+  if (bind(fd, (sockaddr *) &address, sizeof(address)) == -1 ||
+      listen(fd, 8) == -1) {
+    close(fd);
+    return false;
+  }
+
+  gListenFd = fd;
+  gServerThread = std::thread([fd]() {
+    while (true) {
+      int client = accept(fd, nullptr, nullptr);
+      if (client == -1) {
+        // shutdown() by MetricsStop()
+        if (errno == EINTR || errno == ECONNABORTED)
+          continue;
+        break;
+      }
+      ServeConnection(client);
+    }
+  });
+  return true;
+}
+
+void MetricsStop() {
+  if (gListenFd == -1)
+    return;
+  // Wakes the server from accept()
+  shutdown(gListenFd, SHUT_RDWR);
+  gServerThread.join();
+  close(gListenFd);
+  gListenFd = -1;
+}
@@ -0,0 +1,81 @@
+/*
+ * Metrics.h
+ *
+ * Runtime counters and a Prometheus text endpoint.
+ *
+ * Every thread that records a metric gets its own cache-line aligned
+ * slot the first time it does so, and only ever writes that slot, so the
+ * packet path shares no cache lines with other threads or the scraper.
+ * A scrape sums the slots of all threads. A slot is freed when its
+ * thread exits and reused by the next new thread, so restarted threads
+ * do not use up slots. Threads beyond METRICS_MAX_THREADS running at
+ * once share the last slot, which stays correct because all updates are
+ * atomic, only slower; natnet_metrics_thread_overflows_total counts them.
+ *
+ * Durations go to histograms with fixed bucket bounds per histogram.
+ * Rigid bodies are counted per source and streamed ID, up to
+ * METRICS_MAX_RIGID_BODIES per thread, and labeled with the source names
+ * set by MetricsSetSources().
+ *
+ * MetricsStart() serves GET /metrics over HTTP/1.0 from a background
+ * thread; values that other modules already keep (queue occupancy, drop
+ * counts) are appended at scrape time by a collector callback.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#define METRICS_MAX_THREADS         16
+#define METRICS_MAX_RIGID_BODIES    64
+
+enum eMetricsCounter {
+  METRIC_DATA_BYTES = 0,                  // datagram bytes decoded
+  METRIC_FRAMES_DECODED,
+  METRIC_FRAMES_PUBLISHED,
+  METRIC_COMMANDS_OK,
+  METRIC_COMMANDS_ERROR,
+  METRIC_COMMANDS_TIMEOUT,
+  METRIC_COMMANDS_SEND_FAILED,
+  METRIC_COUNTER_COUNT
+};
+
+enum eMetricsHistogram {
+  METRIC_DECODE_SECONDS = 0,              // one datagram through the decoder
+  METRIC_PUBLISH_SECONDS,                 // one frame through the publisher
+  METRIC_COMMAND_SECONDS,                 // command round trip
+  METRIC_HISTOGRAM_COUNT
+};
+
+void MetricsAdd(eMetricsCounter counter, uint64_t n = 1);
+void MetricsObserve(eMetricsHistogram histogram, int64_t ns);
+// A published rigid body of a source; index is its position in the
+// frame, which makes the lookup of the same body in the next frame cheap
+void MetricsRigidBody(int source, int index, int ID, bool bTracked);
+
+// Names of the sources, by index; set before MetricsStart()
+void MetricsSetSources(const std::vector<std::string> &names);
+
+// Prometheus text of every metric, followed by the collector's output
+std::string MetricsFormat();
+
+// Append one sample in Prometheus text format, preceded by its HELP and
+// TYPE lines unless help is nullptr, as for the further samples of a
+// family; labels is "" or e.g. "id=\"3\""
+void MetricsAppend(std::string *out, const char *name, const char *type,
+                   const char *help, const char *labels, double value);
+
+// Called at every scrape to append further samples; set before
+// MetricsStart()
+typedef std::function<void(std::string *out)> MetricsCollector;
+void MetricsSetCollector(MetricsCollector collector);
+
+// Listen on address:port (e.g. "127.0.0.1", 9102); false on failure
+bool MetricsStart(const char *szAddress, int port);
+void MetricsStop();
+
+#endif  // METRICS_H
@@ -0,0 +1,76 @@
+/*
+ * ModelDefCache.cpp
+ */
+
+#include "ModelDefCache.h"
+
+#include <chrono>
+#include <climits>
+
+// Minimum time between two automatic NAT_REQUEST_MODELDEF
+#define MODELDEF_REFRESH_INTERVAL_NS 100000000LL
+
+ModelDefIndex::ModelDefIndex(sDataDescriptions &&descriptions)
+    : descriptions_(std::move(descriptions)) {
+  rigidBodies_.reserve(descriptions_.rigidBodies.size());
+  for (const sRigidBodyDescription &rb : descriptions_.rigidBodies)
+    rigidBodies_[rb.ID] = &rb;
+  skeletons_.reserve(descriptions_.skeletons.size());
+  for (const sSkeletonDescription &skeleton : descriptions_.skeletons)
+    skeletons_[skeleton.skeletonID] = &skeleton;
+  markerSets_.reserve(descriptions_.markerSets.size());
+  for (const sMarkerSetDescription &markerSet : descriptions_.markerSets)
+    markerSets_[markerSet.szName] = &markerSet;
+}
+
+const sRigidBodyDescription *ModelDefIndex::RigidBody(int ID) const {
+  auto it = rigidBodies_.find(ID);
+  return it != rigidBodies_.end() ? it->second : nullptr;
+}
+
+const sSkeletonDescription *ModelDefIndex::Skeleton(int skeletonID) const {
+  auto it = skeletons_.find(skeletonID);
+  return it != skeletons_.end() ? it->second : nullptr;
+}
+
+const sMarkerSetDescription *ModelDefIndex::MarkerSet(
+    const std::string &name) const {
+  auto it = markerSets_.find(name);
+  return it != markerSets_.end() ? it->second : nullptr;
+}
+
+const char *ModelDefIndex::RigidBodyName(int ID) const {
+  const sRigidBodyDescription *rb = RigidBody(ID);
+  return rb != nullptr ? rb->szName.c_str() : nullptr;
+}
+
+ModelDefCache::ModelDefCache()
+    : index_(std::make_shared<ModelDefIndex>(sDataDescriptions())),
+      lastRequest_(LLONG_MIN / 2),
+      updates_(0) {}
+
+std::shared_ptr<const ModelDefIndex> ModelDefCache::Get() const {
+  return std::atomic_load(&index_);
+}
+
+std::shared_ptr<const ModelDefIndex> ModelDefCache::Update(
+    sDataDescriptions &&descriptions) {
+  std::shared_ptr<const ModelDefIndex> index =
+      std::make_shared<ModelDefIndex>(std::move(descriptions));
+  std::atomic_store(&index_, index);
+  updates_.fetch_add(1, std::memory_order_relaxed);
+  return index;
+}
+
+bool ModelDefCache::NeedsRefresh(const FrameOfMocapData &frame) {
+  if (!frame.TrackedModelsChanged())
+    return false;
+
+  int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  int64_t last = lastRequest_.load(std::memory_order_relaxed);
+  if (now - last < MODELDEF_REFRESH_INTERVAL_NS)
+    return false;
+  // Only one of several racing callers sends the request
+  return lastRequest_.compare_exchange_strong(last, now);
+}
@@ -0,0 +1,69 @@
+/*
+ * ModelDefCache.h
+ *
+ * Latest data descriptions of the server, indexed for per-frame lookups.
+ *
+ * An index is built once per NAT_MODELDEF packet and never modified
+ * afterwards; readers take a shared_ptr to the current one and keep
+ * using it while a newer index is swapped in.
+ */
+
+#ifndef MODELDEF_CACHE_H
+#define MODELDEF_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "NatNetModelDef.h"
+
+class ModelDefIndex {
+ public:
+  explicit ModelDefIndex(sDataDescriptions &&descriptions);
+  ModelDefIndex(const ModelDefIndex &) = delete;
+  ModelDefIndex &operator=(const ModelDefIndex &) = delete;
+
+  const sDataDescriptions &Descriptions() const { return descriptions_; }
+
+  // Lookups return nullptr if the server did not describe the model
+  const sRigidBodyDescription *RigidBody(int ID) const;
+  const sSkeletonDescription *Skeleton(int skeletonID) const;
+  const sMarkerSetDescription *MarkerSet(const std::string &name) const;
+
+  // Rigid body name, or nullptr if unknown
+  const char *RigidBodyName(int ID) const;
+
+ private:
+  sDataDescriptions descriptions_;
+  // Point into descriptions_
+  std::unordered_map<int, const sRigidBodyDescription *> rigidBodies_;
+  std::unordered_map<int, const sSkeletonDescription *> skeletons_;
+  std::unordered_map<std::string, const sMarkerSetDescription *> markerSets_;
+};
+
+class ModelDefCache {
+ public:
+  ModelDefCache();
+
+  // Current index; empty until the first descriptions arrive
+  std::shared_ptr<const ModelDefIndex> Get() const;
+
+  // Replace the index with one built from descriptions
+  std::shared_ptr<const ModelDefIndex> Update(sDataDescriptions &&descriptions);
+
+  // Called for every frame; true if the server reported changed models
+  // and a NAT_REQUEST_MODELDEF should be sent now. Requests are rate
+  // limited, as the flag may be set on several consecutive frames.
+  bool NeedsRefresh(const FrameOfMocapData &frame);
+
+  uint64_t Updates() const { return updates_.load(std::memory_order_relaxed); }
+
+ private:
+  std::shared_ptr<const ModelDefIndex> index_;  // std::atomic_load/store
+  std::atomic<int64_t> lastRequest_;            // steady clock, ns
+  std::atomic<uint64_t> updates_;
+};
+
+#endif  // MODELDEF_CACHE_H
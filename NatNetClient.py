@@ -4,6 +4,12 @@ import struct
 from threading import Thread
 import coloredlogs, logging
 
+# Native decoder and receive thread, built by CMake when NumPy is found
+try:
+  import natnet_native
+except ImportError:
+  natnet_native = None
+
 
 # Create structs for reading various object types to speed up parsing.
 Vector3 = struct.Struct('<fff')
@@ -14,7 +20,8 @@ DoubleValue = struct.Struct('<d')
 
 
 class NatNetClient:
-  def __init__(self, ver=(3, 0, 0, 0), server_ip="192.168.2.3", quiet=True):
+  def __init__(self, ver=(3, 0, 0, 0), server_ip="192.168.2.3", quiet=True,
+               native=True):
     self.__natNetStreamVersion = ver
     self.serverIPAddress = server_ip
     self.multicastAddress = "239.255.42.99"
@@ -23,6 +30,11 @@ class NatNetClient:
     # Callbacks
     self.rigidBodyListener = None
     self.newFrameListener = None
+    # Called with each batch of frames as a dict of NumPy arrays (native only)
+    self.batchListener = None
+    # Decode frames on natnet_native's receive thread when available
+    self.native = native and natnet_native is not None
+    self.receiver = None
     # Logging
     if not quiet:
       coloredlogs.install(level='INFO', fmt='NatNet: %(message)s',
@@ -469,6 +481,8 @@ class NatNetClient:
       offset += 4  # Skip the sending app's Version info
       self.__natNetStreamVersion = struct.unpack('BBBB',
                                                  data[offset:offset + 4])
+      if self.receiver is not None:
+        self.receiver.set_version(self.__natNetStreamVersion[0:2])
       logging.info("\tApp NatNet Version: {}"
                    .format(self.__natNetStreamVersion))
       offset += 4
@@ -501,18 +515,71 @@ class NatNetClient:
       if len(data) > 0:
         self.__processMessage(data)
 
+  def __batchThreadFunction(self, receiver):
+    while True:
+      batch = receiver.get(timeout=0.1)
+      if len(batch['frame']) > 0:
+        self.__dispatchBatch(batch)
+
+  def __dispatchBatch(self, batch):
+    if self.batchListener is not None:
+      self.batchListener(batch)
+    if self.rigidBodyListener is None and self.newFrameListener is None:
+      return
+
+    # Per-frame listeners, in the order the unpacking functions call them
+    frames = batch['frame'].tolist()
+    rbStart = batch['rigid_body_start'].tolist()
+    skStart = batch['skeleton_start'].tolist()
+    lmStart = batch['labeled_marker_start'].tolist()
+    if self.rigidBodyListener is not None:
+      rbId = batch['rigid_body_id'].tolist()
+      rbPos = batch['rigid_body_position'].tolist()
+      rbRot = batch['rigid_body_orientation'].tolist()
+      boneStart = batch['bone_start'].tolist()
+      boneId = batch['bone_id'].tolist()
+      bonePos = batch['bone_position'].tolist()
+      boneRot = batch['bone_orientation'].tolist()
+    if self.newFrameListener is not None:
+      markerSets = batch['marker_set_count'].tolist()
+      otherMarkers = batch['other_marker_count'].tolist()
+      timecode = batch['timecode'].tolist()
+      timecodeSub = batch['timecode_subframe'].tolist()
+      timestamp = batch['timestamp'].tolist()
+      params = batch['params'].tolist()
+
+    for i, frameNumber in enumerate(frames):
+      if self.rigidBodyListener is not None:
+        for j in range(rbStart[i], rbStart[i + 1]):
+          self.rigidBodyListener(rbId[j], tuple(rbPos[j]), tuple(rbRot[j]))
+        for b in range(boneStart[skStart[i]], boneStart[skStart[i + 1]]):
+          self.rigidBodyListener(boneId[b], tuple(bonePos[b]),
+                                 tuple(boneRot[b]))
+      if self.newFrameListener is not None:
+        self.newFrameListener(frameNumber, markerSets[i], otherMarkers[i],
+                              rbStart[i + 1] - rbStart[i],
+                              skStart[i + 1] - skStart[i],
+                              lmStart[i + 1] - lmStart[i],
+                              timecode[i], timecodeSub[i], timestamp[i],
+                              (params[i] & 0x01) != 0,
+                              (params[i] & 0x02) != 0)
+
   # ================================ Sockets ================================ #
+  def __localAddress(self):
+    # A hacky way to get the IP of the interface that connects to the Internet
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.connect(("8.8.8.8", 80))
+    my_ip = s.getsockname()[0]
+    s.close()
+    return my_ip
+
   def __createDataSocket(self, port):
     result = socket.socket(socket.AF_INET,  # Internet
                            socket.SOCK_DGRAM,
                            socket.IPPROTO_UDP)  # UDP
     result.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
 
-    # A hacky way to get the IP of the interface that connects to the Internet
-    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
-    s.connect(("8.8.8.8", 80))
-    my_ip = s.getsockname()[0]
-    s.close()
+    my_ip = self.__localAddress()
     # Specify my_ip as the interface to subscribe to multicast through
     result.setsockopt(socket.SOL_IP, socket.IP_ADD_MEMBERSHIP,
                       socket.inet_aton(self.multicastAddress)
@@ -549,10 +616,21 @@ class NatNetClient:
 
   def run(self):
     # Data socket and thread
-    self.dataSocket = self.__createDataSocket(self.dataPort)
-    if self.dataSocket is None:
-      raise RuntimeError("Could not open data channel")
-    dataThread = Thread(target=self.__threadFunction, args=(self.dataSocket,))
+    if self.native:
+      # Frames are received and decoded natively; Python sees batches
+      ver = self.__natNetStreamVersion
+      self.receiver = natnet_native.Receiver(
+          multicast_group=self.multicastAddress,
+          local_ip=self.__localAddress(), port=self.dataPort,
+          version=(ver[0], ver[1]))
+      dataThread = Thread(target=self.__batchThreadFunction,
+                          args=(self.receiver,))
+    else:
+      self.dataSocket = self.__createDataSocket(self.dataPort)
+      if self.dataSocket is None:
+        raise RuntimeError("Could not open data channel")
+      dataThread = Thread(target=self.__threadFunction,
+                          args=(self.dataSocket,))
 
     # Command socket and thread
     self.commandSocket = self.__createCommandSocket()
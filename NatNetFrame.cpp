@@ -0,0 +1,428 @@
+/*
+ * NatNetFrame.cpp
+ *
+ * Bounds-checked indexing of NAT_FRAMEOFDATA packets.
+ */
+
+#include "NatNetFrame.h"
+
+#include <algorithm>
+#include <cstddef>
+
+#include "NatNetTypes.h"
+
+static_assert(offsetof(sRigidBodyData, qw) == 28,
+              "ID, position and orientation must match the packet layout");
+
+void FrameSubscription::Insert(std::vector<int> *IDs, int ID) {
+  auto it = std::lower_bound(IDs->begin(), IDs->end(), ID);
+  if (it == IDs->end() || *it != ID)
+    IDs->insert(it, ID);
+}
+
+void FrameSubscription::Add(const FrameSubscription &other) {
+  sections_ |= other.sections_;
+  for (int ID : other.rigidBodies_)
+    AddRigidBody(ID);
+  for (int ID : other.skeletons_)
+    AddSkeleton(ID);
+}
+
+bool FrameSubscription::Wants(eFrameSection section) const {
+  if ((sections_ & section) != 0)
+    return true;
+  if (section == FRAME_SECTION_RIGID_BODIES)
+    return !rigidBodies_.empty();
+  if (section == FRAME_SECTION_SKELETONS)
+    return !skeletons_.empty();
+  return false;
+}
+
+sRigidBodyData FrameOfMocapData::LoadRigidBody(
+    const sRigidBodyRef &ref) const {
+  sRigidBodyData rb;
+  // ID, position and orientation are contiguous in the packet
+  memcpy(&rb, data_ + ref.offset, 32);
+  const char *tail = data_ + ref.tailOffset;
+  rb.MeanError = hasMeanError_ ? LoadValue<float>(tail) : 0.0f;
+  rb.params = hasRigidBodyParams_ ? LoadValue<short>(tail + 4) : 0x01;
+  return rb;
+}
+
+sMarker FrameOfMocapData::RigidBodyMarker(int i, int k) const {
+  return LoadValue<sMarker>(data_ + rigidBodies_[i].offset + 36 + k * 12);
+}
+
+int FrameOfMocapData::RigidBodyMarkerID(int i, int k) const {
+  const sRigidBodyRef &ref = rigidBodies_[i];
+  if (!hasMarkerIDs_)
+    return -1;
+  return LoadValue<int>(data_ + ref.offset + 36 + ref.nMarkers * 12 + k * 4);
+}
+
+float FrameOfMocapData::RigidBodyMarkerSize(int i, int k) const {
+  const sRigidBodyRef &ref = rigidBodies_[i];
+  if (!hasMarkerIDs_)
+    return 0.0f;
+  return LoadValue<float>(data_ + ref.offset + 36 + ref.nMarkers * 16 +
+                          k * 4);
+}
+
+sLabeledMarker FrameOfMocapData::LabeledMarker(int i) const {
+  const char *p = data_ + labeledMarkers_.offset + i * labeledMarkerStride_;
+  sLabeledMarker marker;
+  marker.ID = LoadValue<int>(p);
+  marker.x = LoadValue<float>(p + 4);
+  marker.y = LoadValue<float>(p + 8);
+  marker.z = LoadValue<float>(p + 12);
+  marker.size = LoadValue<float>(p + 16);
+  marker.params = hasMarkerParams_ ? LoadValue<short>(p + 20) : 0;
+  marker.residual = hasResidual_ ? LoadValue<float>(p + 22) : 0.0f;
+  return marker;
+}
+
+int FrameOfMocapData::MarkerSetMarkersSoA(int i, const sMarkerSoA &out,
+                                          int capacity) const {
+  int count = std::min(markerSets_[i].count, capacity);
+  DeinterleaveMarkers(data_ + markerSets_[i].offset, count, out);
+  return count;
+}
+
+int FrameOfMocapData::OtherMarkersSoA(const sMarkerSoA &out,
+                                      int capacity) const {
+  int count = std::min(otherMarkers_.count, capacity);
+  DeinterleaveMarkers(data_ + otherMarkers_.offset, count, out);
+  return count;
+}
+
+int FrameOfMocapData::LabeledMarkersSoA(const sLabeledMarkerSoA &out,
+                                        int capacity) const {
+  int count = std::min(labeledMarkers_.count, capacity);
+  ExtractLabeledMarkers(data_ + labeledMarkers_.offset, count,
+                        labeledMarkerStride_, hasResidual_ ? 22 : -1, out);
+  return count;
+}
+
+// Rigid body or skeleton bone; the layout is shared
+template <typename Layout>
+static bool IndexRigidBody(PacketReader &reader,
+                           FrameOfMocapData::sRigidBodyRef *ref) {
+  ref->offset = (uint32_t) reader.Offset();
+  // ID, position and orientation
+  if (!reader.Skip(32))
+    return false;
+
+  // Before NatNet 3.0, marker data was here:
+  // positions, then IDs and sizes from 2.0
+  ref->nMarkers = 0;
+  if (Layout::kRigidBodyMarkers) {
+    if (!reader.ReadCount(&ref->nMarkers, Layout::kRigidBodyMarkerSize))
+      return false;
+    reader.Skip(ref->nMarkers * Layout::kRigidBodyMarkerSize);
+  }
+
+  // Mean marker error and tracking flags
+  ref->tailOffset = (uint32_t) reader.Offset();
+  return reader.Skip(Layout::kRigidBodySize - 32);
+}
+
+// Skip count rigid bodies or bones by their length
+template <typename Layout>
+static bool SkipRigidBodies(PacketReader &reader, int count) {
+  if (!Layout::kRigidBodyMarkers)
+    return reader.Skip(count * Layout::kRigidBodySize);
+  for (int j = 0; j < count; j++) {
+    int nMarkers = 0;
+    if (!reader.Skip(32) ||
+        !reader.ReadCount(&nMarkers, Layout::kRigidBodyMarkerSize) ||
+        !reader.Skip(nMarkers * Layout::kRigidBodyMarkerSize +
+                     Layout::kRigidBodySize - 32))
+      return false;
+  }
+  return true;
+}
+
+// count rigid bodies, of which those subscribed are appended to refs
+template <typename Layout>
+static bool IndexSubscribedRigidBodies(
+    PacketReader &reader,
+    const char *pData,
+    int count,
+    const FrameSubscription &subscription,
+    std::vector<FrameOfMocapData::sRigidBodyRef> *refs) {
+  if (!Layout::kRigidBodyMarkers) {
+    // Fixed stride: only the IDs are read
+    size_t offset = reader.Offset();
+    if (!reader.Skip(count * Layout::kRigidBodySize))
+      return false;
+    for (int j = 0; j < count; j++) {
+      uint32_t bodyOffset = (uint32_t) (offset + j * Layout::kRigidBodySize);
+      if (subscription.WantsRigidBody(LoadValue<int>(pData + bodyOffset)))
+        refs->push_back(
+            FrameOfMocapData::sRigidBodyRef{bodyOffset, bodyOffset + 32, 0});
+    }
+    return true;
+  }
+
+  for (int j = 0; j < count; j++) {
+    FrameOfMocapData::sRigidBodyRef ref;
+    if (!IndexRigidBody<Layout>(reader, &ref))
+      return false;
+    if (subscription.WantsRigidBody(LoadValue<int>(pData + ref.offset)))
+      refs->push_back(ref);
+  }
+  return true;
+}
+
+// count rigid bodies or bones, appended to refs
+template <typename Layout>
+static bool IndexRigidBodies(PacketReader &reader,
+                             int count,
+                             std::vector<FrameOfMocapData::sRigidBodyRef> *refs) {
+  size_t first = refs->size();
+  refs->resize(first + count);
+  FrameOfMocapData::sRigidBodyRef *ref = refs->data() + first;
+
+  if (!Layout::kRigidBodyMarkers) {
+    // Fixed stride from NatNet 3.0: check the whole block at once
+    size_t offset = reader.Offset();
+    if (!reader.Skip(count * Layout::kRigidBodySize))
+      return false;
+    for (int j = 0; j < count; j++) {
+      ref[j].offset = (uint32_t) (offset + j * Layout::kRigidBodySize);
+      ref[j].tailOffset = ref[j].offset + 32;
+      ref[j].nMarkers = 0;
+    }
+    return true;
+  }
+
+  for (int j = 0; j < count; j++) {
+    if (!IndexRigidBody<Layout>(reader, &ref[j]))
+      return false;
+  }
+  return true;
+}
+
+// Force plate or device: ID, channel count, then per channel
+// a frame count and that many floats. Only skipped if bIndex is false.
+static bool IndexAnalogData(PacketReader &reader,
+                            bool bIndex,
+                            std::vector<FrameOfMocapData::sGroupRef> *groups,
+                            std::vector<FrameOfMocapData::sBlockRef> *channels) {
+  int nGroups = 0;
+  if (!reader.ReadCount(&nGroups, 8))
+    return false;
+  for (int i = 0; i < nGroups; i++) {
+    FrameOfMocapData::sGroupRef group;
+    if (!reader.Read(&group.ID) || !reader.ReadCount(&group.count, 4))
+      return false;
+    group.first = (int) channels->size();
+    for (int c = 0; c < group.count; c++) {
+      FrameOfMocapData::sBlockRef channel;
+      if (!reader.ReadCount(&channel.count, 4))
+        return false;
+      channel.offset = (uint32_t) reader.Offset();
+      reader.Skip(channel.count * 4);
+      if (bIndex)
+        channels->push_back(channel);
+    }
+    if (bIndex)
+      groups->push_back(group);
+  }
+  return true;
+}
+
+template <int Major, int Minor>
+bool DecodeFrameOfMocapData(const char *pData,
+                            size_t nBytes,
+                            FrameOfMocapData *frame) {
+  typedef NatNetLayout<Major, Minor> Layout;
+
+  // Message header: ID and payload size
+  if (nBytes < 4)
+    return false;
+  uint16_t MessageID = LoadValue<uint16_t>(pData);
+  uint16_t nDataBytes = LoadValue<uint16_t>(pData + 2);
+  if (MessageID != NAT_FRAMEOFDATA)
+    return false;
+  nBytes = std::min(nBytes, (size_t) nDataBytes + 4);
+
+  frame->data_ = pData;
+  frame->size_ = nBytes;
+  frame->hasMarkerIDs_ = Layout::kRigidBodyMarkerIDs;
+  frame->hasMeanError_ = Layout::kMeanError;
+  frame->hasRigidBodyParams_ = Layout::kTrackingParams;
+  frame->hasMarkerParams_ = Layout::kMarkerParams;
+  frame->hasResidual_ = Layout::kResidual;
+  frame->labeledMarkerStride_ = Layout::kLabeledMarkerSize;
+  frame->markerSets_.clear();
+  frame->rigidBodies_.clear();
+  frame->skeletons_.clear();
+  frame->bones_.clear();
+  frame->forcePlates_.clear();
+  frame->devices_.clear();
+  frame->channels_.clear();
+  frame->otherMarkers_ = FrameOfMocapData::sBlockRef{0, 0};
+  frame->labeledMarkers_ = FrameOfMocapData::sBlockRef{0, 0};
+
+  const FrameSubscription *subscription = frame->subscription_;
+  auto wants = [subscription](eFrameSection section) {
+    return subscription == nullptr || subscription->Wants(section);
+  };
+
+  PacketReader reader(pData, nBytes);
+  reader.Skip(4);
+
+  if (!reader.Read(&frame->iFrame))
+    return false;
+
+  // Marker sets: name, then marker positions
+  int nMarkerSets = 0;
+  if (!reader.ReadCount(&nMarkerSets, 5))
+    return false;
+  for (int i = 0; i < nMarkerSets; i++) {
+    FrameOfMocapData::sMarkerSetRef markerSet;
+    const char *szName;
+    markerSet.nameOffset = (uint32_t) reader.Offset();
+    if (!reader.ReadString(&szName) ||
+        !reader.ReadCount(&markerSet.count, 12))
+      return false;
+    markerSet.offset = (uint32_t) reader.Offset();
+    reader.Skip(markerSet.count * 12);
+    if (wants(FRAME_SECTION_MARKER_SETS))
+      frame->markerSets_.push_back(markerSet);
+  }
+
+  // Unlabeled markers
+  if (!reader.ReadCount(&frame->otherMarkers_.count, 12))
+    return false;
+  frame->otherMarkers_.offset = (uint32_t) reader.Offset();
+  reader.Skip(frame->otherMarkers_.count * 12);
+  if (!wants(FRAME_SECTION_OTHER_MARKERS))
+    frame->otherMarkers_.count = 0;
+
+  // Rigid bodies
+  int nRigidBodies = 0;
+  if (!reader.ReadCount(&nRigidBodies, 32))
+    return false;
+  if (subscription == nullptr) {
+    if (!IndexRigidBodies<Layout>(reader, nRigidBodies,
+                                  &frame->rigidBodies_))
+      return false;
+  } else if (subscription->Wants(FRAME_SECTION_RIGID_BODIES)) {
+    if (!IndexSubscribedRigidBodies<Layout>(reader, pData, nRigidBodies,
+                                            *subscription,
+                                            &frame->rigidBodies_))
+      return false;
+  } else if (!SkipRigidBodies<Layout>(reader, nRigidBodies)) {
+    return false;
+  }
+
+  // Skeletons
+  if (Layout::kSkeletons) {
+    int nSkeletons = 0;
+    if (!reader.ReadCount(&nSkeletons, 8))
+      return false;
+    for (int j = 0; j < nSkeletons; j++) {
+      FrameOfMocapData::sGroupRef skeleton;
+      if (!reader.Read(&skeleton.ID) ||
+          !reader.ReadCount(&skeleton.count, 32))
+        return false;
+      if (subscription != nullptr &&
+          !subscription->WantsSkeleton(skeleton.ID)) {
+        if (!SkipRigidBodies<Layout>(reader, skeleton.count))
+          return false;
+        continue;
+      }
+      skeleton.first = (int) frame->bones_.size();
+      if (!IndexRigidBodies<Layout>(reader, skeleton.count, &frame->bones_))
+        return false;
+      frame->skeletons_.push_back(skeleton);
+    }
+  }
+
+  // Labeled markers
+  if (Layout::kLabeledMarkers) {
+    if (!reader.ReadCount(&frame->labeledMarkers_.count,
+                          Layout::kLabeledMarkerSize))
+      return false;
+    frame->labeledMarkers_.offset = (uint32_t) reader.Offset();
+    reader.Skip(frame->labeledMarkers_.count * Layout::kLabeledMarkerSize);
+    if (!wants(FRAME_SECTION_LABELED_MARKERS))
+      frame->labeledMarkers_.count = 0;
+  }
+
+  // Force plate data
+  if (Layout::kForcePlates) {
+    if (!IndexAnalogData(reader, wants(FRAME_SECTION_FORCE_PLATES),
+                         &frame->forcePlates_, &frame->channels_))
+      return false;
+  }
+
+  // Device data
+  if (Layout::kDevices) {
+    if (!IndexAnalogData(reader, wants(FRAME_SECTION_DEVICES),
+                         &frame->devices_, &frame->channels_))
+      return false;
+  }
+
+  // Software latency
+  frame->fLatency = 0.0f;
+  if (Layout::kSoftwareLatency && !reader.Read(&frame->fLatency))
+    return false;
+
+  // Timecode
+  if (!reader.Read(&frame->Timecode) ||
+      !reader.Read(&frame->TimecodeSubframe))
+    return false;
+
+  // Timestamp: double precision from NatNet 2.7
+  if (Layout::kDoubleTimestamp) {
+    if (!reader.Read(&frame->fTimestamp))
+      return false;
+  } else {
+    float fTemp = 0.0f;
+    if (!reader.Read(&fTemp))
+      return false;
+    frame->fTimestamp = (double) fTemp;
+  }
+
+  // High resolution timestamps
+  frame->CameraMidExposureTimestamp = 0;
+  frame->CameraDataReceivedTimestamp = 0;
+  frame->TransmitTimestamp = 0;
+  if (Layout::kHighResTimestamps) {
+    if (!reader.Read(&frame->CameraMidExposureTimestamp) ||
+        !reader.Read(&frame->CameraDataReceivedTimestamp) ||
+        !reader.Read(&frame->TransmitTimestamp))
+      return false;
+  }
+
+  // Frame params, followed by the end of data tag
+  return reader.Read(&frame->params) && reader.Skip(4);
+}
+
+#define NATNET_INSTANTIATE_FRAME_DECODER(MAJOR, MINOR) \
+  template bool DecodeFrameOfMocapData<MAJOR, MINOR>( \
+      const char *, size_t, FrameOfMocapData *);
+NATNET_SUPPORTED_VERSIONS(NATNET_INSTANTIATE_FRAME_DECODER)
+
+FrameDecoder SelectFrameDecoder(int major, int minor) {
+  // Later 3.x servers stream frames in the 3.0 layout
+  if (major == 3)
+    minor = 0;
+#define NATNET_SELECT_FRAME_DECODER(MAJOR, MINOR) \
+  if (major == MAJOR && minor == MINOR) \
+    return &DecodeFrameOfMocapData<MAJOR, MINOR>;
+  NATNET_SUPPORTED_VERSIONS(NATNET_SELECT_FRAME_DECODER)
+  return nullptr;
+}
+
+bool DecodeFrameOfMocapData(const char *pData,
+                            size_t nBytes,
+                            int major,
+                            int minor,
+                            FrameOfMocapData *frame) {
+  FrameDecoder decoder = SelectFrameDecoder(major, minor);
+  return decoder != nullptr && decoder(pData, nBytes, frame);
+}
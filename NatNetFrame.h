@@ -0,0 +1,334 @@
+/*
+ * NatNetFrame.h
+ *
+ * Zero-copy view of a NAT_FRAMEOFDATA packet.
+ *
+ * DecodeFrameOfMocapData() walks the datagram once, checking every
+ * count and string against the received length, and records where each
+ * element starts. The accessors of FrameOfMocapData then read values
+ * straight out of the original buffer, which must outlive the frame.
+ *
+ * A frame may carry a FrameSubscription naming the sections, rigid
+ * bodies and skeletons its consumers read. Everything else is skipped
+ * by its length without being indexed and reads as empty, so the cost
+ * of a frame follows what is consumed rather than the size of the
+ * scene. Without a subscription every element is indexed.
+ *
+ * The decoder is a template on the protocol version, explicitly
+ * instantiated for NATNET_SUPPORTED_VERSIONS. Pick one instantiation
+ * with SelectFrameDecoder() when the server version becomes known.
+ */
+
+#ifndef NATNET_FRAME_H
+#define NATNET_FRAME_H
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "MarkerSoA.h"
+#include "NatNetTypes.h"
+
+// Load a value from a possibly unaligned position in a packet
+template <typename T>
+inline T LoadValue(const char *p) {
+  T value;
+  memcpy(&value, p, sizeof(T));
+  return value;
+}
+
+// Cursor over a received packet; every read is checked against its end
+class PacketReader {
+ public:
+  PacketReader(const char *pData, size_t nBytes)
+      : begin_(pData), ptr_(pData), end_(pData + nBytes) {}
+
+  template <typename T>
+  bool Read(T *value) {
+    if (Remaining() < sizeof(T))
+      return false;
+    memcpy(value, ptr_, sizeof(T));
+    ptr_ += sizeof(T);
+    return true;
+  }
+
+  // Element count followed by count * elementSize bytes of payload
+  bool ReadCount(int *count, size_t elementSize) {
+    if (!Read(count) || *count < 0)
+      return false;
+    return elementSize == 0 ||
+        (size_t) *count <= Remaining() / elementSize;
+  }
+
+  // NUL-terminated string stored inline in the packet
+  bool ReadString(const char **str) {
+    const void *nul = memchr(ptr_, '\0', Remaining());
+    if (nul == nullptr)
+      return false;
+    *str = ptr_;
+    ptr_ = (const char *) nul + 1;
+    return true;
+  }
+
+  bool Skip(size_t nBytes) {
+    if (Remaining() < nBytes)
+      return false;
+    ptr_ += nBytes;
+    return true;
+  }
+
+  size_t Offset() const { return (size_t) (ptr_ - begin_); }
+  size_t Remaining() const { return (size_t) (end_ - ptr_); }
+
+ private:
+  const char *begin_;
+  const char *ptr_;
+  const char *end_;
+};
+
+struct sMarker {
+  float x, y, z;
+};
+
+enum eFrameSection {
+  FRAME_SECTION_MARKER_SETS     = 0x01,
+  FRAME_SECTION_OTHER_MARKERS   = 0x02,
+  FRAME_SECTION_RIGID_BODIES    = 0x04,
+  FRAME_SECTION_SKELETONS       = 0x08,
+  FRAME_SECTION_LABELED_MARKERS = 0x10,
+  FRAME_SECTION_FORCE_PLATES    = 0x20,
+  FRAME_SECTION_DEVICES         = 0x40,
+  FRAME_SECTION_ALL             = 0x7f
+};
+
+// Parts of a frame that are decoded. Sections are subscribed whole;
+// rigid bodies and skeletons may also be subscribed one ID at a time.
+// Empty until something is added.
+class FrameSubscription {
+ public:
+  // Every element of the eFrameSection bits in sections
+  void AddSections(uint32_t sections) { sections_ |= sections; }
+  void AddRigidBody(int ID) { Insert(&rigidBodies_, ID); }
+  void AddSkeleton(int ID) { Insert(&skeletons_, ID); }
+  // Union with another consumer's subscription
+  void Add(const FrameSubscription &other);
+
+  // True if any element of the section is subscribed
+  bool Wants(eFrameSection section) const;
+  bool WantsRigidBody(int ID) const {
+    return (sections_ & FRAME_SECTION_RIGID_BODIES) != 0 ||
+        std::binary_search(rigidBodies_.begin(), rigidBodies_.end(), ID);
+  }
+  bool WantsSkeleton(int ID) const {
+    return (sections_ & FRAME_SECTION_SKELETONS) != 0 ||
+        std::binary_search(skeletons_.begin(), skeletons_.end(), ID);
+  }
+
+ private:
+  static void Insert(std::vector<int> *IDs, int ID);
+
+  uint32_t sections_ = 0;
+  std::vector<int> rigidBodies_;          // sorted
+  std::vector<int> skeletons_;            // sorted
+};
+
+struct sRigidBodyData {
+  int ID;
+  float x, y, z;
+  float qx, qy, qz, qw;
+  float MeanError;      // NatNet 2.0 and later
+  short params;         // 0x01 : tracked in this frame (always set before 2.6)
+
+  bool TrackingValid() const { return (params & 0x01) != 0; }
+};
+
+struct sLabeledMarker {
+  int ID;               // see DecodeMarkerID
+  float x, y, z;
+  float size;
+  short params;         // NatNet 2.6 and later
+  float residual;       // NatNet 3.0 and later
+};
+
+class FrameOfMocapData {
+ public:
+  int iFrame = 0;
+  float fLatency = 0.0f;                  // software latency, before 3.0
+  unsigned int Timecode = 0;
+  unsigned int TimecodeSubframe = 0;
+  double fTimestamp = 0.0;
+  uint64_t CameraMidExposureTimestamp = 0;   // NatNet 3.0 and later
+  uint64_t CameraDataReceivedTimestamp = 0;  // NatNet 3.0 and later
+  uint64_t TransmitTimestamp = 0;            // NatNet 3.0 and later
+  short params = 0;
+
+  // 0x01 Motive is recording
+  bool IsRecording() const { return (params & 0x01) != 0; }
+  // 0x02 Actively tracked model list has changed
+  bool TrackedModelsChanged() const { return (params & 0x02) != 0; }
+
+  // Packet the frame was decoded from
+  const char *Data() const { return data_; }
+  size_t Size() const { return size_; }
+
+  // Decode only what subscription names, from the next frame on;
+  // nullptr decodes everything. The subscription must outlive its use.
+  void SetSubscription(const FrameSubscription *subscription) {
+    subscription_ = subscription;
+  }
+
+  // Marker sets
+  int MarkerSetCount() const { return (int) markerSets_.size(); }
+  const char *MarkerSetName(int i) const {
+    return data_ + markerSets_[i].nameOffset;
+  }
+  int MarkerSetMarkerCount(int i) const { return markerSets_[i].count; }
+  sMarker MarkerSetMarker(int i, int j) const {
+    return LoadValue<sMarker>(data_ + markerSets_[i].offset + j * 12);
+  }
+  // All markers of set i, up to capacity; returns the number written
+  int MarkerSetMarkersSoA(int i, const sMarkerSoA &out, int capacity) const;
+
+  // Unlabeled markers (deprecated by Motive)
+  int OtherMarkerCount() const { return otherMarkers_.count; }
+  sMarker OtherMarker(int j) const {
+    return LoadValue<sMarker>(data_ + otherMarkers_.offset + j * 12);
+  }
+  int OtherMarkersSoA(const sMarkerSoA &out, int capacity) const;
+
+  // Rigid bodies
+  int RigidBodyCount() const { return (int) rigidBodies_.size(); }
+  sRigidBodyData RigidBody(int i) const {
+    return LoadRigidBody(rigidBodies_[i]);
+  }
+  // Rigid body markers (before NatNet 3.0); IDs and sizes from 2.0
+  int RigidBodyMarkerCount(int i) const { return rigidBodies_[i].nMarkers; }
+  sMarker RigidBodyMarker(int i, int k) const;
+  int RigidBodyMarkerID(int i, int k) const;
+  float RigidBodyMarkerSize(int i, int k) const;
+
+  // Skeletons (NatNet 2.1 and later)
+  int SkeletonCount() const { return (int) skeletons_.size(); }
+  int SkeletonID(int s) const { return skeletons_[s].ID; }
+  int SkeletonBoneCount(int s) const { return skeletons_[s].count; }
+  sRigidBodyData SkeletonBone(int s, int b) const {
+    return LoadRigidBody(bones_[skeletons_[s].first + b]);
+  }
+
+  // Labeled markers (NatNet 2.3 and later)
+  int LabeledMarkerCount() const { return labeledMarkers_.count; }
+  sLabeledMarker LabeledMarker(int i) const;
+  // All labeled markers, up to capacity; returns the number written
+  int LabeledMarkersSoA(const sLabeledMarkerSoA &out, int capacity) const;
+
+  // Force plates (NatNet 2.9 and later)
+  int ForcePlateCount() const { return (int) forcePlates_.size(); }
+  int ForcePlateID(int i) const { return forcePlates_[i].ID; }
+  int ForcePlateChannelCount(int i) const { return forcePlates_[i].count; }
+  int ForcePlateFrameCount(int i, int c) const {
+    return channels_[forcePlates_[i].first + c].count;
+  }
+  float ForcePlateValue(int i, int c, int f) const {
+    return LoadValue<float>(
+        data_ + channels_[forcePlates_[i].first + c].offset + f * 4);
+  }
+
+  // Devices (NatNet 2.11 and later)
+  int DeviceCount() const { return (int) devices_.size(); }
+  int DeviceID(int i) const { return devices_[i].ID; }
+  int DeviceChannelCount(int i) const { return devices_[i].count; }
+  int DeviceFrameCount(int i, int c) const {
+    return channels_[devices_[i].first + c].count;
+  }
+  float DeviceValue(int i, int c, int f) const {
+    return LoadValue<float>(
+        data_ + channels_[devices_[i].first + c].offset + f * 4);
+  }
+
+  // Element layout recorded by the decoder
+  // A run of count fixed-size elements starting at offset
+  struct sBlockRef {
+    uint32_t offset;
+    int count;
+  };
+  struct sMarkerSetRef {
+    uint32_t nameOffset;
+    uint32_t offset;
+    int count;
+  };
+  struct sRigidBodyRef {
+    uint32_t offset;        // ID
+    uint32_t tailOffset;    // mean marker error
+    int nMarkers;
+  };
+  // Owner of count consecutive entries in bones_ or channels_
+  struct sGroupRef {
+    int ID;
+    int count;
+    int first;
+  };
+
+ private:
+  template <int Major, int Minor>
+  friend bool DecodeFrameOfMocapData(const char *pData,
+                                     size_t nBytes,
+                                     FrameOfMocapData *frame);
+
+  sRigidBodyData LoadRigidBody(const sRigidBodyRef &ref) const;
+
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  const FrameSubscription *subscription_ = nullptr;
+
+  // Layout flags derived from the protocol version
+  bool hasMarkerIDs_ = false;
+  bool hasMeanError_ = false;
+  bool hasRigidBodyParams_ = false;
+  bool hasMarkerParams_ = false;
+  bool hasResidual_ = false;
+  uint32_t labeledMarkerStride_ = 0;
+
+  // Capacity is kept between frames, so steady-state decoding
+  // does not allocate
+  std::vector<sMarkerSetRef> markerSets_;
+  sBlockRef otherMarkers_{};
+  std::vector<sRigidBodyRef> rigidBodies_;
+  std::vector<sGroupRef> skeletons_;
+  std::vector<sRigidBodyRef> bones_;
+  sBlockRef labeledMarkers_{};
+  std::vector<sGroupRef> forcePlates_;
+  std::vector<sGroupRef> devices_;
+  std::vector<sBlockRef> channels_;
+};
+
+// Index a NAT_FRAMEOFDATA packet (message header included) of nBytes
+// received bytes. Returns false if the packet is not a frame or is
+// truncated; the frame must not be used in that case.
+template <int Major, int Minor>
+bool DecodeFrameOfMocapData(const char *pData,
+                            size_t nBytes,
+                            FrameOfMocapData *frame);
+
+#define NATNET_DECLARE_FRAME_DECODER(MAJOR, MINOR) \
+  extern template bool DecodeFrameOfMocapData<MAJOR, MINOR>( \
+      const char *, size_t, FrameOfMocapData *);
+NATNET_SUPPORTED_VERSIONS(NATNET_DECLARE_FRAME_DECODER)
+#undef NATNET_DECLARE_FRAME_DECODER
+
+typedef bool (*FrameDecoder)(const char *pData,
+                             size_t nBytes,
+                             FrameOfMocapData *frame);
+
+// Decoder for a protocol version, or nullptr if it is not supported
+FrameDecoder SelectFrameDecoder(int major, int minor);
+
+// Select and run the decoder for a protocol version in one call
+bool DecodeFrameOfMocapData(const char *pData,
+                            size_t nBytes,
+                            int major,
+                            int minor,
+                            FrameOfMocapData *frame);
+
+#endif  // NATNET_FRAME_H
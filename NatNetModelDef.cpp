@@ -0,0 +1,184 @@
+/*
+ * NatNetModelDef.cpp
+ *
+ * Bounds-checked decoding of NAT_MODELDEF packets.
+ */
+
+#include "NatNetModelDef.h"
+
+#include <algorithm>
+
+// Inline NUL-terminated string copied into str
+static bool ReadName(PacketReader &reader, std::string *str) {
+  const char *szName;
+  if (!reader.ReadString(&szName))
+    return false;
+  str->assign(szName);
+  return true;
+}
+
+static bool ReadNames(PacketReader &reader,
+                      int count,
+                      std::vector<std::string> *names) {
+  names->resize(count);
+  for (int i = 0; i < count; i++) {
+    if (!ReadName(reader, &(*names)[i]))
+      return false;
+  }
+  return true;
+}
+
+// Rigid body or skeleton bone; the layout is shared
+template <typename Layout>
+static bool DecodeRigidBodyDescription(PacketReader &reader,
+                                       sRigidBodyDescription *rb) {
+  if (Layout::kRigidBodyNames && !ReadName(reader, &rb->szName))
+    return false;
+  if (!reader.Read(&rb->ID) ||
+      !reader.Read(&rb->parentID) ||
+      !reader.Read(&rb->offsetx) ||
+      !reader.Read(&rb->offsety) ||
+      !reader.Read(&rb->offsetz))
+    return false;
+
+  if (Layout::kRigidBodyMarkerDescriptions) {
+    // Marker positions, then required active labels
+    int nMarkers = 0;
+    if (!reader.ReadCount(&nMarkers, 16))
+      return false;
+    rb->markerPositions.resize(nMarkers);
+    rb->markerRequiredLabels.resize(nMarkers);
+    for (int i = 0; i < nMarkers; i++)
+      reader.Read(&rb->markerPositions[i]);
+    for (int i = 0; i < nMarkers; i++)
+      reader.Read(&rb->markerRequiredLabels[i]);
+  }
+  return true;
+}
+
+static bool DecodeForcePlateDescription(PacketReader &reader,
+                                        sForcePlateDescription *plate) {
+  int nChannels = 0;
+  if (!reader.Read(&plate->ID) ||
+      !ReadName(reader, &plate->serialNo) ||
+      !reader.Read(&plate->fWidth) ||
+      !reader.Read(&plate->fLength) ||
+      !reader.Read(&plate->fOriginX) ||
+      !reader.Read(&plate->fOriginY) ||
+      !reader.Read(&plate->fOriginZ) ||
+      !reader.Read(&plate->fCalMat) ||
+      !reader.Read(&plate->fCorners) ||
+      !reader.Read(&plate->iPlateType) ||
+      !reader.Read(&plate->iChannelDataType) ||
+      !reader.ReadCount(&nChannels, 1))
+    return false;
+  return ReadNames(reader, nChannels, &plate->channelNames);
+}
+
+static bool DecodeDeviceDescription(PacketReader &reader,
+                                    sDeviceDescription *device) {
+  int nChannels = 0;
+  if (!reader.Read(&device->ID) ||
+      !ReadName(reader, &device->szName) ||
+      !ReadName(reader, &device->serialNo) ||
+      !reader.Read(&device->iDeviceType) ||
+      !reader.Read(&device->iChannelDataType) ||
+      !reader.ReadCount(&nChannels, 1))
+    return false;
+  return ReadNames(reader, nChannels, &device->channelNames);
+}
+
+template <int Major, int Minor>
+bool DecodeDataDescriptions(const char *pData,
+                            size_t nBytes,
+                            sDataDescriptions *descriptions) {
+  typedef NatNetLayout<Major, Minor> Layout;
+
+  // Message header: ID and payload size
+  if (nBytes < 4)
+    return false;
+  uint16_t MessageID = LoadValue<uint16_t>(pData);
+  uint16_t nDataBytes = LoadValue<uint16_t>(pData + 2);
+  if (MessageID != NAT_MODELDEF)
+    return false;
+  nBytes = std::min(nBytes, (size_t) nDataBytes + 4);
+
+  *descriptions = sDataDescriptions();
+  PacketReader reader(pData, nBytes);
+  reader.Skip(4);
+
+  int nDatasets = 0;
+  if (!reader.ReadCount(&nDatasets, 4))
+    return false;
+
+  for (int i = 0; i < nDatasets; i++) {
+    int type = 0;
+    if (!reader.Read(&type))
+      return false;
+
+    switch (type) {
+      case DESCRIPTOR_MARKERSET: {
+        descriptions->markerSets.push_back(sMarkerSetDescription());
+        sMarkerSetDescription &markerSet = descriptions->markerSets.back();
+        int nMarkers = 0;
+        if (!ReadName(reader, &markerSet.szName) ||
+            !reader.ReadCount(&nMarkers, 1) ||
+            !ReadNames(reader, nMarkers, &markerSet.markerNames))
+          return false;
+        break;
+      }
+      case DESCRIPTOR_RIGIDBODY:
+        descriptions->rigidBodies.push_back(sRigidBodyDescription());
+        if (!DecodeRigidBodyDescription<Layout>(
+            reader, &descriptions->rigidBodies.back()))
+          return false;
+        break;
+      case DESCRIPTOR_SKELETON: {
+        descriptions->skeletons.push_back(sSkeletonDescription());
+        sSkeletonDescription &skeleton = descriptions->skeletons.back();
+        int nBones = 0;
+        if (!ReadName(reader, &skeleton.szName) ||
+            !reader.Read(&skeleton.skeletonID) ||
+            !reader.ReadCount(&nBones, 20))
+          return false;
+        skeleton.bones.resize(nBones);
+        for (int b = 0; b < nBones; b++) {
+          if (!DecodeRigidBodyDescription<Layout>(reader, &skeleton.bones[b]))
+            return false;
+        }
+        break;
+      }
+      case DESCRIPTOR_FORCEPLATE:
+        descriptions->forcePlates.push_back(sForcePlateDescription());
+        if (!DecodeForcePlateDescription(
+            reader, &descriptions->forcePlates.back()))
+          return false;
+        break;
+      case DESCRIPTOR_DEVICE:
+        descriptions->devices.push_back(sDeviceDescription());
+        if (!DecodeDeviceDescription(reader, &descriptions->devices.back()))
+          return false;
+        break;
+      default:
+        // Unknown layout; the rest of the packet cannot be located
+        return false;
+    }
+  }
+  return true;
+}
+
+#define NATNET_INSTANTIATE_MODELDEF_DECODER(MAJOR, MINOR) \
+  template bool DecodeDataDescriptions<MAJOR, MINOR>( \
+      const char *, size_t, sDataDescriptions *);
+NATNET_SUPPORTED_VERSIONS(NATNET_INSTANTIATE_MODELDEF_DECODER)
+
+ModelDefDecoder SelectModelDefDecoder(int major, int minor) {
+  // Later 3.x servers describe models in the 3.0 layout
+  if (major == 3)
+    minor = 0;
+#define NATNET_SELECT_MODELDEF_DECODER(MAJOR, MINOR) \
+  if (major == MAJOR && minor == MINOR) \
+    return &DecodeDataDescriptions<MAJOR, MINOR>;
+  NATNET_SUPPORTED_VERSIONS(NATNET_SELECT_MODELDEF_DECODER)
+  return nullptr;
+}
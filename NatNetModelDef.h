@@ -0,0 +1,100 @@
+/*
+ * NatNetModelDef.h
+ *
+ * Bounds-checked decoding of NAT_MODELDEF (data description) packets.
+ *
+ * Descriptions arrive rarely, so unlike frames they are copied out of
+ * the packet into owning structures. The decoder is a template on the
+ * protocol version, explicitly instantiated for
+ * NATNET_SUPPORTED_VERSIONS; pick one with SelectModelDefDecoder().
+ */
+
+#ifndef NATNET_MODELDEF_H
+#define NATNET_MODELDEF_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "NatNetFrame.h"
+#include "NatNetTypes.h"
+
+// Dataset types in a NAT_MODELDEF packet
+#define DESCRIPTOR_MARKERSET        0
+#define DESCRIPTOR_RIGIDBODY        1
+#define DESCRIPTOR_SKELETON         2
+#define DESCRIPTOR_FORCEPLATE       3
+#define DESCRIPTOR_DEVICE           4
+
+struct sMarkerSetDescription {
+  std::string szName;
+  std::vector<std::string> markerNames;
+};
+
+struct sRigidBodyDescription {
+  std::string szName;                     // NatNet 2.0 and later
+  int ID = 0;
+  int parentID = -1;
+  float offsetx = 0.0f, offsety = 0.0f, offsetz = 0.0f;
+  // Per-marker data (NatNet 3.0 and later)
+  std::vector<sMarker> markerPositions;
+  std::vector<int> markerRequiredLabels;  // 0 if no active label
+};
+
+struct sSkeletonDescription {
+  std::string szName;
+  int skeletonID = 0;
+  std::vector<sRigidBodyDescription> bones;
+};
+
+struct sForcePlateDescription {
+  int ID = 0;
+  std::string serialNo;
+  float fWidth = 0.0f, fLength = 0.0f;
+  float fOriginX = 0.0f, fOriginY = 0.0f, fOriginZ = 0.0f;
+  float fCalMat[12][12];
+  float fCorners[4][3];
+  int iPlateType = 0;
+  int iChannelDataType = 0;
+  std::vector<std::string> channelNames;
+};
+
+struct sDeviceDescription {
+  int ID = 0;
+  std::string szName;
+  std::string serialNo;
+  int iDeviceType = 0;
+  int iChannelDataType = 0;
+  std::vector<std::string> channelNames;
+};
+
+struct sDataDescriptions {
+  std::vector<sMarkerSetDescription> markerSets;
+  std::vector<sRigidBodyDescription> rigidBodies;
+  std::vector<sSkeletonDescription> skeletons;
+  std::vector<sForcePlateDescription> forcePlates;
+  std::vector<sDeviceDescription> devices;
+};
+
+// Decode a NAT_MODELDEF packet (message header included) of nBytes
+// received bytes. Returns false if the packet is not a data description
+// or is truncated, or holds an unknown dataset type.
+template <int Major, int Minor>
+bool DecodeDataDescriptions(const char *pData,
+                            size_t nBytes,
+                            sDataDescriptions *descriptions);
+
+#define NATNET_DECLARE_MODELDEF_DECODER(MAJOR, MINOR) \
+  extern template bool DecodeDataDescriptions<MAJOR, MINOR>( \
+      const char *, size_t, sDataDescriptions *);
+NATNET_SUPPORTED_VERSIONS(NATNET_DECLARE_MODELDEF_DECODER)
+#undef NATNET_DECLARE_MODELDEF_DECODER
+
+typedef bool (*ModelDefDecoder)(const char *pData,
+                                size_t nBytes,
+                                sDataDescriptions *descriptions);
+
+// Decoder for a protocol version, or nullptr if it is not supported
+ModelDefDecoder SelectModelDefDecoder(int major, int minor);
+
+#endif  // NATNET_MODELDEF_H
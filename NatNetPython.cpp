@@ -0,0 +1,585 @@
+/*
+ * NatNetPython.cpp
+ *
+ * natnet_native, a Python extension decoding NatNet frames with the C++
+ * decoder into NumPy arrays.
+ *
+ *   decode(datagram, version=(3, 0)) -> batch, or None if malformed
+ *
+ *   Receiver(multicast_group="239.255.42.99", local_ip="0.0.0.0",
+ *            port=1511, version=(3, 0), capacity=4096)
+ *     .get(timeout=None) -> batch of the frames received since the last
+ *                           call; empty on timeout or once closed
+ *     .set_version((major, minor))
+ *     .stats() -> dict of received, decoded, malformed and dropped
+ *     .close()
+ *
+ * A Receiver joins the group (or, with an empty group, receives unicast)
+ * on a native thread that drains the socket with recvmmsg and decodes
+ * each frame without the GIL. Decoded frames are appended to columns
+ * until get() swaps them out, so Python pays once per batch rather than
+ * once per field; frames arriving while capacity frames are pending are
+ * dropped and counted.
+ *
+ * A batch is a dict of arrays, laid out as FrameColumns:
+ *
+ *   frame, timestamp, mid_exposure, params, timecode, timecode_subframe,
+ *   marker_set_count, other_marker_count      one entry per frame
+ *   rigid_body_start, skeleton_start,
+ *   labeled_marker_start                      frames + 1 offsets
+ *   rigid_body_id, rigid_body_position (n, 3), rigid_body_orientation
+ *   (n, 4, x y z w), rigid_body_error, rigid_body_valid
+ *   skeleton_id, bone_start (skeletons + 1)
+ *   bone_id, bone_position, bone_orientation, bone_error, bone_valid
+ *   labeled_marker_id, labeled_marker_position, labeled_marker_size,
+ *   labeled_marker_residual, labeled_marker_params
+ *
+ * The rigid bodies of frame i are rigid_body_*[rigid_body_start[i]:
+ * rigid_body_start[i + 1]], and likewise for skeletons and markers.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#include <numpy/arrayobject.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "FrameColumns.h"
+#include "NatNetFrame.h"
+#include "NatNetTypes.h"
+
+#define RECEIVER_BATCH          16        // datagrams per recvmmsg
+#define RECEIVER_DATAGRAM_SIZE  65536
+#define RECEIVER_POLL_MS        100       // checks for close()
+#define RECEIVER_RCVBUF         0x800000
+
+// Frames with the fields that only the Python API reports
+struct sBatch {
+  FrameColumns columns;
+  std::vector<uint32_t> timecode;
+  std::vector<uint32_t> timecodeSubframe;
+  std::vector<int32_t> markerSetCount;
+  std::vector<int32_t> otherMarkerCount;
+
+  void Add(const FrameOfMocapData &frame) {
+    columns.Add(frame);
+    timecode.push_back(frame.Timecode);
+    timecodeSubframe.push_back(frame.TimecodeSubframe);
+    markerSetCount.push_back(frame.MarkerSetCount());
+    otherMarkerCount.push_back(frame.OtherMarkerCount());
+  }
+
+  void Clear() {
+    columns.Clear();
+    timecode.clear();
+    timecodeSubframe.clear();
+    markerSetCount.clear();
+    otherMarkerCount.clear();
+  }
+};
+
+template <typename T>
+static PyObject *Array(const std::vector<T> &column, int type) {
+  npy_intp n = (npy_intp) column.size();
+  PyObject *array = PyArray_SimpleNew(1, &n, type);
+  if (array != nullptr && n > 0)
+    memcpy(PyArray_DATA((PyArrayObject *) array), column.data(),
+           n * sizeof(T));
+  return array;
+}
+
+// Float columns side by side, as an (n, k) array
+static PyObject *Stack(std::initializer_list<const std::vector<float> *> columns) {
+  npy_intp dims[2] = {(npy_intp) (*columns.begin())->size(),
+                      (npy_intp) columns.size()};
+  PyObject *array = PyArray_SimpleNew(2, dims, NPY_FLOAT32);
+  if (array == nullptr)
+    return nullptr;
+  float *out = (float *) PyArray_DATA((PyArrayObject *) array);
+  int k = 0;
+  for (const std::vector<float> *column : columns) {
+    for (npy_intp i = 0; i < dims[0]; i++)
+      out[i * dims[1] + k] = (*column)[i];
+    k++;
+  }
+  return array;
+}
+
+// Tracking valid bit of each params entry
+static PyObject *Valid(const std::vector<int16_t> &params) {
+  npy_intp n = (npy_intp) params.size();
+  PyObject *array = PyArray_SimpleNew(1, &n, NPY_BOOL);
+  if (array == nullptr)
+    return nullptr;
+  npy_bool *out = (npy_bool *) PyArray_DATA((PyArrayObject *) array);
+  for (npy_intp i = 0; i < n; i++)
+    out[i] = (params[i] & 0x01) != 0;
+  return array;
+}
+
+// Store value under key of dict, taking the reference; false on error
+static bool Put(PyObject *dict, const char *key, PyObject *value) {
+  if (value == nullptr)
+    return false;
+  int result = PyDict_SetItemString(dict, key, value);
+  Py_DECREF(value);
+  return result == 0;
+}
+
+static PyObject *BatchToDict(const sBatch &batch) {
+  const FrameColumns &f = batch.columns;
+  PyObject *dict = PyDict_New();
+  if (dict == nullptr)
+    return nullptr;
+  bool bOk =
+      Put(dict, "frame", Array(f.frameNumber, NPY_INT32)) &&
+      Put(dict, "timestamp", Array(f.timestamp, NPY_FLOAT64)) &&
+      Put(dict, "mid_exposure", Array(f.midExposure, NPY_UINT64)) &&
+      Put(dict, "params", Array(f.params, NPY_INT16)) &&
+      Put(dict, "timecode", Array(batch.timecode, NPY_UINT32)) &&
+      Put(dict, "timecode_subframe",
+          Array(batch.timecodeSubframe, NPY_UINT32)) &&
+      Put(dict, "marker_set_count", Array(batch.markerSetCount, NPY_INT32)) &&
+      Put(dict, "other_marker_count",
+          Array(batch.otherMarkerCount, NPY_INT32)) &&
+      Put(dict, "rigid_body_start", Array(f.rigidBodyStart, NPY_UINT32)) &&
+      Put(dict, "skeleton_start", Array(f.skeletonStart, NPY_UINT32)) &&
+      Put(dict, "labeled_marker_start",
+          Array(f.labeledMarkerStart, NPY_UINT32)) &&
+
+      Put(dict, "rigid_body_id", Array(f.rigidBodies.ID, NPY_INT32)) &&
+      Put(dict, "rigid_body_position",
+          Stack({&f.rigidBodies.x, &f.rigidBodies.y, &f.rigidBodies.z})) &&
+      Put(dict, "rigid_body_orientation",
+          Stack({&f.rigidBodies.qx, &f.rigidBodies.qy, &f.rigidBodies.qz,
+                 &f.rigidBodies.qw})) &&
+      Put(dict, "rigid_body_error",
+          Array(f.rigidBodies.meanError, NPY_FLOAT32)) &&
+      Put(dict, "rigid_body_valid", Valid(f.rigidBodies.params)) &&
+
+      Put(dict, "skeleton_id", Array(f.skeletonID, NPY_INT32)) &&
+      Put(dict, "bone_start", Array(f.boneStart, NPY_UINT32)) &&
+      Put(dict, "bone_id", Array(f.bones.ID, NPY_INT32)) &&
+      Put(dict, "bone_position",
+          Stack({&f.bones.x, &f.bones.y, &f.bones.z})) &&
+      Put(dict, "bone_orientation",
+          Stack({&f.bones.qx, &f.bones.qy, &f.bones.qz, &f.bones.qw})) &&
+      Put(dict, "bone_error", Array(f.bones.meanError, NPY_FLOAT32)) &&
+      Put(dict, "bone_valid", Valid(f.bones.params)) &&
+
+      Put(dict, "labeled_marker_id", Array(f.labeledMarkers.ID, NPY_INT32)) &&
+      Put(dict, "labeled_marker_position",
+          Stack({&f.labeledMarkers.x, &f.labeledMarkers.y,
+                 &f.labeledMarkers.z})) &&
+      Put(dict, "labeled_marker_size",
+          Array(f.labeledMarkers.size, NPY_FLOAT32)) &&
+      Put(dict, "labeled_marker_residual",
+          Array(f.labeledMarkers.residual, NPY_FLOAT32)) &&
+      Put(dict, "labeled_marker_params",
+          Array(f.labeledMarkers.params, NPY_INT16));
+  if (!bOk) {
+    Py_DECREF(dict);
+    return nullptr;
+  }
+  return dict;
+}
+
+// (major, minor[, ...]) to a decoder; sets an exception if unsupported
+static FrameDecoder DecoderOf(PyObject *version) {
+  int major = 3, minor = 0;
+  if (version != nullptr && version != Py_None) {
+    PyObject *sequence = PySequence_Fast(version, "version must be a sequence");
+    if (sequence == nullptr)
+      return nullptr;
+    bool bValid = PySequence_Fast_GET_SIZE(sequence) >= 2;
+    if (bValid) {
+      major = (int) PyLong_AsLong(PySequence_Fast_GET_ITEM(sequence, 0));
+      minor = (int) PyLong_AsLong(PySequence_Fast_GET_ITEM(sequence, 1));
+    }
+    Py_DECREF(sequence);
+    if (PyErr_Occurred())
+      return nullptr;
+    if (!bValid) {
+      PyErr_SetString(PyExc_ValueError, "version needs a major and minor");
+      return nullptr;
+    }
+  }
+  FrameDecoder decoder = SelectFrameDecoder(major, minor);
+  if (decoder == nullptr)
+    PyErr_Format(PyExc_ValueError, "NatNet %d.%d is not supported",
+                 major, minor);
+  return decoder;
+}
+
+static PyObject *Decode(PyObject *self, PyObject *args, PyObject *kwargs) {
+  static const char *keywords[] = {"datagram", "version", nullptr};
+  Py_buffer datagram;
+  PyObject *version = nullptr;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*|O", (char **) keywords,
+                                   &datagram, &version))
+    return nullptr;
+  FrameDecoder decoder = DecoderOf(version);
+  if (decoder == nullptr) {
+    PyBuffer_Release(&datagram);
+    return nullptr;
+  }
+  static thread_local FrameOfMocapData frame;
+  bool bDecoded = decoder((const char *) datagram.buf, (size_t) datagram.len,
+                          &frame);
+  if (!bDecoded) {
+    PyBuffer_Release(&datagram);
+    Py_RETURN_NONE;
+  }
+  // The frame reads through the buffer until it is copied
+  sBatch batch;
+  batch.Add(frame);
+  PyBuffer_Release(&datagram);
+  return BatchToDict(batch);
+}
+
+class Receiver {
+ public:
+  Receiver(int socket, FrameDecoder decoder, size_t capacity)
+      : socket_(socket), decoder_(decoder), capacity_(capacity),
+        pending_(new sBatch), taken_(new sBatch) {
+    thread_ = std::thread(&Receiver::Run, this);
+  }
+  ~Receiver() { Close(); }
+
+  // Wait up to timeoutMs for a frame; the returned batch is valid until
+  // the next call
+  const sBatch &Take(int timeoutMs) {
+    taken_->Clear();
+    std::unique_lock<std::mutex> lock(mutex_);
+    ready_.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this] {
+      return pending_->columns.Frames() > 0 || !running_;
+    });
+    std::swap(pending_, taken_);
+    return *taken_;
+  }
+
+  void SetDecoder(FrameDecoder decoder) { decoder_ = decoder; }
+
+  void Close() {
+    if (running_.exchange(false))
+      thread_.join();
+    ready_.notify_all();
+    if (socket_ != -1) {
+      close(socket_);
+      socket_ = -1;
+    }
+  }
+
+  bool Running() const { return running_; }
+
+  std::atomic<uint64_t> received{0};
+  std::atomic<uint64_t> decoded{0};
+  std::atomic<uint64_t> malformed{0};
+  std::atomic<uint64_t> dropped{0};
+
+ private:
+  void Run() {
+    std::vector<char> buffers(RECEIVER_BATCH * RECEIVER_DATAGRAM_SIZE);
+    mmsghdr messages[RECEIVER_BATCH];
+    iovec iovecs[RECEIVER_BATCH];
+    for (int i = 0; i < RECEIVER_BATCH; i++) {
+      iovecs[i].iov_base = &buffers[i * RECEIVER_DATAGRAM_SIZE];
+      iovecs[i].iov_len = RECEIVER_DATAGRAM_SIZE;
+      memset(&messages[i], 0, sizeof(messages[i]));
+      messages[i].msg_hdr.msg_iov = &iovecs[i];
+      messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    FrameOfMocapData frame;
+    pollfd pfd{socket_, POLLIN, 0};
+    while (running_) {
+      if (poll(&pfd, 1, RECEIVER_POLL_MS) <= 0)
+        continue;
+      int n = recvmmsg(socket_, messages, RECEIVER_BATCH, MSG_DONTWAIT,
+                       nullptr);
+      if (n <= 0)
+        continue;
+      received += n;
+      FrameDecoder decoder = decoder_.load();
+      for (int i = 0; i < n; i++) {
+        const char *pData = (const char *) iovecs[i].iov_base;
+        size_t nBytes = messages[i].msg_len;
+        uint16_t iMessage = 0;
+        if (nBytes >= 2)
+          memcpy(&iMessage, pData, sizeof(iMessage));
+        if (iMessage != NAT_FRAMEOFDATA || !decoder(pData, nBytes, &frame)) {
+          malformed++;
+          continue;
+        }
+        decoded++;
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (pending_->columns.Frames() >= capacity_) {
+          dropped++;
+          continue;
+        }
+        pending_->Add(frame);
+      }
+      ready_.notify_one();
+    }
+  }
+
+  int socket_;
+  std::atomic<FrameDecoder> decoder_;
+  size_t capacity_;
+  std::atomic<bool> running_{true};
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::unique_ptr<sBatch> pending_;
+  std::unique_ptr<sBatch> taken_;
+};
+
+struct ReceiverObject {
+  PyObject_HEAD
+  Receiver *receiver;
+  // get() from several Python threads takes turns
+  std::mutex *getMutex;
+};
+
+// Data socket bound to port, in the multicast group if one is given
+static int OpenSocket(const char *szGroup, const char *szLocal, int port) {
+  in_addr group{}, local{};
+  bool bMulticast = szGroup[0] != '\0';
+  if ((bMulticast && inet_pton(AF_INET, szGroup, &group) != 1) ||
+      inet_pton(AF_INET, szLocal, &local) != 1) {
+    PyErr_SetString(PyExc_ValueError, "invalid IPv4 address");
+    return -1;
+  }
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd == -1) {
+    PyErr_SetFromErrno(PyExc_OSError);
+    return -1;
+  }
+  int value = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+  value = 0;
+  setsockopt(fd, IPPROTO_IP, IP_MULTICAST_ALL, &value, sizeof(value));
+  value = RECEIVER_RCVBUF;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value));
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons((uint16_t) port);
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(fd, (sockaddr *) &address, sizeof(address)) == -1) {
+    PyErr_SetFromErrno(PyExc_OSError);
+    close(fd);
+    return -1;
+  }
+  if (bMulticast) {
+    ip_mreq mreq{};
+    mreq.imr_multiaddr = group;
+    mreq.imr_interface = local;
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+                   sizeof(mreq)) == -1) {
+      PyErr_SetFromErrno(PyExc_OSError);
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+static int ReceiverInit(ReceiverObject *self, PyObject *args,
+                        PyObject *kwargs) {
+  static const char *keywords[] = {"multicast_group", "local_ip", "port",
+                                   "version", "capacity", nullptr};
+  const char *szGroup = MULTICAST_ADDRESS;
+  const char *szLocal = "0.0.0.0";
+  int port = PORT_DATA;
+  PyObject *version = nullptr;
+  Py_ssize_t capacity = 4096;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|ssiOn", (char **) keywords,
+                                   &szGroup, &szLocal, &port, &version,
+                                   &capacity))
+    return -1;
+  if (capacity < 1) {
+    PyErr_SetString(PyExc_ValueError, "capacity must be positive");
+    return -1;
+  }
+  FrameDecoder decoder = DecoderOf(version);
+  if (decoder == nullptr)
+    return -1;
+  if (self->receiver != nullptr) {
+    PyErr_SetString(PyExc_RuntimeError, "Receiver is already initialized");
+    return -1;
+  }
+  int fd = OpenSocket(szGroup, szLocal, port);
+  if (fd == -1)
+    return -1;
+  self->receiver = new Receiver(fd, decoder, (size_t) capacity);
+  self->getMutex = new std::mutex;
+  return 0;
+}
+
+static void ReceiverClose(ReceiverObject *self) {
+  if (self->receiver == nullptr)
+    return;
+  Py_BEGIN_ALLOW_THREADS
+  self->receiver->Close();
+  Py_END_ALLOW_THREADS
+}
+
+static void ReceiverDealloc(ReceiverObject *self) {
+  ReceiverClose(self);
+  delete self->receiver;
+  delete self->getMutex;
+  Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static bool CheckOpen(ReceiverObject *self) {
+  if (self->receiver == nullptr) {
+    PyErr_SetString(PyExc_RuntimeError, "Receiver is not initialized");
+    return false;
+  }
+  return true;
+}
+
+static PyObject *ReceiverGet(ReceiverObject *self, PyObject *args,
+                             PyObject *kwargs) {
+  static const char *keywords[] = {"timeout", nullptr};
+  PyObject *timeout = Py_None;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", (char **) keywords,
+                                   &timeout) ||
+      !CheckOpen(self))
+    return nullptr;
+  typedef std::chrono::steady_clock Clock;
+  bool bForever = timeout == Py_None;
+  Clock::time_point deadline = Clock::now();
+  if (!bForever) {
+    double seconds = PyFloat_AsDouble(timeout);
+    if (PyErr_Occurred())
+      return nullptr;
+    deadline += std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(std::max(seconds, 0.0)));
+  }
+
+  Receiver *receiver = self->receiver;
+  const sBatch *batch = nullptr;
+  Py_BEGIN_ALLOW_THREADS
+  self->getMutex->lock();
+  Py_END_ALLOW_THREADS
+  // Wait in slices, so Ctrl-C is handled while no frames arrive
+  while (true) {
+    int sliceMs = RECEIVER_POLL_MS;
+    if (!bForever) {
+      // Rounded up, so a fraction of a millisecond still waits
+      double leftMs = std::chrono::duration<double, std::milli>(
+          deadline - Clock::now()).count();
+      sliceMs = std::min(sliceMs, (int) std::ceil(std::max(leftMs, 0.0)));
+    }
+    Py_BEGIN_ALLOW_THREADS
+    batch = &receiver->Take(sliceMs);
+    Py_END_ALLOW_THREADS
+    if (batch->columns.Frames() > 0 || !receiver->Running())
+      break;
+    if (!bForever && Clock::now() >= deadline)
+      break;
+    if (PyErr_CheckSignals() != 0) {
+      self->getMutex->unlock();
+      return nullptr;
+    }
+  }
+  PyObject *dict = BatchToDict(*batch);
+  self->getMutex->unlock();
+  return dict;
+}
+
+static PyObject *ReceiverSetVersion(ReceiverObject *self, PyObject *version) {
+  if (!CheckOpen(self))
+    return nullptr;
+  FrameDecoder decoder = DecoderOf(version);
+  if (decoder == nullptr)
+    return nullptr;
+  self->receiver->SetDecoder(decoder);
+  Py_RETURN_NONE;
+}
+
+static PyObject *ReceiverStats(ReceiverObject *self, PyObject *) {
+  if (!CheckOpen(self))
+    return nullptr;
+  Receiver *receiver = self->receiver;
+  return Py_BuildValue(
+      "{s:K,s:K,s:K,s:K}",
+      "received", (unsigned long long) receiver->received.load(),
+      "decoded", (unsigned long long) receiver->decoded.load(),
+      "malformed", (unsigned long long) receiver->malformed.load(),
+      "dropped", (unsigned long long) receiver->dropped.load());
+}
+
+static PyObject *ReceiverCloseMethod(ReceiverObject *self, PyObject *) {
+  ReceiverClose(self);
+  Py_RETURN_NONE;
+}
+
+static PyMethodDef gReceiverMethods[] = {
+    {"get", (PyCFunction) (void (*)(void)) ReceiverGet,
+     METH_VARARGS | METH_KEYWORDS,
+     "get(timeout=None) -> batch of the frames received since the last call"},
+    {"set_version", (PyCFunction) ReceiverSetVersion, METH_O,
+     "set_version((major, minor)) selects the decoder of later frames"},
+    {"stats", (PyCFunction) ReceiverStats, METH_NOARGS,
+     "stats() -> counts of received, decoded, malformed and dropped"},
+    {"close", (PyCFunction) ReceiverCloseMethod, METH_NOARGS,
+     "close() stops the receive thread and closes the socket"},
+    {nullptr, nullptr, 0, nullptr}};
+
+static PyTypeObject gReceiverType = {PyVarObject_HEAD_INIT(nullptr, 0)};
+
+static PyMethodDef gModuleMethods[] = {
+    {"decode", (PyCFunction) (void (*)(void)) Decode,
+     METH_VARARGS | METH_KEYWORDS,
+     "decode(datagram, version=(3, 0)) -> batch of one frame, or None"},
+    {nullptr, nullptr, 0, nullptr}};
+
+static PyModuleDef gModule = {
+    PyModuleDef_HEAD_INIT, "natnet_native",
+    "NatNet frame decoding and receiving into NumPy arrays", -1,
+    gModuleMethods};
+
+PyMODINIT_FUNC PyInit_natnet_native() {
+  import_array();
+
+  gReceiverType.tp_name = "natnet_native.Receiver";
+  gReceiverType.tp_basicsize = sizeof(ReceiverObject);
+  gReceiverType.tp_flags = Py_TPFLAGS_DEFAULT;
+  gReceiverType.tp_doc = "Receives and decodes NatNet frames on a native thread";
+  gReceiverType.tp_new = PyType_GenericNew;
+  gReceiverType.tp_init = (initproc) ReceiverInit;
+  gReceiverType.tp_dealloc = (destructor) ReceiverDealloc;
+  gReceiverType.tp_methods = gReceiverMethods;
+  if (PyType_Ready(&gReceiverType) < 0)
+    return nullptr;
+
+  PyObject *module = PyModule_Create(&gModule);
+  if (module == nullptr)
+    return nullptr;
+  Py_INCREF(&gReceiverType);
+  if (PyModule_AddObject(module, "Receiver",
+                         (PyObject *) &gReceiverType) < 0) {
+    Py_DECREF(&gReceiverType);
+    Py_DECREF(module);
+    return nullptr;
+  }
+  return module;
+}
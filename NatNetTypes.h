@@ -0,0 +1,103 @@
+/*
+ * NatNetTypes.h
+ *
+ * NatNet protocol constants and packet layouts shared by the client
+ * and the decoders.
+ */
+
+#ifndef NATNET_TYPES_H
+#define NATNET_TYPES_H
+
+#include <cstddef>
+#include <cstdint>
+
+#define NAT_CONNECT                 0
+#define NAT_SERVERINFO              1
+#define NAT_REQUEST                 2
+#define NAT_RESPONSE                3
+#define NAT_REQUEST_MODELDEF        4
+#define NAT_MODELDEF                5
+#define NAT_REQUEST_FRAMEOFDATA     6
+#define NAT_FRAMEOFDATA             7
+#define NAT_MESSAGESTRING           8
+#define NAT_ECHOREQUEST             12
+#define NAT_ECHORESPONSE            13
+#define NAT_UNRECOGNIZED_REQUEST    100
+
+#define MAX_PACKETSIZE              100000    // actual packet size is dynamic
+#define MAX_NAMELENGTH              256
+
+typedef struct {
+  char szName[MAX_NAMELENGTH];            // sending app's name
+  uint8_t Version[4];                     // [major.minor.build.revision]
+  uint8_t NatNetVersion[4];               // [major.minor.build.revision]
+} sSender;
+
+typedef struct sSender_Server {
+  sSender Common;
+  // host's high resolution clock frequency (ticks per second)
+  uint64_t HighResClockFrequency;
+  uint16_t DataPort;
+  bool IsMulticast;
+  uint8_t MulticastGroupAddress[4];
+} sSender_Server;
+
+typedef struct {
+  uint16_t iMessage;                      // message ID (e.g. NAT_FRAMEOFDATA)
+  uint16_t nDataBytes;                    // Num bytes in payload
+  union {
+    uint8_t cData[MAX_PACKETSIZE];
+    char szData[MAX_PACKETSIZE];
+    uint32_t lData[MAX_PACKETSIZE / sizeof(uint32_t)];
+    float fData[MAX_PACKETSIZE / sizeof(float)];
+    sSender Sender;
+    sSender_Server SenderServer;
+  } Data;                                 // Payload incoming from NatNet Server
+} sPacket;
+
+#define MULTICAST_ADDRESS       "239.255.42.99"
+#define PORT_COMMAND            1510      // NatNet Command channel
+#define PORT_DATA               1511      // NatNet Data channel
+
+// Protocol versions with specialized decoders, as X(major, minor)
+#define NATNET_SUPPORTED_VERSIONS(X) \
+  X(2, 5) X(2, 6) X(2, 7) X(2, 8) X(2, 9) X(2, 10) X(3, 0)
+
+constexpr bool NatNetAtLeast(int major, int minor,
+                             int sinceMajor, int sinceMinor) {
+  return major > sinceMajor || (major == sinceMajor && minor >= sinceMinor);
+}
+
+// Packet layout of a protocol version, known at compile time
+template <int Major, int Minor>
+struct NatNetLayout {
+  // Frame of mocap data
+  static constexpr bool kRigidBodyMarkers = Major < 3;
+  static constexpr bool kRigidBodyMarkerIDs = Major == 2;
+  static constexpr bool kMeanError = Major >= 2;
+  static constexpr bool kTrackingParams = NatNetAtLeast(Major, Minor, 2, 6);
+  static constexpr bool kSkeletons = NatNetAtLeast(Major, Minor, 2, 1);
+  static constexpr bool kLabeledMarkers = NatNetAtLeast(Major, Minor, 2, 3);
+  static constexpr bool kMarkerParams = NatNetAtLeast(Major, Minor, 2, 6);
+  static constexpr bool kResidual = Major >= 3;
+  static constexpr bool kForcePlates = NatNetAtLeast(Major, Minor, 2, 9);
+  static constexpr bool kDevices = NatNetAtLeast(Major, Minor, 2, 11);
+  static constexpr bool kSoftwareLatency = Major < 3;
+  static constexpr bool kDoubleTimestamp = NatNetAtLeast(Major, Minor, 2, 7);
+  static constexpr bool kHighResTimestamps = Major >= 3;
+
+  // Bytes per rigid body or bone, excluding pre-3.0 marker data
+  static constexpr size_t kRigidBodySize =
+      32 + (kMeanError ? 4 : 0) + (kTrackingParams ? 2 : 0);
+  // Bytes per rigid body marker before 3.0: position, ID and size
+  static constexpr size_t kRigidBodyMarkerSize =
+      12 + (kRigidBodyMarkerIDs ? 8 : 0);
+  static constexpr size_t kLabeledMarkerSize =
+      20 + (kMarkerParams ? 2 : 0) + (kResidual ? 4 : 0);
+
+  // Data descriptions
+  static constexpr bool kRigidBodyNames = Major >= 2;
+  static constexpr bool kRigidBodyMarkerDescriptions = Major >= 3;
+};
+
+#endif  // NATNET_TYPES_H
@@ -36,86 +36,153 @@ Usage [optional]:
  * Boris Belousov (boris@robot-learning.de)
  */
 
-#include <iostream>
 #include <cstdio>
 #include <cinttypes>
 #include <climits>
 #include <cstring>
+#include <cstddef>
+#include <cerrno>
 #include <chrono>
 #include <thread>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include <ros/ros.h>
 #include <geometry_msgs/PoseStamped.h>
 
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
-#define NAT_CONNECT                 0
-#define NAT_SERVERINFO              1
-#define NAT_REQUEST                 2
-#define NAT_RESPONSE                3
-#define NAT_REQUEST_MODELDEF        4
-#define NAT_MODELDEF                5
-#define NAT_REQUEST_FRAMEOFDATA     6
-#define NAT_FRAMEOFDATA             7
-#define NAT_MESSAGESTRING           8
-#define NAT_UNRECOGNIZED_REQUEST    100
-
-#define MAX_PACKETSIZE              100000    // actual packet size is dynamic
-#define MAX_NAMELENGTH              256
-
-typedef struct {
-  char szName[MAX_NAMELENGTH];            // sending app's name
-  uint8_t Version[4];                     // [major.minor.build.revision]
-  uint8_t NatNetVersion[4];               // [major.minor.build.revision]
-} sSender;
-
-typedef struct sSender_Server {
-  sSender Common;
-  // host's high resolution clock frequency (ticks per second)
-  uint64_t HighResClockFrequency;
-  uint16_t DataPort;
-  bool IsMulticast;
-  uint8_t MulticastGroupAddress[4];
-} sSender_Server;
-
-typedef struct {
-  uint16_t iMessage;                      // message ID (e.g. NAT_FRAMEOFDATA)
-  uint16_t nDataBytes;                    // Num bytes in payload
-  union {
-    uint8_t cData[MAX_PACKETSIZE];
-    char szData[MAX_PACKETSIZE];
-    uint32_t lData[MAX_PACKETSIZE / sizeof(uint32_t)];
-    float fData[MAX_PACKETSIZE / sizeof(float)];
-    sSender Sender;
-    sSender_Server SenderServer;
-  } Data;                                 // Payload incoming from NatNet Server
-} sPacket;
-
-#define MULTICAST_ADDRESS       "239.255.42.99"
-#define PORT_COMMAND            1510      // NatNet Command channel
-#define PORT_DATA               1511      // NatNet Data channel
-
-// Sockets
-int CommandSocket;
-int DataSocket;
-in_addr ServerAddress;
-sockaddr_in HostAddr;
-
-// Global ROS publisher
-ros::Publisher pub;
-geometry_msgs::PoseStamped pose;
-
-// Versioning
-int NatNetVersion[4] = {2, 10, 0, 0};
-int ServerVersion[4] = {0, 0, 0, 0};
-
-// Command mode global variables
-int gCommandResponse = 0;
-int gCommandResponseSize = 0;
-unsigned char gCommandResponseString[PATH_MAX];
+#include "PacketClient.h"
+#include "NatNetTypes.h"
+#include "NatNetFrame.h"
+#include "NatNetModelDef.h"
+#include "ModelDefCache.h"
+#include "Capture.h"
+#include "Take.h"
+#include "CommandClient.h"
+#include "EventLoop.h"
+#include "FrameBus.h"
+#include "FrameContinuity.h"
+#include "LatencyStats.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "PacketPipeline.h"
+#include "PosePredictor.h"
+#include "RigidBodyPublishers.h"
+
+// A NatNet protocol version with the decoders specialized for it
+struct sProtocol {
+  int major;
+  int minor;
+  FrameDecoder frameDecoder;
+  ModelDefDecoder modelDefDecoder;
+};
+
+// One Motive server: its sockets, protocol version, model definitions
+// and outputs. Everything a connection publishes is tagged with its
+// source name.
+struct sConnection {
+  int index = 0;                          // in gConnections
+  std::string source;
+
+  // Sockets
+  in_addr serverAddress{};
+  in_addr localAddress{};
+  in_addr multicastAddress{};
+  int commandSocket = -1;
+  int dataSocket = -1;
+  sockaddr_in hostAddr{};
+
+  // Versioning
+  int serverVersion[4] = {0, 0, 0, 0};
+
+  // Every protocol the server has announced, never removed, and the
+  // current one, switched on NAT_SERVERINFO. Readers load the version
+  // and its decoders together, so a frame is always reported under the
+  // version that decoded it.
+  std::deque<sProtocol> protocols{
+      sProtocol{2, 10, SelectFrameDecoder(2, 10), SelectModelDefDecoder(2, 10)}};
+  std::atomic<const sProtocol *> protocol{&protocols.front()};
+
+  // Latest data descriptions, refreshed when the tracked models change
+  ModelDefCache modelDefCache;
+
+  // What the outputs below read of a frame; the rest is not decoded.
+  // Fixed before the first packet arrives.
+  FrameSubscription subscription;
+
+  // Rigid bodies published on ROS, from ~rigid_bodies
+  FrameSubscription publishedBodies;
+
+  // ROS publishers, one per rigid body
+  std::unique_ptr<RigidBodyPublishers> publishers;
+
+  // Extrapolates poses to the publish instant, when ~predict is set
+  std::unique_ptr<PosePredictor> predictor;
+
+  // Decoded frames for local readers, when ~frame_bus is set
+  FrameBusWriter frameBus;
+
+  // Raw datagrams of both sockets, if capturing
+  CaptureWriter capture;
+
+  // Decoded frames and data descriptions, if recording a take
+  TakeWriter take;
+
+  // Stage latencies of published frames
+  LatencyStats latency;
+
+  // Gaps, duplicates and reordering of the data stream's frame numbers
+  FrameContinuity continuity;
+
+  // Outstanding NAT_REQUEST commands, completed by their responses
+  CommandClient commands;
+
+  // Receive, decode and publish stages, without an event loop
+  std::unique_ptr<PacketPipeline> pipeline;
+
+  // Command listener thread runs while set
+  std::atomic<bool> commandListening{false};
+  pthread_t commandThread{};
+
+  // Data path counters of the event loop, which has no pipeline
+  sPipelineStats eventLoopStats{};
+
+  // Too large for the stack; each is used by one thread at a time
+  std::unique_ptr<sPacket> commandPacket{new sPacket()};
+  std::unique_ptr<sPacketSlot> eventLoopSlot{new sPacketSlot()};
+};
+
+std::vector<std::unique_ptr<sConnection>> gConnections;
+
+// Datagrams read from the data socket per event loop wakeup; the rest
+// wait for the next one so commands and timers are not starved
+#define EVENT_LOOP_DATA_BUDGET 64
+
+// Set while every socket is served by one event loop thread
+EventLoop *gEventLoop = nullptr;
+
+// Set by PacketClientStop to end a run without a console
+std::atomic<bool> gStopRequested(false);
+
+// Receive mode, for the latency report
+bool gSpinReceive = false;
+
+// Granularity of command timeouts
+#define COMMAND_POLL_MS 10
+
+bool RequestModelDef(sConnection *conn);
+static bool ReceiveCommandPacket(sConnection *conn, int flags);
 
 // ============================== Data mode ================================ //
 // Funtion that assigns a time code values to 5 variables passed as arguments
@@ -170,824 +237,647 @@ void DecodeMarkerID(int sourceID, int *pOutEntityID, int *pOutMemberID) {
     *pOutMemberID = sourceID & 0x0000ffff;
 }
 
-// *********************************************************************
-//
-//  Unpack Data:
-//      Recieves pointer to bytes that represent a packet of data
-//
-//      There are lots of print statements that show what
-//      data is being stored
-//
-//      Most memcpy functions will assign the data to a variable.
-//      Use this variable at your discretion.
-//      Variables created for storing data do not exceed the
-//      scope of this function.
-//
-// *********************************************************************
-void Unpack(char *pData) {
-  // Checks for NatNet Version number. Used later in function.
-  // Packets may be different depending on NatNet version.
-  int major = NatNetVersion[0];
-  int minor = NatNetVersion[1];
-
-  char *ptr = pData;
-
-  // -----ROS publshing--------
-
+// Lines of a frame dump or of the data descriptions; the caller admits
+// each dump as a whole against its rate limit
+#define FRAME_PRINTF(...) \
+  LogAppend(LOG_LEVEL_DEBUG, LOG_CLASS_FRAME, __VA_ARGS__)
+#define MODELDEF_PRINTF(...) \
+  LogAppend(LOG_LEVEL_INFO, LOG_CLASS_MODELDEF, __VA_ARGS__)
+
+// Print every field of a decoded frame
+void PrintFrameOfMocapData(const FrameOfMocapData &frame,
+                           int major,
+                           int minor) {
+  FRAME_PRINTF("Frame # : %d\n", frame.iFrame);
+
+  FRAME_PRINTF("Marker Set Count : %d\n", frame.MarkerSetCount());
+  for (int i = 0; i < frame.MarkerSetCount(); i++) {
+    FRAME_PRINTF("Model Name: %s\n", frame.MarkerSetName(i));
+    FRAME_PRINTF("Marker Count : %d\n", frame.MarkerSetMarkerCount(i));
+    for (int j = 0; j < frame.MarkerSetMarkerCount(i); j++) {
+      sMarker marker = frame.MarkerSetMarker(i, j);
+      FRAME_PRINTF("\tMarker %d : [x=%3.2f,y=%3.2f,z=%3.2f]\n",
+                   j, marker.x, marker.y, marker.z);
+    }
+  }
 
-  pose.header.stamp = ros::Time::now();
+  FRAME_PRINTF("Rigid Body Count : %d\n", frame.RigidBodyCount());
+  for (int j = 0; j < frame.RigidBodyCount(); j++) {
+    sRigidBodyData rb = frame.RigidBody(j);
+    FRAME_PRINTF("ID : %d\n", rb.ID);
+    FRAME_PRINTF("pos: [%3.2f,%3.2f,%3.2f]\n", rb.x, rb.y, rb.z);
+    FRAME_PRINTF("ori: [%3.2f,%3.2f,%3.2f,%3.2f]\n",
+                 rb.qx, rb.qy, rb.qz, rb.qw);
 
-  pose.header.frame_id="map";
+    // Before NatNet 3.0, marker data was here
+    if (major < 3) {
+      FRAME_PRINTF("Marker Count: %d\n", frame.RigidBodyMarkerCount(j));
+      for (int k = 0; k < frame.RigidBodyMarkerCount(j); k++) {
+        sMarker marker = frame.RigidBodyMarker(j, k);
+        if (major >= 2) {
+          FRAME_PRINTF("\tMarker %d: id=%d\tsize=%3.1f"
+                       "\tpos=[%3.2f,%3.2f,%3.2f]\n",
+                       k,
+                       frame.RigidBodyMarkerID(j, k),
+                       frame.RigidBodyMarkerSize(j, k),
+                       marker.x, marker.y, marker.z);
+        } else {
+          FRAME_PRINTF("\tMarker %d: pos = [%3.2f,%3.2f,%3.2f]\n", k,
+                       marker.x, marker.y, marker.z);
+        }
+      }
+    }
 
-  
-  //----------------------
+    // NatNet version 2.0 and later
+    if (major >= 2)
+      FRAME_PRINTF("Mean marker error: %3.2f\n", rb.MeanError);
 
-  printf("Begin Packet\n-------\n");
+    // NatNet version 2.6 and later
+    if (((major == 2) && (minor >= 6)) || (major > 2)) {
+      if (rb.TrackingValid()) {
+        FRAME_PRINTF("Tracking Valid: True\n");
+      } else {
+        FRAME_PRINTF("Tracking Valid: False\n");
+      }
+    }
+  }
 
-  // First 2 Bytes is message ID
-  int MessageID = 0;
-  memcpy(&MessageID, ptr, 2);
-  ptr += 2;
-  printf("Message ID : %d\n", MessageID);
+  // Skeletons (NatNet version 2.1 and later)
+  if (((major == 2) && (minor > 0)) || (major > 2))
+    FRAME_PRINTF("Skeleton Count : %d\n", frame.SkeletonCount());
+  for (int s = 0; s < frame.SkeletonCount(); s++) {
+    FRAME_PRINTF("Rigid Body Count : %d\n", frame.SkeletonBoneCount(s));
+    for (int b = 0; b < frame.SkeletonBoneCount(s); b++) {
+      sRigidBodyData bone = frame.SkeletonBone(s, b);
+      FRAME_PRINTF("ID : %d\n", bone.ID);
+      FRAME_PRINTF("pos: [%3.2f,%3.2f,%3.2f]\n", bone.x, bone.y, bone.z);
+      FRAME_PRINTF("ori: [%3.2f,%3.2f,%3.2f,%3.2f]\n",
+                   bone.qx, bone.qy, bone.qz, bone.qw);
+      if (major >= 2)
+        FRAME_PRINTF("Mean marker error: %3.2f\n", bone.MeanError);
+    }
+  }
 
-  // Second 2 Bytes is the size of the packet
-  int nBytes = 0;
-  memcpy(&nBytes, ptr, 2);
-  ptr += 2;
-  printf("Byte count : %d\n", nBytes);
+  // labeled markers (NatNet version 2.3 and later)
+  if (((major == 2) && (minor >= 3)) || (major > 2)) {
+    FRAME_PRINTF("Labeled Marker Count : %d\n", frame.LabeledMarkerCount());
+    for (int j = 0; j < frame.LabeledMarkerCount(); j++) {
+      sLabeledMarker marker = frame.LabeledMarker(j);
+      int modelID, markerID;
+      DecodeMarkerID(marker.ID, &modelID, &markerID);
+      FRAME_PRINTF("ID  : [MarkerID: %d] [ModelID: %d]\n",
+                   markerID, modelID);
+      FRAME_PRINTF("pos : [%3.2f,%3.2f,%3.2f]\n",
+                   marker.x, marker.y, marker.z);
+      FRAME_PRINTF("size: [%3.2f]\n", marker.size);
+      FRAME_PRINTF("err:  [%3.2f]\n", marker.residual);
+    }
+  }
 
-  if (MessageID == 7)      // FRAME OF MOCAP DATA packet
-  {
-    // Next 4 Bytes is the frame number
-    int frameNumber = 0;
-    memcpy(&frameNumber, ptr, 4);
-    ptr += 4;
-    printf("Frame # : %d\n", frameNumber);
-
-    // Next 4 Bytes is the number of data sets (markersets, rigidbodies, etc)
-    int nMarkerSets = 0;
-    memcpy(&nMarkerSets, ptr, 4);
-    ptr += 4;
-    printf("Marker Set Count : %d\n", nMarkerSets);
-
-    // Loop through number of marker sets and get name and data
-    for (int i = 0; i < nMarkerSets; i++) {
-      // Markerset name
-      char szName[256];
-      strcpy(szName, ptr);
-      int nDataBytes = (int) strlen(szName) + 1;
-      ptr += nDataBytes;
-      printf("Model Name: %s\n", szName);
-
-      // marker data
-      int nMarkers = 0;
-      memcpy(&nMarkers, ptr, 4);
-      ptr += 4;
-      printf("Marker Count : %d\n", nMarkers);
-
-      for (int j = 0; j < nMarkers; j++) {
-        float x = 0;
-        memcpy(&x, ptr, 4);
-        ptr += 4;
-        float y = 0;
-        memcpy(&y, ptr, 4);
-        ptr += 4;
-        float z = 0;
-        memcpy(&z, ptr, 4);
-        ptr += 4;
-        printf("\tMarker %d : [x=%3.2f,y=%3.2f,z=%3.2f]\n", j, x, y, z);
-      }
+  for (int i = 0; i < frame.ForcePlateCount(); i++) {
+    FRAME_PRINTF("Force Plate : %d\n", frame.ForcePlateID(i));
+    for (int c = 0; c < frame.ForcePlateChannelCount(i); c++) {
+      // One message per channel line
+      char szLine[LOG_MESSAGE_SIZE];
+      int n = snprintf(szLine, sizeof(szLine), " Channel %d : ", c);
+      for (int f = 0; f < frame.ForcePlateFrameCount(i, c) &&
+          n < (int) sizeof(szLine); f++)
+        n += snprintf(szLine + n, sizeof(szLine) - n, "%3.2f   ",
+                      frame.ForcePlateValue(i, c, f));
+      FRAME_PRINTF("%s\n", szLine);
     }
+  }
 
-    // Loop through unlabeled markers
-    int nOtherMarkers = 0;
-    memcpy(&nOtherMarkers, ptr, 4);
-    ptr += 4;
-    // OtherMarker list is Deprecated
-    //printf("Unidentified Marker Count : %d\n", nOtherMarkers);
-    for (int j = 0; j < nOtherMarkers; j++) {
-      float x = 0.0f;
-      memcpy(&x, ptr, 4);
-      ptr += 4;
-      float y = 0.0f;
-      memcpy(&y, ptr, 4);
-      ptr += 4;
-      float z = 0.0f;
-      memcpy(&z, ptr, 4);
-      ptr += 4;
-
-      // Deprecated
-      //printf("\tMarker %d : pos = [%3.2f,%3.2f,%3.2f]\n",j,x,y,z);
+  for (int i = 0; i < frame.DeviceCount(); i++) {
+    FRAME_PRINTF("Device : %d\n", frame.DeviceID(i));
+    for (int c = 0; c < frame.DeviceChannelCount(i); c++) {
+      // One message per channel line
+      char szLine[LOG_MESSAGE_SIZE];
+      int n = snprintf(szLine, sizeof(szLine), " Channel %d : ", c);
+      for (int f = 0; f < frame.DeviceFrameCount(i, c) &&
+          n < (int) sizeof(szLine); f++)
+        n += snprintf(szLine + n, sizeof(szLine) - n, "%3.2f   ",
+                      frame.DeviceValue(i, c, f));
+      FRAME_PRINTF("%s\n", szLine);
     }
+  }
 
-    // Loop through rigidbodies
-    int nRigidBodies = 0;
-    memcpy(&nRigidBodies, ptr, 4);
-    ptr += 4;
-    printf("Rigid Body Count : %d\n", nRigidBodies);
-    for (int j = 0; j < nRigidBodies; j++) {
-      // Rigid body position and orientation
-      int ID = 0;
-      memcpy(&ID, ptr, 4);
-      ptr += 4;
-      float x = 0.0f;
-      memcpy(&x, ptr, 4);
-      ptr += 4;
-      float y = 0.0f;
-      memcpy(&y, ptr, 4);
-      ptr += 4;
-      float z = 0.0f;
-      memcpy(&z, ptr, 4);
-      ptr += 4;
-      float qx = 0;
-      memcpy(&qx, ptr, 4);
-      ptr += 4;
-      float qy = 0;
-      memcpy(&qy, ptr, 4);
-      ptr += 4;
-      float qz = 0;
-      memcpy(&qz, ptr, 4);
-      ptr += 4;
-      float qw = 0;
-      memcpy(&qw, ptr, 4);
-      ptr += 4;
-      printf("ID : %d\n", ID);
-      printf("pos: [%3.2f,%3.2f,%3.2f]\n", x, y, z);
-      printf("ori: [%3.2f,%3.2f,%3.2f,%3.2f]\n", qx, qy, qz, qw);
-
-      // this publishing location will work for only 1 rigid body (with z-axis up in motive)
-      pose.pose.position.x=x;
-      pose.pose.position.y=y;
-      pose.pose.position.z=z;
-
-      pose.pose.orientation.x = qx;
-      pose.pose.orientation.y = qy;
-      pose.pose.orientation.z = qz;
-      pose.pose.orientation.w = qw;
-
-      pub.publish(pose);
-          
-          //printf("test",1);
-     // printf("test\n--\n");
-
-      // Before NatNet 3.0, marker data was here
-      if (major < 3) {
-        // associated marker positions
-        int nRigidMarkers = 0;
-        memcpy(&nRigidMarkers, ptr, 4);
-        ptr += 4;
-        printf("Marker Count: %d\n", nRigidMarkers);
-        int nBytes = nRigidMarkers * 3 * sizeof(float);
-        float *markerData = (float *) malloc(nBytes);
-        memcpy(markerData, ptr, nBytes);
-        ptr += nBytes;
+  // software latency (removed in version 3.0)
+  if (major < 3)
+    FRAME_PRINTF("software latency : %3.3f\n", frame.fLatency);
 
-        if (major >= 2) {
-          // associated marker IDs
-          nBytes = nRigidMarkers * sizeof(int);
-          int *markerIDs = (int *) malloc(nBytes);
-          memcpy(markerIDs, ptr, nBytes);
-          ptr += nBytes;
-
-          // associated marker sizes
-          nBytes = nRigidMarkers * sizeof(float);
-          float *markerSizes = (float *) malloc(nBytes);
-          memcpy(markerSizes, ptr, nBytes);
-          ptr += nBytes;
-
-          for (int k = 0; k < nRigidMarkers; k++) {
-            printf("\tMarker %d: id=%d\tsize=%3.1f\tpos=[%3.2f,%3.2f,%3.2f]\n",
-                   k,
-                   markerIDs[k],
-                   markerSizes[k],
-                   markerData[k * 3],
-                   markerData[k * 3 + 1],
-                   markerData[k * 3 + 2]);
-          }
+  FRAME_PRINTF("Timestamp : %3.3f\n", frame.fTimestamp);
 
-          if (markerIDs)
-            free(markerIDs);
-          if (markerSizes)
-            free(markerSizes);
+  // high res timestamps (version 3.0 and later)
+  if (major >= 3) {
+    FRAME_PRINTF("Mid-exposure timestamp : %" PRIu64 "\n",
+                 frame.CameraMidExposureTimestamp);
+    FRAME_PRINTF("Camera data received timestamp : %" PRIu64 "\n",
+                 frame.CameraDataReceivedTimestamp);
+    FRAME_PRINTF("Transmit timestamp : %" PRIu64 "\n",
+                 frame.TransmitTimestamp);
+  }
+}
 
-        } else {
-          for (int k = 0; k < nRigidMarkers; k++) {
-            printf("\tMarker %d: pos = [%3.2f,%3.2f,%3.2f]\n", k,
-                   markerData[k * 3], markerData[k * 3 + 1],
-                   markerData[k * 3 + 2]);
-          }
-        }
-        if (markerData)
-          free(markerData);
-      }
+// Print rigid body or skeleton bone description
+static void PrintRigidBodyDescription(const sRigidBodyDescription &rb,
+                                      bool bBone) {
+  if (!rb.szName.empty())
+    MODELDEF_PRINTF(bBone ? "Rigid Body Name: %s\n" : "Name: %s\n",
+                    rb.szName.c_str());
+  MODELDEF_PRINTF(bBone ? "RigidBody ID : %d\n" : "ID : %d\n", rb.ID);
+  MODELDEF_PRINTF("Parent ID : %d\n", rb.parentID);
+  MODELDEF_PRINTF("X Offset : %3.2f\n", rb.offsetx);
+  MODELDEF_PRINTF("Y Offset : %3.2f\n", rb.offsety);
+  MODELDEF_PRINTF("Z Offset : %3.2f\n", rb.offsetz);
+
+  for (size_t markerIdx = 0; markerIdx < rb.markerPositions.size();
+       ++markerIdx) {
+    const sMarker &markerPosition = rb.markerPositions[markerIdx];
+    const int markerRequiredLabel = rb.markerRequiredLabels[markerIdx];
+
+    MODELDEF_PRINTF("\tMarker #%zu:\n", markerIdx);
+    MODELDEF_PRINTF("\t\tPosition: %.2f, %.2f, %.2f\n",
+                    markerPosition.x, markerPosition.y, markerPosition.z);
+
+    if (markerRequiredLabel != 0) {
+      MODELDEF_PRINTF("\t\tRequired active label: %d\n",
+                      markerRequiredLabel);
+    }
+  }
+}
 
-      // NatNet version 2.0 and later
-      if (major >= 2) {
-        // Mean marker error
-        float fError = 0.0f;
-        memcpy(&fError, ptr, 4);
-        ptr += 4;
-        printf("Mean marker error: %3.2f\n", fError);
-      }
+// Print every decoded data description
+void PrintDataDescriptions(const sDataDescriptions &descriptions) {
+  MODELDEF_PRINTF("Dataset Count : %zu\n",
+                  descriptions.markerSets.size() +
+                      descriptions.rigidBodies.size() +
+                      descriptions.skeletons.size() +
+                      descriptions.forcePlates.size() +
+                      descriptions.devices.size());
+
+  for (const sMarkerSetDescription &markerSet : descriptions.markerSets) {
+    MODELDEF_PRINTF("Markerset Name: %s\n", markerSet.szName.c_str());
+    MODELDEF_PRINTF("Marker Count : %zu\n", markerSet.markerNames.size());
+    for (const std::string &name : markerSet.markerNames)
+      MODELDEF_PRINTF("Marker Name: %s\n", name.c_str());
+  }
 
-      // NatNet version 2.6 and later
-      if (((major == 2) && (minor >= 6)) || (major > 2)) {
-        // params
-        short params = 0;
-        memcpy(&params, ptr, 2);
-        ptr += 2;
-        // 0x01 : rigid body was successfully tracked in this frame
-        bool bTrackingValid = params & 0x01;
-        if (bTrackingValid) {
-          printf("Tracking Valid: True\n");
-        } else {
-          printf("Tracking Valid: False\n");
-        }
-      }
+  for (const sRigidBodyDescription &rb : descriptions.rigidBodies)
+    PrintRigidBodyDescription(rb, false);
 
-    } // Go to next rigid body
-
-
-    // Skeletons (NatNet version 2.1 and later)
-    if (((major == 2) && (minor > 0)) || (major > 2)) {
-      int nSkeletons = 0;
-      memcpy(&nSkeletons, ptr, 4);
-      ptr += 4;
-      printf("Skeleton Count : %d\n", nSkeletons);
-
-      // Loop through skeletons
-      for (int j = 0; j < nSkeletons; j++) {
-        // skeleton id
-        int skeletonID = 0;
-        memcpy(&skeletonID, ptr, 4);
-        ptr += 4;
-
-        // Number of rigid bodies (bones) in skeleton
-        int nRigidBodies = 0;
-        memcpy(&nRigidBodies, ptr, 4);
-        ptr += 4;
-        printf("Rigid Body Count : %d\n", nRigidBodies);
-
-        // Loop through rigid bodies (bones) in skeleton
-        for (int j = 0; j < nRigidBodies; j++) {
-          // Rigid body position and orientation
-          int ID = 0;
-          memcpy(&ID, ptr, 4);
-          ptr += 4;
-          float x = 0.0f;
-          memcpy(&x, ptr, 4);
-          ptr += 4;
-          float y = 0.0f;
-          memcpy(&y, ptr, 4);
-          ptr += 4;
-          float z = 0.0f;
-          memcpy(&z, ptr, 4);
-          ptr += 4;
-          float qx = 0;
-          memcpy(&qx, ptr, 4);
-          ptr += 4;
-          float qy = 0;
-          memcpy(&qy, ptr, 4);
-          ptr += 4;
-          float qz = 0;
-          memcpy(&qz, ptr, 4);
-          ptr += 4;
-          float qw = 0;
-          memcpy(&qw, ptr, 4);
-          ptr += 4;
-          printf("ID : %d\n", ID);
-          printf("pos: [%3.2f,%3.2f,%3.2f]\n", x, y, z);
-          printf("ori: [%3.2f,%3.2f,%3.2f,%3.2f]\n", qx, qy, qz, qw);
-
-          
-
-          // Before NatNet 3.0, marker data was here
-          if (major < 3) {
-            // associated marker positions
-            int nRigidMarkers = 0;
-            memcpy(&nRigidMarkers, ptr, 4);
-            ptr += 4;
-            printf("Marker Count: %d\n", nRigidMarkers);
-            int nBytes = nRigidMarkers * 3 * sizeof(float);
-            float *markerData = (float *) malloc(nBytes);
-            memcpy(markerData, ptr, nBytes);
-            ptr += nBytes;
-
-            if (major >= 2) {
-              // associated marker IDs
-              nBytes = nRigidMarkers * sizeof(int);
-              int *markerIDs = (int *) malloc(nBytes);
-              memcpy(markerIDs, ptr, nBytes);
-              ptr += nBytes;
-
-              // associated marker sizes
-              nBytes = nRigidMarkers * sizeof(float);
-              float *markerSizes = (float *) malloc(nBytes);
-              memcpy(markerSizes, ptr, nBytes);
-              ptr += nBytes;
-
-              for (int k = 0; k < nRigidMarkers; k++) {
-                printf("\tMarker %d: id=%d\tsize=%3.1f\tpos=[%3.2f,%3.2f,%3.2f]\n",
-                       k,
-                       markerIDs[k],
-                       markerSizes[k],
-                       markerData[k * 3],
-                       markerData[k * 3 + 1],
-                       markerData[k * 3 + 2]);
-              }
-
-              if (markerIDs)
-                free(markerIDs);
-              if (markerSizes)
-                free(markerSizes);
-
-            } else {
-              for (int k = 0; k < nRigidMarkers; k++) {
-                printf("\tMarker %d: pos = [%3.2f,%3.2f,%3.2f]\n", k,
-                       markerData[k * 3], markerData[k * 3 + 1],
-                       markerData[k * 3 + 2]);
-              }
-            }
-            if (markerData)
-              free(markerData);
-          }
+  for (const sSkeletonDescription &skeleton : descriptions.skeletons) {
+    MODELDEF_PRINTF("Name: %s\n", skeleton.szName.c_str());
+    MODELDEF_PRINTF("ID : %d\n", skeleton.skeletonID);
+    MODELDEF_PRINTF("RigidBody (Bone) Count : %zu\n", skeleton.bones.size());
+    for (const sRigidBodyDescription &bone : skeleton.bones)
+      PrintRigidBodyDescription(bone, true);
+  }
 
-          // Mean marker error (NatNet version 2.0 and later)
-          if (major >= 2) {
-            float fError = 0.0f;
-            memcpy(&fError, ptr, 4);
-            ptr += 4;
-            printf("Mean marker error: %3.2f\n", fError);
-          }
+  for (const sForcePlateDescription &plate : descriptions.forcePlates) {
+    MODELDEF_PRINTF("Force Plate ID : %d\n", plate.ID);
+    MODELDEF_PRINTF("Serial : %s\n", plate.serialNo.c_str());
+    MODELDEF_PRINTF("Channel Count : %zu\n", plate.channelNames.size());
+  }
 
-          // Tracking flags (NatNet version 2.6 and later)
-          if (((major == 2) && (minor >= 6)) || (major > 2)) {
-            // params
-            short params = 0;
-            memcpy(&params, ptr, 2);
-            ptr += 2;
-            // 0x01 : rigid body was successfully tracked in this frame
-            bool bTrackingValid = params & 0x01;
-          }
+  for (const sDeviceDescription &device : descriptions.devices) {
+    MODELDEF_PRINTF("Device Name : %s\n", device.szName.c_str());
+    MODELDEF_PRINTF("Device ID : %d\n", device.ID);
+    MODELDEF_PRINTF("Channel Count : %zu\n", device.channelNames.size());
+  }
+}
 
-        } // next rigid body
+// Capture time of a frame on the server clock, and its age at nowNs
+// (CLOCK_REALTIME): from mid-exposure once the clock offset is known,
+// else from the datagram's arrival, if that is known
+static void FrameAge(const sConnection *conn, const FrameOfMocapData &frame,
+                     const timespec *arrival, int64_t nowNs,
+                     double *sampleTime, double *age) {
+  *sampleTime = frame.fTimestamp;
+  *age = 0.0;
+  int64_t exposureNs;
+  if (frame.CameraMidExposureTimestamp != 0 &&
+      conn->latency.TicksToSeconds(frame.CameraMidExposureTimestamp,
+                                   sampleTime) &&
+      conn->latency.TicksToClientNs(frame.CameraMidExposureTimestamp,
+                                    &exposureNs)) {
+    *age = (nowNs - exposureNs) * 1e-9;
+  } else if (arrival != nullptr) {
+    *age = (nowNs - ((int64_t) arrival->tv_sec * 1000000000LL +
+        arrival->tv_nsec)) * 1e-9;
+  }
+}
 
-      } // next skeleton
-    }
+// Print a decoded frame and publish its rigid bodies; arrival is the
+// kernel receive time, or nullptr if unknown
+void PublishFrameOfMocapData(sConnection *conn,
+                             const FrameOfMocapData &frame,
+                             const timespec *arrival,
+                             int major,
+                             int minor,
+                             bool bPrint) {
+  if (bPrint) {
+    if (gConnections.size() > 1)
+      FRAME_PRINTF("Source : %s\n", conn->source.c_str());
+    PrintFrameOfMocapData(frame, major, minor);
+  }
 
-    // labeled markers (NatNet version 2.3 and later)
-    if (((major == 2) && (minor >= 3)) || (major > 2)) {
-      int nLabeledMarkers = 0;
-      memcpy(&nLabeledMarkers, ptr, 4);
-      ptr += 4;
-      printf("Labeled Marker Count : %d\n", nLabeledMarkers);
-
-      // Loop through labeled markers
-      for (int j = 0; j < nLabeledMarkers; j++) {
-        // id
-        // Marker ID Scheme:
-        // Active Markers:
-        //   ID = ActiveID, correlates to RB ActiveLabels list
-        // Passive Markers:
-        //   If Asset with Legacy Labels
-        //      AssetID 	(Hi Word)
-        //      MemberID	(Lo Word)
-        //   Else
-        //      PointCloud ID
-        int ID = 0;
-        memcpy(&ID, ptr, 4);
-        ptr += 4;
-        int modelID, markerID;
-        DecodeMarkerID(ID, &modelID, &markerID);
-
-
-        // x
-        float x = 0.0f;
-        memcpy(&x, ptr, 4);
-        ptr += 4;
-        // y
-        float y = 0.0f;
-        memcpy(&y, ptr, 4);
-        ptr += 4;
-        // z
-        float z = 0.0f;
-        memcpy(&z, ptr, 4);
-        ptr += 4;
-        // size
-        float size = 0.0f;
-        memcpy(&size, ptr, 4);
-        ptr += 4;
-
-        // NatNet version 2.6 and later
-        if (((major == 2) && (minor >= 6)) || (major > 2)) {
-          // marker params
-          short params = 0;
-          memcpy(&params, ptr, 2);
-          ptr += 2;
-          // marker was not visible (occluded) in this frame
-          bool bOccluded = (params & 0x01) != 0;
-          // position provided by point cloud solve
-          bool bPCSolved = (params & 0x02) != 0;
-          // position provided by model solve
-          bool bModelSolved = (params & 0x04) != 0;
-          if (major >= 3) {
-            // marker has an associated model
-            bool bHasModel = (params & 0x08) != 0;
-            // marker is an unlabeled marker
-            bool bUnlabeled = (params & 0x10) != 0;
-            // marker is an active marker
-            bool bActiveMarker = (params & 0x20) != 0;
-          }
+  // Models were added, removed or renamed in Motive. A replay has no
+  // server to ask; its capture holds the descriptions Motive sent.
+  if (conn->commandSocket != -1 && conn->modelDefCache.NeedsRefresh(frame))
+    RequestModelDef(conn);
 
-        }
+  // -----ROS publshing--------
+  // (with z-axis up in motive)
+  ros::Time stamp = ros::Time::now();
+  double sampleTime = 0.0, age = 0.0;
+  if (conn->predictor) {
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    FrameAge(conn, frame, arrival,
+             (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec,
+             &sampleTime, &age);
+  }
+  for (int j = 0; j < frame.RigidBodyCount(); j++) {
+    sRigidBodyData rb = frame.RigidBody(j);
+    if (!conn->publishedBodies.WantsRigidBody(rb.ID))
+      continue;
+    MetricsRigidBody(conn->index, j, rb.ID, rb.TrackingValid());
+    // Where the body is at the stamp rather than at exposure
+    if (conn->predictor)
+      conn->predictor->Predict(rb, sampleTime, age, &rb);
+    conn->publishers->Publish(rb, stamp);
+  }
+  //----------------------
 
-        // NatNet version 3.0 and later
-        float residual = 0.0f;
-        if (major >= 3) {
-          // Marker residual
-          memcpy(&residual, ptr, 4);
-          ptr += 4;
-        }
+  conn->frameBus.Publish(frame);
+  if (conn->take.IsOpen())
+    conn->take.Write(frame);
+}
 
-        printf("ID  : [MarkerID: %d] [ModelID: %d]\n", markerID, modelID);
-        printf("pos : [%3.2f,%3.2f,%3.2f]\n", x, y, z);
-        printf("size: [%3.2f]\n", size);
-        printf("err:  [%3.2f]\n", residual);
-      }
-    }
+// *********************************************************************
+//
+//  Unpack Data:
+//      Recieves pointer to bytes that represent a packet of data
+//      and the number of bytes received
+//
+//      Frames of mocap data are indexed by DecodeFrameOfMocapData()
+//      without copying; values are read from the packet through the
+//      FrameOfMocapData accessors.
+//
+//      There are lots of print statements that show what
+//      data is being stored
+//
+// *********************************************************************
+void Unpack(sConnection *conn, const char *pData, size_t nReceived) {
+  // Checks for NatNet Version number. Used later in function.
+  // Packets may be different depending on NatNet version.
+  const sProtocol *protocol = conn->protocol.load(std::memory_order_acquire);
+  int major = protocol->major;
+  int minor = protocol->minor;
 
-    // Force Plate data (NatNet version 2.9 and later)
-    if (((major == 2) && (minor >= 9)) || (major > 2)) {
-      int nForcePlates;
-      memcpy(&nForcePlates, ptr, 4);
-      ptr += 4;
-      for (int iForcePlate = 0; iForcePlate < nForcePlates; iForcePlate++) {
-        // ID
-        int ID = 0;
-        memcpy(&ID, ptr, 4);
-        ptr += 4;
-        printf("Force Plate : %d\n", ID);
-
-        // Channel Count
-        int nChannels = 0;
-        memcpy(&nChannels, ptr, 4);
-        ptr += 4;
-
-        // Channel Data
-        for (int i = 0; i < nChannels; i++) {
-          printf(" Channel %d : ", i);
-          int nFrames = 0;
-          memcpy(&nFrames, ptr, 4);
-          ptr += 4;
-          for (int j = 0; j < nFrames; j++) {
-            float val = 0.0f;
-            memcpy(&val, ptr, 4);
-            ptr += 4;
-            printf("%3.2f   ", val);
-          }
-          printf("\n");
-        }
-      }
-    }
+  const char *ptr = pData;
 
-    // Device data (NatNet version 3.0 and later)
-    if (((major == 2) && (minor >= 11)) || (major > 2)) {
-      int nDevices;
-      memcpy(&nDevices, ptr, 4);
-      ptr += 4;
-      for (int iDevice = 0; iDevice < nDevices; iDevice++) {
-        // ID
-        int ID = 0;
-        memcpy(&ID, ptr, 4);
-        ptr += 4;
-        printf("Device : %d\n", ID);
-
-        // Channel Count
-        int nChannels = 0;
-        memcpy(&nChannels, ptr, 4);
-        ptr += 4;
-
-        // Channel Data
-        for (int i = 0; i < nChannels; i++) {
-          printf(" Channel %d : ", i);
-          int nFrames = 0;
-          memcpy(&nFrames, ptr, 4);
-          ptr += 4;
-          for (int j = 0; j < nFrames; j++) {
-            float val = 0.0f;
-            memcpy(&val, ptr, 4);
-            ptr += 4;
-            printf("%3.2f   ", val);
-          }
-          printf("\n");
-        }
-      }
-    }
+  // First 2 Bytes is message ID
+  int MessageID = 0;
+  memcpy(&MessageID, ptr, 2);
+  ptr += 2;
 
-    // software latency (removed in version 3.0)
-    if (major < 3) {
-      float softwareLatency = 0.0f;
-      memcpy(&softwareLatency, ptr, 4);
-      ptr += 4;
-      printf("software latency : %3.3f\n", softwareLatency);
-    }
+  // Second 2 Bytes is the size of the packet
+  int nBytes = 0;
+  memcpy(&nBytes, ptr, 2);
+  ptr += 2;
 
-    // timecode
-    unsigned int timecode = 0;
-    memcpy(&timecode, ptr, 4);
-    ptr += 4;
-    unsigned int timecodeSub = 0;
-    memcpy(&timecodeSub, ptr, 4);
-    ptr += 4;
-    char szTimecode[128] = "";
-    TimecodeStringify(timecode, timecodeSub, szTimecode, 128);
-
-    // timestamp
-    double timestamp = 0.0f;
-
-    // NatNet version 2.7 and later - increased from single to double precision
-    if (((major == 2) && (minor >= 7)) || (major > 2)) {
-      memcpy(&timestamp, ptr, 8);
-      ptr += 8;
-    } else {
-      float fTemp = 0.0f;
-      memcpy(&fTemp, ptr, 4);
-      ptr += 4;
-      timestamp = (double) fTemp;
-    }
-    printf("Timestamp : %3.3f\n", timestamp);
-
-    // high res timestamps (version 3.0 and later)
-    if (major >= 3) {
-      uint64_t cameraMidExposureTimestamp = 0;
-      memcpy(&cameraMidExposureTimestamp, ptr, 8);
-      ptr += 8;
-      printf("Mid-exposure timestamp : %" PRIu64 "\n",
-             cameraMidExposureTimestamp);
-
-      uint64_t cameraDataReceivedTimestamp = 0;
-      memcpy(&cameraDataReceivedTimestamp, ptr, 8);
-      ptr += 8;
-      printf("Camera data received timestamp : %" PRIu64 "\n",
-             cameraDataReceivedTimestamp);
-
-      uint64_t transmitTimestamp = 0;
-      memcpy(&transmitTimestamp, ptr, 8);
-      ptr += 8;
-      printf("Transmit timestamp : %" PRIu64 "\n", transmitTimestamp);
-    }
+  // Frames are dumped at debug level, descriptions at info level
+  int level = MessageID == 7 ? LOG_LEVEL_DEBUG : LOG_LEVEL_INFO;
+  eLogClass cls = MessageID == 7 ? LOG_CLASS_FRAME : LOG_CLASS_MODELDEF;
+  bool bPrint = LOG_ENABLED(level) && LogAdmit(cls);
+  if (bPrint) {
+    LogAppend(level, cls, "Begin Packet\n-------\n");
+    LogAppend(level, cls, "Message ID : %d\n", MessageID);
+    LogAppend(level, cls, "Byte count : %d\n", nBytes);
+  }
 
-    // frame params
-    short params = 0;
-    memcpy(&params, ptr, 2);
-    ptr += 2;
-    // 0x01 Motive is recording
-    bool bIsRecording = (params & 0x01) != 0;
-    // 0x02 Actively tracked model list has changed
-    bool bTrackedModelsChanged = (params & 0x02) != 0;
+  if (MessageID == 7)      // FRAME OF MOCAP DATA packet
+  {
+    // Each thread decodes into its own frame, reusing its index storage
+    static thread_local FrameOfMocapData frame;
+    frame.SetSubscription(&conn->subscription);
+    FrameDecoder decoder = protocol->frameDecoder;
+    if (decoder == nullptr || !decoder(pData, nReceived, &frame)) {
+      LOG_WARN(LOG_CLASS_CLIENT, "[%s] Malformed frame of data (%zu bytes)\n",
+               conn->source.c_str(), nReceived);
+      return;
+    }
 
+    PublishFrameOfMocapData(conn, frame, nullptr, major, minor, bPrint);
 
-    // end of data tag
-    int eod = 0;
-    memcpy(&eod, ptr, 4);
-    ptr += 4;
-    printf("End Packet\n-------------\n");
+    if (bPrint)
+      LogAppend(level, cls, "End Packet\n-------------\n");
 
   } else if (MessageID == 5) // Data Descriptions
   {
-    // number of datasets
-    int nDatasets = 0;
-    memcpy(&nDatasets, ptr, 4);
-    ptr += 4;
-    printf("Dataset Count : %d\n", nDatasets);
-
-    for (int i = 0; i < nDatasets; i++) {
-      printf("Dataset %d\n", i);
-
-      int type = 0;
-      memcpy(&type, ptr, 4);
-      ptr += 4;
-      printf("Type : %d\n", type);
-
-      if (type == 0)   // markerset
-      {
-        // name
-        char szName[256];
-        strcpy(szName, ptr);
-        int nDataBytes = (int) strlen(szName) + 1;
-        ptr += nDataBytes;
-        printf("Markerset Name: %s\n", szName);
-
-        // marker data
-        int nMarkers = 0;
-        memcpy(&nMarkers, ptr, 4);
-        ptr += 4;
-        printf("Marker Count : %d\n", nMarkers);
-
-        for (int j = 0; j < nMarkers; j++) {
-          char szName[256];
-          strcpy(szName, ptr);
-          int nDataBytes = (int) strlen(szName) + 1;
-          ptr += nDataBytes;
-          printf("Marker Name: %s\n", szName);
-        }
-      } else if (type == 1)   // rigid body
-      {
-        if (major >= 2) {
-          // name
-          char szName[MAX_NAMELENGTH];
-          strcpy(szName, ptr);
-          ptr += strlen(ptr) + 1;
-          printf("Name: %s\n", szName);
-        }
+    ModelDefDecoder decoder = protocol->modelDefDecoder;
+    sDataDescriptions descriptions;
+    if (decoder == nullptr ||
+        !decoder(pData, nReceived, &descriptions)) {
+      LOG_WARN(LOG_CLASS_CLIENT,
+               "[%s] Malformed data descriptions (%zu bytes)\n",
+               conn->source.c_str(), nReceived);
+      return;
+    }
 
-        int ID = 0;
-        memcpy(&ID, ptr, 4);
-        ptr += 4;
-        printf("ID : %d\n", ID);
-
-        int parentID = 0;
-        memcpy(&parentID, ptr, 4);
-        ptr += 4;
-        printf("Parent ID : %d\n", parentID);
-
-        float xoffset = 0;
-        memcpy(&xoffset, ptr, 4);
-        ptr += 4;
-        printf("X Offset : %3.2f\n", xoffset);
-
-        float yoffset = 0;
-        memcpy(&yoffset, ptr, 4);
-        ptr += 4;
-        printf("Y Offset : %3.2f\n", yoffset);
-
-        float zoffset = 0;
-        memcpy(&zoffset, ptr, 4);
-        ptr += 4;
-        printf("Z Offset : %3.2f\n", zoffset);
-
-        // Per-marker data (NatNet 3.0 and later)
-        if (major >= 3) {
-          int nMarkers = 0;
-          memcpy(&nMarkers, ptr, 4);
-          ptr += 4;
-
-          // Marker positions
-          nBytes = nMarkers * 3 * sizeof(float);
-          float *markerPositions = (float *) malloc(nBytes);
-          memcpy(markerPositions, ptr, nBytes);
-          ptr += nBytes;
-
-          // Marker required active labels
-          nBytes = nMarkers * sizeof(int);
-          int *markerRequiredLabels = (int *) malloc(nBytes);
-          memcpy(markerRequiredLabels, ptr, nBytes);
-          ptr += nBytes;
-
-          for (int markerIdx = 0; markerIdx < nMarkers; ++markerIdx) {
-            float *markerPosition = markerPositions + markerIdx * 3;
-            const int markerRequiredLabel = markerRequiredLabels[markerIdx];
-
-            printf("\tMarker #%d:\n", markerIdx);
-            printf("\t\tPosition: %.2f, %.2f, %.2f\n",
-                   markerPosition[0],
-                   markerPosition[1],
-                   markerPosition[2]);
-
-            if (markerRequiredLabel != 0) {
-              printf("\t\tRequired active label: %d\n", markerRequiredLabel);
-            }
-          }
+    if (bPrint) {
+      if (gConnections.size() > 1)
+        MODELDEF_PRINTF("Source : %s\n", conn->source.c_str());
+      PrintDataDescriptions(descriptions);
+    }
+    // Frames recorded from here on are described by this packet
+    if (conn->take.IsOpen())
+      conn->take.WriteModelDef(major, minor, pData, nReceived);
+    std::shared_ptr<const ModelDefIndex> index =
+        conn->modelDefCache.Update(std::move(descriptions));
+    for (const sRigidBodyDescription &rb : index->Descriptions().rigidBodies)
+      conn->publishers->SetName(rb.ID, rb.szName);
+    if (bPrint)
+      LogAppend(level, cls, "End Packet\n-------------\n");
 
-          free(markerPositions);
-          free(markerRequiredLabels);
-        }
-      } else if (type == 2)   // skeleton
-      {
-        char szName[MAX_NAMELENGTH];
-        strcpy(szName, ptr);
-        ptr += strlen(ptr) + 1;
-        printf("Name: %s\n", szName);
-
-        int ID = 0;
-        memcpy(&ID, ptr, 4);
-        ptr += 4;
-        printf("ID : %d\n", ID);
-
-        int nRigidBodies = 0;
-        memcpy(&nRigidBodies, ptr, 4);
-        ptr += 4;
-        printf("RigidBody (Bone) Count : %d\n", nRigidBodies);
-
-        for (int i = 0; i < nRigidBodies; i++) {
-          if (major >= 2) {
-            // RB name
-            char szName[MAX_NAMELENGTH];
-            strcpy(szName, ptr);
-            ptr += strlen(ptr) + 1;
-            printf("Rigid Body Name: %s\n", szName);
-          }
+  } else {
+    LOG_WARN(LOG_CLASS_CLIENT, "[%s] Unrecognized Packet Type %d.\n",
+             conn->source.c_str(), MessageID);
+  }
 
-          int ID = 0;
-          memcpy(&ID, ptr, 4);
-          ptr += 4;
-          printf("RigidBody ID : %d\n", ID);
-
-          int parentID = 0;
-          memcpy(&parentID, ptr, 4);
-          ptr += 4;
-          printf("Parent ID : %d\n", parentID);
-
-          float xoffset = 0;
-          memcpy(&xoffset, ptr, 4);
-          ptr += 4;
-          printf("X Offset : %3.2f\n", xoffset);
-
-          float yoffset = 0;
-          memcpy(&yoffset, ptr, 4);
-          ptr += 4;
-          printf("Y Offset : %3.2f\n", yoffset);
-
-          float zoffset = 0;
-          memcpy(&zoffset, ptr, 4);
-          ptr += 4;
-          printf("Z Offset : %3.2f\n", zoffset);
-        }
-      }
+}
 
-    }   // next dataset
+static int64_t MonotonicNs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
 
-    printf("End Packet\n-------------\n");
+// Decode stage of the data pipeline
+static bool DecodeDataPacket(sConnection *conn, sPacketSlot *slot) {
+  uint16_t MessageID = slot->nBytes >= 2 ? LoadValue<uint16_t>(slot->data) : 0;
+  slot->isFrame = MessageID == NAT_FRAMEOFDATA;
+  // Written here to keep file I/O off the receive thread
+  if (conn->capture.IsOpen())
+    conn->capture.Write(CAPTURE_CHANNEL_DATA, slot->arrival,
+                        slot->data, slot->nBytes);
+  // Anything else is handed to Unpack by the publish stage
+  if (!slot->isFrame)
+    return true;
+  const sProtocol *protocol = conn->protocol.load(std::memory_order_acquire);
+  FrameDecoder decoder = protocol->frameDecoder;
+  slot->natNetMajor = protocol->major;
+  slot->natNetMinor = protocol->minor;
+  int64_t start = MonotonicNs();
+  slot->frame.SetSubscription(&conn->subscription);
+  if (decoder == nullptr || !decoder(slot->data, slot->nBytes, &slot->frame))
+    return false;
+  MetricsObserve(METRIC_DECODE_SECONDS, MonotonicNs() - start);
+  MetricsAdd(METRIC_DATA_BYTES, slot->nBytes);
+  MetricsAdd(METRIC_FRAMES_DECODED);
+  conn->continuity.Update(slot->frame.iFrame, slot->kernelDrops,
+                          slot->pipelineDrops);
+  return true;
+}
 
-  } else {
-    printf("Unrecognized Packet Type.\n");
+// Publish stage of the data pipeline
+static void PublishDataPacket(sConnection *conn, const sPacketSlot *slot) {
+  if (!slot->isFrame) {
+    Unpack(conn, slot->data, slot->nBytes);
+    return;
   }
+  int64_t start = MonotonicNs();
+  // Formatting stays on the publish thread; the writer thread does the I/O
+  bool bPrint = LOG_ENABLED(LOG_LEVEL_DEBUG) && LogAdmit(LOG_CLASS_FRAME);
+  if (bPrint) {
+    FRAME_PRINTF("Begin Packet\n-------\n");
+    FRAME_PRINTF("Message ID : %d\n", NAT_FRAMEOFDATA);
+    FRAME_PRINTF("Byte count : %d\n", (int) slot->frame.Size() - 4);
+    FRAME_PRINTF("Arrival : %ld.%09ld\n",
+                 (long) slot->arrival.tv_sec, (long) slot->arrival.tv_nsec);
+  }
+  PublishFrameOfMocapData(conn, slot->frame, &slot->arrival,
+                          slot->natNetMajor, slot->natNetMinor, bPrint);
+  if (bPrint)
+    FRAME_PRINTF("End Packet\n-------------\n");
+
+  MetricsObserve(METRIC_PUBLISH_SECONDS, MonotonicNs() - start);
+  MetricsAdd(METRIC_FRAMES_PUBLISHED);
+
+  timespec published;
+  clock_gettime(CLOCK_REALTIME, &published);
+  conn->latency.AddFrame(slot->frame, slot->arrival, slot->received,
+                         slot->decoded, published);
+}
 
+void PrintPipelineStats(sConnection *conn) {
+  sPipelineStats stats = conn->pipeline ? conn->pipeline->GetStats()
+                                        : conn->eventLoopStats;
+  if (gConnections.size() > 1)
+    printf("[PacketClient] source %s\n", conn->source.c_str());
+  printf("[PacketClient] received %" PRIu64 " in %" PRIu64 " calls,"
+         " dropped %" PRIu64 " decode errors %" PRIu64
+         " decode stalls %" PRIu64 " published %" PRIu64 "\n",
+         stats.received, stats.receiveCalls, stats.dropped,
+         stats.decodeErrors, stats.decodeStalls, stats.published);
+  printf("[PacketClient] decode queue %zu/%zu (max %zu),"
+         " publish queue %zu/%zu (max %zu)\n",
+         stats.decodeQueue.occupancy, stats.decodeQueue.depth,
+         stats.decodeQueue.highWater,
+         stats.publishQueue.occupancy, stats.publishQueue.depth,
+         stats.publishQueue.highWater);
+  sContinuityStats continuity = conn->continuity.GetStats();
+  printf("[PacketClient] frames %" PRIu64 ", missing %" PRIu64
+         " (kernel %" PRIu64 ", pipeline %" PRIu64 ", upstream %" PRIu64
+         "), late %" PRIu64 ", duplicates %" PRIu64 ", resets %" PRIu64
+         ", socket drops %" PRIu64 "\n",
+         continuity.frames, continuity.missing, continuity.missingKernel,
+         continuity.missingPipeline,
+         continuity.missing - continuity.missingKernel -
+             continuity.missingPipeline,
+         continuity.late, continuity.duplicates, continuity.resets,
+         continuity.kernelDrops);
 }
 
-// Data listener thread. Listens for incoming bytes from NatNet
-static void *DataListenThread(void *dummy) {
-  char szData[20000];
-  socklen_t addr_len = sizeof(struct sockaddr);
-  sockaddr_in TheirAddress{};
+void PrintLogStats() {
+  sLogStats logStats = LogGetStats();
+  printf("[PacketClient] log messages %" PRIu64 ", dropped %" PRIu64
+         ", frame dumps suppressed %" PRIu64 "\n",
+         logStats.written, logStats.dropped,
+         logStats.suppressed[LOG_CLASS_FRAME]);
+}
 
-  while (true) {
-    // Block until we receive a datagram from the network
-    // (from anyone including ourselves)
-    ssize_t nDataBytesReceived = recvfrom(DataSocket,
-                                          szData,
-                                          sizeof(szData),
-                                          0,
-                                          (sockaddr *) &TheirAddress,
-                                          &addr_len);
-    // Once we have bytes recieved Unpack organizes all the data
-    Unpack(szData);
+// Samples kept by the pipelines, the continuity trackers and the log,
+// appended to every metrics scrape; each family is labeled by source
+static void CollectMetrics(std::string *out) {
+  struct sSample {
+    const char *name;
+    const char *type;
+    const char *help;
+  };
+  static const sSample samples[] = {
+    {"natnet_datagrams_received_total", "counter",
+     "Datagrams read from the data socket"},
+    {"natnet_pipeline_dropped_total", "counter",
+     "Datagrams dropped because the decode queue was full"},
+    {"natnet_decode_errors_total", "counter",
+     "Datagrams rejected by the decoder"},
+    {"natnet_decode_queue_occupancy", "gauge",
+     "Datagrams waiting for the decode thread"},
+    {"natnet_publish_queue_occupancy", "gauge",
+     "Frames waiting for the publish thread"},
+    {"natnet_socket_dropped_total", "counter",
+     "Datagrams dropped by the kernel on the data socket (SO_RXQ_OVFL)"},
+    {"natnet_frames_missing_total", "counter",
+     "Frame numbers skipped in the data stream"},
+    {"natnet_frames_late_total", "counter",
+     "Frames that arrived after a newer one"},
+    {"natnet_frames_duplicate_total", "counter",
+     "Frames that arrived twice"},
+  };
+  const int nSamples = sizeof(samples) / sizeof(samples[0]);
+  std::vector<double> values(gConnections.size() * nSamples);
+  for (size_t c = 0; c < gConnections.size(); c++) {
+    const sConnection *conn = gConnections[c].get();
+    sPipelineStats stats = conn->pipeline ? conn->pipeline->GetStats()
+                                          : conn->eventLoopStats;
+    sContinuityStats continuity = conn->continuity.GetStats();
+    double *v = &values[c * nSamples];
+    v[0] = (double) stats.received;
+    v[1] = (double) stats.dropped;
+    v[2] = (double) stats.decodeErrors;
+    v[3] = (double) stats.decodeQueue.occupancy;
+    v[4] = (double) stats.publishQueue.occupancy;
+    v[5] = (double) continuity.kernelDrops;
+    v[6] = (double) continuity.missing;
+    v[7] = (double) continuity.late;
+    v[8] = (double) continuity.duplicates;
   }
+  // Prometheus wants the samples of a family together
+  for (int i = 0; i < nSamples; i++) {
+    for (size_t c = 0; c < gConnections.size(); c++) {
+      std::string labels = "source=\"" + gConnections[c]->source + "\"";
+      MetricsAppend(out, samples[i].name, samples[i].type,
+                    c == 0 ? samples[i].help : nullptr, labels.c_str(),
+                    values[c * nSamples + i]);
+    }
+  }
+  sLogStats logStats = LogGetStats();
+  MetricsAppend(out, "natnet_log_dropped_total", "counter",
+                "Log messages dropped because the log queue was full", "",
+                (double) logStats.dropped);
+}
 
-  return 0;
+void PrintLatencyStats(sConnection *conn) {
+  sLatencySummary summaries[LATENCY_STAGE_COUNT];
+  conn->latency.Summaries(summaries);
+  if (gConnections.size() > 1)
+    printf("[PacketClient] source %s\n", conn->source.c_str());
+  printf("[PacketClient] receive mode: %s\n",
+         gSpinReceive ? "spinning" : "blocking");
+  printf("[PacketClient] %-22s %10s %10s %10s %10s\n",
+         "latency (ms)", "frames", "p50", "p99", "max");
+  for (int i = 0; i < LATENCY_STAGE_COUNT; i++) {
+    printf("[PacketClient] %-22s %10" PRIu64 " %10.3f %10.3f %10.3f\n",
+           LatencyStats::StageName(i), summaries[i].count,
+           summaries[i].p50 * 1e3, summaries[i].p99 * 1e3,
+           summaries[i].max * 1e3);
+  }
+  if (conn->predictor) {
+    sPosePredictorStats prediction = conn->predictor->GetStats();
+    printf("[PacketClient] poses extrapolated %" PRIu64 " (clamped %" PRIu64
+           "), published raw %" PRIu64 ", history restarts %" PRIu64 "\n",
+           prediction.predicted, prediction.clamped, prediction.raw,
+           prediction.rejected);
+  }
 }
 
 // ============================= Command mode ============================== //
-// Send a command to Motive.
-int SendCommand(char *szCommand) {
-  // reset global result
-  gCommandResponse = -1;
-
-  // format command packet
-  sPacket commandPacket{};
-  strcpy(commandPacket.Data.szData, szCommand);
-  commandPacket.iMessage = NAT_REQUEST;
-  commandPacket.nDataBytes =
-      (unsigned short) (strlen(commandPacket.Data.szData) + 1);
-
-  // send command and wait (a bit)
-  // for command response to set global response var in CommandListenThread
-  ssize_t iRet = sendto(CommandSocket,
-                        (char *) &commandPacket,
-                        4 + commandPacket.nDataBytes,
-                        0,
-                        (sockaddr *) &HostAddr,
-                        sizeof(HostAddr));
-  if (iRet == -1) {
-    printf("Socket error sending command");
-  } else {
-    int waitTries = 5;
-    while (waitTries--) {
-      if (gCommandResponse != -1)
-        break;
-      std::this_thread::sleep_for(std::chrono::milliseconds(30));
-    }
+// Log a command result and count it in the metrics
+static void ReportCommandResult(const sConnection *conn,
+                                const std::string &command,
+                                const sCommandResult &result) {
+  const char *szSource = conn->source.c_str();
+  switch (result.status) {
+    case COMMAND_OK:
+      MetricsAdd(METRIC_COMMANDS_OK);
+      MetricsObserve(METRIC_COMMAND_SECONDS,
+                     (int64_t) (result.roundTrip * 1e9));
+      LOG_INFO(LOG_CLASS_COMMAND, "[%s] %s: success%s%s\n", szSource,
+               command.c_str(),
+               result.response.empty() ? "" : ", response : ",
+               result.response.c_str());
+      break;
+    case COMMAND_ERROR:
+      MetricsAdd(METRIC_COMMANDS_ERROR);
+      MetricsObserve(METRIC_COMMAND_SECONDS,
+                     (int64_t) (result.roundTrip * 1e9));
+      LOG_WARN(LOG_CLASS_COMMAND, "[%s] %s: failed with %d\n",
+               szSource, command.c_str(), result.code);
+      break;
+    case COMMAND_TIMEOUT:
+      MetricsAdd(METRIC_COMMANDS_TIMEOUT);
+      LOG_WARN(LOG_CLASS_COMMAND, "[%s] %s: no response after %d tries\n",
+               szSource, command.c_str(), result.attempts);
+      break;
+    case COMMAND_SEND_FAILED:
+      MetricsAdd(METRIC_COMMANDS_SEND_FAILED);
+      LOG_ERROR(LOG_CLASS_COMMAND,
+                "[%s] %s: socket error sending command\n",
+                szSource, command.c_str());
+      break;
+  }
+}
 
-    if (gCommandResponse == -1) {
-      printf("Command response not received (timeout)");
-    } else if (gCommandResponse == 0) {
-      printf("Command response received with success");
-    } else if (gCommandResponse > 0) {
-      printf("Command response received with errors");
-    }
+// Send a command without waiting; the result is logged when it arrives
+void SendCommandAsync(sConnection *conn, const std::string &command) {
+  conn->commands.Send(command,
+                      [conn, command](const sCommandResult &result) {
+                        ReportCommandResult(conn, command, result);
+                      });
+}
+
+// Ask the server for its data descriptions; the reply arrives on the
+// command listener thread
+bool RequestModelDef(sConnection *conn) {
+  sPacket packet{};
+  packet.iMessage = NAT_REQUEST_MODELDEF;
+  packet.nDataBytes = 0;
+  int nTries = 3;
+  while (nTries--) {
+    ssize_t iRet = sendto(conn->commandSocket,
+                          (char *) &packet,
+                          4 + packet.nDataBytes,
+                          0,
+                          (sockaddr *) &conn->hostAddr,
+                          sizeof(conn->hostAddr));
+    if (iRet != -1)
+      return true;
+    LOG_ERROR(LOG_CLASS_COMMAND, "[%s] REQUEST_MODELDEF failed\n",
+              conn->source.c_str());
   }
+  return false;
+}
 
-  return gCommandResponse;
+// Echo our clock to the server, which replies with its own clock;
+// used to relate frame timestamps to arrival times
+bool SendEchoRequest(sConnection *conn) {
+  timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  int64_t sentNs = (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+
+  sPacket packet{};
+  packet.iMessage = NAT_ECHOREQUEST;
+  packet.nDataBytes = sizeof(sentNs);
+  memcpy(packet.Data.cData, &sentNs, sizeof(sentNs));
+  return sendto(conn->commandSocket,
+                (char *) &packet,
+                4 + packet.nDataBytes,
+                0,
+                (sockaddr *) &conn->hostAddr,
+                sizeof(conn->hostAddr)) != -1;
 }
 
 int CreateCommandSocket(in_addr_t IP_Address, unsigned short uPort) {
@@ -1028,91 +918,267 @@ int CreateCommandSocket(in_addr_t IP_Address, unsigned short uPort) {
   return sockfd;
 }
 
-// Command response listener thread
-static void *CommandListenThread(void *dummy) {
+// Make a protocol version current. Called only from the thread handling
+// command packets; entries stay alive for readers still holding one.
+static void SetProtocol(sConnection *conn, int major, int minor) {
+  for (const sProtocol &protocol : conn->protocols) {
+    if (protocol.major == major && protocol.minor == minor) {
+      conn->protocol.store(&protocol, std::memory_order_release);
+      return;
+    }
+  }
+  conn->protocols.push_back(sProtocol{major, minor,
+                                      SelectFrameDecoder(major, minor),
+                                      SelectModelDefDecoder(major, minor)});
+  conn->protocol.store(&conn->protocols.back(), std::memory_order_release);
+}
+
+// Handle a packet received on the command socket
+static void HandleCommandPacket(sConnection *conn, sPacket &PacketIn,
+                                size_t nDataBytesReceived) {
+  unsigned char *ptr = (unsigned char *) &PacketIn;
+  sSender_Server *server_info = (sSender_Server *) (ptr + 4);
+
+  // handle command
+  switch (PacketIn.iMessage) {
+    case NAT_MODELDEF:
+      LOG_DEBUG(LOG_CLASS_COMMAND, "[%s] Received NAT_MODELDEF packet\n",
+                conn->source.c_str());
+      Unpack(conn, (char *) &PacketIn, nDataBytesReceived);
+      break;
+    case NAT_FRAMEOFDATA:
+      LOG_DEBUG(LOG_CLASS_COMMAND, "[%s] Received NAT_FRAMEOFDATA packet\n",
+                conn->source.c_str());
+      Unpack(conn, (char *) &PacketIn, nDataBytesReceived);
+      break;
+    case NAT_SERVERINFO:
+      // Streaming app's name and version, e.g., Motive 2.0.0.0, and its
+      // NatNet version, e.g., 3.0.0.0
+      LOG_INFO(LOG_CLASS_CLIENT, "[%s] %s %d.%d.%d.%d\nNatNet %d.%d.%d.%d\n",
+               conn->source.c_str(),
+               server_info->Common.szName,
+               server_info->Common.Version[0], server_info->Common.Version[1],
+               server_info->Common.Version[2], server_info->Common.Version[3],
+               server_info->Common.NatNetVersion[0],
+               server_info->Common.NatNetVersion[1],
+               server_info->Common.NatNetVersion[2],
+               server_info->Common.NatNetVersion[3]);
+      // Save versions in the connection
+      for (int i = 0; i < 4; i++)
+        conn->serverVersion[i] = server_info->Common.Version[i];
+      // Switch to this protocol version and its decoders
+      SetProtocol(conn, server_info->Common.NatNetVersion[0],
+                  server_info->Common.NatNetVersion[1]);
+      if (conn->protocol.load()->frameDecoder == nullptr)
+        LOG_ERROR(LOG_CLASS_CLIENT, "[%s] NatNet %d.%d is not supported\n",
+                  conn->source.c_str(),
+                  server_info->Common.NatNetVersion[0],
+                  server_info->Common.NatNetVersion[1]);
+      // Frame timestamps are in ticks of this clock
+      if (nDataBytesReceived >=
+          4 + offsetof(sSender_Server, HighResClockFrequency) + 8)
+        conn->latency.SetClockFrequency(server_info->HighResClockFrequency);
+      break;
+    case NAT_ECHORESPONSE:
+      // Our request time, then the server's clock
+      if (PacketIn.nDataBytes >= 16 && nDataBytesReceived >= 20) {
+        int64_t sentNs;
+        uint64_t serverTicks;
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        memcpy(&sentNs, &PacketIn.Data.cData[0], 8);
+        memcpy(&serverTicks, &PacketIn.Data.cData[8], 8);
+        conn->latency.AddEcho(
+            sentNs, serverTicks,
+            (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec);
+      }
+      break;
+    case NAT_RESPONSE:
+    case NAT_UNRECOGNIZED_REQUEST:
+      // Completes the oldest outstanding command
+      if (!conn->commands.HandleResponse((const char *) &PacketIn,
+                                         nDataBytesReceived))
+        LOG_DEBUG(LOG_CLASS_COMMAND,
+                  "[%s] response %d without a pending request\n",
+                  conn->source.c_str(), (int) PacketIn.iMessage);
+      break;
+    case NAT_MESSAGESTRING:
+      LOG_INFO(LOG_CLASS_COMMAND, "[%s] Received message: %s\n",
+               conn->source.c_str(), PacketIn.Data.szData);
+      break;
+  }
+}
+
+// Read and handle one datagram from the command socket; false if none
+// was read
+static bool ReceiveCommandPacket(sConnection *conn, int flags) {
+  // Only one thread reads a connection's command socket
+  sPacket &PacketIn = *conn->commandPacket;
   char ip_as_str[INET_ADDRSTRLEN];
-  ssize_t nDataBytesReceived;
   sockaddr_in TheirAddress{};
-  sPacket PacketIn{};
   socklen_t addr_len = sizeof(struct sockaddr);
 
-  while (true) {
-    // blocking
-    nDataBytesReceived = recvfrom(CommandSocket,
-                                  (char *) &PacketIn,
-                                  sizeof(sPacket),
-                                  0,
-                                  (struct sockaddr *) &TheirAddress,
-                                  &addr_len);
-
-    if ((nDataBytesReceived == 0) || (nDataBytesReceived == -1))
-      continue;
+  ssize_t nDataBytesReceived = recvfrom(conn->commandSocket,
+                                        (char *) &PacketIn,
+                                        sizeof(sPacket),
+                                        flags,
+                                        (struct sockaddr *) &TheirAddress,
+                                        &addr_len);
+  if ((nDataBytesReceived == 0) || (nDataBytesReceived == -1))
+    return false;
+
+  if (conn->capture.IsOpen()) {
+    timespec arrival;
+    clock_gettime(CLOCK_REALTIME, &arrival);
+    conn->capture.Write(CAPTURE_CHANNEL_COMMAND, arrival,
+                        (const char *) &PacketIn,
+                        (size_t) nDataBytesReceived);
+  }
 
-    // debug - print message
+  // debug - print message
+  if (LOG_ENABLED(LOG_LEVEL_DEBUG)) {
     inet_ntop(AF_INET, &(TheirAddress.sin_addr), ip_as_str, INET_ADDRSTRLEN);
-    printf("[Client] Received command from %s: Command=%d, nDataBytes=%d\n",
-           ip_as_str, (int) PacketIn.iMessage, (int) PacketIn.nDataBytes);
+    LOG_DEBUG(LOG_CLASS_COMMAND,
+              "[%s] Received command from %s: Command=%d,"
+              " nDataBytes=%d\n",
+              conn->source.c_str(), ip_as_str, (int) PacketIn.iMessage,
+              (int) PacketIn.nDataBytes);
+  }
+
+  HandleCommandPacket(conn, PacketIn, (size_t) nDataBytesReceived);
+  return true;
+}
+
+// Command response listener thread, one per connection
+static void *CommandListenThread(void *arg) {
+  sConnection *conn = (sConnection *) arg;
+  // blocking; shutdown() of the socket wakes it up to exit
+  while (conn->commandListening.load(std::memory_order_relaxed))
+    ReceiveCommandPacket(conn, 0);
+
+  return 0;
+}
 
-    unsigned char *ptr = (unsigned char *) &PacketIn;
-    sSender_Server *server_info = (sSender_Server *) (ptr + 4);
+// Read what is pending on a data socket and run the decode and
+// publish stages inline
+static void ReceiveDataPackets(sConnection *conn) {
+  sPacketSlot &slot = *conn->eventLoopSlot;
+  sPipelineStats &stats = conn->eventLoopStats;
+  for (int i = 0; i < EVENT_LOOP_DATA_BUDGET; i++) {
+    if (!ReceiveDatagram(conn->dataSocket, &slot, MSG_DONTWAIT))
+      return;
+    stats.received++;
+    stats.receiveCalls++;
+    slot.valid = DecodeDataPacket(conn, &slot);
+    clock_gettime(CLOCK_REALTIME, &slot.decoded);
+    if (!slot.valid) {
+      stats.decodeErrors++;
+      continue;
+    }
+    PublishDataPacket(conn, &slot);
+    stats.published++;
+  }
+}
+
+static void StopEventLoop(int signum) {
+  if (gEventLoop != nullptr)
+    gEventLoop->Stop();
+}
 
-    // handle command
-    switch (PacketIn.iMessage) {
-      case NAT_MODELDEF:std::cout << "[Client] Received NAT_MODELDEF packet";
-        Unpack((char *) &PacketIn);
+// Feed a capture through the handlers of live packets
+static int ReplayMain(sConnection *conn, const std::string &path,
+                      double speed) {
+  sPacket &PacketIn = *conn->commandPacket;
+  sReplayStats stats;
+  bool bOpened = ReplayCapture(
+      path, speed,
+      [conn, &PacketIn](const sCaptureRecord &record, const char *pData) {
+        if (record.channel == CAPTURE_CHANNEL_COMMAND) {
+          size_t nBytes = std::min((size_t) record.nBytes, sizeof(PacketIn));
+          memcpy(&PacketIn, pData, nBytes);
+          HandleCommandPacket(conn, PacketIn, nBytes);
+        } else {
+          Unpack(conn, pData, record.nBytes);
+        }
+      },
+      &stats);
+  if (!bOpened) {
+    printf("[PacketClient] cannot replay %s\n", path.c_str());
+    return -1;
+  }
+  printf("[PacketClient] replayed %" PRIu64 " packets (%" PRIu64 " bytes)"
+         " in %.3f s: %.0f packets/s\n",
+         stats.records, stats.bytes, stats.seconds,
+         stats.seconds > 0.0 ? stats.records / stats.seconds : 0.0);
+  return 0;
+}
+
+// Write the index of a take being recorded
+static void CloseTake(sConnection *conn) {
+  if (!conn->take.IsOpen())
+    return;
+  printf("[%s] recorded %" PRIu64 " frames\n", conn->source.c_str(),
+         conn->take.Frames());
+  conn->take.Close();
+}
+
+// Ask a server for one frame of data on the command socket
+static void RequestFrameOfData(sConnection *conn) {
+  sPacket PacketOut{};
+  PacketOut.iMessage = NAT_REQUEST_FRAMEOFDATA;
+  PacketOut.nDataBytes = 0;
+  int nTries = 3;
+  while (nTries--) {
+    ssize_t iRet = sendto(conn->commandSocket,
+                          (char *) &PacketOut,
+                          4 + PacketOut.nDataBytes,
+                          0,
+                          (sockaddr *) &conn->hostAddr,
+                          sizeof(conn->hostAddr));
+    if (iRet != -1)
+      break;
+    printf("[%s] REQUEST_FRAMEOFDATA failed\n", conn->source.c_str());
+  }
+}
+
+// Handle a key of the main menu, for every connection; false on quit
+static bool HandleKey(int c) {
+  for (std::unique_ptr<sConnection> &conn : gConnections) {
+    switch (c) {
+      case 's':
+        // send NAT_REQUEST_MODELDEF command to server
+        // (will respond on the "Command Listener" thread)
+        RequestModelDef(conn.get());
         break;
-      case NAT_FRAMEOFDATA:
-        std::cout << "[Client] Received NAT_FRAMEOFDATA packet";
-        Unpack((char *) &PacketIn);
+      case 'f':
+        // send NAT_REQUEST_FRAMEOFDATA
+        // (will respond on the "Command Listener" thread)
+        RequestFrameOfData(conn.get());
         break;
-      case NAT_SERVERINFO:
-        // Streaming app's name, e.g., Motive
-        std::cout << server_info->Common.szName << " ";
-        // Streaming app's version, e.g., 2.0.0.0
-        for (int i = 0; i < 4; ++i) {
-          std::cout << static_cast<int>(server_info->Common.Version[i]) << ".";
-        }
-        std::cout << '\b' << std::endl;
-        // Streaming app's NatNet version, e.g., 3.0.0.0
-        std::cout << "NatNet ";
-        int digit;
-        for (int i = 0; i < 4; ++i) {
-          digit = static_cast<int>(server_info->Common.NatNetVersion[i]);
-          std::cout << digit << ".";
-        }
-        std::cout << '\b' << std::endl;
-        // Save versions in global variables
-        for (int i = 0; i < 4; i++) {
-          NatNetVersion[i] = server_info->Common.NatNetVersion[i];
-          ServerVersion[i] = server_info->Common.Version[i];
-        }
+      case 't':
+        // send a test request
+        // (will respond on the "Command Listener" thread)
+        SendCommandAsync(conn.get(), "TestRequest");
         break;
-      case NAT_RESPONSE:gCommandResponseSize = PacketIn.nDataBytes;
-        if (gCommandResponseSize == 4)
-          memcpy(&gCommandResponse,
-                 &PacketIn.Data.lData[0],
-                 gCommandResponseSize);
-        else {
-          memcpy(&gCommandResponseString[0],
-                 &PacketIn.Data.cData[0],
-                 gCommandResponseSize);
-          printf("Response : %s", gCommandResponseString);
-          gCommandResponse = 0;   // ok
-        }
+      case 'w':
+        // Playback setup; the commands are in flight together and
+        // complete in order
+        SendCommandAsync(conn.get(), "SetPlaybackStartFrame,-50");
+        SendCommandAsync(conn.get(), "SetPlaybackStopFrame,1500");
+        SendCommandAsync(conn.get(), "SetPlaybackLooping,0");
+        SendCommandAsync(conn.get(), "SetPlaybackCurrentFrame,100");
         break;
-      case NAT_UNRECOGNIZED_REQUEST:
-        printf("[Client] received 'unrecognized request'\n");
-        gCommandResponseSize = 0;
-        gCommandResponse = 1;       // err
+      case 'p':PrintPipelineStats(conn.get());
         break;
-      case NAT_MESSAGESTRING:
-        printf("[Client] Received message: %s\n",
-               PacketIn.Data.szData);
+      case 'l':PrintLatencyStats(conn.get());
         break;
+      case 'q':return false;
+      default:break;
     }
   }
-
-  return 0;
+  if (c == 'p')
+    PrintLogStats();
+  return true;
 }
 
 // ================================ Main =================================== //
@@ -1144,54 +1210,63 @@ bool IPAddress_StringToAddr(char *szNameOrAddress,
   return true;
 }
 
-int main(int argc, char *argv[]) {
-  int retval;
-  char szMyIPAddress[128] = "";
-  char szServerIPAddress[128] = "";
-  in_addr MyAddress{}, MultiCastAddress{};
-  int optval = 0x100000;
-  socklen_t optval_size = 4;
-
-  //-----------------------------
-  // ROS Section
-  int rate_b = 10; //10 hz
-
-  ros::init(argc, argv, "Mocap");
-
-  ros::NodeHandle nh;
-
-  pub = nh.advertise<geometry_msgs::PoseStamped>("/mavros/vision_pose/pose",1000);//,1,true);
-
-
-  //----------------------------
-
-
-  // ================ Read IP addresses
-  // server address
-  if (argc > 1) {
-    strcpy(szServerIPAddress, argv[1]);    // specified on command line
-    retval = (int) IPAddress_StringToAddr(szServerIPAddress, &ServerAddress);
-  } else {
-    printf("Usage:\n\n\tPacketClient [ServerIP] [LocalIP]\n");
+// Parse "[name=]server_ip[,local_ip[,multicast_group]]" of ~servers;
+// the local address defaults to szDefaultLocal
+static bool ParseServer(const std::string &entry, const char *szDefaultLocal,
+                        sConnection *conn) {
+  std::string addresses = entry;
+  size_t equals = entry.find('=');
+  if (equals != std::string::npos) {
+    conn->source = entry.substr(0, equals);
+    addresses = entry.substr(equals + 1);
   }
-
-  // client address
-  if (argc > 2) {
-    strcpy(szMyIPAddress, argv[2]);    // specified on command line
-    retval = (int) IPAddress_StringToAddr(szMyIPAddress, &MyAddress);
-  } else {
-    printf("Usage:\n\n\tPacketClient [ServerIP] [LocalIP]\n");
+  std::vector<std::string> fields;
+  size_t begin = 0;
+  while (true) {
+    size_t comma = addresses.find(',', begin);
+    fields.push_back(addresses.substr(begin, comma - begin));
+    if (comma == std::string::npos)
+      break;
+    begin = comma + 1;
+  }
+  if (fields.size() > 3 || fields[0].empty())
+    return false;
+  const char *szLocal = fields.size() > 1 && !fields[1].empty()
+                            ? fields[1].c_str() : szDefaultLocal;
+  const char *szMulticast = fields.size() > 2 && !fields[2].empty()
+                                ? fields[2].c_str() : MULTICAST_ADDRESS;
+  char szAddress[128];
+  snprintf(szAddress, sizeof(szAddress), "%s", fields[0].c_str());
+  if (!IPAddress_StringToAddr(szAddress, &conn->serverAddress))
+    return false;
+  if (szLocal[0] != '\0') {
+    snprintf(szAddress, sizeof(szAddress), "%s", szLocal);
+    if (!IPAddress_StringToAddr(szAddress, &conn->localAddress))
+      return false;
   }
-  MultiCastAddress.s_addr = inet_addr(MULTICAST_ADDRESS);
-  printf("Client: %s\n", szMyIPAddress);
-  printf("Server: %s\n", szServerIPAddress);
-  printf("Multicast Group: %s\n", MULTICAST_ADDRESS);
+  return inet_pton(AF_INET, szMulticast, &conn->multicastAddress) == 1;
+}
 
+// Create the command and data sockets of a connection and join its
+// multicast group
+static bool OpenConnection(sConnection *conn) {
+  int optval = 0x100000;
+  socklen_t optval_size = 4;
+  char szServer[INET_ADDRSTRLEN], szLocal[INET_ADDRSTRLEN],
+      szMulticast[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &conn->serverAddress, szServer, sizeof(szServer));
+  inet_ntop(AF_INET, &conn->localAddress, szLocal, sizeof(szLocal));
+  inet_ntop(AF_INET, &conn->multicastAddress, szMulticast,
+            sizeof(szMulticast));
+  printf("Source: %s\n", conn->source.c_str());
+  printf("Client: %s\n", szLocal);
+  printf("Server: %s\n", szServer);
+  printf("Multicast Group: %s\n", szMulticast);
 
   // ================ Create "Command" socket
   unsigned short port = 0;
-  CommandSocket = CreateCommandSocket(MyAddress.s_addr, port);
-  if (CommandSocket == -1) {
+  conn->commandSocket = CreateCommandSocket(conn->localAddress.s_addr, port);
+  if (conn->commandSocket == -1) {
     // error
     printf("Command socket creation error\n");
   } else {
@@ -1199,8 +1274,9 @@ int main(int argc, char *argv[]) {
     //u_long iMode=1;
     //ioctlsocket(CommandSocket,FIONBIO,&iMode);
     // set buffer
-    setsockopt(CommandSocket, SOL_SOCKET, SO_RCVBUF, (char *) &optval, 4);
-    getsockopt(CommandSocket,
+    setsockopt(conn->commandSocket, SOL_SOCKET, SO_RCVBUF,
+               (char *) &optval, 4);
+    getsockopt(conn->commandSocket,
                SOL_SOCKET,
                SO_RCVBUF,
                (char *) &optval,
@@ -1209,33 +1285,28 @@ int main(int argc, char *argv[]) {
       // err - actual size...
       printf("[CommandSocket] ReceiveBuffer size = %d\n", optval);
     }
-    // startup our "Command Listener" thread
-    pthread_t cmd_listen_thread;
-    pthread_attr_t cmd_thread_attr{};
-    if ((bool) pthread_attr_init(&cmd_thread_attr))
-      printf("attributes not set to default\n");
-    pthread_create(&cmd_listen_thread,
-                   &cmd_thread_attr,
-                   CommandListenThread,
-                   nullptr);
   }
 
-
   // ================ Create "Data" socket
-  DataSocket = socket(AF_INET, SOCK_DGRAM, 0);
+  conn->dataSocket = socket(AF_INET, SOCK_DGRAM, 0);
 
   // allow multiple clients on same machine to use address/port
   int value = 1;
-  retval = setsockopt(DataSocket,
-                      SOL_SOCKET,
-                      SO_REUSEADDR,
-                      (char *) &value,
-                      sizeof(value));
+  int retval = setsockopt(conn->dataSocket,
+                          SOL_SOCKET,
+                          SO_REUSEADDR,
+                          (char *) &value,
+                          sizeof(value));
   if (retval == -1) {
-    close(DataSocket);
     printf("Error while setting DataSocket options\n");
-    return -1;
+    return false;
   }
+  // Every connection binds the data port; deliver only the group this
+  // socket joined, not those joined by the others
+  value = 0;
+  if (setsockopt(conn->dataSocket, IPPROTO_IP, IP_MULTICAST_ALL,
+                 (char *) &value, sizeof(value)) == -1)
+    printf("[PacketClient] IP_MULTICAST_ALL not supported\n");
 
   struct sockaddr_in MySocketAddr{};
   memset(&MySocketAddr, 0, sizeof(MySocketAddr));
@@ -1243,163 +1314,483 @@ int main(int argc, char *argv[]) {
   MySocketAddr.sin_port = htons(PORT_DATA);
 //  MySocketAddr.sin_addr = MyAddress;
   MySocketAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-  if (bind(DataSocket,
+  if (bind(conn->dataSocket,
            (struct sockaddr *) &MySocketAddr,
            sizeof(struct sockaddr)) == -1) {
     printf("[PacketClient] bind failed\n");
-    return 0;
+    return false;
   }
   // join multicast group
   struct ip_mreq Mreq{};
-  Mreq.imr_multiaddr = MultiCastAddress;
-  Mreq.imr_interface = MyAddress;
-  retval = setsockopt(DataSocket,
+  Mreq.imr_multiaddr = conn->multicastAddress;
+  Mreq.imr_interface = conn->localAddress;
+  retval = setsockopt(conn->dataSocket,
                       IPPROTO_IP,
                       IP_ADD_MEMBERSHIP,
                       (char *) &Mreq,
                       sizeof(Mreq));
   if (retval == -1) {
     printf("[PacketClient] join failed\n");
-    return -1;
+    return false;
   }
   // create a 1MB buffer
-  setsockopt(DataSocket, SOL_SOCKET, SO_RCVBUF, (char *) &optval, 4);
-  getsockopt(DataSocket, SOL_SOCKET, SO_RCVBUF, (char *) &optval, &optval_size);
+  optval = 0x100000;
+  setsockopt(conn->dataSocket, SOL_SOCKET, SO_RCVBUF, (char *) &optval, 4);
+  getsockopt(conn->dataSocket, SOL_SOCKET, SO_RCVBUF, (char *) &optval,
+             &optval_size);
   if (optval != 0x100000) {
     printf("[PacketClient] ReceiveBuffer size = %d\n", optval);
   }
-  // startup our "Data Listener" thread
-  pthread_t data_listen_thread;
-  pthread_attr_t data_thread_attr{};
-  if ((bool) pthread_attr_init(&data_thread_attr))
-    printf("attributes not set to default\n");
-  pthread_create(&data_listen_thread,
-                 &data_thread_attr,
-                 DataListenThread,
-                 nullptr);
-
 
   // ================ Server address for commands
-  memset(&HostAddr, 0, sizeof(HostAddr));
-  HostAddr.sin_family = AF_INET;
-  HostAddr.sin_port = htons(PORT_COMMAND);
-  HostAddr.sin_addr = ServerAddress;
+  memset(&conn->hostAddr, 0, sizeof(conn->hostAddr));
+  conn->hostAddr.sin_family = AF_INET;
+  conn->hostAddr.sin_port = htons(PORT_COMMAND);
+  conn->hostAddr.sin_addr = conn->serverAddress;
+  conn->commands.SetSendFunction([conn](const char *pData, size_t nBytes) {
+    return sendto(conn->commandSocket, pData, nBytes, 0,
+                  (sockaddr *) &conn->hostAddr,
+                  sizeof(conn->hostAddr)) != -1;
+  });
+  return true;
+}
 
-  // send initial connect request
-  sPacket PacketOut{};
-  PacketOut.iMessage = NAT_CONNECT;
-  PacketOut.nDataBytes = 0;
-  int nTries = 3;
-  while (nTries--) {
-    ssize_t iRet = sendto(CommandSocket,
-                          (char *) &PacketOut,
-                          4 + PacketOut.nDataBytes,
-                          0,
-                          (sockaddr *) &HostAddr,
-                          sizeof(HostAddr));
-    if (iRet != -1)
-      break;
-    printf("Initial connect request failed\n");
+// Stop the threads of a connection and close its sockets
+static void CloseConnection(sConnection *conn) {
+  if (conn->pipeline)
+    conn->pipeline->Stop();
+  if (conn->commandListening.exchange(false)) {
+    // Wakes the listener from its blocking receive
+    shutdown(conn->commandSocket, SHUT_RD);
+    pthread_join(conn->commandThread, nullptr);
   }
+  if (conn->commandSocket != -1)
+    close(conn->commandSocket);
+  if (conn->dataSocket != -1)
+    close(conn->dataSocket);
+}
 
+void PacketClientStop() {
+  gStopRequested = true;
+}
+
+int PacketClientRun(ros::NodeHandle &nh, ros::NodeHandle &pnh,
+                    const std::vector<std::string> &args, bool bNodelet) {
+  //-----------------------------
+  // ROS Section
+  int rate_b = 10; //10 hz
+
+  // A reloaded nodelet starts over
+  gConnections.clear();
+  gStopRequested = false;
+
+  // Motive servers, "[name=]server_ip[,local_ip[,multicast_group]]"
+  // each; without the list, the one server given on the command line
+  std::vector<std::string> servers;
+  pnh.param("servers", servers, std::vector<std::string>());
+  const char *szDefaultLocal = args.size() > 1 ? args[1].c_str() : "";
+  if (servers.empty()) {
+    if (args.size() > 1) {
+      servers.push_back(args[0]);
+    } else {
+      printf("Usage:\n\n\tPacketClient [ServerIP] [LocalIP]\n");
+      servers.push_back(!args.empty() ? args[0] : "127.0.0.1");
+    }
+  }
+  std::vector<std::string> sources;
+  for (size_t i = 0; i < servers.size(); i++) {
+    std::unique_ptr<sConnection> conn(new sConnection());
+    conn->index = (int) i;
+    if (!ParseServer(servers[i], szDefaultLocal, conn.get())) {
+      printf("[PacketClient] invalid server %s\n", servers[i].c_str());
+      return -1;
+    }
+    if (conn->source.empty())
+      conn->source = "motive" + std::to_string(i);
+    sources.push_back(conn->source);
+    gConnections.push_back(std::move(conn));
+  }
+  bool bMultiple = gConnections.size() > 1;
+
+  // Rigid body topics; "{id}", "{name}" and "{source}" are replaced per
+  // body
+  std::string topicTemplate, frameId;
+  pnh.param("topic_template", topicTemplate,
+            std::string("/mavros/vision_pose/pose"));
+  pnh.param("frame_id", frameId, std::string("map"));
+  if (bMultiple && topicTemplate.find("{source}") == std::string::npos) {
+    // Keep the servers' bodies apart
+    topicTemplate = "/{source}" + topicTemplate;
+    printf("[PacketClient] topic_template has no {source}, using %s\n",
+           topicTemplate.c_str());
+  }
+  // Publish by shared pointer from a message pool, so subscribers in
+  // this process get the messages without serialization
+  bool bZeroCopy;
+  pnh.param("zero_copy", bZeroCopy, bNodelet);
+  for (std::unique_ptr<sConnection> &conn : gConnections) {
+    conn->publishers.reset(new RigidBodyPublishers(
+        nh, topicTemplate, conn->source, frameId, 1000, bZeroCopy));
+  }
+
+  // Extrapolation of poses by their age at publishing
+  bool bPredict;
+  sPosePredictorConfig predictorConfig;
+  double predictMaxHorizonMs;
+  pnh.param("predict", bPredict, false);
+  pnh.param("predict_history", predictorConfig.history, 4);
+  pnh.param("predict_max_horizon_ms", predictMaxHorizonMs, 50.0);
+  pnh.param("predict_max_error", predictorConfig.maxError, 0.02);
+  pnh.param("predict_max_angle_error", predictorConfig.maxAngleError, 0.1);
+  predictorConfig.maxHorizon = predictMaxHorizonMs * 1e-3;
+  if (bPredict) {
+    for (std::unique_ptr<sConnection> &conn : gConnections)
+      conn->predictor.reset(new PosePredictor(predictorConfig));
+  }
+
+  // Depth of the rings between the receive, decode and publish stages,
+  // and datagrams drained per receive call
+  int decodeQueueDepth, publishQueueDepth, receiveBatch;
+  pnh.param("decode_queue_depth", decodeQueueDepth, 64);
+  pnh.param("publish_queue_depth", publishQueueDepth, 64);
+  pnh.param("receive_batch", receiveBatch, 1);
+  sPipelineConfig pipelineConfig;
+  pipelineConfig.decodeDepth = (size_t) std::max(decodeQueueDepth, 1);
+  pipelineConfig.publishDepth = (size_t) std::max(publishQueueDepth, 1);
+  pipelineConfig.receiveBatch = (size_t) std::max(receiveBatch, 1);
+
+  // Latency mode: spinning receive and decode threads with locked
+  // memory, optionally pinned and under SCHED_FIFO
+  bool bLowLatency, bLockMemory;
+  pnh.param("low_latency", bLowLatency, false);
+  pnh.param("lock_memory", bLockMemory, bLowLatency);
+  pnh.param("busy_poll_us", pipelineConfig.busyPollUs, 0);
+  pnh.param("receive_cpu", pipelineConfig.receiveCpu, -1);
+  pnh.param("decode_cpu", pipelineConfig.decodeCpu, -1);
+  pnh.param("realtime_priority", pipelineConfig.realtimePriority, 0);
+  pipelineConfig.spin = bLowLatency;
+  gSpinReceive = bLowLatency;
+
+  // Verbosity, and per-second caps on frame dumps and command traffic.
+  // Frame dumps at debug decode whole frames, so they are opt-in.
+  std::string logLevel;
+  double logRateFrame, logRateCommand;
+  pnh.param("log_level", logLevel, std::string("info"));
+  pnh.param("log_rate_frame", logRateFrame, 0.0);
+  pnh.param("log_rate_command", logRateCommand, 0.0);
+  int level;
+  if (!LogParseLevel(logLevel.c_str(), &level)) {
+    printf("[PacketClient] unknown log_level %s\n", logLevel.c_str());
+    return -1;
+  }
+  LogSetLevel(level);
+  LogSetRateLimit(LOG_CLASS_FRAME, logRateFrame);
+  LogSetRateLimit(LOG_CLASS_COMMAND, logRateCommand);
+
+  // Command round trip timeout and resends before a command fails
+  int commandTimeoutMs, commandRetries;
+  pnh.param("command_timeout_ms", commandTimeoutMs, 100);
+  pnh.param("command_retries", commandRetries, 2);
+  for (std::unique_ptr<sConnection> &conn : gConnections) {
+    conn->commands.SetTimeout(std::max(commandTimeoutMs, COMMAND_POLL_MS));
+    conn->commands.SetRetries(std::max(commandRetries, 0));
+  }
+
+  // Prometheus endpoint, off unless a port is given
+  std::string metricsAddress;
+  int metricsPort;
+  pnh.param("metrics_address", metricsAddress, std::string("127.0.0.1"));
+  pnh.param("metrics_port", metricsPort, 0);
+
+  // Serve all sockets, stdin and the timers from one epoll thread
+  // instead of the listener and pipeline threads
+  bool bEventLoop;
+  pnh.param("event_loop", bEventLoop, false);
+
+  // Record every datagram, or replay a recording instead of connecting
+  std::string captureFile, replayFile;
+  double replaySpeed;
+  pnh.param("capture_file", captureFile, std::string());
+  pnh.param("replay_file", replayFile, std::string());
+  pnh.param("replay_speed", replaySpeed, 1.0);
+
+  // Shared-memory segment of recent frames for other local processes;
+  // with several servers, each has its own segment and capture file
+  std::string frameBusName;
+  int frameBusSlots;
+  pnh.param("frame_bus", frameBusName, std::string());
+  pnh.param("frame_bus_slots", frameBusSlots, 64);
+  for (std::unique_ptr<sConnection> &conn : gConnections) {
+    std::string name = frameBusName;
+    if (bMultiple)
+      name += "_" + conn->source;
+    if (!frameBusName.empty() &&
+        !conn->frameBus.Open(name, (uint32_t) std::max(frameBusSlots, 1))) {
+      printf("[PacketClient] cannot create frame bus %s\n", name.c_str());
+      return -1;
+    }
+  }
+  // Decoded frames in an indexed file for post-processing, live or
+  // from a replayed capture
+  std::string takeFile;
+  pnh.param("take_file", takeFile, std::string());
+  for (std::unique_ptr<sConnection> &conn : gConnections) {
+    std::string path = takeFile;
+    if (bMultiple)
+      path += "." + conn->source;
+    if (!takeFile.empty() && !conn->take.Open(path)) {
+      printf("[PacketClient] cannot open take file %s\n", path.c_str());
+      return -1;
+    }
+  }
+  // Rigid bodies to publish on ROS, by streamed ID; all if empty
+  std::vector<int> rigidBodies;
+  pnh.param("rigid_bodies", rigidBodies, std::vector<int>());
+  for (std::unique_ptr<sConnection> &conn : gConnections) {
+    if (rigidBodies.empty())
+      conn->publishedBodies.AddSections(FRAME_SECTION_RIGID_BODIES);
+    for (int ID : rigidBodies)
+      conn->publishedBodies.AddRigidBody(ID);
+    // Frames are decoded as far as some output reads them
+    conn->subscription.Add(conn->publishedBodies);
+    if (conn->frameBus.IsOpen())
+      conn->subscription.AddSections(FRAME_SECTION_RIGID_BODIES |
+          FRAME_SECTION_LABELED_MARKERS);
+    if (conn->take.IsOpen())
+      conn->subscription.AddSections(FRAME_SECTION_RIGID_BODIES |
+          FRAME_SECTION_SKELETONS | FRAME_SECTION_LABELED_MARKERS);
+    if (LOG_ENABLED(LOG_LEVEL_DEBUG))
+      conn->subscription.AddSections(FRAME_SECTION_ALL);
+  }
+
+  // A recording holds one server's packets
+  if (!replayFile.empty()) {
+    int result = ReplayMain(gConnections[0].get(), replayFile, replaySpeed);
+    CloseTake(gConnections[0].get());
+    return result;
+  }
+  for (std::unique_ptr<sConnection> &conn : gConnections) {
+    std::string path = captureFile;
+    if (bMultiple)
+      path += "." + conn->source;
+    if (!captureFile.empty() && !conn->capture.Open(path)) {
+      printf("[PacketClient] cannot open capture file %s\n", path.c_str());
+      return -1;
+    }
+  }
 
-  // ================ Main menu
-  printf("Packet Client started\n\n");
-  printf(
-      "Commands:"
-          "\ns\tsend data descriptions"
-          "\nf\tsend frame of data"
-          "\nt\tsend test request"
-          "\nq\tquit\n\n");
-  int c;
-  char szRequest[512];
-  bool bExit = false;
-  while (!bExit) {
-    c = getchar();
-    switch (c) {
-      case 's':
-        // send NAT_REQUEST_MODELDEF command to server
-        // (will respond on the "Command Listener" thread)
-        PacketOut.iMessage = NAT_REQUEST_MODELDEF;
-        PacketOut.nDataBytes = 0;
-        nTries = 3;
-        while (nTries--) {
-          ssize_t iRet = sendto(CommandSocket,
-                                (char *) &PacketOut,
-                                4 + PacketOut.nDataBytes,
-                                0,
-                                (sockaddr *) &HostAddr,
-                                sizeof(HostAddr));
-          if (iRet != -1)
-            break;
-          printf("REQUEST_MODELDEF failed\n");
-        }
-        break;
-      case 'f':
-        // send NAT_REQUEST_FRAMEOFDATA
-        // (will respond on the "Command Listener" thread)
-        PacketOut.iMessage = NAT_REQUEST_FRAMEOFDATA;
-        PacketOut.nDataBytes = 0;
-        nTries = 3;
-        while (nTries--) {
-          ssize_t iRet = sendto(CommandSocket,
-                                (char *) &PacketOut,
-                                4 + PacketOut.nDataBytes,
-                                0,
-                                (sockaddr *) &HostAddr,
-                                sizeof(HostAddr));
-          if (iRet != -1)
-            break;
-          printf("REQUEST_FRAMEOFDATA failed\n");
-        }
-        break;
-      case 't':
-        // send NAT_MESSAGESTRING
-        // (will respond on the "Command Listener" thread)
-        strcpy(szRequest, "TestRequest");
-        PacketOut.iMessage = NAT_REQUEST;
-        PacketOut.nDataBytes = (unsigned short) (strlen(szRequest) + 1);
-        strcpy(PacketOut.Data.szData, szRequest);
-        nTries = 3;
-        while (nTries--) {
-          ssize_t iRet = sendto(CommandSocket,
-                                (char *) &PacketOut,
-                                4 + PacketOut.nDataBytes,
-                                0,
-                                (sockaddr *) &HostAddr,
-                                sizeof(HostAddr));
-          if (iRet != -1)
-            break;
-        }
-        break;
-      case 'w': {
-        char szCommand[512];
-        int testVal;
-        int returnCode;
 
-        testVal = -50;
-        sprintf(szCommand, "SetPlaybackStartFrame,%d", testVal);
-        returnCode = SendCommand(szCommand);
+  //----------------------------
 
-        testVal = 1500;
-        sprintf(szCommand, "SetPlaybackStopFrame,%d", testVal);
-        returnCode = SendCommand(szCommand);
 
-        testVal = 0;
-        sprintf(szCommand, "SetPlaybackLooping,%d", testVal);
-        returnCode = SendCommand(szCommand);
+  // ================ Sockets of every server
+  for (std::unique_ptr<sConnection> &conn : gConnections) {
+    if (!OpenConnection(conn.get()))
+      return -1;
+  }
+  // From here on messages go through the log writer
+  LogStart();
+  // startup our "Command Listener" threads
+  if (!bEventLoop) {
+    for (std::unique_ptr<sConnection> &conn : gConnections) {
+      if (conn->commandSocket == -1)
+        continue;
+      pthread_attr_t cmd_thread_attr{};
+      if ((bool) pthread_attr_init(&cmd_thread_attr))
+        printf("attributes not set to default\n");
+      conn->commandListening = true;
+      pthread_create(&conn->commandThread,
+                     &cmd_thread_attr,
+                     CommandListenThread,
+                     conn.get());
+    }
+  }
 
-        testVal = 100;
-        sprintf(szCommand, "SetPlaybackCurrentFrame,%d", testVal);
-        returnCode = SendCommand(szCommand);
+  std::atomic<bool> bClockSync(!bEventLoop);
+  std::thread clockSyncThread;
+  EventLoop loop;
+  if (!bEventLoop) {
+    // startup the receive, decode and publish stages of every server
+    for (std::unique_ptr<sConnection> &conn : gConnections)
+      conn->pipeline.reset(new PacketPipeline(pipelineConfig));
+    // After the slot pools exist, so they are faulted in and locked too
+    if (bLockMemory && mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+      LOG_WARN(LOG_CLASS_CLIENT, "[PacketClient] mlockall failed: %s\n",
+               strerror(errno));
+    for (std::unique_ptr<sConnection> &conn : gConnections) {
+      sConnection *c = conn.get();
+      c->pipeline->Start(
+          c->dataSocket,
+          [c](sPacketSlot *slot) { return DecodeDataPacket(c, slot); },
+          [c](const sPacketSlot *slot) { PublishDataPacket(c, slot); });
+    }
 
+    // Clock offsets to NatNet 3.0 servers, refreshed every second, and
+    // command timeouts
+    clockSyncThread = std::thread([&bClockSync]() {
+      int nTicks = 0;
+      while (bClockSync) {
+        bool bEcho = nTicks++ % (1000 / COMMAND_POLL_MS) == 0;
+        for (std::unique_ptr<sConnection> &conn : gConnections) {
+          if (bEcho && conn->protocol.load()->major >= 3)
+            SendEchoRequest(conn.get());
+          conn->commands.Poll();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(COMMAND_POLL_MS));
       }
+    });
+  } else {
+    bool bReady = loop.Open();
+    for (std::unique_ptr<sConnection> &conn : gConnections) {
+      sConnection *c = conn.get();
+      if (!EnableReceiveTimestamps(c->dataSocket))
+        LOG_WARN(LOG_CLASS_CLIENT,
+                 "[%s] kernel timestamps unavailable\n", c->source.c_str());
+      if (!EnableReceiveOverflowCount(c->dataSocket))
+        LOG_WARN(LOG_CLASS_CLIENT,
+                 "[%s] kernel drop counts unavailable\n", c->source.c_str());
+      bReady = bReady &&
+          loop.Add(c->dataSocket, [c]() { ReceiveDataPackets(c); }) &&
+          (c->commandSocket == -1 || loop.Add(c->commandSocket, [c]() {
+            while (ReceiveCommandPacket(c, MSG_DONTWAIT)) {}
+          }));
+    }
+    bReady = bReady &&
+        loop.AddTimer(1000, []() {
+          for (std::unique_ptr<sConnection> &conn : gConnections) {
+            if (conn->protocol.load()->major >= 3)
+              SendEchoRequest(conn.get());
+          }
+        }) &&
+        loop.AddTimer(COMMAND_POLL_MS, [&loop]() {
+          for (std::unique_ptr<sConnection> &conn : gConnections)
+            conn->commands.Poll();
+          if (gStopRequested)
+            loop.Stop();
+        }) &&
+        (bNodelet || loop.Add(STDIN_FILENO, [&loop]() {
+          char keys[64];
+          ssize_t nKeys = read(STDIN_FILENO, keys, sizeof(keys));
+          if (nKeys <= 0) {
+            // No console, e.g. when run as a daemon
+            loop.Remove(STDIN_FILENO);
+            return;
+          }
+          for (ssize_t i = 0; i < nKeys; i++) {
+            if (!HandleKey(keys[i]))
+              loop.Stop();
+          }
+        }));
+    if (!bReady) {
+      printf("[PacketClient] event loop setup failed\n");
+      return -1;
+    }
+    // SIGINT and SIGTERM end the loop like 'q'; a nodelet's belong to
+    // its manager
+    gEventLoop = &loop;
+    if (!bNodelet) {
+      struct sigaction action{};
+      action.sa_handler = StopEventLoop;
+      sigemptyset(&action.sa_mask);
+      sigaction(SIGINT, &action, nullptr);
+      sigaction(SIGTERM, &action, nullptr);
+    }
+  }
+
+
+  if (metricsPort > 0) {
+    MetricsSetSources(sources);
+    MetricsSetCollector(CollectMetrics);
+    if (!MetricsStart(metricsAddress.c_str(), metricsPort))
+      LOG_ERROR(LOG_CLASS_CLIENT,
+                "[PacketClient] cannot serve metrics on %s:%d\n",
+                metricsAddress.c_str(), metricsPort);
+  }
+
+
+  for (std::unique_ptr<sConnection> &conn : gConnections) {
+    // send initial connect request
+    sPacket PacketOut{};
+    PacketOut.iMessage = NAT_CONNECT;
+    PacketOut.nDataBytes = 0;
+    int nTries = 3;
+    while (nTries--) {
+      ssize_t iRet = sendto(conn->commandSocket,
+                            (char *) &PacketOut,
+                            4 + PacketOut.nDataBytes,
+                            0,
+                            (sockaddr *) &conn->hostAddr,
+                            sizeof(conn->hostAddr));
+      if (iRet != -1)
         break;
-      case 'q':bExit = true;
-        break;
-      default:break;
+      printf("[%s] Initial connect request failed\n", conn->source.c_str());
     }
+
+    // Model names are needed before bodies can be published by name,
+    // and a take starts with the models it records
+    if (conn->publishers->NeedsNames() || conn->take.IsOpen())
+      RequestModelDef(conn.get());
   }
 
+
+  // ================ Main menu
+  printf("Packet Client started\n\n");
+  if (!bNodelet) {
+    printf(
+        "Commands:"
+            "\ns\tsend data descriptions"
+            "\nf\tsend frame of data"
+            "\nt\tsend test request"
+            "\np\tprint pipeline statistics"
+            "\nl\tprint latency statistics"
+            "\nq\tquit\n\n");
+  }
+  if (gEventLoop != nullptr) {
+    if (!gEventLoop->Run())
+      LOG_ERROR(LOG_CLASS_CLIENT, "[PacketClient] event loop failed\n");
+  } else if (bNodelet) {
+    while (!gStopRequested)
+      std::this_thread::sleep_for(std::chrono::milliseconds(COMMAND_POLL_MS));
+  } else {
+    while (HandleKey(getchar())) {}
+  }
+
+  // Stop every thread before the sockets are closed
+  if (gEventLoop != nullptr) {
+    if (!bNodelet) {
+      signal(SIGINT, SIG_DFL);
+      signal(SIGTERM, SIG_DFL);
+    }
+    gEventLoop = nullptr;
+  }
+  MetricsStop();
+  bClockSync = false;
+  if (clockSyncThread.joinable())
+    clockSyncThread.join();
+  for (std::unique_ptr<sConnection> &conn : gConnections)
+    CloseConnection(conn.get());
+  LogStop();
+  for (std::unique_ptr<sConnection> &conn : gConnections) {
+    conn->frameBus.Close();
+    if (conn->capture.IsOpen()) {
+      printf("[%s] captured %" PRIu64 " packets\n",
+             conn->source.c_str(), conn->capture.Records());
+      conn->capture.Close();
+    }
+    CloseTake(conn.get());
+  }
+  gConnections.clear();
   return 0;
 }
+
+#ifndef PACKET_CLIENT_NODELET
+int main(int argc, char *argv[]) {
+  ros::init(argc, argv, "Mocap");
+
+  ros::NodeHandle nh;
+  ros::NodeHandle pnh("~");
+  return PacketClientRun(nh, pnh,
+                         std::vector<std::string>(argv + 1, argv + argc),
+                         false);
+}
+#endif
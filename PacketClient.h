@@ -0,0 +1,28 @@
+/*
+ * PacketClient.h
+ *
+ * The packet client as a function of its node handles, run by the
+ * PacketClient node and by the PacketClientNodelet. One client runs per
+ * process at a time.
+ */
+
+#ifndef PACKET_CLIENT_H
+#define PACKET_CLIENT_H
+
+#include <string>
+#include <vector>
+
+#include <ros/ros.h>
+
+// Connect to the servers configured under pnh and publish until quit.
+// args are the command line arguments after the program name. A nodelet
+// has no console menu or signal handlers and publishes by shared
+// pointer unless ~zero_copy is false; it runs until PacketClientStop().
+// Returns 0, or -1 if setup failed.
+int PacketClientRun(ros::NodeHandle &nh, ros::NodeHandle &pnh,
+                    const std::vector<std::string> &args, bool bNodelet);
+
+// Make a running PacketClientRun return; safe from any thread
+void PacketClientStop();
+
+#endif  // PACKET_CLIENT_H
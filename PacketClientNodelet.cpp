@@ -0,0 +1,43 @@
+/*
+ * PacketClientNodelet.cpp
+ *
+ * PacketClient as a nodelet. Loaded into the same manager as its
+ * consumers, with ~zero_copy (the default here), every pose reaches them
+ * as a shared pointer to the published message.
+ *
+ * onInit returns at once; the client runs on its own thread with the
+ * nodelet's multi-threaded node handles until the nodelet is unloaded.
+ */
+
+#include <thread>
+
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+#include "PacketClient.h"
+
+namespace packet_client {
+
+class PacketClientNodelet : public nodelet::Nodelet {
+ public:
+  ~PacketClientNodelet() override {
+    PacketClientStop();
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+ private:
+  void onInit() override {
+    thread_ = std::thread([this]() {
+      if (PacketClientRun(getMTNodeHandle(), getMTPrivateNodeHandle(),
+                          std::vector<std::string>(), true) != 0)
+        NODELET_ERROR("PacketClient setup failed");
+    });
+  }
+
+  std::thread thread_;
+};
+
+}  // namespace packet_client
+
+PLUGINLIB_EXPORT_CLASS(packet_client::PacketClientNodelet, nodelet::Nodelet)
@@ -0,0 +1,348 @@
+/*
+ * PacketPipeline.cpp
+ */
+
+#include "PacketPipeline.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+#include "Log.h"
+
+// Polls of an empty ring before a stage thread goes to sleep
+#define STAGE_SPIN_COUNT 200
+
+// Ancillary data room per datagram
+#define CONTROL_BUFFER_SIZE 64
+
+void StageSignal::Notify() {
+  // Pairs with the fence in Wait(): either the waiter sees the new item
+  // or we see it sleeping
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleeping_.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cv_.notify_one();
+  }
+}
+
+void StageSignal::NotifyAll() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  cv_.notify_all();
+}
+
+void StageSignal::Wait(const std::function<bool()> &ready) {
+  for (int i = 0; i < STAGE_SPIN_COUNT; i++) {
+    if (ready())
+      return;
+    std::this_thread::yield();
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  sleeping_.store(true, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  // The timeout only bounds the cost of a lost wakeup
+  cv_.wait_for(lock, std::chrono::milliseconds(10), ready);
+  sleeping_.store(false, std::memory_order_relaxed);
+}
+
+PacketPipeline::PacketPipeline(const sPipelineConfig &config)
+    : decodeQueue_(std::max(config.decodeDepth, (size_t) 1)),
+      publishQueue_(std::max(config.publishDepth, (size_t) 1)),
+      // slots being received, one in flight in the later stages,
+      // all others queued or free
+      freeSlots_(decodeQueue_.Capacity() + publishQueue_.Capacity() +
+          std::max(config.receiveBatch, (size_t) 1) + 2),
+      pool_(freeSlots_.Capacity()),
+      scratch_(MAX_DATAGRAM_SIZE),
+      receiveBatch_(std::max(config.receiveBatch, (size_t) 1)),
+      receiveFlags_(config.spin ? MSG_DONTWAIT : 0),
+      messages_(receiveBatch_),
+      iovecs_(receiveBatch_),
+      control_(receiveBatch_ * CONTROL_BUFFER_SIZE),
+      spin_(config.spin),
+      busyPollUs_(config.busyPollUs),
+      receiveCpu_(config.receiveCpu),
+      decodeCpu_(config.decodeCpu),
+      realtimePriority_(config.realtimePriority) {
+  for (size_t i = 0; i < pool_.size(); i++)
+    freeSlots_.Push(&pool_[i]);
+}
+
+PacketPipeline::~PacketPipeline() {
+  Stop();
+}
+
+void PacketPipeline::Start(int socket, DecodeStage decode,
+                           PublishStage publish) {
+  socket_ = socket;
+  if (!EnableReceiveTimestamps(socket_))
+    LOG_WARN(LOG_CLASS_CLIENT,
+             "[PacketPipeline] kernel timestamps unavailable\n");
+  if (!EnableReceiveOverflowCount(socket_))
+    LOG_WARN(LOG_CLASS_CLIENT,
+             "[PacketPipeline] kernel drop counts unavailable\n");
+  if (busyPollUs_ > 0 &&
+      setsockopt(socket_, SOL_SOCKET, SO_BUSY_POLL,
+                 &busyPollUs_, sizeof(busyPollUs_)) != 0)
+    LOG_WARN(LOG_CLASS_CLIENT,
+             "[PacketPipeline] SO_BUSY_POLL not set: %s\n", strerror(errno));
+  decode_ = decode;
+  publish_ = publish;
+  running_ = true;
+  publishThread_ = std::thread(&PacketPipeline::PublishLoop, this);
+  decodeThread_ = std::thread(&PacketPipeline::DecodeLoop, this);
+  receiveThread_ = std::thread(&PacketPipeline::ReceiveLoop, this);
+}
+
+void PacketPipeline::Stop() {
+  if (!running_.exchange(false))
+    return;
+
+  // Wakes the receive thread from its blocking receive call
+  shutdown(socket_, SHUT_RD);
+  decodeSignal_.NotifyAll();
+  publishSignal_.NotifyAll();
+
+  receiveThread_.join();
+  decodeThread_.join();
+  publishThread_.join();
+}
+
+sPipelineStats PacketPipeline::GetStats() const {
+  sPipelineStats stats;
+  stats.received = received_.load(std::memory_order_relaxed);
+  stats.receiveCalls = receiveCalls_.load(std::memory_order_relaxed);
+  stats.dropped = dropped_.load(std::memory_order_relaxed);
+  stats.decodeErrors = decodeErrors_.load(std::memory_order_relaxed);
+  stats.decodeStalls = decodeStalls_.load(std::memory_order_relaxed);
+  stats.published = published_.load(std::memory_order_relaxed);
+  stats.decodeQueue = sRingStats{decodeQueue_.Capacity(),
+                                 decodeQueue_.Size(),
+                                 decodeQueue_.HighWater()};
+  stats.publishQueue = sRingStats{publishQueue_.Capacity(),
+                                  publishQueue_.Size(),
+                                  publishQueue_.HighWater()};
+  return stats;
+}
+
+// Pin the calling thread and raise its priority as configured
+static void ConfigureStageThread(const char *name, int cpu, int priority) {
+  if (cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err != 0)
+      LOG_WARN(LOG_CLASS_CLIENT,
+               "[PacketPipeline] cannot pin %s thread to cpu %d: %s\n",
+               name, cpu, strerror(err));
+  }
+  if (priority > 0) {
+    sched_param param{};
+    param.sched_priority = priority;
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err != 0)
+      LOG_WARN(LOG_CLASS_CLIENT,
+               "[PacketPipeline] no SCHED_FIFO for %s thread: %s\n",
+               name, strerror(err));
+  }
+}
+
+void PacketPipeline::ReceiveLoop() {
+  ConfigureStageThread("receive", receiveCpu_, realtimePriority_);
+
+  // Slots owned by the receive thread, refilled from the free ring
+  std::vector<sPacketSlot *> slots;
+  slots.reserve(receiveBatch_);
+
+  while (running_.load(std::memory_order_relaxed)) {
+    sPacketSlot *slot;
+    while (slots.size() < receiveBatch_ && freeSlots_.Pop(&slot))
+      slots.push_back(slot);
+    if (slots.empty()) {
+      // Every slot is in flight; keep draining the socket anyway
+      if (recv(socket_, scratch_.data(), scratch_.size(), receiveFlags_) > 0)
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+
+    int nReceived = ReceiveBatch(slots.data(), slots.size());
+    if (nReceived <= 0 || !running_.load(std::memory_order_relaxed))
+      continue;
+    received_.fetch_add(nReceived, std::memory_order_relaxed);
+    receiveCalls_.fetch_add(1, std::memory_order_relaxed);
+
+    // Hand over what the decoder accepts and keep the rest,
+    // including unused slots, for the next call
+    size_t nKept = 0;
+    bool bPushed = false;
+    for (size_t i = 0; i < slots.size(); i++) {
+      if ((int) i < nReceived)
+        slots[i]->pipelineDrops = dropped_.load(std::memory_order_relaxed);
+      if ((int) i < nReceived && decodeQueue_.Push(slots[i])) {
+        bPushed = true;
+        continue;
+      }
+      if ((int) i < nReceived) {
+        // Decoder is behind; the slot is reused
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+      }
+      slots[nKept++] = slots[i];
+    }
+    slots.resize(nKept);
+    if (bPushed)
+      decodeSignal_.Notify();
+  }
+}
+
+// Arrival time from SCM_TIMESTAMPNS, or now if the kernel sent none,
+// and the socket drop count from SO_RXQ_OVFL, sent once it is non-zero
+static void ReadAncillaryData(msghdr *message, sPacketSlot *slot) {
+  bool bTimestamp = false;
+  slot->kernelDrops = 0;
+  for (cmsghdr *cmsg = CMSG_FIRSTHDR(message); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(message, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET)
+      continue;
+    if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      memcpy(&slot->arrival, CMSG_DATA(cmsg), sizeof(timespec));
+      bTimestamp = true;
+    } else if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+      memcpy(&slot->kernelDrops, CMSG_DATA(cmsg), sizeof(uint32_t));
+    }
+  }
+  if (!bTimestamp)
+    clock_gettime(CLOCK_REALTIME, &slot->arrival);
+}
+
+bool EnableReceiveTimestamps(int socket) {
+  int value = 1;
+  return setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPNS,
+                    &value, sizeof(value)) == 0;
+}
+
+bool EnableReceiveOverflowCount(int socket) {
+  int value = 1;
+  return setsockopt(socket, SOL_SOCKET, SO_RXQ_OVFL,
+                    &value, sizeof(value)) == 0;
+}
+
+bool ReceiveDatagram(int socket, sPacketSlot *slot, int flags) {
+  char control[CONTROL_BUFFER_SIZE];
+  iovec iov{slot->data, sizeof(slot->data)};
+  msghdr hdr{};
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  hdr.msg_control = control;
+  hdr.msg_controllen = sizeof(control);
+  ssize_t nBytes = recvmsg(socket, &hdr, flags);
+  if (nBytes <= 0)
+    return false;
+  slot->nBytes = (size_t) nBytes;
+  clock_gettime(CLOCK_REALTIME, &slot->received);
+  ReadAncillaryData(&hdr, slot);
+  return true;
+}
+
+int PacketPipeline::ReceiveBatch(sPacketSlot **slots, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    iovecs_[i].iov_base = slots[i]->data;
+    iovecs_[i].iov_len = sizeof(slots[i]->data);
+    msghdr &hdr = messages_[i].msg_hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iovecs_[i];
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = &control_[i * CONTROL_BUFFER_SIZE];
+    hdr.msg_controllen = CONTROL_BUFFER_SIZE;
+  }
+
+  int nReceived;
+  if (count == 1) {
+    // One datagram per syscall
+    ssize_t nBytes = recvmsg(socket_, &messages_[0].msg_hdr, receiveFlags_);
+    if (nBytes <= 0)
+      return 0;
+    messages_[0].msg_len = (unsigned int) nBytes;
+    nReceived = 1;
+  } else {
+    // Block for the first datagram, then take whatever else is queued
+    nReceived = recvmmsg(socket_, messages_.data(), (unsigned int) count,
+                         spin_ ? MSG_DONTWAIT : MSG_WAITFORONE, nullptr);
+  }
+
+  timespec received;
+  if (nReceived > 0)
+    clock_gettime(CLOCK_REALTIME, &received);
+  for (int i = 0; i < nReceived; i++) {
+    slots[i]->nBytes = messages_[i].msg_len;
+    slots[i]->received = received;
+    ReadAncillaryData(&messages_[i].msg_hdr, slots[i]);
+  }
+  return nReceived;
+}
+
+void PacketPipeline::DecodeLoop() {
+  ConfigureStageThread("decode", decodeCpu_, realtimePriority_);
+
+  std::function<bool()> ready = [this]() {
+    return !decodeQueue_.Empty() || !running_.load(std::memory_order_relaxed);
+  };
+
+  while (true) {
+    sPacketSlot *slot;
+    if (!decodeQueue_.Pop(&slot)) {
+      if (!running_.load(std::memory_order_relaxed))
+        break;
+      if (!spin_)
+        decodeSignal_.Wait(ready);
+      continue;
+    }
+
+    slot->valid = decode_(slot);
+    clock_gettime(CLOCK_REALTIME, &slot->decoded);
+    if (!slot->valid)
+      decodeErrors_.fetch_add(1, std::memory_order_relaxed);
+
+    // Discarded slots still go through the publish thread,
+    // which is the only producer of the free ring
+    if (!publishQueue_.Push(slot)) {
+      decodeStalls_.fetch_add(1, std::memory_order_relaxed);
+      while (!publishQueue_.Push(slot)) {
+        if (!running_.load(std::memory_order_relaxed))
+          return;
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+      }
+    }
+    publishSignal_.Notify();
+  }
+}
+
+void PacketPipeline::PublishLoop() {
+  std::function<bool()> ready = [this]() {
+    return !publishQueue_.Empty() ||
+        !running_.load(std::memory_order_relaxed);
+  };
+
+  while (true) {
+    sPacketSlot *slot;
+    if (!publishQueue_.Pop(&slot)) {
+      if (!running_.load(std::memory_order_relaxed))
+        break;
+      publishSignal_.Wait(ready);
+      continue;
+    }
+
+    if (slot->valid) {
+      publish_(slot);
+      published_.fetch_add(1, std::memory_order_relaxed);
+    }
+    freeSlots_.Push(slot);
+  }
+}
@@ -0,0 +1,175 @@
+/*
+ * PacketPipeline.h
+ *
+ * Staged receive -> decode -> publish pipeline for the data socket.
+ *
+ * The receive thread only drains the socket into a preallocated pool of
+ * packet slots. Slots travel to the decode and publish threads through
+ * single-producer/single-consumer rings and come back to the receive
+ * thread through a free ring, so no stage allocates or takes a lock on
+ * the packet path. When the decode ring is full the newest datagram is
+ * dropped instead of blocking recvfrom.
+ *
+ * With a receive batch above one, the receive thread drains up to that
+ * many pending datagrams per recvmmsg call. Every slot carries the
+ * kernel receive timestamp (SO_TIMESTAMPNS) of its datagram and the
+ * drop counts of the socket (SO_RXQ_OVFL) and of the pipeline up to it.
+ *
+ * In spin mode the receive thread polls the socket with non-blocking
+ * reads and the decode thread polls its ring instead of sleeping, which
+ * costs two busy cores but removes the scheduler wakeup from the packet
+ * path. Either thread can be pinned to a core and run under SCHED_FIFO;
+ * that needs CAP_SYS_NICE or an rtprio limit, and a failure only warns.
+ */
+
+#ifndef PACKET_PIPELINE_H
+#define PACKET_PIPELINE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <time.h>
+
+#include "NatNetFrame.h"
+#include "SpscRing.h"
+
+#define MAX_DATAGRAM_SIZE 65536
+
+struct sPacketSlot {
+  size_t nBytes = 0;
+  timespec arrival{};         // kernel receive time, CLOCK_REALTIME
+  timespec received{};        // receive call returned, CLOCK_REALTIME
+  uint32_t kernelDrops = 0;   // SO_RXQ_OVFL: socket drops so far
+  uint64_t pipelineDrops = 0; // pipeline drops before this datagram
+  timespec decoded{};         // decode stage finished, CLOCK_REALTIME
+  bool isFrame = false;       // frame holds the decoded NAT_FRAMEOFDATA
+  bool valid = false;         // set from the decode stage result
+  int natNetMajor = 0;        // protocol version frame was decoded with
+  int natNetMinor = 0;
+  FrameOfMocapData frame;
+  char data[MAX_DATAGRAM_SIZE];
+};
+
+struct sRingStats {
+  size_t depth;
+  size_t occupancy;
+  size_t highWater;
+};
+
+struct sPipelineStats {
+  uint64_t received;          // datagrams read from the socket
+  uint64_t receiveCalls;      // receive syscalls that returned data
+  uint64_t dropped;           // no free slot or decode ring full
+  uint64_t decodeErrors;      // rejected by the decode stage
+  uint64_t decodeStalls;      // decode waited for a full publish ring
+  uint64_t published;
+  sRingStats decodeQueue;
+  sRingStats publishQueue;
+};
+
+// Ask for kernel receive timestamps (SO_TIMESTAMPNS) on a socket
+bool EnableReceiveTimestamps(int socket);
+// Ask for the socket's drop count (SO_RXQ_OVFL) with every datagram
+bool EnableReceiveOverflowCount(int socket);
+// Read one datagram and its arrival time into slot, for callers that
+// run the stages themselves; false if nothing was read
+bool ReceiveDatagram(int socket, sPacketSlot *slot, int flags);
+
+// Decode stage; returns false to discard the packet
+typedef std::function<bool(sPacketSlot *)> DecodeStage;
+typedef std::function<void(const sPacketSlot *)> PublishStage;
+
+// Wakes a stage thread that went to sleep on an empty ring
+class StageSignal {
+ public:
+  void Notify();
+  void NotifyAll();
+  // Spin briefly, then sleep until ready() or a short timeout
+  void Wait(const std::function<bool()> &ready);
+
+ private:
+  std::atomic<bool> sleeping_{false};
+  std::mutex mutex_;
+  std::condition_variable cv_;
+};
+
+struct sPipelineConfig {
+  size_t decodeDepth = 64;
+  size_t publishDepth = 64;
+  size_t receiveBatch = 1;    // datagrams per receive syscall
+  bool spin = false;          // poll socket and decode ring, never sleep
+  int busyPollUs = 0;         // SO_BUSY_POLL on the socket, 0 for none
+  int receiveCpu = -1;        // core of the receive thread, -1 for any
+  int decodeCpu = -1;         // core of the decode thread, -1 for any
+  int realtimePriority = 0;   // SCHED_FIFO priority of both, 0 for none
+};
+
+class PacketPipeline {
+ public:
+  explicit PacketPipeline(const sPipelineConfig &config);
+  ~PacketPipeline();
+
+  PacketPipeline(const PacketPipeline &) = delete;
+  PacketPipeline &operator=(const PacketPipeline &) = delete;
+
+  // Start the receive, decode and publish threads on a bound socket
+  void Start(int socket, DecodeStage decode, PublishStage publish);
+  // Stop and join all stages; the socket can no longer be read
+  void Stop();
+
+  sPipelineStats GetStats() const;
+
+ private:
+  void ReceiveLoop();
+  // Receive into up to count slots; returns the number filled
+  int ReceiveBatch(sPacketSlot **slots, size_t count);
+  void DecodeLoop();
+  void PublishLoop();
+
+  int socket_ = -1;
+  DecodeStage decode_;
+  PublishStage publish_;
+
+  SpscRing<sPacketSlot *> decodeQueue_;
+  SpscRing<sPacketSlot *> publishQueue_;
+  SpscRing<sPacketSlot *> freeSlots_;     // publish -> receive
+  std::vector<sPacketSlot> pool_;
+  std::vector<char> scratch_;             // sink for dropped datagrams
+
+  // recvmmsg descriptors, owned by the receive thread
+  size_t receiveBatch_;
+  int receiveFlags_;          // MSG_DONTWAIT when spinning
+  std::vector<mmsghdr> messages_;
+  std::vector<iovec> iovecs_;
+  std::vector<char> control_;
+
+  bool spin_;
+  int busyPollUs_;
+  int receiveCpu_;
+  int decodeCpu_;
+  int realtimePriority_;
+
+  StageSignal decodeSignal_;
+  StageSignal publishSignal_;
+  std::atomic<bool> running_{false};
+
+  std::atomic<uint64_t> received_{0};
+  std::atomic<uint64_t> receiveCalls_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<uint64_t> decodeErrors_{0};
+  std::atomic<uint64_t> decodeStalls_{0};
+  std::atomic<uint64_t> published_{0};
+
+  std::thread receiveThread_;
+  std::thread decodeThread_;
+  std::thread publishThread_;
+};
+
+#endif  // PACKET_PIPELINE_H
@@ -0,0 +1,202 @@
+/*
+ * PosePredictor.cpp
+ */
+
+#include "PosePredictor.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Quaternions are x, y, z, w
+static void Multiply(const double a[4], const double b[4], double out[4]) {
+  double x = a[3] * b[0] + a[0] * b[3] + a[1] * b[2] - a[2] * b[1];
+  double y = a[3] * b[1] - a[0] * b[2] + a[1] * b[3] + a[2] * b[0];
+  double z = a[3] * b[2] + a[0] * b[1] - a[1] * b[0] + a[2] * b[3];
+  double w = a[3] * b[3] - a[0] * b[0] - a[1] * b[1] - a[2] * b[2];
+  out[0] = x;
+  out[1] = y;
+  out[2] = z;
+  out[3] = w;
+}
+
+static void Normalize(double q[4]) {
+  double n = std::sqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+  if (n == 0.0) {
+    q[0] = q[1] = q[2] = 0.0;
+    q[3] = 1.0;
+    return;
+  }
+  for (int i = 0; i < 4; i++)
+    q[i] /= n;
+}
+
+// Rotation vector (axis * angle) of a unit quaternion, shortest way round
+static void ToRotationVector(const double q[4], double rv[3]) {
+  double sign = q[3] < 0.0 ? -1.0 : 1.0;
+  double s = std::sqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2]);
+  double angle = 2.0 * std::atan2(s, sign * q[3]);
+  double k = s > 1e-12 ? sign * angle / s : 2.0 * sign;
+  for (int i = 0; i < 3; i++)
+    rv[i] = q[i] * k;
+}
+
+static void FromRotationVector(const double rv[3], double q[4]) {
+  double angle = std::sqrt(rv[0] * rv[0] + rv[1] * rv[1] + rv[2] * rv[2]);
+  double k = angle > 1e-12 ? std::sin(angle / 2.0) / angle : 0.5;
+  for (int i = 0; i < 3; i++)
+    q[i] = rv[i] * k;
+  q[3] = std::cos(angle / 2.0);
+}
+
+// Orientation q rotated by angular velocity w over dt seconds
+static void Rotate(const double q[4], const double w[3], double dt,
+                   double out[4]) {
+  double rv[3] = {w[0] * dt, w[1] * dt, w[2] * dt};
+  double dq[4];
+  FromRotationVector(rv, dq);
+  Multiply(dq, q, out);
+  Normalize(out);
+}
+
+// Angle between two orientations
+static double AngleBetween(const double a[4], const double b[4]) {
+  double dot = std::fabs(a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3]);
+  return 2.0 * std::acos(std::min(dot, 1.0));
+}
+
+PosePredictor::PosePredictor(const sPosePredictorConfig &config)
+    : config_(config) {
+  config_.history = std::max(2, std::min(config_.history,
+                                         POSE_PREDICTOR_MAX_HISTORY));
+  config_.maxHorizon = std::max(config_.maxHorizon, 0.0);
+}
+
+void PosePredictor::Fit(sBody *body) const {
+  int n = body->nSamples;
+  const sSample &oldest = body->samples[0];
+  const sSample &newest = body->samples[n - 1];
+  double span = newest.t - oldest.t;
+  if (span <= 0.0) {
+    body->hasVelocity = false;
+    return;
+  }
+
+  // Least squares slope; times relative to the newest keep precision
+  double tMean = 0.0, pMean[3] = {0.0, 0.0, 0.0};
+  for (int i = 0; i < n; i++) {
+    tMean += body->samples[i].t - newest.t;
+    for (int k = 0; k < 3; k++)
+      pMean[k] += body->samples[i].p[k];
+  }
+  tMean /= n;
+  for (int k = 0; k < 3; k++)
+    pMean[k] /= n;
+  double stt = 0.0, stp[3] = {0.0, 0.0, 0.0};
+  for (int i = 0; i < n; i++) {
+    double dt = body->samples[i].t - newest.t - tMean;
+    stt += dt * dt;
+    for (int k = 0; k < 3; k++)
+      stp[k] += dt * (body->samples[i].p[k] - pMean[k]);
+  }
+  for (int k = 0; k < 3; k++)
+    body->v[k] = stp[k] / stt;
+
+  // newest = delta * oldest, delta in the world frame
+  double inverse[4] = {-oldest.q[0], -oldest.q[1], -oldest.q[2], oldest.q[3]};
+  double delta[4], rv[3];
+  Multiply(newest.q, inverse, delta);
+  ToRotationVector(delta, rv);
+  for (int k = 0; k < 3; k++)
+    body->w[k] = rv[k] / span;
+  body->hasVelocity = true;
+}
+
+bool PosePredictor::Predict(const sRigidBodyData &rb, double sampleTime,
+                            double horizon, sRigidBodyData *predicted) {
+  *predicted = rb;
+  std::lock_guard<std::mutex> lock(mutex_);
+  sBody &body = bodies_[rb.ID];
+  if (!rb.TrackingValid()) {
+    body.nSamples = 0;
+    body.hasVelocity = false;
+    raw_++;
+    return false;
+  }
+
+  sSample sample;
+  sample.t = sampleTime;
+  sample.p[0] = rb.x;
+  sample.p[1] = rb.y;
+  sample.p[2] = rb.z;
+  sample.q[0] = rb.qx;
+  sample.q[1] = rb.qy;
+  sample.q[2] = rb.qz;
+  sample.q[3] = rb.qw;
+  Normalize(sample.q);
+
+  if (body.nSamples > 0) {
+    const sSample &last = body.samples[body.nSamples - 1];
+    double dt = sampleTime - last.t;
+    if (dt <= 0.0 || dt > POSE_PREDICTOR_MAX_GAP) {
+      // Out of order, or too long ago to say anything about now
+      body.nSamples = 0;
+      body.hasVelocity = false;
+    } else if (body.hasVelocity) {
+      double error2 = 0.0;
+      for (int k = 0; k < 3; k++) {
+        double e = last.p[k] + body.v[k] * dt - sample.p[k];
+        error2 += e * e;
+      }
+      double expected[4];
+      Rotate(last.q, body.w, dt, expected);
+      if (error2 > config_.maxError * config_.maxError ||
+          AngleBetween(expected, sample.q) > config_.maxAngleError) {
+        body.nSamples = 0;
+        body.hasVelocity = false;
+        rejected_++;
+      }
+    }
+  }
+
+  if (body.nSamples == config_.history) {
+    std::move(body.samples + 1, body.samples + body.nSamples, body.samples);
+    body.nSamples--;
+  }
+  body.samples[body.nSamples++] = sample;
+  if (body.nSamples < config_.history) {
+    // Too few poses for a velocity that would pass the error bound
+    body.hasVelocity = false;
+    raw_++;
+    return false;
+  }
+  Fit(&body);
+  if (!body.hasVelocity || horizon <= 0.0) {
+    raw_++;
+    return false;
+  }
+
+  if (horizon > config_.maxHorizon) {
+    horizon = config_.maxHorizon;
+    clamped_++;
+  }
+  double q[4];
+  Rotate(sample.q, body.w, horizon, q);
+  predicted->x = (float) (sample.p[0] + body.v[0] * horizon);
+  predicted->y = (float) (sample.p[1] + body.v[1] * horizon);
+  predicted->z = (float) (sample.p[2] + body.v[2] * horizon);
+  predicted->qx = (float) q[0];
+  predicted->qy = (float) q[1];
+  predicted->qz = (float) q[2];
+  predicted->qw = (float) q[3];
+  predicted_++;
+  return true;
+}
+
+sPosePredictorStats PosePredictor::GetStats() const {
+  sPosePredictorStats stats;
+  stats.predicted = predicted_.load(std::memory_order_relaxed);
+  stats.clamped = clamped_.load(std::memory_order_relaxed);
+  stats.raw = raw_.load(std::memory_order_relaxed);
+  stats.rejected = rejected_.load(std::memory_order_relaxed);
+  return stats;
+}
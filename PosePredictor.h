@@ -0,0 +1,91 @@
+/*
+ * PosePredictor.h
+ *
+ * Latency compensation of rigid body poses.
+ *
+ * Each body keeps its last few tracked poses with their capture times
+ * (mid-exposure on the server clock, or the frame timestamp before
+ * NatNet 3.0). Linear velocity is the least squares slope of the
+ * positions over that history; angular velocity is the rotation from the
+ * oldest to the newest orientation divided by the time between them.
+ * A pose is then extrapolated by its age at publishing, so that it
+ * describes the body at the publish instant rather than at exposure.
+ *
+ * The horizon is clamped to maxHorizon. Every new pose is also compared
+ * with where the previous estimate put it: when the position or angle
+ * error exceeds its bound (an impact, a tracking swap) the history is
+ * restarted and raw poses are published until it has refilled. Lost
+ * tracking and gaps longer than POSE_PREDICTOR_MAX_GAP restart it too.
+ */
+
+#ifndef POSE_PREDICTOR_H
+#define POSE_PREDICTOR_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+#include "NatNetFrame.h"
+
+#define POSE_PREDICTOR_MAX_HISTORY  16
+#define POSE_PREDICTOR_MAX_GAP      0.25    // seconds
+
+struct sPosePredictorConfig {
+  int history = 4;                // poses in the velocity fit, 2 or more
+  double maxHorizon = 0.05;       // seconds
+  double maxError = 0.02;         // meters
+  double maxAngleError = 0.1;     // radians
+};
+
+struct sPosePredictorStats {
+  uint64_t predicted;             // poses published extrapolated
+  uint64_t clamped;               // ... whose horizon exceeded maxHorizon
+  uint64_t raw;                   // poses published as received
+  uint64_t rejected;              // history restarts on a large error
+};
+
+class PosePredictor {
+ public:
+  explicit PosePredictor(const sPosePredictorConfig &config);
+  PosePredictor(const PosePredictor &) = delete;
+  PosePredictor &operator=(const PosePredictor &) = delete;
+
+  // Add a pose of rb.ID captured at sampleTime (seconds on the server
+  // clock) and return it extrapolated by horizon seconds; false if it
+  // was returned unchanged
+  bool Predict(const sRigidBodyData &rb, double sampleTime, double horizon,
+               sRigidBodyData *predicted);
+
+  // May be called from any thread
+  sPosePredictorStats GetStats() const;
+
+ private:
+  struct sSample {
+    double t;
+    double p[3];
+    double q[4];                  // x, y, z, w
+  };
+
+  struct sBody {
+    sSample samples[POSE_PREDICTOR_MAX_HISTORY];
+    int nSamples = 0;             // oldest is samples[0]
+    bool hasVelocity = false;
+    double v[3];                  // m/s
+    double w[3];                  // rad/s, world frame
+  };
+
+  // Velocity estimate over the history of a body
+  void Fit(sBody *body) const;
+
+  sPosePredictorConfig config_;
+  std::mutex mutex_;
+  std::unordered_map<int, sBody> bodies_;
+
+  std::atomic<uint64_t> predicted_{0};
+  std::atomic<uint64_t> clamped_{0};
+  std::atomic<uint64_t> raw_{0};
+  std::atomic<uint64_t> rejected_{0};
+};
+
+#endif  // POSE_PREDICTOR_H
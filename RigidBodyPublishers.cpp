@@ -0,0 +1,143 @@
+/*
+ * RigidBodyPublishers.cpp
+ */
+
+#include "RigidBodyPublishers.h"
+
+#include <cctype>
+
+#include <boost/make_shared.hpp>
+
+// Messages in flight per rigid body before new ones are allocated
+#define MESSAGE_POOL_SIZE 8
+
+// Replace every occurrence of key in str
+static void ReplaceAll(std::string *str,
+                       const std::string &key,
+                       const std::string &value) {
+  size_t pos = 0;
+  while ((pos = str->find(key, pos)) != std::string::npos) {
+    str->replace(pos, key.size(), value);
+    pos += value.size();
+  }
+}
+
+// Model names may hold characters that are not valid in a ROS name
+static std::string SanitizeName(const std::string &name) {
+  std::string sanitized(name);
+  for (char &c : sanitized) {
+    if (!isalnum((unsigned char) c) && c != '_')
+      c = '_';
+  }
+  if (sanitized.empty() || isdigit((unsigned char) sanitized[0]))
+    sanitized.insert(0, "_");
+  return sanitized;
+}
+
+RigidBodyPublishers::RigidBodyPublishers(ros::NodeHandle &nh,
+                                         const std::string &topicTemplate,
+                                         const std::string &source,
+                                         const std::string &frameId,
+                                         uint32_t queueSize,
+                                         bool zeroCopy)
+    : nh_(nh),
+      topicTemplate_(topicTemplate),
+      frameId_(frameId),
+      queueSize_(queueSize),
+      zeroCopy_(zeroCopy) {
+  // The source is fixed, unlike names
+  ReplaceAll(&topicTemplate_, "{source}", SanitizeName(source));
+  ReplaceAll(&frameId_, "{source}", SanitizeName(source));
+}
+
+bool RigidBodyPublishers::NeedsNames() const {
+  return topicTemplate_.find("{name}") != std::string::npos;
+}
+
+void RigidBodyPublishers::SetName(int ID, const std::string &name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto named = names_.find(ID);
+  if (named != names_.end() && named->second == name)
+    return;
+  names_[ID] = name;
+  // A renamed body moves to its new topic on the next frame
+  if (NeedsNames())
+    entries_.erase(ID);
+}
+
+std::string RigidBodyPublishers::TopicFor(int ID,
+                                          const std::string &name) const {
+  std::string topic(topicTemplate_);
+  ReplaceAll(&topic, "{id}", std::to_string(ID));
+  ReplaceAll(&topic, "{name}", SanitizeName(name));
+  return topic;
+}
+
+RigidBodyPublishers::sEntry *RigidBodyPublishers::Lookup(int ID) {
+  auto it = entries_.find(ID);
+  if (it != entries_.end())
+    return &it->second;
+
+  std::string name;
+  if (NeedsNames()) {
+    auto named = names_.find(ID);
+    if (named == names_.end())
+      return nullptr;
+    name = named->second;
+  }
+
+  std::string topic = TopicFor(ID, name);
+  auto advertised = topics_.find(topic);
+  if (advertised == topics_.end()) {
+    ROS_INFO("Publishing rigid body %d on %s", ID, topic.c_str());
+    advertised = topics_.insert(std::make_pair(
+        topic,
+        nh_.advertise<geometry_msgs::PoseStamped>(topic, queueSize_))).first;
+  }
+
+  sEntry &entry = entries_[ID];
+  entry.pub = &advertised->second;
+  entry.pose.header.frame_id = frameId_;
+  if (zeroCopy_)
+    entry.pool.resize(MESSAGE_POOL_SIZE);
+  return &entry;
+}
+
+geometry_msgs::PoseStampedPtr RigidBodyPublishers::Recycle(sEntry *entry) {
+  geometry_msgs::PoseStampedPtr &msg = entry->pool[entry->next];
+  entry->next = (entry->next + 1) % entry->pool.size();
+  // Still queued by roscpp or kept by a subscriber, which owns it now
+  if (!msg || msg.use_count() > 1) {
+    msg = boost::make_shared<geometry_msgs::PoseStamped>();
+    msg->header.frame_id = frameId_;
+  }
+  return msg;
+}
+
+void RigidBodyPublishers::Publish(const sRigidBodyData &rb,
+                                  const ros::Time &stamp) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  sEntry *entry = Lookup(rb.ID);
+  if (entry == nullptr)
+    return;
+
+  geometry_msgs::PoseStampedPtr msg;
+  if (zeroCopy_)
+    msg = Recycle(entry);
+  geometry_msgs::PoseStamped &pose = msg ? *msg : entry->pose;
+  pose.header.stamp = stamp;
+  pose.pose.position.x = rb.x;
+  pose.pose.position.y = rb.y;
+  pose.pose.position.z = rb.z;
+
+  pose.pose.orientation.x = rb.qx;
+  pose.pose.orientation.y = rb.qy;
+  pose.pose.orientation.z = rb.qz;
+  pose.pose.orientation.w = rb.qw;
+
+  // By pointer, roscpp hands the message itself to local subscribers
+  if (msg)
+    entry->pub->publish(msg);
+  else
+    entry->pub->publish(pose);
+}
@@ -0,0 +1,83 @@
+/*
+ * RigidBodyPublishers.h
+ *
+ * Registry of ROS pose publishers, one per streamed rigid body.
+ *
+ * Topics are built from a template in which "{id}" is replaced by the
+ * streamed rigid body ID, "{name}" by its model name from the data
+ * descriptions and "{source}" by the name of the Motive server, which
+ * may also appear in the frame ID. Bodies that resolve to the same topic
+ * share a publisher, so a template without placeholders publishes every
+ * body on one topic.
+ * Each body owns a preallocated PoseStamped that is reused every frame.
+ *
+ * With zeroCopy, messages are published by shared pointer instead, from
+ * a small per-body pool. Subscribers in the same process, such as
+ * nodelets in the client's manager, then receive the message itself
+ * without serialization or copy. A pooled message is only refilled once
+ * roscpp and every subscriber have released it.
+ */
+
+#ifndef RIGID_BODY_PUBLISHERS_H
+#define RIGID_BODY_PUBLISHERS_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <ros/ros.h>
+#include <geometry_msgs/PoseStamped.h>
+
+#include "NatNetFrame.h"
+
+class RigidBodyPublishers {
+ public:
+  RigidBodyPublishers(ros::NodeHandle &nh,
+                      const std::string &topicTemplate,
+                      const std::string &source,
+                      const std::string &frameId,
+                      uint32_t queueSize,
+                      bool zeroCopy = false);
+
+  // True if topics depend on model names from the data descriptions
+  bool NeedsNames() const;
+
+  // Model name of a rigid body, from the data descriptions
+  void SetName(int ID, const std::string &name);
+
+  // Publish one rigid body. Bodies whose topic needs a name that is
+  // not known yet are skipped.
+  void Publish(const sRigidBodyData &rb, const ros::Time &stamp);
+
+ private:
+  struct sEntry {
+    ros::Publisher *pub;
+    geometry_msgs::PoseStamped pose;
+    // Messages published by pointer, when zeroCopy_
+    std::vector<geometry_msgs::PoseStampedPtr> pool;
+    size_t next = 0;
+  };
+
+  // Publisher for a rigid body, created on first use; mutex_ held
+  sEntry *Lookup(int ID);
+  // Next pooled message that nobody holds any more; mutex_ held
+  geometry_msgs::PoseStampedPtr Recycle(sEntry *entry);
+  std::string TopicFor(int ID, const std::string &name) const;
+
+  ros::NodeHandle nh_;
+  std::string topicTemplate_;
+  std::string frameId_;
+  uint32_t queueSize_;
+  bool zeroCopy_;
+
+  // Frames are published from the data and command threads
+  std::mutex mutex_;
+  std::unordered_map<int, sEntry> entries_;
+  std::map<std::string, ros::Publisher> topics_;
+  std::unordered_map<int, std::string> names_;
+};
+
+#endif  // RIGID_BODY_PUBLISHERS_H
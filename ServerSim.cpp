@@ -0,0 +1,463 @@
+/*
+ * ServerSim.cpp
+ *
+ * Stand-in for a Motive server, for testing the client without one.
+ *
+ * Answers NAT_CONNECT with NAT_SERVERINFO, NAT_REQUEST_MODELDEF with the
+ * data descriptions of a synthetic scene, NAT_REQUEST_FRAMEOFDATA with
+ * the latest frame, NAT_ECHOREQUEST with its clock and every NAT_REQUEST
+ * command with success. Frames of the scene are streamed to the
+ * multicast group on PORT_DATA, or to a unicast address, at a fixed
+ * rate; losses, reordering and duplicates can be induced to exercise
+ * the client's continuity tracking.
+ *
+ * Usage:
+ *
+ *   ServerSim [-v 3.0] [-F rate] [-n frames] [-a localIP]
+ *             [-g multicastGroup | -u unicastIP] [-T ttl]
+ *             [-L loss%] [-O reorder%] [-D duplicate%] [-S seed]
+ *             [-m markerSets] [-k markersPerSet] [-o otherMarkers]
+ *             [-r rigidBodies] [-R markersPerRigidBody]
+ *             [-s skeletons] [-b bonesPerSkeleton]
+ *             [-l labeledMarkers] [-f forcePlates] [-c channels]
+ *
+ *   -a binds the command socket and sends multicast from this address.
+ *   -u 127.0.0.1 streams over loopback, which needs no multicast route:
+ *      ./ServerSim -u 127.0.0.1 & ./PacketClient 127.0.0.1 127.0.0.1
+ *   -O holds a frame back and sends it after the next one.
+ *
+ * Timestamps are taken from a 10 MHz tick count of CLOCK_MONOTONIC when
+ * a frame is sent, so the client's latency report is meaningful. The
+ * counts of sent, dropped, reordered and duplicated frames are printed
+ * every second; SIGINT or SIGTERM stop the server.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cinttypes>
+#include <csignal>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "NatNetFrame.h"
+#include "NatNetTypes.h"
+#include "SyntheticFrames.h"
+
+// Server clock, as Motive's high resolution timestamps
+#define SIM_CLOCK_FREQUENCY 10000000ULL
+
+// Largest payload of one UDP datagram
+#define SIM_MAX_DATAGRAM 65507
+
+static std::atomic<bool> gRunning(true);
+
+static void Stop(int signum) {
+  gRunning = false;
+}
+
+static uint64_t MonotonicNs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static uint64_t NowTicks() {
+  return MonotonicNs() / (1000000000ULL / SIM_CLOCK_FREQUENCY);
+}
+
+struct sSimConfig {
+  int major = 3;
+  int minor = 0;
+  double frameRate = 120.0;
+  uint64_t nFrames = 0;                   // 0 for no limit
+  in_addr localAddress{};                 // INADDR_ANY by default
+  in_addr multicastAddress{};
+  in_addr unicastAddress{};
+  bool bUnicast = false;
+  int ttl = 1;
+  double loss = 0.0;                      // probabilities, 0 to 1
+  double reorder = 0.0;
+  double duplicate = 0.0;
+  unsigned int seed = 1;
+  sSyntheticScene scene;
+};
+
+struct sSimStats {
+  std::atomic<uint64_t> sent{0};
+  std::atomic<uint64_t> dropped{0};
+  std::atomic<uint64_t> reordered{0};
+  std::atomic<uint64_t> duplicated{0};
+  std::atomic<uint64_t> late{0};          // frames sent a period late
+  std::atomic<uint64_t> commands{0};
+};
+
+// State shared by the command and data threads
+struct sSimServer {
+  sSimConfig config;
+  int commandSocket = -1;
+  int dataSocket = -1;
+  std::vector<char> modelDef;
+  std::mutex mutex;
+  std::vector<char> latestFrame;          // for NAT_REQUEST_FRAMEOFDATA
+  sSimStats stats;
+};
+
+static void SendReply(const sSimServer &server, const sockaddr_in &to,
+                      uint16_t iMessage, const void *pData, size_t nBytes) {
+  std::vector<char> packet(4 + nBytes);
+  uint16_t size = (uint16_t) nBytes;
+  memcpy(packet.data(), &iMessage, 2);
+  memcpy(packet.data() + 2, &size, 2);
+  if (nBytes > 0)
+    memcpy(packet.data() + 4, pData, nBytes);
+  sendto(server.commandSocket, packet.data(), packet.size(), 0,
+         (const sockaddr *) &to, sizeof(to));
+}
+
+static void SendServerInfo(const sSimServer &server, const sockaddr_in &to) {
+  sSender_Server info{};
+  strcpy(info.Common.szName, "ServerSim");
+  info.Common.Version[0] = 1;
+  info.Common.NatNetVersion[0] = (uint8_t) server.config.major;
+  info.Common.NatNetVersion[1] = (uint8_t) server.config.minor;
+  info.HighResClockFrequency = SIM_CLOCK_FREQUENCY;
+  info.DataPort = PORT_DATA;
+  info.IsMulticast = !server.config.bUnicast;
+  memcpy(info.MulticastGroupAddress, &server.config.multicastAddress, 4);
+  SendReply(server, to, NAT_SERVERINFO, &info,
+            offsetof(sSender_Server, MulticastGroupAddress) + 4);
+}
+
+// Answer requests on the command socket until stopped
+static void CommandLoop(sSimServer *server) {
+  std::vector<char> buffer(MAX_PACKETSIZE);
+  while (gRunning) {
+    sockaddr_in from{};
+    socklen_t fromLength = sizeof(from);
+    ssize_t nBytes = recvfrom(server->commandSocket, buffer.data(),
+                              buffer.size(), 0, (sockaddr *) &from,
+                              &fromLength);
+    if (nBytes < 4)
+      continue;
+    server->stats.commands++;
+    uint16_t iMessage, nDataBytes;
+    memcpy(&iMessage, buffer.data(), 2);
+    memcpy(&nDataBytes, buffer.data() + 2, 2);
+    nDataBytes = (uint16_t) std::min<size_t>(nDataBytes, nBytes - 4);
+    const char *pData = buffer.data() + 4;
+
+    switch (iMessage) {
+      case NAT_CONNECT:SendServerInfo(*server, from);
+        break;
+      case NAT_REQUEST_MODELDEF:
+        sendto(server->commandSocket, server->modelDef.data(),
+               server->modelDef.size(), 0, (sockaddr *) &from,
+               sizeof(from));
+        break;
+      case NAT_REQUEST_FRAMEOFDATA: {
+        std::lock_guard<std::mutex> lock(server->mutex);
+        if (!server->latestFrame.empty())
+          sendto(server->commandSocket, server->latestFrame.data(),
+                 server->latestFrame.size(), 0, (sockaddr *) &from,
+                 sizeof(from));
+        break;
+      }
+      case NAT_REQUEST: {
+        // Every command succeeds
+        std::string command(pData, strnlen(pData, nDataBytes));
+        int32_t code = command.empty() ? 1 : 0;
+        SendReply(*server, from, NAT_RESPONSE, &code, sizeof(code));
+        break;
+      }
+      case NAT_ECHOREQUEST: {
+        // The request's payload, then our clock
+        char reply[16] = {};
+        memcpy(reply, pData, std::min<size_t>(nDataBytes, 8));
+        uint64_t ticks = NowTicks();
+        memcpy(reply + 8, &ticks, 8);
+        SendReply(*server, from, NAT_ECHORESPONSE, reply, sizeof(reply));
+        break;
+      }
+      default:SendReply(*server, from, NAT_UNRECOGNIZED_REQUEST, nullptr, 0);
+        break;
+    }
+  }
+}
+
+static bool OpenSockets(sSimServer *server) {
+  const sSimConfig &config = server->config;
+
+  server->commandSocket = socket(AF_INET, SOCK_DGRAM, 0);
+  int value = 1;
+  setsockopt(server->commandSocket, SOL_SOCKET, SO_REUSEADDR, &value,
+             sizeof(value));
+  sockaddr_in commandAddr{};
+  commandAddr.sin_family = AF_INET;
+  commandAddr.sin_port = htons(PORT_COMMAND);
+  commandAddr.sin_addr = config.localAddress;
+  if (bind(server->commandSocket, (sockaddr *) &commandAddr,
+           sizeof(commandAddr)) == -1) {
+    printf("[ServerSim] cannot bind the command port %d: %s\n",
+           PORT_COMMAND, strerror(errno));
+    return false;
+  }
+
+  server->dataSocket = socket(AF_INET, SOCK_DGRAM, 0);
+  if (!config.bUnicast) {
+    unsigned char ttl = (unsigned char) config.ttl;
+    setsockopt(server->dataSocket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl,
+               sizeof(ttl));
+    if (config.localAddress.s_addr != htonl(INADDR_ANY) &&
+        setsockopt(server->dataSocket, IPPROTO_IP, IP_MULTICAST_IF,
+                   &config.localAddress, sizeof(config.localAddress)) == -1) {
+      printf("[ServerSim] cannot send multicast from the local address\n");
+      return false;
+    }
+  }
+  // Room for bursts at high frame rates
+  value = 0x400000;
+  setsockopt(server->dataSocket, SOL_SOCKET, SO_SNDBUF, &value,
+             sizeof(value));
+  return true;
+}
+
+// Stream frames at the configured rate until stopped
+static void DataLoop(sSimServer *server) {
+  const sSimConfig &config = server->config;
+  sockaddr_in dataAddr{};
+  dataAddr.sin_family = AF_INET;
+  dataAddr.sin_port = htons(PORT_DATA);
+  dataAddr.sin_addr =
+      config.bUnicast ? config.unicastAddress : config.multicastAddress;
+
+  std::mt19937 random(config.seed);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  std::vector<char> frame, held;
+  auto send = [&](const std::vector<char> &packet) {
+    if (sendto(server->dataSocket, packet.data(), packet.size(), 0,
+               (sockaddr *) &dataAddr, sizeof(dataAddr)) != -1)
+      server->stats.sent++;
+  };
+
+  uint64_t periodNs = (uint64_t) (1e9 / config.frameRate);
+  uint64_t startNs = MonotonicNs();
+  uint64_t deadline = startNs;
+  for (uint64_t i = 1; gRunning && (config.nFrames == 0 ||
+      i <= config.nFrames); i++) {
+    deadline += periodNs;
+    uint64_t nowNs = MonotonicNs();
+    if (nowNs > deadline + periodNs) {
+      server->stats.late++;
+      // Far behind, e.g. after a stall: do not burst to catch up
+      if (nowNs > deadline + 10 * periodNs)
+        deadline = nowNs;
+    } else if (nowNs < deadline) {
+      timespec wake;
+      wake.tv_sec = (time_t) (deadline / 1000000000ULL);
+      wake.tv_nsec = (long) (deadline % 1000000000ULL);
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, nullptr);
+    }
+
+    if (!BuildFrameOfMocapData(config.major, config.minor, config.scene,
+                               (int) i, &frame))
+      break;
+    // Exposure one period ago, camera data 3 ms before sending
+    uint64_t transmit = NowTicks();
+    uint64_t period = (uint64_t) (SIM_CLOCK_FREQUENCY / config.frameRate);
+    uint64_t exposure = transmit - std::min(transmit, period);
+    SetSyntheticTimestamps(config.major, config.minor,
+                           (double) (i - 1) / config.frameRate,
+                           exposure,
+                           std::max(exposure, transmit - 30000),
+                           transmit, &frame);
+    {
+      std::lock_guard<std::mutex> lock(server->mutex);
+      server->latestFrame = frame;
+    }
+
+    if (uniform(random) < config.loss) {
+      server->stats.dropped++;
+    } else if (held.empty() && uniform(random) < config.reorder) {
+      held.swap(frame);
+      server->stats.reordered++;
+    } else {
+      send(frame);
+      if (uniform(random) < config.duplicate) {
+        send(frame);
+        server->stats.duplicated++;
+      }
+      if (!held.empty()) {
+        send(held);
+        held.clear();
+      }
+    }
+
+    if (i % (uint64_t) std::max(config.frameRate, 1.0) == 0) {
+      double seconds = (MonotonicNs() - startNs) * 1e-9;
+      printf("[ServerSim] frame %" PRIu64 ": sent %" PRIu64
+             " (%.0f/s), dropped %" PRIu64 ", reordered %" PRIu64
+             ", duplicated %" PRIu64 ", late %" PRIu64
+             ", commands %" PRIu64 "\n",
+             i, server->stats.sent.load(),
+             server->stats.sent.load() / seconds,
+             server->stats.dropped.load(), server->stats.reordered.load(),
+             server->stats.duplicated.load(), server->stats.late.load(),
+             server->stats.commands.load());
+    }
+  }
+  if (!held.empty())
+    send(held);
+}
+
+static bool ParseAddress(const char *szAddress, in_addr *address) {
+  if (inet_pton(AF_INET, szAddress, address) == 1)
+    return true;
+  printf("Invalid address %s\n", szAddress);
+  return false;
+}
+
+static void Usage() {
+  printf("Usage: ServerSim [-v 3.0] [-F rate] [-n frames] [-a localIP]\n"
+         "                 [-g multicastGroup | -u unicastIP] [-T ttl]\n"
+         "                 [-L loss%%] [-O reorder%%] [-D duplicate%%]"
+         " [-S seed]\n"
+         "                 [-m markerSets] [-k markersPerSet]"
+         " [-o otherMarkers]\n"
+         "                 [-r rigidBodies] [-R markersPerRigidBody]\n"
+         "                 [-s skeletons] [-b bonesPerSkeleton]\n"
+         "                 [-l labeledMarkers] [-f forcePlates]"
+         " [-c channels]\n");
+}
+
+int main(int argc, char *argv[]) {
+  sSimServer server;
+  sSimConfig &config = server.config;
+  sSyntheticScene &scene = config.scene;
+  config.localAddress.s_addr = htonl(INADDR_ANY);
+  inet_pton(AF_INET, MULTICAST_ADDRESS, &config.multicastAddress);
+
+  int opt;
+  while ((opt = getopt(argc, argv,
+                       "v:F:n:a:g:u:T:L:O:D:S:m:k:o:r:R:s:b:l:f:c:h")) != -1) {
+    switch (opt) {
+      case 'v':
+        if (sscanf(optarg, "%d.%d", &config.major, &config.minor) != 2) {
+          printf("Invalid version %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'F':config.frameRate = atof(optarg);
+        break;
+      case 'n':config.nFrames = strtoull(optarg, nullptr, 10);
+        break;
+      case 'a':
+        if (!ParseAddress(optarg, &config.localAddress))
+          return 1;
+        break;
+      case 'g':
+        if (!ParseAddress(optarg, &config.multicastAddress))
+          return 1;
+        break;
+      case 'u':
+        if (!ParseAddress(optarg, &config.unicastAddress))
+          return 1;
+        config.bUnicast = true;
+        break;
+      case 'T':config.ttl = atoi(optarg);
+        break;
+      case 'L':config.loss = atof(optarg) / 100.0;
+        break;
+      case 'O':config.reorder = atof(optarg) / 100.0;
+        break;
+      case 'D':config.duplicate = atof(optarg) / 100.0;
+        break;
+      case 'S':config.seed = (unsigned int) strtoul(optarg, nullptr, 10);
+        break;
+      case 'm':scene.markerSets = atoi(optarg);
+        break;
+      case 'k':scene.markersPerSet = atoi(optarg);
+        break;
+      case 'o':scene.otherMarkers = atoi(optarg);
+        break;
+      case 'r':scene.rigidBodies = atoi(optarg);
+        break;
+      case 'R':scene.markersPerRigidBody = atoi(optarg);
+        break;
+      case 's':scene.skeletons = atoi(optarg);
+        break;
+      case 'b':scene.bonesPerSkeleton = atoi(optarg);
+        break;
+      case 'l':scene.labeledMarkers = atoi(optarg);
+        break;
+      case 'f':scene.forcePlates = atoi(optarg);
+        break;
+      case 'c':scene.forcePlateChannels = atoi(optarg);
+        break;
+      default:Usage();
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (config.frameRate <= 0.0) {
+    Usage();
+    return 1;
+  }
+
+  std::vector<char> frame;
+  if (!BuildDataDescriptions(config.major, config.minor, scene,
+                             &server.modelDef) ||
+      !BuildFrameOfMocapData(config.major, config.minor, scene, 1, &frame)) {
+    printf("NatNet %d.%d: unsupported version or scene too large"
+           " for one packet\n", config.major, config.minor);
+    return 1;
+  }
+  if (frame.size() > SIM_MAX_DATAGRAM ||
+      server.modelDef.size() > SIM_MAX_DATAGRAM) {
+    printf("Scene too large for one datagram (%zu bytes)\n", frame.size());
+    return 1;
+  }
+  if (!OpenSockets(&server))
+    return 1;
+
+  char szDestination[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, config.bUnicast ? &config.unicastAddress
+                                     : &config.multicastAddress,
+            szDestination, sizeof(szDestination));
+  printf("[ServerSim] NatNet %d.%d, %zu byte frames at %.0f Hz to %s:%d\n",
+         config.major, config.minor, frame.size(), config.frameRate,
+         szDestination, PORT_DATA);
+
+  struct sigaction action{};
+  action.sa_handler = Stop;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  std::thread commandThread(CommandLoop, &server);
+  DataLoop(&server);
+
+  // Wakes the command thread from its blocking receive
+  gRunning = false;
+  shutdown(server.commandSocket, SHUT_RDWR);
+  commandThread.join();
+  close(server.commandSocket);
+  close(server.dataSocket);
+  printf("[ServerSim] sent %" PRIu64 " frames, dropped %" PRIu64
+         ", reordered %" PRIu64 ", duplicated %" PRIu64 "\n",
+         server.stats.sent.load(), server.stats.dropped.load(),
+         server.stats.reordered.load(), server.stats.duplicated.load());
+  return 0;
+}
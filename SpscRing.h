@@ -0,0 +1,95 @@
+/*
+ * SpscRing.h
+ *
+ * Bounded lock-free queue for exactly one producer thread and one
+ * consumer thread, with occupancy counters that any thread may read.
+ */
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+#define CACHE_LINE_SIZE 64
+
+template <typename T>
+class SpscRing {
+ public:
+  // depth is rounded up to a power of two
+  explicit SpscRing(size_t depth)
+      : items_(RoundUp(depth)), mask_(items_.size() - 1) {}
+
+  SpscRing(const SpscRing &) = delete;
+  SpscRing &operator=(const SpscRing &) = delete;
+
+  // Producer only. Returns false if the ring is full.
+  bool Push(const T &item) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head - cachedTail_ > mask_) {
+      cachedTail_ = tail_.load(std::memory_order_acquire);
+      if (head - cachedTail_ > mask_)
+        return false;
+    }
+    items_[head & mask_] = item;
+    head_.store(head + 1, std::memory_order_release);
+
+    size_t occupancy = head + 1 - cachedTail_;
+    if (occupancy > highWater_.load(std::memory_order_relaxed))
+      highWater_.store(occupancy, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Consumer only. Returns false if the ring is empty.
+  bool Pop(T *item) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == cachedHead_) {
+      cachedHead_ = head_.load(std::memory_order_acquire);
+      if (tail == cachedHead_)
+        return false;
+    }
+    *item = items_[tail & mask_];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t Capacity() const { return items_.size(); }
+
+  // Approximate when read outside the producer or consumer
+  size_t Size() const {
+    size_t tail = tail_.load(std::memory_order_acquire);
+    size_t head = head_.load(std::memory_order_acquire);
+    return head - tail;
+  }
+  bool Empty() const { return Size() == 0; }
+
+  size_t HighWater() const {
+    return highWater_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  static size_t RoundUp(size_t depth) {
+    size_t size = 1;
+    while (size < depth)
+      size <<= 1;
+    return size;
+  }
+
+  std::vector<T> items_;
+  const size_t mask_;
+
+  // Producer side
+  char pad0_[CACHE_LINE_SIZE];
+  std::atomic<size_t> head_{0};
+  size_t cachedTail_ = 0;
+  std::atomic<size_t> highWater_{0};
+
+  // Consumer side
+  char pad1_[CACHE_LINE_SIZE];
+  std::atomic<size_t> tail_{0};
+  size_t cachedHead_ = 0;
+  char pad2_[CACHE_LINE_SIZE];
+};
+
+#endif  // SPSC_RING_H
@@ -0,0 +1,318 @@
+/*
+ * SyntheticFrames.cpp
+ */
+
+#include "SyntheticFrames.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "NatNetFrame.h"
+#include "NatNetModelDef.h"
+#include "NatNetTypes.h"
+
+// Frame rate of the generated take
+#define SYNTHETIC_FRAME_RATE 120.0
+
+// Appends little-endian values to a packet
+class PacketWriter {
+ public:
+  explicit PacketWriter(std::vector<char> *packet) : packet_(packet) {}
+
+  template <typename T>
+  void Write(const T &value) {
+    const char *p = (const char *) &value;
+    packet_->insert(packet_->end(), p, p + sizeof(T));
+  }
+
+  void WriteString(const std::string &str) {
+    packet_->insert(packet_->end(), str.c_str(), str.c_str() + str.size() + 1);
+  }
+
+ private:
+  std::vector<char> *packet_;
+};
+
+// Start a packet with its message header; the size is set by EndPacket()
+static void BeginPacket(std::vector<char> *packet, uint16_t iMessage) {
+  packet->clear();
+  PacketWriter writer(packet);
+  writer.Write(iMessage);
+  writer.Write((uint16_t) 0);
+}
+
+static bool EndPacket(std::vector<char> *packet) {
+  size_t nDataBytes = packet->size() - 4;
+  if (nDataBytes > UINT16_MAX)
+    return false;
+  uint16_t size = (uint16_t) nDataBytes;
+  memcpy(packet->data() + 2, &size, 2);
+  return true;
+}
+
+// Rigid body or bone ID, position and orientation, and the fields
+// following its markers
+static void WritePose(PacketWriter &writer, int major, int minor,
+                      int ID, float phase, int nMarkers) {
+  writer.Write(ID);
+  writer.Write(0.1f * ID + 0.5f * std::cos(phase));
+  writer.Write(0.5f * std::sin(phase));
+  writer.Write(1.0f);
+  // Rotation about z
+  writer.Write(0.0f);
+  writer.Write(0.0f);
+  writer.Write(std::sin(phase / 2));
+  writer.Write(std::cos(phase / 2));
+
+  // Before NatNet 3.0, marker data was here
+  if (major < 3) {
+    writer.Write(nMarkers);
+    for (int k = 0; k < nMarkers; k++) {
+      writer.Write(0.02f * k);
+      writer.Write(0.01f * ID);
+      writer.Write(1.0f);
+    }
+    if (major >= 2) {
+      for (int k = 0; k < nMarkers; k++)
+        writer.Write(k + 1);
+      for (int k = 0; k < nMarkers; k++)
+        writer.Write(0.014f);
+    }
+  }
+
+  if (major >= 2)
+    writer.Write(0.0005f);
+  if (NatNetAtLeast(major, minor, 2, 6))
+    writer.Write((short) 0x01);           // tracking valid
+}
+
+static void WriteAnalogData(PacketWriter &writer, int nGroups,
+                            int nChannels, int iFrame) {
+  writer.Write(nGroups);
+  for (int i = 0; i < nGroups; i++) {
+    writer.Write(i + 1);
+    writer.Write(nChannels);
+    for (int c = 0; c < nChannels; c++) {
+      writer.Write(1);                    // one analog frame per mocap frame
+      writer.Write((float) (c + iFrame % 100));
+    }
+  }
+}
+
+bool BuildFrameOfMocapData(int major, int minor,
+                           const sSyntheticScene &scene,
+                           int iFrame,
+                           std::vector<char> *packet) {
+  if (SelectFrameDecoder(major, minor) == nullptr)
+    return false;
+
+  BeginPacket(packet, NAT_FRAMEOFDATA);
+  PacketWriter writer(packet);
+  float phase = (float) (iFrame / SYNTHETIC_FRAME_RATE);
+
+  writer.Write(iFrame);
+
+  writer.Write(scene.markerSets);
+  for (int i = 0; i < scene.markerSets; i++) {
+    writer.WriteString("MarkerSet" + std::to_string(i + 1));
+    writer.Write(scene.markersPerSet);
+    for (int j = 0; j < scene.markersPerSet; j++) {
+      writer.Write(0.01f * j + std::cos(phase));
+      writer.Write(0.01f * i);
+      writer.Write(1.0f);
+    }
+  }
+
+  writer.Write(scene.otherMarkers);
+  for (int j = 0; j < scene.otherMarkers; j++) {
+    writer.Write(0.03f * j);
+    writer.Write(-1.0f);
+    writer.Write(0.0f);
+  }
+
+  writer.Write(scene.rigidBodies);
+  for (int j = 0; j < scene.rigidBodies; j++)
+    WritePose(writer, major, minor, j + 1, phase + j,
+              scene.markersPerRigidBody);
+
+  if (NatNetAtLeast(major, minor, 2, 1)) {
+    writer.Write(scene.skeletons);
+    for (int s = 0; s < scene.skeletons; s++) {
+      int skeletonID = s + 1;
+      writer.Write(skeletonID);
+      writer.Write(scene.bonesPerSkeleton);
+      for (int b = 0; b < scene.bonesPerSkeleton; b++)
+        WritePose(writer, major, minor, (skeletonID << 16) | (b + 1),
+                  phase + b, 0);
+    }
+  }
+
+  if (NatNetAtLeast(major, minor, 2, 3)) {
+    writer.Write(scene.labeledMarkers);
+    for (int j = 0; j < scene.labeledMarkers; j++) {
+      // Model ID in the upper 16 bits, marker ID in the lower
+      int modelID = scene.rigidBodies > 0 ? j % scene.rigidBodies + 1 : 0;
+      writer.Write((modelID << 16) | (j + 1));
+      writer.Write(0.02f * j + std::cos(phase));
+      writer.Write(std::sin(phase));
+      writer.Write(1.0f);
+      writer.Write(0.014f);
+      if (NatNetAtLeast(major, minor, 2, 6))
+        writer.Write((short) 0);
+      if (major >= 3)
+        writer.Write(0.0002f);
+    }
+  }
+
+  if (NatNetAtLeast(major, minor, 2, 9))
+    WriteAnalogData(writer, scene.forcePlates, scene.forcePlateChannels,
+                    iFrame);
+  if (NatNetAtLeast(major, minor, 2, 11))
+    WriteAnalogData(writer, scene.devices, scene.deviceChannels, iFrame);
+
+  if (major < 3)
+    writer.Write(0.002f);                 // software latency
+
+  writer.Write((unsigned int) 0);         // timecode
+  writer.Write((unsigned int) 0);
+  double fTimestamp = iFrame / SYNTHETIC_FRAME_RATE;
+  if (NatNetAtLeast(major, minor, 2, 7))
+    writer.Write(fTimestamp);
+  else
+    writer.Write((float) fTimestamp);
+
+  if (major >= 3) {
+    // Ticks of a 10 MHz clock
+    uint64_t exposure = (uint64_t) (fTimestamp * 1e7);
+    writer.Write(exposure);
+    writer.Write(exposure + 30000);
+    writer.Write(exposure + 40000);
+  }
+
+  writer.Write((short) 0);                // params
+  writer.Write(0);                        // end of data tag
+  return EndPacket(packet);
+}
+
+void SetSyntheticTimestamps(int major, int minor,
+                            double fTimestamp,
+                            uint64_t midExposure,
+                            uint64_t dataReceived,
+                            uint64_t transmit,
+                            std::vector<char> *packet) {
+  // The frame ends with the timestamps, params and end of data tag
+  char *end = packet->data() + packet->size() - 6;
+  if (major >= 3) {
+    end -= 24;
+    memcpy(end, &midExposure, 8);
+    memcpy(end + 8, &dataReceived, 8);
+    memcpy(end + 16, &transmit, 8);
+  }
+  if (NatNetAtLeast(major, minor, 2, 7)) {
+    memcpy(end - 8, &fTimestamp, 8);
+  } else {
+    float fTemp = (float) fTimestamp;
+    memcpy(end - 4, &fTemp, 4);
+  }
+}
+
+static void WriteRigidBodyDescription(PacketWriter &writer,
+                                      int major,
+                                      const std::string &name,
+                                      int ID, int parentID,
+                                      int nMarkers) {
+  if (major >= 2)
+    writer.WriteString(name);
+  writer.Write(ID);
+  writer.Write(parentID);
+  writer.Write(0.0f);
+  writer.Write(0.0f);
+  writer.Write(0.1f);
+
+  if (major >= 3) {
+    writer.Write(nMarkers);
+    for (int k = 0; k < nMarkers; k++) {
+      writer.Write(0.02f * k);
+      writer.Write(0.0f);
+      writer.Write(0.0f);
+    }
+    for (int k = 0; k < nMarkers; k++)
+      writer.Write(0);                    // no required active label
+  }
+}
+
+bool BuildDataDescriptions(int major, int minor,
+                           const sSyntheticScene &scene,
+                           std::vector<char> *packet) {
+  if (SelectModelDefDecoder(major, minor) == nullptr)
+    return false;
+
+  BeginPacket(packet, NAT_MODELDEF);
+  PacketWriter writer(packet);
+
+  bool bDevices = NatNetAtLeast(major, minor, 2, 11);
+  writer.Write(scene.markerSets + scene.rigidBodies + scene.skeletons +
+               scene.forcePlates + (bDevices ? scene.devices : 0));
+
+  for (int i = 0; i < scene.markerSets; i++) {
+    writer.Write((int) DESCRIPTOR_MARKERSET);
+    writer.WriteString("MarkerSet" + std::to_string(i + 1));
+    writer.Write(scene.markersPerSet);
+    for (int j = 0; j < scene.markersPerSet; j++)
+      writer.WriteString("Marker" + std::to_string(j + 1));
+  }
+
+  for (int j = 0; j < scene.rigidBodies; j++) {
+    writer.Write((int) DESCRIPTOR_RIGIDBODY);
+    WriteRigidBodyDescription(writer, major,
+                              "RigidBody" + std::to_string(j + 1),
+                              j + 1, -1, scene.markersPerRigidBody);
+  }
+
+  for (int s = 0; s < scene.skeletons; s++) {
+    writer.Write((int) DESCRIPTOR_SKELETON);
+    writer.WriteString("Skeleton" + std::to_string(s + 1));
+    writer.Write(s + 1);
+    writer.Write(scene.bonesPerSkeleton);
+    for (int b = 0; b < scene.bonesPerSkeleton; b++)
+      WriteRigidBodyDescription(writer, major,
+                                "Bone" + std::to_string(b + 1),
+                                b + 1, b > 0 ? b : -1, 0);
+  }
+
+  for (int i = 0; i < scene.forcePlates; i++) {
+    writer.Write((int) DESCRIPTOR_FORCEPLATE);
+    writer.Write(i + 1);
+    writer.WriteString("FP" + std::to_string(i + 1));
+    writer.Write(0.6f);                   // width
+    writer.Write(0.4f);                   // length
+    writer.Write(0.0f);
+    writer.Write(0.0f);
+    writer.Write(0.0f);
+    for (int k = 0; k < 12 * 12; k++)
+      writer.Write(k % 13 == 0 ? 1.0f : 0.0f);
+    for (int k = 0; k < 4 * 3; k++)
+      writer.Write(0.0f);
+    writer.Write(1);                      // plate type
+    writer.Write(0);                      // channel data type
+    writer.Write(scene.forcePlateChannels);
+    for (int c = 0; c < scene.forcePlateChannels; c++)
+      writer.WriteString("Channel" + std::to_string(c + 1));
+  }
+
+  for (int i = 0; bDevices && i < scene.devices; i++) {
+    writer.Write((int) DESCRIPTOR_DEVICE);
+    writer.Write(i + 1);
+    writer.WriteString("Device" + std::to_string(i + 1));
+    writer.WriteString("SN" + std::to_string(i + 1));
+    writer.Write(0);                      // device type
+    writer.Write(0);                      // channel data type
+    writer.Write(scene.deviceChannels);
+    for (int c = 0; c < scene.deviceChannels; c++)
+      writer.WriteString("Channel" + std::to_string(c + 1));
+  }
+
+  return EndPacket(packet);
+}
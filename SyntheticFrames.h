@@ -0,0 +1,53 @@
+/*
+ * SyntheticFrames.h
+ *
+ * Generation of NAT_FRAMEOFDATA and NAT_MODELDEF packets for a
+ * configurable scene, in the layout of any supported NatNet version.
+ * Used to benchmark and exercise the decoders without a Motive server.
+ */
+
+#ifndef SYNTHETIC_FRAMES_H
+#define SYNTHETIC_FRAMES_H
+
+#include <cstdint>
+#include <vector>
+
+struct sSyntheticScene {
+  int markerSets = 1;
+  int markersPerSet = 10;
+  int otherMarkers = 0;
+  int rigidBodies = 4;
+  int markersPerRigidBody = 4;
+  int skeletons = 0;
+  int bonesPerSkeleton = 21;
+  int labeledMarkers = 16;
+  int forcePlates = 0;
+  int forcePlateChannels = 6;
+  int devices = 0;                        // NatNet 2.11 and later
+  int deviceChannels = 8;
+};
+
+// Build frame iFrame of the scene, message header included. Bodies move
+// along a fixed path so consecutive frames differ. Returns false if the
+// version is not supported or the frame exceeds the 16-bit payload size.
+bool BuildFrameOfMocapData(int major, int minor,
+                           const sSyntheticScene &scene,
+                           int iFrame,
+                           std::vector<char> *packet);
+
+// Overwrite the timestamps of a frame built by BuildFrameOfMocapData():
+// fTimestamp in seconds, and from NatNet 3.0 the server clock ticks of
+// mid-exposure, camera data received and transmit
+void SetSyntheticTimestamps(int major, int minor,
+                            double fTimestamp,
+                            uint64_t midExposure,
+                            uint64_t dataReceived,
+                            uint64_t transmit,
+                            std::vector<char> *packet);
+
+// Build the data descriptions of the scene, message header included
+bool BuildDataDescriptions(int major, int minor,
+                           const sSyntheticScene &scene,
+                           std::vector<char> *packet);
+
+#endif  // SYNTHETIC_FRAMES_H
@@ -0,0 +1,553 @@
+/*
+ * Take.cpp
+ */
+
+#include "Take.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TAKE_HEADER_SIZE  (TAKE_MAGIC_SIZE + sizeof(sTakeFileHeader))
+
+// Columns are appended and read back in the same order, each starting on
+// an 8-byte boundary of the payload
+static void Align(std::vector<char> *payload) {
+  payload->resize((payload->size() + 7) & ~(size_t) 7, 0);
+}
+
+template <typename T>
+static void PutColumn(std::vector<char> *payload, const std::vector<T> &column) {
+  Align(payload);
+  const char *p = (const char *) column.data();
+  payload->insert(payload->end(), p, p + column.size() * sizeof(T));
+}
+
+class ColumnReader {
+ public:
+  ColumnReader(const char *data, size_t size) : data_(data), size_(size) {}
+
+  template <typename T>
+  const T *Next(size_t count) {
+    offset_ = (offset_ + 7) & ~(size_t) 7;
+    if (offset_ > size_ || (size_ - offset_) / sizeof(T) < count) {
+      ok_ = false;
+      return nullptr;
+    }
+    const T *column = (const T *) (data_ + offset_);
+    offset_ += count * sizeof(T);
+    return column;
+  }
+
+  bool Ok() const { return ok_; }
+
+ private:
+  const char *data_;
+  size_t size_;
+  size_t offset_ = 0;
+  bool ok_ = true;
+};
+
+static void PutPoses(std::vector<char> *payload, const sPoseColumns &poses) {
+  PutColumn(payload, poses.ID);
+  PutColumn(payload, poses.x);
+  PutColumn(payload, poses.y);
+  PutColumn(payload, poses.z);
+  PutColumn(payload, poses.qx);
+  PutColumn(payload, poses.qy);
+  PutColumn(payload, poses.qz);
+  PutColumn(payload, poses.qw);
+  PutColumn(payload, poses.meanError);
+  PutColumn(payload, poses.params);
+}
+
+static bool NextRigidBodies(ColumnReader *reader, size_t count,
+                            sTakeRigidBodyColumns *columns) {
+  columns->ID = reader->Next<int32_t>(count);
+  const float **floats[8] = {&columns->x, &columns->y, &columns->z,
+                             &columns->qx, &columns->qy, &columns->qz,
+                             &columns->qw, &columns->meanError};
+  for (int k = 0; k < 8; k++)
+    *floats[k] = reader->Next<float>(count);
+  columns->params = reader->Next<int16_t>(count);
+  return reader->Ok();
+}
+
+// Offsets of n elements into a column of count: non-decreasing and
+// ending at count, so every element range lies inside the column
+static bool ValidStarts(const uint32_t *start, size_t n, uint32_t count) {
+  for (size_t i = 0; i < n; i++) {
+    if (start[i] > start[i + 1])
+      return false;
+  }
+  return start[n] == count;
+}
+
+static sRigidBodyData RigidBodyAt(const sTakeRigidBodyColumns &columns,
+                                  uint32_t i) {
+  sRigidBodyData rb;
+  rb.ID = columns.ID[i];
+  rb.x = columns.x[i];
+  rb.y = columns.y[i];
+  rb.z = columns.z[i];
+  rb.qx = columns.qx[i];
+  rb.qy = columns.qy[i];
+  rb.qz = columns.qz[i];
+  rb.qw = columns.qw[i];
+  rb.MeanError = columns.meanError[i];
+  rb.params = columns.params[i];
+  return rb;
+}
+
+TakeWriter::~TakeWriter() {
+  Close();
+}
+
+bool TakeWriter::Open(const std::string &path, uint32_t chunkFrames) {
+  Close();
+  std::lock_guard<std::mutex> lock(mutex_);
+  // The index is at the end, so a take cannot be appended to
+  file_ = fopen(path.c_str(), "wb");
+  if (file_ == nullptr)
+    return false;
+  sTakeFileHeader header;
+  header.version = TAKE_VERSION;
+  header.chunkFrames = std::max(chunkFrames, 1u);
+  if (fwrite(TAKE_MAGIC, 1, TAKE_MAGIC_SIZE, file_) != TAKE_MAGIC_SIZE ||
+      fwrite(&header, sizeof(header), 1, file_) != 1) {
+    fclose(file_);
+    file_ = nullptr;
+    return false;
+  }
+  offset_ = TAKE_HEADER_SIZE;
+  chunkFrames_ = header.chunkFrames;
+  frames_ = 0;
+  chunks_.clear();
+  modelDefs_.clear();
+  columns_.Clear();
+  return true;
+}
+
+void TakeWriter::Close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (file_ == nullptr)
+    return;
+  FlushChunk();
+
+  uint64_t indexOffset = offset_;
+  payload_.clear();
+  const char *p = (const char *) chunks_.data();
+  payload_.insert(payload_.end(), p,
+                  p + chunks_.size() * sizeof(sTakeChunkEntry));
+  p = (const char *) modelDefs_.data();
+  payload_.insert(payload_.end(), p,
+                  p + modelDefs_.size() * sizeof(sTakeModelDefEntry));
+  if (WriteBlock(TAKE_BLOCK_INDEX, frames_, 0, payload_)) {
+    sTakeTrailer trailer;
+    trailer.indexOffset = indexOffset;
+    trailer.nChunks = chunks_.size();
+    trailer.nModelDefs = modelDefs_.size();
+    memcpy(trailer.magic, TAKE_MAGIC, TAKE_MAGIC_SIZE);
+    fwrite(&trailer, sizeof(trailer), 1, file_);
+  }
+  fclose(file_);
+  file_ = nullptr;
+}
+
+bool TakeWriter::WriteBlock(uint16_t type, uint64_t firstIndex,
+                            uint32_t nFrames,
+                            const std::vector<char> &payload) {
+  static const char padding[8] = {0};
+  sTakeBlockHeader header;
+  header.magic = TAKE_BLOCK_MAGIC;
+  header.type = type;
+  header.reserved = 0;
+  header.size = (payload.size() + 7) & ~(uint64_t) 7;
+  header.firstIndex = firstIndex;
+  header.nFrames = nFrames;
+  header.reserved2 = 0;
+  size_t nPadding = header.size - payload.size();
+  // Buffered by stdio; a chunk is one write every chunkFrames frames
+  if (fwrite(&header, sizeof(header), 1, file_) != 1 ||
+      fwrite(payload.data(), 1, payload.size(), file_) != payload.size() ||
+      fwrite(padding, 1, nPadding, file_) != nPadding)
+    return false;
+  offset_ += sizeof(header) + header.size;
+  return true;
+}
+
+bool TakeWriter::FlushChunk() {
+  const FrameColumns &f = columns_;
+  uint32_t nFrames = (uint32_t) f.Frames();
+  if (nFrames == 0)
+    return true;
+
+  sTakeChunkCounts counts;
+  counts.nRigidBodies = (uint32_t) f.rigidBodies.Size();
+  counts.nSkeletons = (uint32_t) f.skeletonID.size();
+  counts.nBones = (uint32_t) f.bones.Size();
+  counts.nLabeledMarkers = (uint32_t) f.labeledMarkers.Size();
+
+  payload_.clear();
+  const char *p = (const char *) &counts;
+  payload_.insert(payload_.end(), p, p + sizeof(counts));
+  PutColumn(&payload_, f.frameNumber);
+  PutColumn(&payload_, f.timestamp);
+  PutColumn(&payload_, f.midExposure);
+  PutColumn(&payload_, f.params);
+  PutColumn(&payload_, f.rigidBodyStart);
+  PutColumn(&payload_, f.skeletonStart);
+  PutColumn(&payload_, f.labeledMarkerStart);
+  PutPoses(&payload_, f.rigidBodies);
+  PutColumn(&payload_, f.skeletonID);
+  PutColumn(&payload_, f.boneStart);
+  PutPoses(&payload_, f.bones);
+  PutColumn(&payload_, f.labeledMarkers.ID);
+  PutColumn(&payload_, f.labeledMarkers.x);
+  PutColumn(&payload_, f.labeledMarkers.y);
+  PutColumn(&payload_, f.labeledMarkers.z);
+  PutColumn(&payload_, f.labeledMarkers.size);
+  PutColumn(&payload_, f.labeledMarkers.residual);
+  PutColumn(&payload_, f.labeledMarkers.params);
+
+  sTakeChunkEntry entry;
+  entry.offset = offset_;
+  entry.firstIndex = frames_ - nFrames;
+  entry.nFrames = nFrames;
+  entry.firstFrameNumber = f.frameNumber.front();
+  entry.lastFrameNumber = f.frameNumber.back();
+  entry.reserved = 0;
+  entry.firstTimestamp = f.timestamp.front();
+  entry.lastTimestamp = f.timestamp.back();
+  bool bWritten = WriteBlock(TAKE_BLOCK_FRAMES, entry.firstIndex, nFrames,
+                             payload_);
+  if (bWritten)
+    chunks_.push_back(entry);
+  columns_.Clear();
+  return bWritten;
+}
+
+bool TakeWriter::WriteModelDef(int major, int minor, const char *pData,
+                               size_t nBytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (file_ == nullptr)
+    return false;
+  // Frames already buffered were described by the previous definition
+  FlushChunk();
+  sTakeModelDefHeader header;
+  header.major = (int16_t) major;
+  header.minor = (int16_t) minor;
+  header.nBytes = (uint32_t) nBytes;
+  payload_.clear();
+  const char *p = (const char *) &header;
+  payload_.insert(payload_.end(), p, p + sizeof(header));
+  payload_.insert(payload_.end(), pData, pData + nBytes);
+  sTakeModelDefEntry entry;
+  entry.offset = offset_;
+  entry.firstIndex = frames_;
+  if (!WriteBlock(TAKE_BLOCK_MODELDEF, frames_, 0, payload_))
+    return false;
+  modelDefs_.push_back(entry);
+  return true;
+}
+
+bool TakeWriter::Write(const FrameOfMocapData &frame) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (file_ == nullptr)
+    return false;
+
+  columns_.Add(frame);
+  frames_++;
+  if (columns_.Frames() >= chunkFrames_)
+    return FlushChunk();
+  return true;
+}
+
+TakeReader::~TakeReader() {
+  Close();
+}
+
+bool TakeReader::Open(const std::string &path) {
+  Close();
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    return false;
+  struct stat st{};
+  if (fstat(fd, &st) == -1 || (size_t) st.st_size < TAKE_HEADER_SIZE) {
+    close(fd);
+    return false;
+  }
+  void *mapping = mmap(nullptr, (size_t) st.st_size, PROT_READ,
+                       MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return false;
+  data_ = (const char *) mapping;
+  size_ = (size_t) st.st_size;
+  sTakeFileHeader header;
+  memcpy(&header, data_ + TAKE_MAGIC_SIZE, sizeof(header));
+  if (memcmp(data_, TAKE_MAGIC, TAKE_MAGIC_SIZE) != 0 ||
+      header.version != TAKE_VERSION) {
+    Close();
+    return false;
+  }
+  // Frames are read where the index points, not front to back
+  madvise((void *) data_, size_, MADV_RANDOM);
+  bIndexed_ = ReadIndex();
+  if (!bIndexed_ && !ScanBlocks()) {
+    Close();
+    return false;
+  }
+  if (!chunks_.empty())
+    frames_ = chunks_.back().firstIndex + chunks_.back().nFrames;
+  return true;
+}
+
+void TakeReader::Close() {
+  if (data_ != nullptr) {
+    munmap((void *) data_, size_);
+    data_ = nullptr;
+  }
+  size_ = 0;
+  frames_ = 0;
+  bIndexed_ = false;
+  chunks_.clear();
+  modelDefs_.clear();
+}
+
+const sTakeBlockHeader *TakeReader::Block(uint64_t offset) const {
+  if (offset < TAKE_HEADER_SIZE || offset % 8 != 0 ||
+      offset > size_ || size_ - offset < sizeof(sTakeBlockHeader))
+    return nullptr;
+  const sTakeBlockHeader *header = (const sTakeBlockHeader *) (data_ + offset);
+  if (header->magic != TAKE_BLOCK_MAGIC ||
+      header->size > size_ - offset - sizeof(sTakeBlockHeader))
+    return nullptr;
+  return header;
+}
+
+bool TakeReader::ReadIndex() {
+  if (size_ < TAKE_HEADER_SIZE + sizeof(sTakeTrailer))
+    return false;
+  sTakeTrailer trailer;
+  memcpy(&trailer, data_ + size_ - sizeof(trailer), sizeof(trailer));
+  if (memcmp(trailer.magic, TAKE_MAGIC, TAKE_MAGIC_SIZE) != 0)
+    return false;
+  const sTakeBlockHeader *header = Block(trailer.indexOffset);
+  if (header == nullptr || header->type != TAKE_BLOCK_INDEX ||
+      trailer.nChunks > header->size / sizeof(sTakeChunkEntry) ||
+      trailer.nModelDefs * sizeof(sTakeModelDefEntry) >
+          header->size - trailer.nChunks * sizeof(sTakeChunkEntry))
+    return false;
+  const char *p = (const char *) (header + 1);
+  chunks_.resize(trailer.nChunks);
+  memcpy(chunks_.data(), p, chunks_.size() * sizeof(sTakeChunkEntry));
+  p += chunks_.size() * sizeof(sTakeChunkEntry);
+  modelDefs_.resize(trailer.nModelDefs);
+  memcpy(modelDefs_.data(), p,
+         modelDefs_.size() * sizeof(sTakeModelDefEntry));
+  return true;
+}
+
+bool TakeReader::ScanBlocks() {
+  // Up to the first block the writer did not finish
+  uint64_t offset = TAKE_HEADER_SIZE;
+  const sTakeBlockHeader *header;
+  while ((header = Block(offset)) != nullptr) {
+    if (header->type == TAKE_BLOCK_FRAMES) {
+      sTakeChunk chunk;
+      if (header->nFrames == 0 || !ReadChunkAt(offset, &chunk))
+        break;
+      sTakeChunkEntry entry;
+      entry.offset = offset;
+      entry.firstIndex = chunk.firstIndex;
+      entry.nFrames = chunk.nFrames;
+      entry.firstFrameNumber = chunk.frameNumber[0];
+      entry.lastFrameNumber = chunk.frameNumber[chunk.nFrames - 1];
+      entry.reserved = 0;
+      entry.firstTimestamp = chunk.timestamp[0];
+      entry.lastTimestamp = chunk.timestamp[chunk.nFrames - 1];
+      chunks_.push_back(entry);
+    } else if (header->type == TAKE_BLOCK_MODELDEF) {
+      sTakeModelDefEntry entry;
+      entry.offset = offset;
+      entry.firstIndex = header->firstIndex;
+      modelDefs_.push_back(entry);
+    } else {
+      break;
+    }
+    offset += sizeof(sTakeBlockHeader) + header->size;
+  }
+  return true;
+}
+
+size_t TakeReader::ChunkOf(uint64_t index) const {
+  if (index >= frames_)
+    return chunks_.size();
+  auto it = std::upper_bound(
+      chunks_.begin(), chunks_.end(), index,
+      [](uint64_t i, const sTakeChunkEntry &entry) {
+        return i < entry.firstIndex;
+      });
+  return (size_t) (it - chunks_.begin()) - 1;
+}
+
+uint64_t TakeReader::FindFrame(int frameNumber) const {
+  auto it = std::partition_point(
+      chunks_.begin(), chunks_.end(),
+      [frameNumber](const sTakeChunkEntry &entry) {
+        return entry.lastFrameNumber < frameNumber;
+      });
+  if (it == chunks_.end())
+    return frames_;
+  sTakeChunk chunk;
+  if (!ReadChunk((size_t) (it - chunks_.begin()), &chunk))
+    return frames_;
+  uint32_t i = 0;
+  while (i < chunk.nFrames - 1 && chunk.frameNumber[i] < frameNumber)
+    i++;
+  return chunk.firstIndex + i;
+}
+
+uint64_t TakeReader::FindTime(double seconds) const {
+  auto it = std::partition_point(
+      chunks_.begin(), chunks_.end(),
+      [seconds](const sTakeChunkEntry &entry) {
+        return entry.lastTimestamp < seconds;
+      });
+  if (it == chunks_.end())
+    return frames_;
+  sTakeChunk chunk;
+  if (!ReadChunk((size_t) (it - chunks_.begin()), &chunk))
+    return frames_;
+  uint32_t i = 0;
+  while (i < chunk.nFrames - 1 && chunk.timestamp[i] < seconds)
+    i++;
+  return chunk.firstIndex + i;
+}
+
+bool TakeReader::ReadChunk(size_t c, sTakeChunk *chunk) const {
+  return c < chunks_.size() && ReadChunkAt(chunks_[c].offset, chunk) &&
+         chunk->nFrames == chunks_[c].nFrames;
+}
+
+bool TakeReader::ReadChunkAt(uint64_t offset, sTakeChunk *chunk) const {
+  const sTakeBlockHeader *header = Block(offset);
+  if (header == nullptr || header->type != TAKE_BLOCK_FRAMES ||
+      header->size < sizeof(sTakeChunkCounts))
+    return false;
+
+  const char *payload = (const char *) (header + 1);
+  size_t n = header->nFrames;
+  memcpy(&chunk->counts, payload, sizeof(chunk->counts));
+  chunk->firstIndex = header->firstIndex;
+  chunk->nFrames = header->nFrames;
+
+  ColumnReader reader(payload, header->size);
+  reader.Next<sTakeChunkCounts>(1);
+  chunk->frameNumber = reader.Next<int32_t>(n);
+  chunk->timestamp = reader.Next<double>(n);
+  chunk->midExposure = reader.Next<uint64_t>(n);
+  chunk->params = reader.Next<int16_t>(n);
+  chunk->rigidBodyStart = reader.Next<uint32_t>(n + 1);
+  chunk->skeletonStart = reader.Next<uint32_t>(n + 1);
+  chunk->labeledMarkerStart = reader.Next<uint32_t>(n + 1);
+  NextRigidBodies(&reader, chunk->counts.nRigidBodies, &chunk->rigidBodies);
+  chunk->skeletonID = reader.Next<int32_t>(chunk->counts.nSkeletons);
+  chunk->boneStart = reader.Next<uint32_t>(chunk->counts.nSkeletons + 1);
+  NextRigidBodies(&reader, chunk->counts.nBones, &chunk->bones);
+  size_t nMarkers = chunk->counts.nLabeledMarkers;
+  sTakeLabeledMarkerColumns &markers = chunk->labeledMarkers;
+  markers.ID = reader.Next<int32_t>(nMarkers);
+  markers.x = reader.Next<float>(nMarkers);
+  markers.y = reader.Next<float>(nMarkers);
+  markers.z = reader.Next<float>(nMarkers);
+  markers.size = reader.Next<float>(nMarkers);
+  markers.residual = reader.Next<float>(nMarkers);
+  markers.params = reader.Next<int16_t>(nMarkers);
+  if (!reader.Ok())
+    return false;
+
+  // The starts must stay inside their columns
+  return ValidStarts(chunk->rigidBodyStart, n, chunk->counts.nRigidBodies) &&
+         ValidStarts(chunk->skeletonStart, n, chunk->counts.nSkeletons) &&
+         ValidStarts(chunk->labeledMarkerStart, n,
+                     chunk->counts.nLabeledMarkers) &&
+         ValidStarts(chunk->boneStart, chunk->counts.nSkeletons,
+                     chunk->counts.nBones);
+}
+
+bool TakeReader::ReadFrame(uint64_t index, sTakeFrame *frame) const {
+  size_t c = ChunkOf(index);
+  sTakeChunk chunk;
+  if (!ReadChunk(c, &chunk))
+    return false;
+  ChunkFrame(chunk, (uint32_t) (index - chunk.firstIndex), frame);
+  return true;
+}
+
+void TakeReader::ChunkFrame(const sTakeChunk &chunk, uint32_t i,
+                            sTakeFrame *frame) {
+  frame->frameNumber = chunk.frameNumber[i];
+  frame->timestamp = chunk.timestamp[i];
+  frame->midExposure = chunk.midExposure[i];
+  frame->params = chunk.params[i];
+
+  uint32_t first = chunk.rigidBodyStart[i], last = chunk.rigidBodyStart[i + 1];
+  frame->rigidBodies.clear();
+  for (uint32_t k = first; k < last; k++)
+    frame->rigidBodies.push_back(RigidBodyAt(chunk.rigidBodies, k));
+
+  first = chunk.skeletonStart[i];
+  last = chunk.skeletonStart[i + 1];
+  frame->skeletons.resize(last - first);
+  for (uint32_t s = first; s < last; s++) {
+    sTakeSkeleton &skeleton = frame->skeletons[s - first];
+    skeleton.ID = chunk.skeletonID[s];
+    skeleton.bones.clear();
+    for (uint32_t b = chunk.boneStart[s]; b < chunk.boneStart[s + 1]; b++)
+      skeleton.bones.push_back(RigidBodyAt(chunk.bones, b));
+  }
+
+  first = chunk.labeledMarkerStart[i];
+  last = chunk.labeledMarkerStart[i + 1];
+  const sTakeLabeledMarkerColumns &markers = chunk.labeledMarkers;
+  frame->labeledMarkers.resize(last - first);
+  for (uint32_t k = first; k < last; k++) {
+    sLabeledMarker &marker = frame->labeledMarkers[k - first];
+    marker.ID = markers.ID[k];
+    marker.x = markers.x[k];
+    marker.y = markers.y[k];
+    marker.z = markers.z[k];
+    marker.size = markers.size[k];
+    marker.params = markers.params[k];
+    marker.residual = markers.residual[k];
+  }
+}
+
+bool TakeReader::ModelDef(uint64_t index, sTakeModelDef *modelDef) const {
+  auto it = std::upper_bound(
+      modelDefs_.begin(), modelDefs_.end(), index,
+      [](uint64_t i, const sTakeModelDefEntry &entry) {
+        return i < entry.firstIndex;
+      });
+  if (it == modelDefs_.begin())
+    return false;
+  const sTakeBlockHeader *header = Block((it - 1)->offset);
+  if (header == nullptr || header->type != TAKE_BLOCK_MODELDEF ||
+      header->size < sizeof(sTakeModelDefHeader))
+    return false;
+  sTakeModelDefHeader def;
+  memcpy(&def, header + 1, sizeof(def));
+  if (def.nBytes > header->size - sizeof(def))
+    return false;
+  modelDef->major = def.major;
+  modelDef->minor = def.minor;
+  modelDef->pData = (const char *) (header + 1) + sizeof(def);
+  modelDef->nBytes = def.nBytes;
+  return true;
+}
@@ -0,0 +1,262 @@
+/*
+ * Take.h
+ *
+ * Recording of decoded frames in an indexed, columnar file.
+ *
+ * A take file is an 8-byte magic and a sTakeFileHeader, followed by
+ * blocks, each a sTakeBlockHeader and its payload padded to 8 bytes:
+ *
+ *   TAKE_BLOCK_FRAMES    a chunk of up to chunkFrames consecutive frames;
+ *                        frame fields, rigid bodies, skeleton bones and
+ *                        labeled markers each stored column by column
+ *   TAKE_BLOCK_MODELDEF  a NAT_MODELDEF packet with its NatNet version,
+ *                        in effect from frame firstIndex on
+ *   TAKE_BLOCK_INDEX     written by Close(): a sTakeChunkEntry per
+ *                        chunk and a sTakeModelDefEntry per model
+ *                        definition, then a sTakeTrailer ending the file
+ *
+ * TakeReader memory-maps a take and finds a frame by number or time by
+ * a binary search of the index, then a scan of one chunk's column, so
+ * nothing before it is read. Columns are 8-byte aligned and returned as
+ * pointers into the mapping. A take without an index, cut short by a
+ * crash, is indexed by walking its block headers instead.
+ *
+ * Frame numbers and timestamps are assumed to grow through a take;
+ * reordered frames are recorded where they arrived.
+ */
+
+#ifndef TAKE_H
+#define TAKE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "FrameColumns.h"
+#include "NatNetFrame.h"
+
+#define TAKE_MAGIC                  "NNTAKE01"
+#define TAKE_MAGIC_SIZE             8
+#define TAKE_VERSION                1
+#define TAKE_BLOCK_MAGIC            0x4B4C4254u   // "TBLK"
+#define TAKE_CHUNK_FRAMES           240
+
+#define TAKE_BLOCK_FRAMES           1
+#define TAKE_BLOCK_MODELDEF         2
+#define TAKE_BLOCK_INDEX            3
+
+#pragma pack(push, 1)
+struct sTakeFileHeader {
+  uint32_t version;                       // TAKE_VERSION
+  uint32_t chunkFrames;
+};
+
+struct sTakeBlockHeader {
+  uint32_t magic;                         // TAKE_BLOCK_MAGIC
+  uint16_t type;                          // TAKE_BLOCK_*
+  uint16_t reserved;
+  uint64_t size;                          // payload bytes, a multiple of 8
+  uint64_t firstIndex;                    // first frame the block holds
+                                          // or applies to
+  uint32_t nFrames;                       // frames in a TAKE_BLOCK_FRAMES
+  uint32_t reserved2;
+};
+
+// Element counts of a chunk, at the start of its payload
+struct sTakeChunkCounts {
+  uint32_t nRigidBodies;
+  uint32_t nSkeletons;
+  uint32_t nBones;
+  uint32_t nLabeledMarkers;
+};
+
+// Model definition payload: this header, then the packet
+struct sTakeModelDefHeader {
+  int16_t major;
+  int16_t minor;
+  uint32_t nBytes;
+};
+
+struct sTakeChunkEntry {
+  uint64_t offset;                        // of the block header
+  uint64_t firstIndex;
+  uint32_t nFrames;
+  int32_t firstFrameNumber;
+  int32_t lastFrameNumber;
+  uint32_t reserved;
+  double firstTimestamp;
+  double lastTimestamp;
+};
+
+struct sTakeModelDefEntry {
+  uint64_t offset;                        // of the block header
+  uint64_t firstIndex;
+};
+
+struct sTakeTrailer {
+  uint64_t indexOffset;                   // of the index block header
+  uint64_t nChunks;
+  uint64_t nModelDefs;
+  char magic[TAKE_MAGIC_SIZE];            // TAKE_MAGIC
+};
+#pragma pack(pop)
+
+// Rigid bodies or skeleton bones of a chunk, by column
+struct sTakeRigidBodyColumns {
+  const int32_t *ID;
+  const float *x, *y, *z;
+  const float *qx, *qy, *qz, *qw;
+  const float *meanError;
+  const int16_t *params;
+};
+
+struct sTakeLabeledMarkerColumns {
+  const int32_t *ID;
+  const float *x, *y, *z;
+  const float *size;
+  const float *residual;
+  const int16_t *params;
+};
+
+// Columns of one chunk, pointing into the mapping. The elements of
+// frame i are [start[i], start[i + 1]) of each *Start column.
+struct sTakeChunk {
+  uint64_t firstIndex;
+  uint32_t nFrames;
+  const int32_t *frameNumber;
+  const double *timestamp;
+  const uint64_t *midExposure;            // server ticks, NatNet 3.0
+  const int16_t *params;
+  const uint32_t *rigidBodyStart;
+  const uint32_t *skeletonStart;
+  const uint32_t *labeledMarkerStart;
+
+  sTakeChunkCounts counts;
+  sTakeRigidBodyColumns rigidBodies;
+  const int32_t *skeletonID;
+  const uint32_t *boneStart;              // per skeleton, nSkeletons + 1
+  sTakeRigidBodyColumns bones;
+  sTakeLabeledMarkerColumns labeledMarkers;
+};
+
+// One frame, copied out of its chunk
+struct sTakeSkeleton {
+  int ID;
+  std::vector<sRigidBodyData> bones;
+};
+
+struct sTakeFrame {
+  int frameNumber = 0;
+  double timestamp = 0.0;
+  uint64_t midExposure = 0;
+  short params = 0;
+  std::vector<sRigidBodyData> rigidBodies;
+  std::vector<sTakeSkeleton> skeletons;
+  std::vector<sLabeledMarker> labeledMarkers;
+};
+
+// A NAT_MODELDEF packet, pointing into the mapping
+struct sTakeModelDef {
+  int major;
+  int minor;
+  const char *pData;
+  size_t nBytes;
+};
+
+class TakeWriter {
+ public:
+  TakeWriter() = default;
+  TakeWriter(const TakeWriter &) = delete;
+  TakeWriter &operator=(const TakeWriter &) = delete;
+  ~TakeWriter();
+
+  // Create or truncate path
+  bool Open(const std::string &path,
+            uint32_t chunkFrames = TAKE_CHUNK_FRAMES);
+  // Write the last chunk and the index
+  void Close();
+  // Open() and Close() must not race with the writes
+  bool IsOpen() const { return file_ != nullptr; }
+
+  // Both may be called from any thread. A model definition applies to
+  // the frames written after it.
+  bool WriteModelDef(int major, int minor, const char *pData,
+                     size_t nBytes);
+  bool Write(const FrameOfMocapData &frame);
+
+  uint64_t Frames() const { return frames_; }
+
+ private:
+  bool FlushChunk();
+  bool WriteBlock(uint16_t type, uint64_t firstIndex, uint32_t nFrames,
+                  const std::vector<char> &payload);
+
+  std::mutex mutex_;
+  FILE *file_ = nullptr;
+  uint64_t offset_ = 0;
+  uint32_t chunkFrames_ = TAKE_CHUNK_FRAMES;
+  uint64_t frames_ = 0;
+  std::vector<sTakeChunkEntry> chunks_;
+  std::vector<sTakeModelDefEntry> modelDefs_;
+
+  // Frames of the chunk being filled
+  FrameColumns columns_;
+  std::vector<char> payload_;
+};
+
+class TakeReader {
+ public:
+  TakeReader() = default;
+  TakeReader(const TakeReader &) = delete;
+  TakeReader &operator=(const TakeReader &) = delete;
+  ~TakeReader();
+
+  // Map a take; false if it cannot be read or is not a take
+  bool Open(const std::string &path);
+  void Close();
+
+  uint64_t FrameCount() const { return frames_; }
+  size_t ChunkCount() const { return chunks_.size(); }
+  const sTakeChunkEntry &ChunkEntry(size_t c) const { return chunks_[c]; }
+  // True if the take was closed; otherwise the index was rebuilt
+  bool HasIndex() const { return bIndexed_; }
+
+  // Index of the first frame with a number or timestamp at least the
+  // given one, or FrameCount() if there is none
+  uint64_t FindFrame(int frameNumber) const;
+  uint64_t FindTime(double seconds) const;
+
+  // Chunk holding frame index, or ChunkCount()
+  size_t ChunkOf(uint64_t index) const;
+
+  // False if the chunk is damaged, including start columns that leave
+  // their element columns
+  bool ReadChunk(size_t c, sTakeChunk *chunk) const;
+  bool ReadFrame(uint64_t index, sTakeFrame *frame) const;
+  // Copy frame i < nFrames out of a chunk from ReadChunk, whose offsets
+  // are validated
+  static void ChunkFrame(const sTakeChunk &chunk, uint32_t i,
+                         sTakeFrame *frame);
+
+  // Model definition in effect at frame index; false if none was
+  // recorded before it
+  bool ModelDef(uint64_t index, sTakeModelDef *modelDef) const;
+
+ private:
+  const sTakeBlockHeader *Block(uint64_t offset) const;
+  bool ReadIndex();
+  bool ScanBlocks();
+  bool ReadChunkAt(uint64_t offset, sTakeChunk *chunk) const;
+
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  uint64_t frames_ = 0;
+  bool bIndexed_ = false;
+  std::vector<sTakeChunkEntry> chunks_;
+  std::vector<sTakeModelDefEntry> modelDefs_;
+};
+
+#endif  // TAKE_H